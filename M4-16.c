@@ -3,177 +3,180 @@
 #include "M4.h"
 #include "common.h"
 
-// GROUP 0 ////////////////////////////
-
-int execute_0_shift(void)
-{
-    FUNC_VM();
-
-    uint32_t imm5 = (CPU.op >> 6) & 0x1F;
-    uint32_t value = CPU.REG.r[(CPU.op >> 3) & 0x7]; // [Rm]
-    uint32_t result;
-
-    switch ((CPU.op >> 11) & 0x3) // op_type
-    {
-    case 0: // LSL Rd, Rm, # [000 00 # Rm Rd]
-        result = value << imm5;
-        break;
-    case 1: // LSR Rd, Rm, # [000 01 # Rm Rd]
-        result = value >> imm5;
-        break;
-    case 2: // ASR Rd, Rm, # [000 10 # Rm Rd]
-        result = (int32_t)value >> imm5;
-        break;
-    default:
-        return -1;
+/*
+    Обработката на данни е в ядра alu_<група>_<операция>(cpu, s), а
+    T16_VARIANTS генерира от всяко два обработчика: execute_<...>_s, който
+    задава флаговете, и execute_<...> без флагове за IT блок. s е константа,
+    затова и двата са без проверки при изпълнение.
+*/
+#define T16_VARIANTS(name)                        \
+    static int execute_##name(CortexM4 *cpu)      \
+    {                                             \
+        FUNC_VM();                                \
+        return alu_##name(cpu, 0);                \
+    }                                             \
+    static int execute_##name##_s(CortexM4 *cpu)  \
+    {                                             \
+        FUNC_VM();                                \
+        return alu_##name(cpu, 1);                \
     }
 
-    CPU.REG.r[CPU.op & 0x7] = result; // [Rd]
+#define T16_PAIR(name) {execute_##name, execute_##name##_s}
+
+// GROUP 0 ////////////////////////////
 
-    // update_flags(); // Update Z, N, C flags
+// Изместване с константа: d->imm е 1..32 (LSR #0 и ASR #0 са #32), LSL #0 оставя C
+static inline int alu_0_shift(CortexM4 *cpu, uint32_t type, int s)
+{
+    const M4_DECODED *d = cpu->dec;
+    uint32_t carry;
+    uint32_t result = m4_shift_c(cpu, cpu->REG.r[d->rm], type, d->imm, &carry);
+    cpu->REG.r[d->rd] = m4_alu_logic(cpu, result, carry, s);
     return 0;
 }
 
-int execute_0_add_sub_imm(void)
+// LSL Rd, Rm, # [000 00 # Rm Rd]
+static inline int alu_0_lsl(CortexM4 *cpu, int s)
 {
-    FUNC_VM();
-    uint32_t imm3 = (CPU.op >> 6) & 0x7;
-    uint32_t op = (CPU.op >> 9) & 0x1;
-    uint32_t value = CPU.REG.r[(CPU.op >> 3) & 0x7]; // [Rn]
-    uint32_t result;
+    return alu_0_shift(cpu, M4_SHIFT_LSL, s);
+}
 
-    if (op == 0)
-    { // ADD Rd, Rn, # [000 1110 # Rn Rd]
-        result = value + imm3;
-    }
-    else
-    { // SUB Rd, Rn, # [000 1111 # Rn Rd]
-        result = value - imm3;
-    }
+// LSR Rd, Rm, # [000 01 # Rm Rd]
+static inline int alu_0_lsr(CortexM4 *cpu, int s)
+{
+    return alu_0_shift(cpu, M4_SHIFT_LSR, s);
+}
 
-    CPU.REG.r[CPU.op & 0x7] = result; // [Rd]
+// ASR Rd, Rm, # [000 10 # Rm Rd]
+static inline int alu_0_asr(CortexM4 *cpu, int s)
+{
+    return alu_0_shift(cpu, M4_SHIFT_ASR, s);
+}
 
-    // update_flags(); // Update Z, N, C, V flags
+// ADD Rd, Rn, Rm [000 1100 Rm Rn Rd]
+static inline int alu_0_add_reg(CortexM4 *cpu, int s)
+{
+    const M4_DECODED *d = cpu->dec;
+    cpu->REG.r[d->rd] = m4_alu_add(cpu, cpu->REG.r[d->rn], cpu->REG.r[d->rm], s);
     return 0;
 }
 
-int execute_0_add_sub_reg(void)
+// SUB Rd, Rn, Rm [000 1101 Rm Rn Rd]
+static inline int alu_0_sub_reg(CortexM4 *cpu, int s)
 {
-    FUNC_VM();
-    uint32_t value1 = CPU.REG.r[(CPU.op >> 3) & 0x7]; // [Rn]
-    uint32_t value2 = CPU.REG.r[(CPU.op >> 6) & 0x7]; // [Rm]
-    uint32_t result;
-
-    if (((CPU.op >> 9) & 0x1) == 0)
-    { // ADD Rd, Rn, Rm  [000 1100 Rm Rn Rd]
-        result = value1 + value2;
-    }
-    else
-    { // SUB Rd, Rn, Rm [000 1101 Rm Rn Rd]
-        result = value1 - value2;
-    }
-
-    CPU.REG.r[CPU.op & 0x7] = result; // [Rd]
-
-    // update_flags(); // Update Z, N, C, V flags
+    const M4_DECODED *d = cpu->dec;
+    cpu->REG.r[d->rd] = m4_alu_sub(cpu, cpu->REG.r[d->rn], cpu->REG.r[d->rm], s);
     return 0;
 }
 
-static int execute_0(void)
+// ADD Rd, Rn, # [000 1110 # Rn Rd]
+static inline int alu_0_add_imm(CortexM4 *cpu, int s)
 {
-    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    cpu->REG.r[d->rd] = m4_alu_add(cpu, cpu->REG.r[d->rn], d->imm, s);
+    return 0;
+}
 
-    if (CPU.op >> 11 == 3) // ADD/SUB
-    {
+// SUB Rd, Rn, # [000 1111 # Rn Rd]
+static inline int alu_0_sub_imm(CortexM4 *cpu, int s)
+{
+    const M4_DECODED *d = cpu->dec;
+    cpu->REG.r[d->rd] = m4_alu_sub(cpu, cpu->REG.r[d->rn], d->imm, s);
+    return 0;
+}
 
-        if (CPU.op & 0b0000010000000000) // bit 10 0x400
-        {
-            return execute_0_add_sub_imm();
-        }
-        else
-        {
-            return execute_0_add_sub_reg();
-        }
-    }
-    else
-    {
-        return execute_0_shift();
+T16_VARIANTS(0_lsl)
+T16_VARIANTS(0_lsr)
+T16_VARIANTS(0_asr)
+T16_VARIANTS(0_add_reg)
+T16_VARIANTS(0_sub_reg)
+T16_VARIANTS(0_add_imm)
+T16_VARIANTS(0_sub_imm)
+
+// LSL, LSR, ASR по битове 12:11 и S
+static const M4_HANDLER t16_shift_imm[3][2] = {T16_PAIR(0_lsl), T16_PAIR(0_lsr), T16_PAIR(0_asr)};
+
+// ADD/SUB по битове 10:9 и S
+static const M4_HANDLER t16_add_sub[4][2] = {
+    T16_PAIR(0_add_reg),
+    T16_PAIR(0_sub_reg),
+    T16_PAIR(0_add_imm),
+    T16_PAIR(0_sub_imm),
+};
+
+static int decode_0(uint32_t op, M4_DECODED *d, int s)
+{
+    d->rd = op & 0x7;        // [Rd]
+    d->rn = (op >> 3) & 0x7; // [Rn] или [Rm] при шифт
+
+    if ((op >> 11) == 3)
+    { // ADD/SUB
+        d->rm = (op >> 6) & 0x7;  // [Rm]
+        d->imm = (op >> 6) & 0x7; // imm3
+        d->handler = t16_add_sub[(op >> 9) & 0x3][s];
+        return 0;
     }
-
-    return -1;
+    d->rm = (op >> 3) & 0x7;   // [Rm]
+    d->imm = (op >> 6) & 0x1F; // imm5
+    if (!d->imm && (op >> 11))
+        d->imm = 32; // LSR #0 и ASR #0 са #32
+    d->handler = t16_shift_imm[op >> 11][s];
+    return 0;
 }
 
 // GROUP 1 ////////////////////////////
 
-static int execute_1_mov(void)
+static inline int alu_1_mov(CortexM4 *cpu, int s)
 { // MOV Rd, # [001 00 Rd #]
-    FUNC_VM();
-    uint32_t imm8 = CPU.op & 0xFF;         // imm8
-    CPU.REG.r[(CPU.op >> 8) & 0x7] = imm8; // Запис в [Rd] (R0–R7)
-    CPU.psr.apsr.Z = (imm8 == 0);          // Zero флаг
-    CPU.psr.apsr.N = 0;                    // Negative флаг (винаги 0 за imm8) ???
+    cpu->REG.r[cpu->dec->rd] = m4_alu_logic(cpu, cpu->dec->imm, M4_C_KEEP, s); // N, Z (N винаги 0 за imm8)
     return 0;
 }
 
-static int execute_1_cmp(void)
+static int execute_1_cmp(CortexM4 *cpu)
 { // CMP Rn, # [001 01 Rn #]
     FUNC_VM();
-    uint32_t imm8 = CPU.op & 0xFF;                                // imm8
-    uint32_t value = CPU.REG.r[(CPU.op >> 8) & 0x7];              // Стойност на [Rn] (R0–R7)
+    uint32_t imm8 = cpu->dec->imm;                                // imm8
+    uint32_t value = cpu->REG.r[cpu->dec->rn];                    // Стойност на [Rn] (R0–R7)
     uint32_t result = value - imm8;                               // Изваждане (само за флагове)
-    CPU.psr.apsr.Z = (result == 0);                               // Zero флаг
-    CPU.psr.apsr.N = (result >> 31) & 0x1;                        // Negative флаг
-    CPU.psr.apsr.C = (value >= imm8);                             // Carry флаг (беззнаково)
-    CPU.psr.apsr.V = ((value ^ result) & (~imm8 ^ result)) >> 31; // Overflow флаг
+    m4_flags_lazy(cpu, result, value, imm8, OP_CMP, UPDATE_NZCV); // NZCV
     return 0;
 }
 
-static int execute_1_add(void)
+static inline int alu_1_add(CortexM4 *cpu, int s)
 { // ADD Rd, # [001 10 Rd #]
-    FUNC_VM();
-    uint32_t rd = (CPU.op >> 8) & 0x7;                           // Rd (R0–R7)
-    uint32_t imm8 = CPU.op & 0xFF;                               // imm8
-    uint32_t value = CPU.REG.r[rd];                              // Стойност на Rd
-    uint32_t result = value + imm8;                              // Добавяне
-    CPU.REG.r[rd] = result;                                      // Запис в Rd
-    CPU.psr.apsr.Z = (result == 0);                              // Zero флаг
-    CPU.psr.apsr.N = (result >> 31) & 0x1;                       // Negative флаг
-    CPU.psr.apsr.C = ((uint64_t)value + imm8 > 0xFFFFFFFF);      // Carry флаг
-    CPU.psr.apsr.V = ((value ^ result) & (imm8 ^ result)) >> 31; // Overflow флаг
+    uint32_t rd = cpu->dec->rd; // Rd (R0–R7)
+    cpu->REG.r[rd] = m4_alu_add(cpu, cpu->REG.r[rd], cpu->dec->imm, s);
     return 0;
 }
 
-static int execute_1_sub(void)
+static inline int alu_1_sub(CortexM4 *cpu, int s)
 { // SUB Rd, # [001 11 Rd #]
-    FUNC_VM();
-    uint32_t rd = (CPU.op >> 8) & 0x7;                            // Rd (R0–R7)
-    uint32_t imm8 = CPU.op & 0xFF;                                // imm8
-    uint32_t value = CPU.REG.r[rd];                               // Стойност на Rd
-    uint32_t result = value - imm8;                               // Изваждане
-    CPU.REG.r[rd] = result;                                       // Запис в Rd
-    CPU.psr.apsr.Z = (result == 0);                               // Zero флаг
-    CPU.psr.apsr.N = (result >> 31) & 0x1;                        // Negative флаг
-    CPU.psr.apsr.C = (value >= imm8);                             // Carry флаг
-    CPU.psr.apsr.V = ((value ^ result) & (~imm8 ^ result)) >> 31; // Overflow флаг
+    uint32_t rd = cpu->dec->rd; // Rd (R0–R7)
+    cpu->REG.r[rd] = m4_alu_sub(cpu, cpu->REG.r[rd], cpu->dec->imm, s);
     return 0;
 }
 
-static int execute_1(void)
+T16_VARIANTS(1_mov)
+T16_VARIANTS(1_add)
+T16_VARIANTS(1_sub)
+
+// MOV, CMP, ADD, SUB imm8 по битове 12:11 и S; CMP винаги задава флаговете
+static const M4_HANDLER t16_imm8[4][2] = {
+    T16_PAIR(1_mov),
+    {execute_1_cmp, execute_1_cmp},
+    T16_PAIR(1_add),
+    T16_PAIR(1_sub),
+};
+
+static int decode_1(uint32_t op, M4_DECODED *d, int s)
 {
-    FUNC_VM();
     // MOV/CMP/ADD/SUB imm
-    switch ((CPU.op >> 11) & 3)
-    {
-    case 0:
-        return execute_1_mov();
-    case 1:
-        return execute_1_cmp();
-    case 2:
-        return execute_1_add();
-    case 3:
-        return execute_1_sub();
-    }
-    return -1;
+    d->rd = d->rn = (op >> 8) & 0x7; // [Rd] / [Rn]
+    d->imm = op & 0xFF;              // imm8
+    d->handler = t16_imm8[(op >> 11) & 0x3][s];
+    if (((op >> 11) & 0x3) == 1)
+        d->flags = M4_DEC_SETS_FLAGS; // CMP
+    return 0;
 }
 
 // GROUP 2 ////////////////////////////
@@ -210,246 +213,305 @@ static int execute_1(void)
     LDR Rd, [PC, #]     [010 01 Rd PC Relative Offset] >> 10
 */
 
-// AND, EOR, LSL, LSR, ASR, ADC, SBC, ROR, TST, NEG, CMP, CMN, ORR, MUL, BIC, MVN
-int execute_2_and_rd_rm(void)
-{
-    FUNC_VM();
-    uint32_t rm = (CPU.op >> 3) & 0x7; // Rm или Rn
-    uint32_t rd = CPU.op & 0x7;        // Rd или Rm
-    uint32_t value1 = CPU.REG.r[rd];   // Rd или Rn
-    uint32_t value2 = CPU.REG.r[rm];   // Rm или Rs
-    uint32_t result;
-    uint32_t carry = CPU.psr.apsr.C;
-
-    switch ((CPU.op >> 6) & 0xF)
-    {         // Битове 9:6
-    case 0x0: // AND Rd, Rm
-        result = value1 & value2;
-        // update_flags();
-        break;
-    case 0x1: // EOR Rd, Rm
-        result = value1 ^ value2;
-        // update_flags();
-        break;
-    case 0x2: // LSL Rd, Rs
-        if (value2 == 0)
-        {
-            result = value1;
-        }
-        else
-        {
-            carry = (value1 >> (32 - (value2 & 0xFF))) & 0x1;
-            result = value1 << (value2 & 0xFF);
-        }
-        // update_flags();
-        break;
-    case 0x3: // LSR Rd, Rs
-        if (value2 == 0)
-        {
-            result = value1;
-        }
-        else
-        {
-            carry = (value1 >> ((value2 & 0xFF) - 1)) & 0x1;
-            result = value1 >> (value2 & 0xFF);
-        }
-        // update_flags();
-        break;
-    case 0x4: // ASR Rd, Rs
-        if (value2 == 0)
-        {
-            result = value1;
-        }
-        else
-        {
-            carry = (value1 >> ((value2 & 0xFF) - 1)) & 0x1;
-            result = (int32_t)value1 >> (value2 & 0xFF);
-        }
-        // update_flags();
-        break;
-    case 0x5: // ADC Rd, Rm
-        result = value1 + value2 + carry;
-        // update_flags();
-        break;
-    case 0x6: // SBC Rd, Rm
-        result = value1 - value2 - (1 - carry);
-        // update_flags();
-        break;
-    case 0x7: // ROR Rd, Rs
-        if (value2 == 0)
-        {
-            result = value1;
-        }
-        else
-        {
-            uint32_t shift = value2 & 0xFF;
-            carry = (value1 >> (shift - 1)) & 0x1;
-            result = (value1 >> shift) | (value1 << (32 - shift));
-        }
-        // update_flags();
-        break;
-    case 0x8: // TST Rn, Rm
-        result = value1 & value2;
-        // update_flags();
-        return 0;
-    case 0x9: // NEG Rd, Rm
-        result = 0 - value2;
-        // update_flags();
-        break;
-    case 0xA: // CMP Rn, Rm
-        result = value1 - value2;
-        // update_flags();
-        return 0;
-    case 0xB: // CMN Rn, Rm
-        result = value1 + value2;
-        // update_flags();
-        return 0;
-    case 0xC: // ORR Rd, Rm
-        result = value1 | value2;
-        // update_flags();
-        break;
-    case 0xD: // MUL Rd, Rm
-        result = value1 * value2;
-        // update_flags();
-        break;
-    case 0xE: // BIC Rd, Rm
-        result = value1 & ~value2;
-        // update_flags();
-        break;
-    case 0xF: // MVN Rd, Rm
-        result = ~value2;
-        // update_flags();
-        break;
-    default:
-        return -1;
+// AND, EOR, ORR, BIC, MUL, MVN: Rd = f(Rd, Rm), N и Z
+#define T16_ALU_LOGIC(name, expr)                                         \
+    static inline int alu_2_##name(CortexM4 *cpu, int s)                  \
+    {                                                                     \
+        uint32_t rd = cpu->dec->rd;                                       \
+        uint32_t a = cpu->REG.r[rd];                                      \
+        uint32_t b = cpu->REG.r[cpu->dec->rm];                            \
+        (void)a;                                                          \
+        cpu->REG.r[rd] = m4_alu_logic(cpu, (expr), M4_C_KEEP, s);         \
+        return 0;                                                         \
     }
 
-    CPU.REG.r[rd] = result;
+T16_ALU_LOGIC(and, a & b)
+T16_ALU_LOGIC(eor, a ^ b)
+T16_ALU_LOGIC(orr, a | b)
+T16_ALU_LOGIC(mul, a * b)
+T16_ALU_LOGIC(bic, a & ~b)
+T16_ALU_LOGIC(mvn, ~b)
+
+// LSL, LSR, ASR, ROR Rd, Rs: изместване с долния байт на Rs, C остава при 0
+static inline int alu_2_shift(CortexM4 *cpu, uint32_t type, int s)
+{
+    uint32_t rd = cpu->dec->rd;
+    uint32_t carry;
+    uint32_t result = m4_shift_c(cpu, cpu->REG.r[rd], type, cpu->REG.r[cpu->dec->rm] & 0xFF, &carry);
+    cpu->REG.r[rd] = m4_alu_logic(cpu, result, carry, s);
+    return 0;
+}
+
+static inline int alu_2_lsl(CortexM4 *cpu, int s)
+{
+    return alu_2_shift(cpu, M4_SHIFT_LSL, s);
+}
+
+static inline int alu_2_lsr(CortexM4 *cpu, int s)
+{
+    return alu_2_shift(cpu, M4_SHIFT_LSR, s);
+}
+
+static inline int alu_2_asr(CortexM4 *cpu, int s)
+{
+    return alu_2_shift(cpu, M4_SHIFT_ASR, s);
+}
+
+static inline int alu_2_ror(CortexM4 *cpu, int s)
+{
+    return alu_2_shift(cpu, M4_SHIFT_ROR, s);
+}
+
+// ADC Rd, Rm
+static inline int alu_2_adc(CortexM4 *cpu, int s)
+{
+    uint32_t rd = cpu->dec->rd;
+    cpu->REG.r[rd] = m4_alu_adc(cpu, cpu->REG.r[rd], cpu->REG.r[cpu->dec->rm], s);
+    return 0;
+}
+
+// SBC Rd, Rm
+static inline int alu_2_sbc(CortexM4 *cpu, int s)
+{
+    uint32_t rd = cpu->dec->rd;
+    cpu->REG.r[rd] = m4_alu_sbc(cpu, cpu->REG.r[rd], cpu->REG.r[cpu->dec->rm], s);
+    return 0;
+}
+
+// NEG Rd, Rm (RSB Rd, Rm, #0)
+static inline int alu_2_neg(CortexM4 *cpu, int s)
+{
+    cpu->REG.r[cpu->dec->rd] = m4_alu_rsb(cpu, cpu->REG.r[cpu->dec->rm], 0, s);
+    return 0;
+}
+
+T16_VARIANTS(2_and)
+T16_VARIANTS(2_eor)
+T16_VARIANTS(2_lsl)
+T16_VARIANTS(2_lsr)
+T16_VARIANTS(2_asr)
+T16_VARIANTS(2_adc)
+T16_VARIANTS(2_sbc)
+T16_VARIANTS(2_ror)
+T16_VARIANTS(2_neg)
+T16_VARIANTS(2_orr)
+T16_VARIANTS(2_mul)
+T16_VARIANTS(2_bic)
+T16_VARIANTS(2_mvn)
+
+// TST Rn, Rm
+static int execute_2_tst(CortexM4 *cpu)
+{
+    FUNC_VM();
+    m4_alu_logic(cpu, cpu->REG.r[cpu->dec->rd] & cpu->REG.r[cpu->dec->rm], M4_C_KEEP, 1);
     return 0;
 }
 
-// BX Rm, BLX Rm
-int execute_2_bx_rm(void)
+// CMP Rn, Rm
+static int execute_2_cmp(CortexM4 *cpu)
 {
     FUNC_VM();
-    uint32_t rm = (CPU.op >> 3) & 0xF; // Rm (вкл. H2)
-    uint32_t h2 = (CPU.op >> 6) & 0x1; // H2
-    uint32_t rm_idx = rm | (h2 << 3);  // Rm или висок регистър
-    uint32_t target = CPU.REG.r[rm_idx];
+    uint32_t a = cpu->REG.r[cpu->dec->rd];
+    uint32_t b = cpu->REG.r[cpu->dec->rm];
+    m4_flags_lazy(cpu, a - b, a, b, OP_CMP, UPDATE_NZCV);
+    return 0;
+}
 
-    if ((CPU.op >> 6) & 0x1)
-    {                                        // BLX
-        CPU.REG.LR = (CPU.REG.PC + 2) | 0x1; // Запазване на следващия адрес с Thumb бит
-    }
-    CPU.REG.PC = target & ~0x1; // Смяна на PC, изчистване на Thumb бит
+// CMN Rn, Rm
+static int execute_2_cmn(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t a = cpu->REG.r[cpu->dec->rd];
+    uint32_t b = cpu->REG.r[cpu->dec->rm];
+    m4_flags_lazy(cpu, a + b, a, b, OP_CMN, UPDATE_NZCV);
     return 0;
 }
 
-// ADD Rd, Rm, CMP Rm, Rn, MOV Rd, Rm
-int execute_2_add_rd_rm(void)
+// AND..MVN по битове 9:6 и S; TST, CMP, CMN винаги задават флаговете
+static const M4_HANDLER t16_alu[16][2] = {
+    T16_PAIR(2_and), T16_PAIR(2_eor), T16_PAIR(2_lsl),
+    T16_PAIR(2_lsr), T16_PAIR(2_asr), T16_PAIR(2_adc),
+    T16_PAIR(2_sbc), T16_PAIR(2_ror), {execute_2_tst, execute_2_tst},
+    T16_PAIR(2_neg), {execute_2_cmp, execute_2_cmp}, {execute_2_cmn, execute_2_cmn},
+    T16_PAIR(2_orr), T16_PAIR(2_mul), T16_PAIR(2_bic),
+    T16_PAIR(2_mvn),
+};
+
+// BX Rm
+static int execute_2_bx(CortexM4 *cpu)
 {
     FUNC_VM();
-    uint32_t rm = (CPU.op >> 3) & 0xF; // Rm (вкл. H2)
-    uint32_t rd = CPU.op & 0x7;        // Rd (вкл. H1)
-    uint32_t h1 = (CPU.op >> 7) & 0x1; // H1
-    uint32_t h2 = (CPU.op >> 6) & 0x1; // H2
-    uint32_t rd_idx = rd | (h1 << 3);  // Rd или висок регистър
-    uint32_t rm_idx = rm | (h2 << 3);  // Rm или висок регистър
-    uint32_t value1 = CPU.REG.r[rd_idx];
-    uint32_t value2 = CPU.REG.r[rm_idx];
-    uint32_t result;
+    uint32_t target = cpu->REG.r[cpu->dec->rm]; // Rm или висок регистър (вкл. H2)
+#if USE_NVIC
+    if (M4_IS_EXC_RETURN(cpu, target))
+        return m4_exception_return(cpu, target);
+#endif
+    M4_HOOK_RETURN(cpu, target);
+    cpu->REG.PC = target & ~0x1; // Смяна на PC, изчистване на Thumb бит
+    return 0;
+}
 
-    switch ((CPU.op >> 8) & 0x3)
-    {         // Битове 9:8
-    case 0x0: // ADD Rd, Rm
-        result = value1 + value2;
-        if (rd_idx == 15)
-        {                   // Ако Rd е PC
-            result &= ~0x1; // Изчистване на Thumb бит
-        }
-        // update_flags();
-        break;
-    case 0x1: // CMP Rn, Rm
-        result = value1 - value2;
-        // update_flags();
-        return 0;
-    case 0x2: // MOV Rd, Rm
-        result = value2;
-        if (rd_idx == 15)
-        {                   // Ако Rd е PC
-            result &= ~0x1; // Изчистване на Thumb бит
-        }
-        // update_flags();
-        break;
-    default:
-        return -1;
+// BLX Rm
+static int execute_2_blx(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t target = cpu->REG.r[cpu->dec->rm];
+    cpu->REG.LR = (cpu->REG.PC + 2) | 0x1; // Запазване на следващия адрес с Thumb бит
+    M4_HOOK_CALL(cpu, target, cpu->REG.LR);
+    cpu->REG.PC = target & ~0x1;
+    return 0;
+}
+
+// Висок регистър като операнд: PC се чете като адреса на инструкцията + 4
+static inline uint32_t t16_hi_read(const CortexM4 *cpu, uint32_t r)
+{
+    return r == 15 ? cpu->REG.PC + 4 : cpu->REG.r[r];
+}
+
+// ADD Rd, Rm (високи регистри)
+static int execute_2_add_hi(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t rd = cpu->dec->rd; // Rd или висок регистър (вкл. H1)
+    uint32_t result = t16_hi_read(cpu, rd) + t16_hi_read(cpu, cpu->dec->rm);
+    if (rd == 15)
+    {                   // Ако Rd е PC
+        result &= ~0x1; // Изчистване на Thumb бит
+        M4_HOOK_RETURN(cpu, result);
     }
+    cpu->REG.r[rd] = result;
+    return 0;
+}
+
+// CMP Rn, Rm (високи регистри)
+static int execute_2_cmp_hi(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t a = cpu->REG.r[cpu->dec->rd];
+    uint32_t b = cpu->REG.r[cpu->dec->rm];
+    m4_flags_lazy(cpu, a - b, a, b, OP_CMP, UPDATE_NZCV);
+    return 0;
+}
 
-    CPU.REG.r[rd_idx] = result;
+// MOV Rd, Rm (високи регистри)
+static int execute_2_mov_hi(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t rd = cpu->dec->rd;
+    uint32_t result = t16_hi_read(cpu, cpu->dec->rm);
+    if (rd == 15)
+    {                   // Ако Rd е PC
+        result &= ~0x1; // Изчистване на Thumb бит
+        M4_HOOK_RETURN(cpu, result); // MOV PC, LR
+    }
+    cpu->REG.r[rd] = result;
     return 0;
 }
 
-// STR Rd, [Rn, Rm], STRH, STRB, LDRSB, LDR, LDRH, LDRB, LDRSH
-int execute_2_str_rd_rd_rm(void)
+// ADD, CMP, MOV с високи регистри по битове 9:8
+static const M4_HANDLER t16_hi[3] = {execute_2_add_hi, execute_2_cmp_hi, execute_2_mov_hi};
+
+// STR Rd, [Rn, Rm]
+static int execute_2_str_reg(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    return WRITE_MEM_32(cpu, cpu->REG.r[d->rn] + cpu->REG.r[d->rm], cpu->REG.r[d->rd]);
+}
+
+// STRH Rd, [Rn, Rm]
+static int execute_2_strh_reg(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    return WRITE_MEM_16(cpu, cpu->REG.r[d->rn] + cpu->REG.r[d->rm], cpu->REG.r[d->rd] & 0xFFFF);
+}
+
+// STRB Rd, [Rn, Rm]
+static int execute_2_strb_reg(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    return WRITE_MEM_8(cpu, cpu->REG.r[d->rn] + cpu->REG.r[d->rm], cpu->REG.r[d->rd] & 0xFF);
+}
+
+// LDRSB Rd, [Rn, Rm]
+static int execute_2_ldrsb_reg(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    int res;
+    cpu->REG.r[d->rd] = (int32_t)(int8_t)READ_MEM_8(cpu, cpu->REG.r[d->rn] + cpu->REG.r[d->rm], &res);
+    return res;
+}
+
+// LDR Rd, [Rn, Rm]
+static int execute_2_ldr_reg(CortexM4 *cpu)
 {
     FUNC_VM();
-    uint32_t rm = (CPU.op >> 6) & 0x7;             // Rm
-    uint32_t rn = (CPU.op >> 3) & 0x7;             // Rn
-    uint32_t rd = CPU.op & 0x7;                    // Rd
-    uint32_t addr = CPU.REG.r[rn] + CPU.REG.r[rm]; // Адрес = Rn + Rm
+    const M4_DECODED *d = cpu->dec;
     int res;
+    cpu->REG.r[d->rd] = READ_MEM_32(cpu, cpu->REG.r[d->rn] + cpu->REG.r[d->rm], &res);
+    return res;
+}
 
-    switch ((CPU.op >> 9) & 0xF)
-    {         // Битове 12:9
-    case 0x8: // STR Rd, [Rn, Rm]
-        return WRITE_MEM_32(addr, CPU.REG.r[rd]);
-    case 0x9: // STRH Rd, [Rn, Rm]
-        return WRITE_MEM_16(addr, CPU.REG.r[rd] & 0xFFFF);
-    case 0xA: // STRB Rd, [Rn, Rm]
-        return WRITE_MEM_8(addr, CPU.REG.r[rd] & 0xFF);
-    case 0xB: // LDRSB Rd, [Rn, Rm]
-        CPU.REG.r[rd] = (int32_t)(int8_t)READ_MEM_8(addr, &res);
-        return res;
-    case 0xC: // LDR Rd, [Rn, Rm]
-        CPU.REG.r[rd] = READ_MEM_32(addr, &res);
-        return res;
-    case 0xD: // LDRH Rd, [Rn, Rm]
-        CPU.REG.r[rd] = READ_MEM_16(addr, &res);
-        return res;
-    case 0xE: // LDRB Rd, [Rn, Rm]
-        CPU.REG.r[rd] = READ_MEM_8(addr, &res);
-        return res;
-    case 0xF: // LDRSH Rd, [Rn, Rm]
-        CPU.REG.r[rd] = (int32_t)(int16_t)READ_MEM_16(addr, &res);
-        return res;
-    default:
-        return -1;
-    }
+// LDRH Rd, [Rn, Rm]
+static int execute_2_ldrh_reg(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    int res;
+    cpu->REG.r[d->rd] = READ_MEM_16(cpu, cpu->REG.r[d->rn] + cpu->REG.r[d->rm], &res);
+    return res;
+}
+
+// LDRB Rd, [Rn, Rm]
+static int execute_2_ldrb_reg(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    int res;
+    cpu->REG.r[d->rd] = READ_MEM_8(cpu, cpu->REG.r[d->rn] + cpu->REG.r[d->rm], &res);
+    return res;
+}
+
+// LDRSH Rd, [Rn, Rm]
+static int execute_2_ldrsh_reg(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    int res;
+    cpu->REG.r[d->rd] = (int32_t)(int16_t)READ_MEM_16(cpu, cpu->REG.r[d->rn] + cpu->REG.r[d->rm], &res);
+    return res;
 }
 
+// STR..LDRSH Rd, [Rn, Rm] по битове 11:9
+static const M4_HANDLER t16_ldst_reg[8] = {
+    execute_2_str_reg,  execute_2_strh_reg, execute_2_strb_reg, execute_2_ldrsb_reg,
+    execute_2_ldr_reg,  execute_2_ldrh_reg, execute_2_ldrb_reg, execute_2_ldrsh_reg,
+};
+
 // LDR Rd, [PC, #]
-int execute_2_ldr_pc(void)
+static int execute_2_ldr_pc(CortexM4 *cpu)
 {
     FUNC_VM();
-    uint32_t rd = (CPU.op >> 8) & 0x7;     // Rd (R0–R7)
-    uint32_t imm8 = CPU.op & 0xFF;         // imm8 (0–255)
-    uint32_t pc = (CPU.REG.PC + 4) & ~0x3; // Подравнен PC + 4 (pipeline offset)
-    uint32_t addr = pc + (imm8 << 2);      // Адрес = Align(PC + 4, 4) + imm8*4
+    uint32_t rd = cpu->dec->rd;             // Rd (R0–R7)
+    uint32_t pc = (cpu->REG.PC + 4) & ~0x3; // Подравнен PC + 4 (pipeline offset)
+    uint32_t addr = pc + cpu->dec->imm;     // Адрес = Align(PC + 4, 4) + imm8*4
     int res;
-    uint32_t value = READ_MEM_32(addr, &res); // Четене от паметта
+    uint32_t value = READ_MEM_32(cpu, addr, &res); // Четене от паметта
     if (res)
     {
         DEBUG_M4("[ERROR] Memory read failed at address 0x%08X\n", addr);
         return res;
     }
-    CPU.REG.r[rd] = value; // Запис в Rd
+    cpu->REG.r[rd] = value; // Запис в Rd
     return 0;
 }
 
-static int execute_2(void)
+static int decode_2(uint32_t opcode, M4_DECODED *d, int s)
 {
-    FUNC_VM();
-    uint32_t op = CPU.op & 0x1FFF; // Премахване на битове 15:13
+    uint32_t op = opcode & 0x1FFF; // Премахване на битове 15:13
 
     // >>6 за AND, EOR, LSL, LSR, ASR, ADC, SBC, ROR, TST, NEG, CMP, CMN, ORR, MUL, BIC, MVN
     switch (op >> 6)
@@ -470,15 +532,23 @@ static int execute_2(void)
     case 0xD: // MUL
     case 0xE: // BIC
     case 0xF: // MVN
-        return execute_2_and_rd_rm();
+        d->rd = opcode & 0x7;        // Rd или Rm
+        d->rm = (opcode >> 3) & 0x7; // Rm или Rn
+        d->handler = t16_alu[op >> 6][s];
+        if ((op >> 6) == 0x8 || (op >> 6) == 0xA || (op >> 6) == 0xB)
+            d->flags = M4_DEC_SETS_FLAGS; // TST, CMP, CMN
+        return 0;
     }
 
     // >>7 за BX, BLX
     switch (op >> 7)
     {
-    case 0x1C: // BX
-    case 0x1F: // BLX
-        return execute_2_bx_rm();
+    case 0xE: // BX
+    case 0xF: // BLX
+        d->rm = (opcode >> 3) & 0xF; // Rm (вкл. H2)
+        d->flags = M4_DEC_BRANCH;
+        d->handler = (op & 0x80) ? execute_2_blx : execute_2_bx;
+        return 0;
     }
 
     // >>8 за ADD, CMP, MOV
@@ -487,7 +557,14 @@ static int execute_2(void)
     case 0x4: // ADD
     case 0x5: // CMP
     case 0x6: // MOV
-        return execute_2_add_rd_rm();
+        d->rd = (opcode & 0x7) | (((opcode >> 7) & 0x1) << 3); // Rd (вкл. H1)
+        d->rm = (opcode >> 3) & 0xF;                          // Rm (вкл. H2)
+        if (d->rd == 15 && (op >> 8) != 0x5)                  // ADD/MOV в PC
+            d->flags = M4_DEC_BRANCH;
+        else if ((op >> 8) == 0x5)
+            d->flags = M4_DEC_SETS_FLAGS; // CMP
+        d->handler = t16_hi[(op >> 8) & 0x3];
+        return 0;
     }
 
     // >>9 за STR, STRH, STRB, LDRSB, LDR, LDRH, LDRB, LDRSH
@@ -501,17 +578,23 @@ static int execute_2(void)
     case 0xD: // LDRH
     case 0xE: // LDRB
     case 0xF: // LDRSH
-        return execute_2_str_rd_rd_rm();
+        d->rd = opcode & 0x7;        // Rd
+        d->rn = (opcode >> 3) & 0x7; // Rn
+        d->rm = (opcode >> 6) & 0x7; // Rm
+        d->handler = t16_ldst_reg[(op >> 9) & 0x7];
+        return 0;
     }
 
     // >>10 за LDR Rd, [PC, #]
     switch (op >> 11)
     {
     case 0x1: // 01001xxx
-        return execute_2_ldr_pc();
+        d->rd = (opcode >> 8) & 0x7;   // Rd (R0–R7)
+        d->imm = (opcode & 0xFF) << 2; // imm8*4
+        d->handler = execute_2_ldr_pc;
+        return 0;
     }
 
-    DEBUG_M4("[ERROR] Unknown Group 2 Instruction: 0x%04X\n", CPU.op);
     return -1;
 }
 
@@ -524,39 +607,54 @@ static int execute_2(void)
     LDRB Rd, [Rn, #OFF]     [011 11 # Offset Rn Rd]
 */
 
-static int execute_3(void)
+// STR Rd, [Rn, #OFF] и STR Rd, [SP, #OFF]
+static int execute_3_str(CortexM4 *cpu)
 {
     FUNC_VM();
-    uint32_t op = CPU.op & 0x1FFF;        // Премахване на битове 15:13
-    uint32_t imm5 = (CPU.op >> 6) & 0x1F; // Offset (битове 10:6)
-    uint32_t rn = (CPU.op >> 3) & 0x7;    // Rn (битове 5:3)
-    uint32_t rd = CPU.op & 0x7;           // Rd (битове 2:0)
-    uint32_t address;
+    const M4_DECODED *d = cpu->dec;
+    return WRITE_MEM_32(cpu, cpu->REG.r[d->rn] + d->imm, cpu->REG.r[d->rd]);
+}
+
+// LDR Rd, [Rn, #OFF] и LDR Rd, [SP, #OFF]
+static int execute_3_ldr(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
     int res;
-    switch (op >> 11) // (битове 12:11)
-    {
-    case 0:
-        PRINTF("\tSTR Rd, [Rn, #OFF]\n");
-        address = CPU.REG.r[rn] + (imm5 << 2); // Offset = imm5 * 4
-        return WRITE_MEM_32(address, CPU.REG.r[rd]);
-    case 1:
-        PRINTF("\tLDR Rd, [Rn, #OFF]\n");
-        address = CPU.REG.r[rn] + (imm5 << 2); // Offset = imm5 * 4
-        CPU.REG.r[rd] = READ_MEM_32(address, &res);
-        return res;
-    case 2:
-        PRINTF("\tSTRB Rd, [Rn, #OFF]\n");
-        address = CPU.REG.r[rn] + imm5; // Offset = imm5
-        return WRITE_MEM_8(address, CPU.REG.r[rd] & 0xFF);
-    case 3:
-        PRINTF("\tLDRB Rd, [Rn, #OFF]\n");
-        address = CPU.REG.r[rn] + imm5; // Offset = imm5
-        CPU.REG.r[rd] = READ_MEM_8(address, &res);
-        return res;
-    default:
-        DEBUG_M4("[ERROR] Unknown Group 3 Instruction: 0x%04X\n", CPU.op);
-        return -1;
-    }
+    cpu->REG.r[d->rd] = READ_MEM_32(cpu, cpu->REG.r[d->rn] + d->imm, &res);
+    return res;
+}
+
+// STRB Rd, [Rn, #OFF]
+static int execute_3_strb(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    return WRITE_MEM_8(cpu, cpu->REG.r[d->rn] + d->imm, cpu->REG.r[d->rd] & 0xFF);
+}
+
+// LDRB Rd, [Rn, #OFF]
+static int execute_3_ldrb(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    int res;
+    cpu->REG.r[d->rd] = READ_MEM_8(cpu, cpu->REG.r[d->rn] + d->imm, &res);
+    return res;
+}
+
+// STR, LDR, STRB, LDRB по битове 12:11
+static const M4_HANDLER t16_ldst_imm[4] = {execute_3_str, execute_3_ldr, execute_3_strb, execute_3_ldrb};
+
+static int decode_3(uint32_t op, M4_DECODED *d)
+{
+    uint32_t imm5 = (op >> 6) & 0x1F; // Offset (битове 10:6)
+    d->rn = (op >> 3) & 0x7;          // Rn (битове 5:3)
+    d->rd = op & 0x7;                 // Rd (битове 2:0)
+    // STR/LDR: Offset = imm5 * 4, STRB/LDRB: Offset = imm5
+    d->imm = (op & 0x1000) ? imm5 : (imm5 << 2);
+    d->handler = t16_ldst_imm[(op >> 11) & 0x3];
+    return 0;
 }
 
 // GROUP 4 ////////////////////////////
@@ -567,154 +665,363 @@ static int execute_3(void)
     LDR Rd,  [SP, #OFF]     [100 11 Rd SP Relative Offset]
 */
 
-static int execute_4(void)
+// STRH Rd, [Rn, #OFF]
+static int execute_4_strh(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    return WRITE_MEM_16(cpu, cpu->REG.r[d->rn] + d->imm, cpu->REG.r[d->rd] & 0xFFFF);
+}
+
+// LDRH Rd, [Rn, #OFF]
+static int execute_4_ldrh(CortexM4 *cpu)
 {
     FUNC_VM();
-    uint32_t op = CPU.op & 0x1FFF; // Премахване на битове 15:13
-    uint32_t rd, address;
+    const M4_DECODED *d = cpu->dec;
     int res;
+    cpu->REG.r[d->rd] = READ_MEM_16(cpu, cpu->REG.r[d->rn] + d->imm, &res);
+    return res;
+}
 
-    switch (op >> 11)
-    {       // Битове 12:11
-    case 0: // STRH Rd, [Rn, #OFF]
-    {
-        uint32_t imm5 = (CPU.op >> 6) & 0x1F;  // Offset (битове 10:6)
-        uint32_t rn = (CPU.op >> 3) & 0x7;     // Rn (битове 5:3)
-        rd = CPU.op & 0x7;                     // Rd (битове 2:0)
-        address = CPU.REG.r[rn] + (imm5 << 1); // Offset = imm5 * 2
-        return WRITE_MEM_16(address, CPU.REG.r[rd] & 0xFFFF);
-    }
-    case 1: // LDRH Rd, [Rn, #OFF]
-    {
-        uint32_t imm5 = (CPU.op >> 6) & 0x1F;  // Offset (битове 10:6)
-        uint32_t rn = (CPU.op >> 3) & 0x7;     // Rn (битове 5:3)
-        rd = CPU.op & 0x7;                     // Rd (битове 2:0)
-        address = CPU.REG.r[rn] + (imm5 << 1); // Offset = imm5 * 2
-        CPU.REG.r[rd] = READ_MEM_16(address, &res);
-        return res;
-    }
-    case 2: // STR Rd, [SP, #OFF]
-    {
-        rd = (CPU.op >> 8) & 0x7;           // Rd (битове 10:8)
-        uint32_t imm8 = CPU.op & 0xFF;      // Offset (битове 7:0)
-        address = CPU.REG.SP + (imm8 << 2); // Offset = imm8 * 4
-        return WRITE_MEM_32(address, CPU.REG.r[rd]);
-    }
-    case 3: // LDR Rd, [SP, #OFF]
-    {
-        rd = (CPU.op >> 8) & 0x7;           // Rd (битове 10:8)
-        uint32_t imm8 = CPU.op & 0xFF;      // Offset (битове 7:0)
-        address = CPU.REG.SP + (imm8 << 2); // Offset = imm8 * 4
-        CPU.REG.r[rd] = READ_MEM_32(address, &res);
-        return res;
+// STRH, LDRH, STR [SP], LDR [SP] по битове 12:11
+static const M4_HANDLER t16_ldst_sp[4] = {execute_4_strh, execute_4_ldrh, execute_3_str, execute_3_ldr};
+
+static int decode_4(uint32_t op, M4_DECODED *d)
+{
+    if (op & 0x1000)
+    {                              // STR/LDR Rd, [SP, #OFF]
+        d->rd = (op >> 8) & 0x7;   // Rd (битове 10:8)
+        d->rn = 13;                // SP
+        d->imm = (op & 0xFF) << 2; // Offset = imm8 * 4
     }
-    default:
-        DEBUG_M4("[ERROR] Unknown Group 4 Instruction: 0x%04X\n", CPU.op);
-        return -1;
+    else
+    {                                     // STRH/LDRH Rd, [Rn, #OFF]
+        d->rd = op & 0x7;                 // Rd (битове 2:0)
+        d->rn = (op >> 3) & 0x7;          // Rn (битове 5:3)
+        d->imm = ((op >> 6) & 0x1F) << 1; // Offset = imm5 * 2
     }
+    d->handler = t16_ldst_sp[(op >> 11) & 0x3];
+    return 0;
 }
 
 // GROUP 5 ////////////////////////////
 
-static int execute_5(void)
+// ADD Rd, PC, #OFF [101 00 Rd imm8]
+static int execute_5_add_pc(CortexM4 *cpu)
 {
     FUNC_VM();
-    int res;
-    uint32_t op = (CPU.op >> 8) & 0xFF; // Битове 15:8 за декодиране
+    uint32_t pc = (cpu->REG.PC + 4) & ~0x3;        // Подравнен PC + 4 (pipeline offset)
+    cpu->REG.r[cpu->dec->rd] = pc + cpu->dec->imm; // Rd = Align(PC + 4, 4) + imm8*4
+    return 0;
+}
 
-    // ADD Rd, PC, #OFF [101 00 Rd imm8]
-    if ((op & 0xF8) == 0xA0)
-    { // 101 00 xxx
-        PRINTF("\tADD Rd, PC, #OFF\n");
-        uint32_t rd = (CPU.op >> 8) & 0x7; // Rd (R0–R7)
-        uint32_t imm8 = CPU.op & 0xFF;     // imm8
-        uint32_t pc = CPU.REG.PC & ~0x3;   // Подравнен PC
-        CPU.REG.r[rd] = pc + (imm8 << 2);  // Rd = PC + imm8*4
-        return 0;
-    }
-    // ADD Rd, SP, #OFF [101 01 Rd imm8]
-    else if ((op & 0xF8) == 0xA8)
-    { // 101 01 xxx
-        PRINTF("\tADD Rd, SP, #OFF\n");
-        uint32_t rd = (CPU.op >> 8) & 0x7;        // Rd (R0–R7)
-        uint32_t imm8 = CPU.op & 0xFF;            // imm8
-        CPU.REG.r[rd] = CPU.REG.SP + (imm8 << 2); // Rd = SP + imm8*4
-        return 0;
-    }
-    // SUB SP, SP, #OFF [101 100001 imm7]
-    else if (op == 0xB0)
-    { // 101 100001
-        PRINTF("\tSUB SP, SP, #OFF\n");
-        uint32_t imm7 = CPU.op & 0x7F; // imm7 (7 бита)
-        CPU.REG.SP -= (imm7 << 2);     // SP = SP - imm7*4
-        return 0;
-    }
-    // PUSH {<reg list>, <LR>} [101 1010 M reglist]
-    else if ((op & 0xFE) == 0xB4)
-    { // 101 1010 x
-        PRINTF("\tPUSH {<reg list>, <LR>}\n");
-        uint32_t reglist = CPU.op & 0xFF;                  // R0–R7
-        uint32_t lr = (CPU.op >> 8) & 0x1;                 // M (LR)
-        uint32_t count = __builtin_popcount(reglist) + lr; // Брой регистри
-        uint32_t addr = CPU.REG.SP;
-        // Запис в стека (намаляващ стек)
-        for (int i = 0; i < 8; i++)
-        {
-            if (reglist & (1 << i))
-            {
-                addr -= 4;
-                if (WRITE_MEM_32(addr, CPU.REG.r[i])) // Запис на Ri
-                    return -1;
-            }
-        }
-        if (lr)
-        {
-            addr -= 4;
-            if (WRITE_MEM_32(addr, CPU.REG.LR)) // Запис на LR
-                return -1;
-        }
-        CPU.REG.SP = addr; // Актуализация на SP
-        return 0;
-    }
-    // POP {<reg list>, <PC>} [101 1110 P reglist]
-    else if ((op & 0xFE) == 0xBC)
-    { // 101 1110 x
-        PRINTF("\tPOP {<reg list>, <PC>}\n");
-        uint32_t reglist = CPU.op & 0xFF;  // R0–R7
-        uint32_t pc = (CPU.op >> 8) & 0x1; // P (PC)
-        uint32_t addr = CPU.REG.SP;
-        // Четене от стека
-        for (int i = 0; i < 8; i++)
-        {
-            if (reglist & (1 << i))
-            {
-                CPU.REG.r[i] = READ_MEM_32(addr, &res); // Четене в Ri
-                if (res)
-                    return -1;
-                addr += 4;
-            }
-        }
-        if (pc)
-        {
-            CPU.REG.PC = READ_MEM_32(addr, &res) & ~0x1; // Четене в PC, Thumb бит=0
-            if (res)
-                return -1;
-            addr += 4;
-        }
-        CPU.REG.SP = addr; // Актуализация на SP
+// ADD Rd, SP, #OFF [101 01 Rd imm8]
+static int execute_5_add_sp(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = cpu->REG.SP + cpu->dec->imm; // Rd = SP + imm8*4
+    return 0;
+}
+
+// ADD SP, SP, #OFF [1011 0000 0 imm7]
+static int execute_5_add_sp_imm(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.SP += cpu->dec->imm; // SP = SP + imm7*4
+    return 0;
+}
+
+// SUB SP, SP, #OFF [1011 0000 1 imm7]
+static int execute_5_sub_sp(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.SP -= cpu->dec->imm; // SP = SP - imm7*4
+    return 0;
+}
+
+// CBZ / CBNZ Rn, <label> [1011 N0i1 imm5 Rn]
+// Само напред: целта е PC + 4 + i:imm5:0, d->cond е 1 за CBNZ
+static int execute_5_cbz(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    if ((cpu->REG.r[d->rn] != 0) == d->cond)
+        cpu->REG.PC += 4 + d->imm; // Скок
+    else
+        cpu->REG.PC += 2;
+    return 0;
+}
+
+// SXTH Rd, Rm [1011 0010 00 Rm Rd]
+static int execute_5_sxth(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = (uint32_t)(int32_t)(int16_t)cpu->REG.r[cpu->dec->rm];
+    return 0;
+}
+
+// SXTB Rd, Rm [1011 0010 01 Rm Rd]
+static int execute_5_sxtb(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = (uint32_t)(int32_t)(int8_t)cpu->REG.r[cpu->dec->rm];
+    return 0;
+}
+
+// UXTH Rd, Rm [1011 0010 10 Rm Rd]
+static int execute_5_uxth(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = cpu->REG.r[cpu->dec->rm] & 0xFFFF;
+    return 0;
+}
+
+// UXTB Rd, Rm [1011 0010 11 Rm Rd]
+static int execute_5_uxtb(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = cpu->REG.r[cpu->dec->rm] & 0xFF;
+    return 0;
+}
+
+// REV Rd, Rm [1011 1010 00 Rm Rd]
+static int execute_5_rev(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = __builtin_bswap32(cpu->REG.r[cpu->dec->rm]);
+    return 0;
+}
+
+// REV16 Rd, Rm [1011 1010 01 Rm Rd]
+static int execute_5_rev16(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t value = cpu->REG.r[cpu->dec->rm];
+    cpu->REG.r[cpu->dec->rd] = ((value >> 8) & 0x00FF00FF) | ((value << 8) & 0xFF00FF00);
+    return 0;
+}
+
+// REVSH Rd, Rm [1011 1010 11 Rm Rd]
+static int execute_5_revsh(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t value = cpu->REG.r[cpu->dec->rm];
+    cpu->REG.r[cpu->dec->rd] = (uint32_t)(int32_t)(int16_t)(((value >> 8) & 0xFF) | (value << 8));
+    return 0;
+}
+
+// Индексирани с битове 7:6; REV 10 е недефинирана
+static const M4_HANDLER t16_extend[4] = {execute_5_sxth, execute_5_sxtb, execute_5_uxth, execute_5_uxtb};
+static const M4_HANDLER t16_rev[4] = {execute_5_rev, execute_5_rev16, NULL, execute_5_revsh};
+
+// PUSH {<reg list>, <LR>} [101 1010 M reglist]
+static int execute_5_push(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t reglist = cpu->dec->imm & 0xFF;  // R0–R7
+    uint32_t lr = (cpu->dec->imm >> 8) & 0x1; // M (LR)
+    uint32_t words[9];
+    uint32_t n = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        if (reglist & (1 << i))
+            words[n++] = cpu->REG.r[i];
+    }
+    if (lr)
+        words[n++] = cpu->REG.LR;
+    // Намаляващ стек: най-малкият регистър е на най-ниския адрес
+    uint32_t addr = cpu->REG.SP - 4 * n;
+    if (m4_mem_write_words(cpu, addr, words, n))
+        return -1;
+    cpu->REG.SP = addr; // Актуализация на SP
+    return 0;
+}
+
+// POP {<reg list>, <PC>} [101 1110 P reglist]
+static int execute_5_pop(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t reglist = cpu->dec->imm & 0xFF;  // R0–R7
+    uint32_t pc = (cpu->dec->imm >> 8) & 0x1; // P (PC)
+    uint32_t words[9];
+    uint32_t n = __builtin_popcount(reglist) + pc;
+    if (m4_mem_read_words(cpu, cpu->REG.SP, words, n))
+        return -1;
+    n = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        if (reglist & (1 << i))
+            cpu->REG.r[i] = words[n++]; // Четене в Ri
+    }
+    if (pc)
+    {
+        uint32_t target = words[n++];
+        cpu->REG.SP += 4 * n; // Актуализация на SP
+#if USE_NVIC
+        if (M4_IS_EXC_RETURN(cpu, target))
+            return m4_exception_return(cpu, target);
+#endif
+        cpu->REG.PC = target & ~0x1; // Четене в PC, Thumb бит=0
+        M4_HOOK_RETURN(cpu, cpu->REG.PC);
         return 0;
     }
-    // BKPT # [101 11110 imm8]
-    else if (op == 0xBE)
-    { // 101 11110
-        PRINTF("\tBKPT #\n");
-        uint32_t imm8 = CPU.op & 0xFF; // imm8
-        // Спиране за дебъгване (зависи от системата)
-        // trigger_breakpoint(imm8); // Хипотетична функция
+    cpu->REG.SP += 4 * n; // Актуализация на SP
+    return 0;
+}
+
+// BKPT # [101 11110 imm8]
+static int execute_5_bkpt(CortexM4 *cpu)
+{
+    FUNC_VM();
+    // Спиране за дебъгване: PC остава на BKPT, imm8 е кодът за изход
+    cpu->stop = M4_STOP_BKPT;
+    cpu->stop_code = cpu->dec->imm;
+    return 0;
+}
+
+// NOP / YIELD / SEV [1011 1111 hint 0000]
+static int execute_5_nop(CortexM4 *cpu)
+{
+    FUNC_VM();
+    (void)cpu;
+    return 0;
+}
+
+// WFI / WFE [1011 1111 0011 0000] / [1011 1111 0010 0000] и WFI.W / WFE.W
+int m4_execute_wfi(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.PC += cpu->dec->size;
+#if USE_NVIC
+    if (cpu->nvic.pending)
+        return 0; // Чакащо прекъсване: WFI не заспива
+#endif
+#if USE_EVENTS
+    if (cpu->event_count)
+    {
+        m4_events_sleep(cpu); // Времето се прескача до събуждането
         return 0;
     }
+#endif
+    // Ядрото заспива до събитие; m4_run връща управлението
+    cpu->stop = M4_STOP_WFI;
+    cpu->stop_code = cpu->dec->imm;
+    return 0;
+}
 
-    return -1; // Невалиден опкод
+// IT{x{y{z}}} <firstcond> [1011 1111 firstcond mask]
+// Условието се проверява веднъж за целия блок: d->rd е предварително
+// изчислената маска на T инструкциите, изпълнява се или тя, или
+// допълнението й. Следващите инструкции се изпълняват от m4_execute_it.
+static int execute_5_it(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t all = (1u << d->rn) - 1;
+    cpu->ITSTATE = (uint8_t)d->imm;
+    cpu->it_exec = m4_check_condition(cpu, d->cond) ? d->rd : all & ~d->rd;
+    cpu->REG.PC += 2;
+    return 0;
+}
+
+static int decode_5(uint32_t opcode, M4_DECODED *d)
+{
+    uint32_t op = (opcode >> 8) & 0xFF; // Битове 15:8 за декодиране
+
+    if ((op & 0xF8) == 0xA0)
+    { // 101 00 xxx
+        d->rd = (opcode >> 8) & 0x7;   // Rd (R0–R7)
+        d->imm = (opcode & 0xFF) << 2; // imm8*4
+        d->handler = execute_5_add_pc;
+    }
+    else if ((op & 0xF8) == 0xA8)
+    { // 101 01 xxx
+        d->rd = (opcode >> 8) & 0x7;   // Rd (R0–R7)
+        d->imm = (opcode & 0xFF) << 2; // imm8*4
+        d->handler = execute_5_add_sp;
+    }
+    else if (op == 0xB0)
+    { // 1011 0000 S imm7
+        d->imm = (opcode & 0x7F) << 2; // imm7*4
+        d->handler = (opcode & 0x80) ? execute_5_sub_sp : execute_5_add_sp_imm;
+    }
+    else if ((op & 0xF5) == 0xB1)
+    { // 1011 N0i1: CBZ, CBNZ
+        d->rn = opcode & 0x7;                                              // Rn (R0–R7)
+        d->imm = ((opcode >> 9) & 0x1) << 6 | ((opcode >> 3) & 0x1F) << 1; // i:imm5:0
+        d->cond = (opcode >> 11) & 0x1;                                    // N
+        d->flags = M4_DEC_BRANCH;
+        d->handler = execute_5_cbz;
+    }
+    else if (op == 0xB2 || op == 0xBA)
+    { // 1011 0010 / 1011 1010: SXTH, SXTB, UXTH, UXTB / REV, REV16, REVSH
+        d->rd = opcode & 0x7;        // Rd (R0–R7)
+        d->rm = (opcode >> 3) & 0x7; // Rm (R0–R7)
+        d->handler = (op == 0xB2 ? t16_extend : t16_rev)[(opcode >> 6) & 0x3];
+        if (!d->handler)
+            return -1;
+    }
+    else if ((op & 0xFE) == 0xB4)
+    { // 101 1010 x
+        d->imm = opcode & 0x1FF; // reglist + M (LR)
+        d->handler = execute_5_push;
+    }
+    else if ((op & 0xFE) == 0xBC)
+    { // 101 1110 x
+        d->imm = opcode & 0x1FF; // reglist + P (PC)
+        if (opcode & 0x100)
+            d->flags = M4_DEC_BRANCH;
+        d->handler = execute_5_pop;
+    }
+    else if (op == 0xBE)
+    { // 101 11110
+        d->imm = opcode & 0xFF;   // imm8
+        d->flags = M4_DEC_BRANCH; // Спира блока, PC не се увеличава
+        d->handler = execute_5_bkpt;
+    }
+#if USE_SYSTEM
+    else if ((opcode & 0xFFEC) == 0xB660)
+    {                             // 1011 0110 011 im 0 0 I F
+        d->flags = M4_DEC_BRANCH; // Маските се проверяват след инструкцията
+        d->handler = m4_execute_cps;
+    }
+#endif
+    else if (op == 0xBF && (opcode & 0xF) == 0)
+    { // 101 11111 hint 0000
+        d->imm = (opcode >> 4) & 0xF; // hint
+        if (d->imm == 0x2 || d->imm == 0x3)
+        { // WFE, WFI
+            d->flags = M4_DEC_BRANCH;
+            d->handler = m4_execute_wfi;
+        }
+        else
+        {
+            d->handler = execute_5_nop;
+        }
+    }
+    else if (op == 0xBF)
+    { // 101 11111 firstcond mask
+        uint32_t firstcond = (opcode >> 4) & 0xF;
+        uint32_t mask = opcode & 0xF;
+        if (firstcond == 0xF)
+            return -1;
+        d->imm = opcode & 0xFF;          // Начално ITSTATE
+        d->cond = firstcond;
+        d->rn = 4 - __builtin_ctz(mask); // Брой инструкции в блока
+        d->rd = 0x1;                     // Първата е винаги T
+        for (uint32_t i = 1; i < d->rn; i++)
+        {
+            if (((mask >> (4 - i)) & 0x1) == (firstcond & 0x1))
+                d->rd |= 1u << i;
+        }
+        d->flags = M4_DEC_BRANCH; // Блокът на IT се изпълнява стъпка по стъпка
+        d->handler = execute_5_it;
+    }
+    else
+    {
+        return -1; // Невалиден опкод
+    }
+    return 0;
 }
 
 // GROUP 6 ////////////////////////////
@@ -726,140 +1033,126 @@ static int execute_5(void)
     SWI #                       [110 1 1 1 1 1 #] return 0 !
 */
 
-// Помощна функция за проверка на условията за B{<cond>}
-static int check_condition(uint32_t cond)
-{
-    switch (cond)
-    {
-    case 0x0:
-        return CPU.psr.apsr.Z; // EQ
-    case 0x1:
-        return !CPU.psr.apsr.Z; // NE
-    case 0x2:
-        return CPU.psr.apsr.C; // CS/HS
-    case 0x3:
-        return !CPU.psr.apsr.C; // CC/LO
-    case 0x4:
-        return CPU.psr.apsr.N; // MI
-    case 0x5:
-        return !CPU.psr.apsr.N; // PL
-    case 0x6:
-        return CPU.psr.apsr.V; // VS
-    case 0x7:
-        return !CPU.psr.apsr.V; // VC
-    case 0x8:
-        return CPU.psr.apsr.C && !CPU.psr.apsr.Z; // HI
-    case 0x9:
-        return !CPU.psr.apsr.C || CPU.psr.apsr.Z; // LS
-    case 0xA:
-        return CPU.psr.apsr.N == CPU.psr.apsr.V; // GE
-    case 0xB:
-        return CPU.psr.apsr.N != CPU.psr.apsr.V; // LT
-    case 0xC:
-        return !CPU.psr.apsr.Z && (CPU.psr.apsr.N == CPU.psr.apsr.V); // GT
-    case 0xD:
-        return CPU.psr.apsr.Z || (CPU.psr.apsr.N != CPU.psr.apsr.V); // LE
-    case 0xE:
-        return 1; // AL (винаги изпълнява)
-    default:
-        return 0; // Невалидно условие
-    }
-}
-
-static int execute_6(void)
-{
-    FUNC_VM();
-    uint32_t op = CPU.op & 0x1FFF; // Премахване на битове 15:13
+// STMIA Rn!, {<reg list>}
+static int execute_6_stm(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t rn = cpu->dec->rn;        // Rn (битове 10:8)
+    uint32_t reg_list = cpu->dec->imm; // Register List (битове 7:0)
+    uint32_t address = cpu->REG.r[rn]; // Начален адрес
+    uint32_t words[8];
+    uint32_t n = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        if (reg_list & (1 << i))
+            words[n++] = cpu->REG.r[i];
+    }
+    if (m4_mem_write_words(cpu, address, words, n))
+    {
+        DEBUG_M4("[ERROR] Memory write failed at 0x%08X\n", address);
+        return -1;
+    }
+    cpu->REG.r[rn] = address + 4 * n; // Write-back на Rn
+    return 0;
+}
 
-    // Проверка на бит 12
-    if ((op >> 12) == 0)
-    {                                     // STMIA или LDMIA
-        uint32_t rn = (op >> 8) & 0x7;    // Rn (битове 10:8)
-        uint32_t reg_list = op & 0xFF;    // Register List (битове 7:0)
-        uint32_t address = CPU.REG.r[rn]; // Начален адрес
-        int res;
-
-        if (reg_list == 0)
-        { // Празен списък е невалиден
-            DEBUG_M4("[ERROR] Empty register list in STMIA/LDMIA: 0x%04X\n", CPU.op);
-            return -1;
-        }
+// LDMIA Rn!, {<reg list>}
+static int execute_6_ldm(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t rn = cpu->dec->rn;
+    uint32_t reg_list = cpu->dec->imm;
+    uint32_t address = cpu->REG.r[rn];
+    uint32_t words[8];
+    uint32_t n = __builtin_popcount(reg_list);
+    if (m4_mem_read_words(cpu, address, words, n))
+    {
+        DEBUG_M4("[ERROR] Memory read failed at 0x%08X\n", address);
+        return -1;
+    }
+    n = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        if (reg_list & (1 << i))
+            cpu->REG.r[i] = words[n++];
+    }
+    if (!(reg_list & (1 << rn)))
+        cpu->REG.r[rn] = address + 4 * n; // Rn е в списъка: без write-back
+    return 0;
+}
 
-        if ((op >> 11) & 0x1)
-        { // LDMIA Rn!, {<reg list>}
-            for (int i = 0; i < 8; i++)
-            {
-                if (reg_list & (1 << i))
-                {
-                    CPU.REG.r[i] = READ_MEM_32(address, &res);
-                    if (res)
-                    {
-                        DEBUG_M4("[ERROR] Memory read failed at 0x%08X\n", address);
-                        return res;
-                    }
-                    address += 4;
-                }
-            }
-        }
-        else
-        { // STMIA Rn!, {<reg list>}
-            for (int i = 0; i < 8; i++)
-            {
-                if (reg_list & (1 << i))
-                {
-                    res = WRITE_MEM_32(address, CPU.REG.r[i]);
-                    if (res)
-                    {
-                        DEBUG_M4("[ERROR] Memory write failed at 0x%08X\n", address);
-                        return res;
-                    }
-                    address += 4;
-                }
-            }
-        }
+// SWI #
+static int execute_6_swi(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.PC += 2;
+#if USE_NVIC
+    // SVCall се обслужва от фърмуера, след инструкцията
+    return m4_exception_sync(cpu, M4_EXC_SVCALL);
+#else
+    // Обработчикът на SVC е на извикващия: m4_run спира след инструкцията
+    DEBUG_M4("[INFO] SWI %d executed\n", cpu->dec->imm);
+    cpu->stop = M4_STOP_SVC;
+    cpu->stop_code = cpu->dec->imm;
+    return 0; // Според спецификацията връща 0
+#endif
+}
+
+// B{<cond>} <Target Addr>
+static int execute_6_b_cond(CortexM4 *cpu)
+{
+    FUNC_VM();
+    if (!m4_check_condition(cpu, cpu->dec->cond))
+    {
+        cpu->REG.PC += 2;
+        return 0; // Условието не е изпълнено, не правим скок
+    }
+
+    // Изчисляване на целевия адрес: PC + 4 + (offset * 2)
+    uint32_t target = (cpu->REG.PC + 4) + cpu->dec->imm;
+    cpu->REG.PC = target & ~0x1; // Подравняване и запазване на Thumb бит
+    return 0;
+}
+
+static int decode_6(uint32_t opcode, M4_DECODED *d)
+{
+    uint32_t op = opcode & 0x1FFF; // Премахване на битове 15:13
 
-        CPU.REG.r[rn] = address; // Write-back на Rn
+    // Проверка на бит 12
+    if ((op >> 12) == 0)
+    {                            // STMIA или LDMIA
+        d->rn = (op >> 8) & 0x7; // Rn (битове 10:8)
+        d->imm = op & 0xFF;      // Register List (битове 7:0)
+        if (d->imm == 0)
+            return -1; // Празен списък е невалиден
+        d->handler = (op & 0x800) ? execute_6_ldm : execute_6_stm;
         return 0;
     }
     else
     { // B{<cond>} или SWI
-        if (((op >> 6) & 0x3F) == 0x3F)
-        { // SWI #
-
-            uint32_t imm6 = op & 0x3F; // Immediate (битове 5:0)
-            // TODO: Извикване на обработчик за SWI (зависи от системата)
-            DEBUG_M4("[INFO] SWI %d executed\n", imm6);
-            return 0; // Според спецификацията връща 0
+        if (((op >> 8) & 0xF) == 0xF)
+        {                             // SWI # [110 1 1111 imm8]
+            d->imm = op & 0xFF;       // Immediate (битове 7:0)
+            d->flags = M4_DEC_BRANCH; // Спира блока
+            d->handler = execute_6_swi;
+            return 0;
         }
         else if (((op >> 8) & 0xF) == 0xE)
         { // Unused Opcode [110 1 1 1 1 0 ...]
-            DEBUG_M4("[ERROR] Unused opcode: 0x%04X\n", CPU.op);
             return -1;
         }
         else
-        { // B{<cond>} <Target Addr>
-
-            uint32_t cond = (op >> 8) & 0xF; // Условие (битове 11:8)
-            int8_t offset = op & 0xFF;       // Знаков offset (битове 7:0)
-
-            if (!check_condition(cond))
-            {
-                return 0; // Условието не е изпълнено, не правим скок
-            }
-
-            // Изчисляване на целевия адрес: PC + 4 + (offset * 2)
-            uint32_t target = (CPU.REG.PC + 4) + ((int32_t)offset << 1);
-            CPU.REG.PC = target & ~0x1; // Подравняване и запазване на Thumb бит
+        {                                                           // B{<cond>} <Target Addr>
+            d->cond = (op >> 8) & 0xF;                              // Условие (битове 11:8)
+            d->imm = (uint32_t)((int32_t)(int8_t)(op & 0xFF) << 1); // Знаков offset * 2
+            d->flags = M4_DEC_BRANCH;
+            d->handler = execute_6_b_cond;
             return 0;
         }
     }
-
-    DEBUG_M4("[ERROR] Unknown Group 6 Instruction: 0x%04X\n", CPU.op);
-    return -1;
 }
 
 // GROUP 7 ////////////////////////////
-
 /*
     B <Target Addr>             [111 00 # Offset]
     BLX <Target Addr>           [111 01 # Offset (lower half)]
@@ -867,125 +1160,354 @@ static int execute_6(void)
     BL <Target Addr>            [111 11 # Offset (lower half)]
 */
 
-// GROUP 7 ////////////////////////////
-/*
-    B <Target Addr>             [111 00 # Offset]
-    BLX <Target Addr>           [111 01 # Offset (lower half)]
-    BL{X} <Target Addr> (+)     [111 10 # Offset (upper half)]
-    BL <Target Addr>            [111 11 # Offset (lower half)]
-*/
-
-// Статични променливи за BL/BLX състояние
-static uint32_t upper_offset = 0; // Горна половина на офсета
-static int is_upper_pending = 0;  // Флаг за чакаща горна половина
+// B <Target Addr>
+static int execute_7_b(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t target = (cpu->REG.PC + 4) + cpu->dec->imm; // PC + 4 + offset*2
+    cpu->REG.PC = target & ~0x1;                         // Подравняване за Thumb
+    cpu->bl_upper_pending = 0;                           // Изчистване на BL/BLX състояние
+    return 0;
+}
 
-static int execute_7(void)
+// BL{X} <Target Addr> (upper half)
+static int execute_7_bl_upper(CortexM4 *cpu)
 {
     FUNC_VM();
-    uint32_t op = CPU.op & 0x1FFF; // Премахване на битове 15:13
+    cpu->bl_upper_offset = cpu->dec->imm; // Съхраняване на горните 11 бита
+    cpu->bl_upper_pending = 1;            // Отбелязваме, че чакаме долна половина
+    return 0;
+}
 
-    switch (op >> 11) // Битове 12:11
-    {
-    case 0: // B <Target Addr>
+// BL / BLX <Target Addr> (lower half): d->imm е долният офсет, d->cond = 1 за BLX
+static int execute_7_bl_lower(CortexM4 *cpu)
+{
+    FUNC_VM();
+    if (!cpu->bl_upper_pending)
     {
-        int32_t offset = ((int32_t)(op & 0x7FF) << 21) >> 20; // Знаков 11-битов офсет
-        uint32_t target = (CPU.REG.PC + 4) + (offset << 1);   // PC + 4 + offset*2
-        CPU.REG.PC = target & ~0x1;                           // Подравняване за Thumb
-        is_upper_pending = 0;                                 // Изчистване на BL/BLX състояние
-        return 0;
+        DEBUG_M4("[ERROR] BL/BLX lower half without upper half: 0x%04X\n", cpu->op);
+        return -1;
     }
-    case 2: // BL{X} <Target Addr> (upper half)
-    {
-        upper_offset = (op & 0x7FF) << 11; // Съхраняване на горните 11 бита
-        is_upper_pending = 1;              // Отбелязваме, че чакаме долна половина
-        return 0;
+
+    int32_t offset = cpu->bl_upper_offset | cpu->dec->imm; // Комбиниран 22-битов офсет
+    if (!cpu->dec->cond)
+    {                                             // BL: Знаково разширение
+        offset = ((int32_t)(offset << 10) >> 10); // Разширяване на знака
     }
-    case 1: // BLX <Target Addr> (lower half)
-    case 3: // BL <Target Addr> (lower half)
-    {
-        if (!is_upper_pending)
-        {
-            DEBUG_M4("[ERROR] BL/BLX lower half without upper half: 0x%04X\n", CPU.op);
-            return -1;
-        }
 
-        uint32_t lower_offset = (op & 0x7FF) << 1;    // Долните 11 бита, изместени с 1
-        int32_t offset = upper_offset | lower_offset; // Комбиниран 22-битов офсет
-        if ((op >> 11) == 1)
-        {                         // BLX: Добавяме H бит за подравняване
-            offset |= (op & 0x1); // H бит (bit 0)
-        }
-        else
-        {                                             // BL: Знаково разширение
-            offset = ((int32_t)(offset << 10) >> 10); // Разширяване на знака
-        }
+    uint32_t target = (cpu->REG.PC + 4) + offset; // Целеви адрес
+    cpu->REG.LR = (cpu->REG.PC + 2) | 0x1;        // Запазване на следващия адрес (Thumb)
+    cpu->REG.PC = target & ~0x1;                  // Подравняване за Thumb
+    cpu->bl_upper_pending = 0;                    // Изчистване на състояние
+    M4_HOOK_CALL(cpu, cpu->REG.PC, cpu->REG.LR);
+    return 0;
+}
 
-        uint32_t target = (CPU.REG.PC + 4) + offset; // Целеви адрес
-        CPU.REG.LR = (CPU.REG.PC + 2) | 0x1;         // Запазване на следващия адрес (Thumb)
-        CPU.REG.PC = target & ~0x1;                  // Подравняване за Thumb
-        is_upper_pending = 0;                        // Изчистване на състояние
-        return 0;
+static int decode_7(uint32_t opcode, M4_DECODED *d)
+{
+    uint32_t op = opcode & 0x1FFF; // Премахване на битове 15:13
+
+    if ((op >> 11) == 0)
+    {                                                             // B <Target Addr>
+        d->imm = (uint32_t)(((int32_t)(op & 0x7FF) << 21) >> 20); // Знаков 11-битов офсет * 2
+        d->flags = M4_DEC_BRANCH;
+        d->handler = execute_7_b;
     }
-    default:
-        DEBUG_M4("[ERROR] Unknown Group 7 Instruction: 0x%04X\n", CPU.op);
-        is_upper_pending = 0; // Изчистване на състояние при грешка
-        return -1;
+    else if ((op >> 11) == 2)
+    {                                // BL{X} горна половина
+        d->imm = (op & 0x7FF) << 11; // Горните 11 бита
+        d->handler = execute_7_bl_upper;
     }
+    else
+    {                               // BL/BLX долна половина сменя PC
+        d->cond = (op >> 11) == 1;  // BLX
+        d->imm = (op & 0x7FF) << 1; // Долните 11 бита, изместени с 1
+        if (d->cond)
+            d->imm |= op & 0x1; // BLX: H бит за подравняване
+        d->flags = M4_DEC_BRANCH;
+        d->handler = execute_7_bl_lower;
+    }
+    return 0;
 }
 
-// EXECUTE 16 bytes  //////////////////
+// DECODE 16 bytes  ///////////////////
 
-int m4_execute_16(void)
-{
-    FUNC_VM();
-    int res;
+/*
+    Thumb-16 има само 65536 кодировки, затова всяка от тях се декодира
+    веднъж при старта на програмата в t16_table: обработчикът е вече
+    специализиран за операцията, а полетата са извлечени. m4_decode_16 е
+    копиране на елемент, m4_execute_16 - едно косвено извикване. Невалидните
+    кодировки са с handler = NULL.
+
+    Обработката на данни (до 0x4400) в IT блок не променя флаговете, затова
+    за нея t16_it_handler пази варианта без флагове (s = 0).
+*/
+
+#define T16_IT_OPS 0x4400 // Групи 0, 1 и AND..MVN от група 2
 
-    int op = CPU.op >> 13;
-    DEBUG_M4("[V] INSTRUCTION [16]: 0x%04X, OP: %d\n", CPU.op, op);
+static M4_DECODED t16_table[0x10000];
+static M4_HANDLER t16_it_handler[T16_IT_OPS];
 
-    switch (op)
+static int decode_16(uint32_t op, M4_DECODED *d, int s)
+{
+    memset(d, 0, sizeof(*d));
+    d->op = op;
+    d->size = 2;
+
+    switch (op >> 13)
     {
     case 0b000: // 0
-        res = execute_0();
-        break;
+        return decode_0(op, d, s);
     case 0b001: // 1
-        res = execute_1();
-        break;
+        return decode_1(op, d, s);
     case 0b010: // 2
-        res = execute_2();
-        break;
+        return decode_2(op, d, s);
     case 0b011: // 3
-        res = execute_3();
-        break;
+        return decode_3(op, d);
     case 0b100: // 4
-        res = execute_4();
-        break;
+        return decode_4(op, d);
     case 0b101: // 5
-        res = execute_5();
-        break;
+        return decode_5(op, d);
     case 0b110: // 6
-        res = execute_6();
-        break;
-    case 0b111: // 7
-        res = execute_7();
-        break;
-    default:
-        DEBUG_M4("[ERROR] Unknown Instruction: 0x%04X, PC: 0x%08X\n", CPU.op, CPU.REG.PC);
-        res = -1;
-        break;
+        return decode_6(op, d);
+    default: // 7
+        return decode_7(op, d);
     }
+}
 
-    if (res)
+// Генерира t16_table преди main, така че ядрата в няколко нишки (M4-BATCH.c)
+// четат готова таблица
+__attribute__((constructor)) static void t16_table_build(void)
+{
+    for (uint32_t op = 0; op < 0x10000; op++)
     {
-        //PRINT_REG(); // отпечатва регистри
+        if (decode_16(op, &t16_table[op], 1))
+            t16_table[op].handler = NULL;
     }
-    else
+    for (uint32_t op = 0; op < T16_IT_OPS; op++)
     {
-        //PRINT_REG(); // отпечатва регистри
-        CPU.REG.PC += 2;
+        M4_DECODED d;
+        t16_it_handler[op] = decode_16(op, &d, 0) ? NULL : d.handler;
     }
+}
+
+int m4_decode_16(uint16_t op, M4_DECODED *d)
+{
+    FUNC_VM();
+    *d = t16_table[op];
+    return d->handler ? 0 : -1;
+}
+
+// EXECUTE 16 bytes  //////////////////
+
+int m4_dispatch_16(CortexM4 *cpu, const M4_DECODED *d)
+{
+    FUNC_VM();
+    cpu->dec = d;
+    int res = d->handler(cpu);
+
+    if (!res && !(d->flags & M4_DEC_BRANCH)) // Преходите сами задават PC
+        cpu->REG.PC += 2;
 
     RETURN_ERROR(res); // OK = 0 / ERROR = -1
 }
 
-///////////////////////////////////////
\ No newline at end of file
+int m4_execute_16(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = &t16_table[cpu->op & 0xFFFF];
+
+    if (!d->handler)
+    {
+        DEBUG_M4("[ERROR] Unknown Instruction: 0x%04X, PC: 0x%08X\n", cpu->op, cpu->REG.PC);
+        RETURN_ERROR(-1);
+    }
+    return m4_dispatch_16(cpu, d);
+}
+
+// IT БЛОКОВЕ //////////////////////////
+
+// ITAdvance: следващата инструкция от блока или край на блока
+static void it_advance(CortexM4 *cpu)
+{
+    uint32_t it = cpu->ITSTATE;
+    cpu->ITSTATE = (it & 0x7) ? (uint8_t)((it & 0xE0) | ((it << 1) & 0x1F)) : 0;
+    cpu->it_exec >>= 1;
+}
+
+// Изчислява cpu->it_exec от ITSTATE и текущите флагове. Нужно е, когато
+// флаговете се променят в блока, и при връщане от изключение в блока.
+void m4_it_refresh(CortexM4 *cpu)
+{
+    uint32_t it = cpu->ITSTATE;
+    uint32_t lsb = (it >> 4) & 0x1;
+    uint32_t n = 4 - __builtin_ctz(it & 0xF); // Оставащи инструкции
+    uint32_t c = m4_check_condition(cpu, it >> 4);
+    cpu->it_exec = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if ((((it >> (4 - i)) & 0x1) == lsb) == c)
+            cpu->it_exec |= 1u << i;
+    }
+}
+
+// Изпълнява или прескача инструкция d от IT блок според cpu->it_exec, без
+// да проверява условието й
+int m4_execute_it(CortexM4 *cpu, const M4_DECODED *d)
+{
+    FUNC_VM();
+    uint32_t exec = cpu->it_exec & 0x1;
+    it_advance(cpu); // SVC в блока записва ITSTATE на следващата инструкция
+    if (!exec)
+    {
+        cpu->REG.PC += d->size;
+        return 0;
+    }
+
+    int res;
+    if (d->size == 4)
+    {
+        res = m4_dispatch_32(cpu, d);
+    }
+    else if (d->op < T16_IT_OPS)
+    {
+        // Варианта без флагове (ADDS е ADD и т.н.)
+        cpu->dec = d;
+        res = t16_it_handler[d->op](cpu);
+        if (!res)
+            cpu->REG.PC += 2;
+        cpu->error = res;
+    }
+    else
+    {
+        res = m4_dispatch_16(cpu, d);
+    }
+    if (!res && cpu->ITSTATE && (d->flags & M4_DEC_SETS_FLAGS))
+        m4_it_refresh(cpu); // Флаговете са променени: условието се преизчислява
+    return res;
+}
+
+///////////////////////////////////////
+
+#if USE_EVENTS
+// Регистрите (битове 0–15) и флаговете (M4_POLL_*), които инструкцията
+// чете и записва, за откриване на цикли на изчакване. Връща 1 за условен
+// преход, 0 за инструкция без други ефекти и -1 за всичко останало -
+// запис в паметта, друг преход, изключение или непозната инструкция.
+int m4_poll_16(const M4_DECODED *d, uint32_t *reads, uint32_t *writes)
+{
+    uint32_t rd = 1u << d->rd;
+    uint32_t rn = 1u << d->rn;
+    uint32_t rm = 1u << d->rm;
+    uint32_t r = 0;
+    uint32_t w = 0;
+    M4_HANDLER h = d->handler;
+
+    if (d->op < 0x1800 && h == t16_shift_imm[d->op >> 11][1])
+    {
+        r = rm;
+        w = rd | M4_POLL_NZ;
+        if ((d->op >> 11) || d->imm)
+            w |= M4_POLL_C; // LSL #0 оставя C
+    }
+    else if (h == t16_add_sub[(d->op >> 9) & 0x3][1])
+    {
+        r = (d->op & 0x400) ? rn : rn | rm;
+        w = rd | M4_POLL_NZCV;
+    }
+    else if (h == execute_1_mov_s)
+        w = rd | M4_POLL_NZ;
+    else if (h == execute_1_cmp)
+    {
+        r = rn;
+        w = M4_POLL_NZCV;
+    }
+    else if (h == execute_1_add_s || h == execute_1_sub_s)
+    {
+        r = rd;
+        w = rd | M4_POLL_NZCV;
+    }
+    else if (h == t16_alu[(d->op >> 6) & 0xF][1])
+    {
+        r = rd | rm;
+        switch ((d->op >> 6) & 0xF)
+        {
+        case 0x2: // LSL, LSR, ASR, ROR Rd, Rs: C остава при Rs = 0
+        case 0x3:
+        case 0x4:
+        case 0x7:
+            r |= M4_POLL_C;
+            w = rd | M4_POLL_NZ | M4_POLL_C;
+            break;
+        case 0x5: // ADC, SBC
+        case 0x6:
+            r |= M4_POLL_C;
+            w = rd | M4_POLL_NZCV;
+            break;
+        case 0x8: // TST
+            w = M4_POLL_NZ;
+            break;
+        case 0x9: // NEG
+            r = rm;
+            w = rd | M4_POLL_NZCV;
+            break;
+        case 0xA: // CMP, CMN
+        case 0xB:
+            w = M4_POLL_NZCV;
+            break;
+        case 0xF: // MVN
+            r = rm;
+            w = rd | M4_POLL_NZ;
+            break;
+        default: // AND, EOR, ORR, MUL, BIC
+            w = rd | M4_POLL_NZ;
+            break;
+        }
+    }
+    else if (h == execute_2_add_hi || h == execute_2_cmp_hi || h == execute_2_mov_hi)
+    {
+        if (d->rd == 15 || d->rm == 15)
+            return -1;
+        r = h == execute_2_mov_hi ? rm : rd | rm;
+        w = h == execute_2_cmp_hi ? M4_POLL_NZCV : rd;
+    }
+    else if (h == t16_ldst_reg[(d->op >> 9) & 0x7])
+    {
+        if (((d->op >> 9) & 0xF) < 0xB)
+            return -1; // STR, STRH, STRB
+        r = rn | rm;
+        w = rd;
+    }
+    else if (h == execute_2_ldr_pc || h == execute_5_add_pc)
+        w = rd;
+    else if (h == execute_3_str || h == execute_3_strb || h == execute_4_strh)
+        return -1;
+    else if (h == execute_3_ldr || h == execute_3_ldrb || h == execute_4_ldrh)
+    {
+        r = rn;
+        w = rd;
+    }
+    else if (h == execute_5_add_sp)
+    {
+        r = 1u << 13;
+        w = rd;
+    }
+    else if (h == t16_extend[(d->op >> 6) & 0x3] || h == t16_rev[(d->op >> 6) & 0x3])
+    {
+        r = rm;
+        w = rd;
+    }
+    else if (h == execute_6_b_cond)
+    {
+        *reads = M4_POLL_NZCV;
+        *writes = 0;
+        return 1;
+    }
+    else if (h != execute_5_nop)
+        return -1;
+
+    *reads = r;
+    *writes = w;
+    return 0;
+}
+#endif // USE_EVENTS
@@ -1,87 +1,1501 @@
-#include "m4.h"
+// ARMv7-M / Cortex M4F / 32 битови инструкции (Thumb-2)
+
+#include "M4.h"
 #include "common.h"
 
-int m4_execute_32(void)
+/*
+    cpu->op е hw1:hw2 - първото полуслово е в битове 31:16. Декодирането
+    е чрез таблицата t32_patterns (маска, стойност, декодер), в която
+    първото съвпадение печели, както cost_32 в M4-CYCLES.c. За да не се
+    обхожда цялата, при старта на програмата се генерира t32_index:
+    за всяка стойност на битове 12:4 на hw1 - шаблоните, които могат да
+    съвпаднат. Декодерите избират обработчика от таблици по полетата на
+    инструкцията (t32_dp, t32_ldst ...), така че изпълнението от кеша на
+    инструкциите е едно косвено извикване без допълнително декодиране.
+
+    DSP разширението (ARMv7E-M) е в M4-DSP.c, FPv4-SP - в M4-FPU.c.
+*/
+
+#define T32_S (1u << 20) // S: обработката на данни променя флаговете
+#define T32_P (1u << 24) // P: адресът е с отместването (LDRD, STRD)
+#define T32_W (1u << 21) // W: запис на адреса обратно в Rn (LDM, LDRD ...)
+
+// ПОМОЩНИ ////////////////////////////
+
+// Изнесеният бит на ThumbExpandImm_C: бит 31 на константата, ако е завъртяна
+static inline uint32_t t32_imm_carry(const CortexM4 *cpu)
 {
-    FUNC_VM();
+    return (cpu->op & 0x04004000) ? cpu->dec->imm >> 31 : M4_C_KEEP;
+}
 
-    int res = 0;
+// Зареждане в PC (LDR, LDM, POP.W): преход или връщане от изключение
+static int t32_load_pc(CortexM4 *cpu, uint32_t target)
+{
+#if USE_NVIC
+    if (M4_IS_EXC_RETURN(cpu, target))
+        return m4_exception_return(cpu, target);
+#endif
+    cpu->REG.PC = target & ~0x1; // Thumb бит=0
+    M4_HOOK_RETURN(cpu, cpu->REG.PC);
+    return 0;
+}
+
+// ОБРАБОТКА НА ДАННИ /////////////////
+/*
+    AND, BIC, ORR, ORN, EOR, ADD, ADC, SBC, SUB, RSB с втори операнд
+    модифицирана константа (d->imm) или изместен регистър (d->rm, d->imm =
+    изместване | вид << 8). TST, TEQ, CMN, CMP (Rd = PC, S) само задават
+    флаговете, MOV и MVN (Rn = PC) не четат Rn.
+*/
+
+#define T32_DP_LOGIC(name, expr)                                                      \
+    static inline int dp_##name(CortexM4 *cpu, uint32_t a, uint32_t b, uint32_t carry, int s) \
+    {                                                                                 \
+        (void)a;                                                                      \
+        cpu->REG.r[cpu->dec->rd] = m4_alu_logic(cpu, (expr), carry, s);              \
+        return 0;                                                                     \
+    }
+
+#define T32_DP_ARITH(name, kernel)                                                    \
+    static inline int dp_##name(CortexM4 *cpu, uint32_t a, uint32_t b, uint32_t carry, int s) \
+    {                                                                                 \
+        (void)carry;                                                                  \
+        cpu->REG.r[cpu->dec->rd] = kernel(cpu, a, b, s);                              \
+        return 0;                                                                     \
+    }
+
+T32_DP_LOGIC(and, a & b)
+T32_DP_LOGIC(bic, a & ~b)
+T32_DP_LOGIC(orr, a | b)
+T32_DP_LOGIC(orn, a | ~b)
+T32_DP_LOGIC(eor, a ^ b)
+T32_DP_LOGIC(mov, b)
+T32_DP_LOGIC(mvn, ~b)
+T32_DP_ARITH(add, m4_alu_add)
+T32_DP_ARITH(adc, m4_alu_adc)
+T32_DP_ARITH(sbc, m4_alu_sbc)
+T32_DP_ARITH(sub, m4_alu_sub)
+T32_DP_ARITH(rsb, m4_alu_rsb)
+
+// Сравненията винаги задават флаговете
+static inline int dp_tst(CortexM4 *cpu, uint32_t a, uint32_t b, uint32_t carry, int s)
+{
+    (void)s;
+    m4_alu_logic(cpu, a & b, carry, 1);
+    return 0;
+}
+
+static inline int dp_teq(CortexM4 *cpu, uint32_t a, uint32_t b, uint32_t carry, int s)
+{
+    (void)s;
+    m4_alu_logic(cpu, a ^ b, carry, 1);
+    return 0;
+}
+
+static inline int dp_cmn(CortexM4 *cpu, uint32_t a, uint32_t b, uint32_t carry, int s)
+{
+    (void)carry, (void)s;
+    m4_flags_lazy(cpu, a + b, a, b, OP_CMN, UPDATE_NZCV);
+    return 0;
+}
+
+static inline int dp_cmp(CortexM4 *cpu, uint32_t a, uint32_t b, uint32_t carry, int s)
+{
+    (void)carry, (void)s;
+    m4_flags_lazy(cpu, a - b, a, b, OP_CMP, UPDATE_NZCV);
+    return 0;
+}
 
-    // Проверка за DSP инструкции
-    if ((CPU.op & 0xFF800000) == 0xF3800000 || (CPU.op & 0xFF800000) == 0xF3C00000)
+/*
+    Обработчиците на двете форми на втория операнд, всяка с и без S.
+    S е константа в тялото, затова вариантът без S не изчислява нито
+    флаговете, нито изнесения бит на константата.
+*/
+#define T32_DP_FORMS(name, suffix, s)                                                  \
+    static int execute_32_##name##_imm##suffix(CortexM4 *cpu)                          \
+    {                                                                                  \
+        FUNC_VM();                                                                     \
+        const M4_DECODED *d = cpu->dec;                                                \
+        return dp_##name(cpu, cpu->REG.r[d->rn], d->imm, s ? t32_imm_carry(cpu) : M4_C_KEEP, s); \
+    }                                                                                  \
+    static int execute_32_##name##_reg##suffix(CortexM4 *cpu)                          \
+    {                                                                                  \
+        FUNC_VM();                                                                     \
+        const M4_DECODED *d = cpu->dec;                                                \
+        uint32_t carry;                                                                \
+        uint32_t b = m4_shift_c(cpu, cpu->REG.r[d->rm], d->imm >> 8, d->imm & 0xFF, &carry); \
+        return dp_##name(cpu, cpu->REG.r[d->rn], b, carry, s);                         \
+    }
+
+#define T32_DP(name)            \
+    T32_DP_FORMS(name, , 0)     \
+    T32_DP_FORMS(name, _s, 1)
+
+T32_DP(and)
+T32_DP(bic)
+T32_DP(orr)
+T32_DP(orn)
+T32_DP(eor)
+T32_DP(mov)
+T32_DP(mvn)
+T32_DP(add)
+T32_DP(adc)
+T32_DP(sbc)
+T32_DP(sub)
+T32_DP(rsb)
+T32_DP_FORMS(tst, , 1)
+T32_DP_FORMS(teq, , 1)
+T32_DP_FORMS(cmn, , 1)
+T32_DP_FORMS(cmp, , 1)
+
+#define T32_DP_PAIR(name)                                            \
+    {                                                                \
+        {execute_32_##name##_imm, execute_32_##name##_imm_s},        \
+        {execute_32_##name##_reg, execute_32_##name##_reg_s},        \
+    }
+#define T32_DP_TEST(name)                                            \
+    {                                                                \
+        {NULL, execute_32_##name##_imm},                             \
+        {NULL, execute_32_##name##_reg},                             \
+    }
+
+// По битове 8:5 на hw1, формата на операнда (0: константа, 1: регистър) и S
+static const M4_HANDLER t32_dp[16][2][2] = {
+    [0x0] = T32_DP_PAIR(and),
+    [0x1] = T32_DP_PAIR(bic),
+    [0x2] = T32_DP_PAIR(orr),
+    [0x3] = T32_DP_PAIR(orn),
+    [0x4] = T32_DP_PAIR(eor),
+    [0x8] = T32_DP_PAIR(add),
+    [0xA] = T32_DP_PAIR(adc),
+    [0xB] = T32_DP_PAIR(sbc),
+    [0xD] = T32_DP_PAIR(sub),
+    [0xE] = T32_DP_PAIR(rsb),
+};
+
+// Rd = PC с S: сравнения
+static const M4_HANDLER t32_dp_test[16][2][2] = {
+    [0x0] = T32_DP_TEST(tst),
+    [0x4] = T32_DP_TEST(teq),
+    [0x8] = T32_DP_TEST(cmn),
+    [0xD] = T32_DP_TEST(cmp),
+};
+
+// Rn = PC: MOV (вкл. LSL, LSR, ASR, ROR, RRX с константа) и MVN
+static const M4_HANDLER t32_dp_move[16][2][2] = {
+    [0x2] = T32_DP_PAIR(mov),
+    [0x3] = T32_DP_PAIR(mvn),
+};
+
+// ThumbExpandImm: i:imm3:imm8 -> 32-битова константа
+static uint32_t t32_expand_imm(uint32_t op)
+{
+    uint32_t imm12 = ((op >> 15) & 0x800) | ((op >> 4) & 0x700) | (op & 0xFF);
+    uint32_t imm8 = op & 0xFF;
+    if (imm12 >> 10)
     {
-        DEBUG_M4("[ERROR] DSP instruction not supported yet: 0x%08X at PC: 0x%08X\n", CPU.op, CPU.REG.PC);
-        RETURN_ERROR(-1);
+        uint32_t rot = imm12 >> 7; // 8..31
+        uint32_t value = 0x80 | (imm12 & 0x7F);
+        return (value >> rot) | (value << (32 - rot));
     }
-    // Проверка за FPU инструкции
-    else if ((CPU.op & 0xEE000000) == 0xEE000000)
+    switch ((imm12 >> 8) & 0x3)
     {
-        DEBUG_M4("[ERROR] FPU instruction not supported yet: 0x%08X at PC: 0x%08X\n", CPU.op, CPU.REG.PC);
-        RETURN_ERROR(-1);
+    case 0:
+        return imm8; // 000000XY
+    case 1:
+        return imm8 * 0x00010001; // 00XY00XY
+    case 2:
+        return imm8 * 0x01000100; // XY00XY00
+    default:
+        return imm8 * 0x01010101; // XYXYXYXY
     }
+}
 
-    uint8_t op = (CPU.op >> 27) & 0x1F;
-    DEBUG_M4("[V] INSTRUCTION [32]: 0x%08X, OP: %d\n", CPU.op, op);
-
-    switch (op)
+// Избор на обработчика по битове 8:5 на hw1, Rd и Rn
+static int decode_dp(uint32_t op, M4_DECODED *d, int form)
+{
+    uint32_t opc = (op >> 21) & 0xF;
+    int s = (op & T32_S) != 0;
+    M4_HANDLER h;
+    if (d->rd == 15 && !s)
+        return -1; // <op>.W PC, ... е непредсказуема
+    if (d->rd == 15)
+        h = t32_dp_test[opc][form][s];
+    else if (d->rn == 15)
+        h = t32_dp_move[opc][form][s];
+    else
+        h = t32_dp[opc][form][s];
+    if (!h || d->rd == 15)
     {
-    case 0b11110: // Branch with Link (BL)
+        if (!h)
+            return -1;
+        d->rd = 0; // TST, TEQ, CMN, CMP не записват Rd
+    }
+    d->handler = h;
+    if (s)
+        d->flags = M4_DEC_SETS_FLAGS;
+    return 0;
+}
+
+// <op>{S}.W Rd, Rn, #const [11110 i 0 op S Rn | 0 imm3 Rd imm8]
+static int decode_dp_imm(uint32_t op, M4_DECODED *d)
+{
+    d->rn = (op >> 16) & 0xF;
+    d->rd = (op >> 8) & 0xF;
+    d->imm = t32_expand_imm(op);
+    return decode_dp(op, d, 0);
+}
+
+// <op>{S}.W Rd, Rn, Rm{, <shift> #n} [1110101 op S Rn | 0 imm3 Rd imm2 type Rm]
+static int decode_dp_reg(uint32_t op, M4_DECODED *d)
+{
+    uint32_t type = (op >> 4) & 0x3;
+    uint32_t n = ((op >> 10) & 0x1C) | ((op >> 6) & 0x3); // imm3:imm2
+    if (((op >> 21) & 0xF) == 0x6)
+        return m4_decode_dsp(op, d); // PKHBT, PKHTB
+
+    // DecodeImmShift: LSR #0 и ASR #0 са #32, ROR #0 е RRX
+    if (!n && type == 3)
+        type = M4_SHIFT_RRX;
+    else if (!n && type)
+        n = 32;
+    d->rn = (op >> 16) & 0xF;
+    d->rd = (op >> 8) & 0xF;
+    d->rm = op & 0xF;
+    d->imm = n | (type << 8);
+    return decode_dp(op, d, 1);
+}
+
+// ADDW, SUBW, ADR: Rd = Rn + imm (d->imm е със знак); Rn = PC е Align(PC, 4)
+static int execute_32_addw(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t base = d->rn == 15 ? (cpu->REG.PC + 4) & ~0x3 : cpu->REG.r[d->rn];
+    cpu->REG.r[d->rd] = base + d->imm;
+    return 0;
+}
+
+// MOVW Rd, #imm16
+static int execute_32_movw(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = cpu->dec->imm;
+    return 0;
+}
+
+// MOVT Rd, #imm16
+static int execute_32_movt(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t rd = cpu->dec->rd;
+    cpu->REG.r[rd] = (cpu->REG.r[rd] & 0xFFFF) | (cpu->dec->imm << 16);
+    return 0;
+}
+
+// BFI Rd, Rn, #lsb, #width / BFC (Rn = PC): d->imm е маската на полето
+static int execute_32_bfi(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t value = d->rn == 15 ? 0 : cpu->REG.r[d->rn] << d->rm;
+    cpu->REG.r[d->rd] = (cpu->REG.r[d->rd] & ~d->imm) | (value & d->imm);
+    return 0;
+}
+
+// UBFX Rd, Rn, #lsb, #width: d->imm е маската на ширината
+static int execute_32_ubfx(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    cpu->REG.r[d->rd] = (cpu->REG.r[d->rn] >> d->rm) & d->imm;
+    return 0;
+}
+
+// SBFX Rd, Rn, #lsb, #width: d->imm е ширината
+static int execute_32_sbfx(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t top = 32 - d->rm - d->imm; // Битове над полето
+    cpu->REG.r[d->rd] = (uint32_t)((int32_t)(cpu->REG.r[d->rn] << top) >> (32 - d->imm));
+    return 0;
+}
+
+// Операндът на SSAT/USAT: Rn, изместен с LSL или ASR (sh) с d->rm
+static inline int64_t t32_sat_operand(CortexM4 *cpu)
+{
+    int32_t value = (int32_t)cpu->REG.r[cpu->dec->rn];
+    uint32_t n = cpu->dec->rm;
+    if (cpu->op & (1u << 21))
+        return value >> n; // ASR, n от 1 до 31
+    return (int32_t)((uint32_t)value << n);
+}
+
+// SSAT Rd, #sat, Rn{, shift}: насищане до d->imm бита със знак, Q при насищане
+static int execute_32_ssat(CortexM4 *cpu)
+{
+    FUNC_VM();
+    int64_t value = t32_sat_operand(cpu);
+    int64_t max = ((int64_t)1 << (cpu->dec->imm - 1)) - 1;
+    int64_t min = -max - 1;
+    if (value > max || value < min)
     {
-        PRINTF("\tBL <link>\n");
-        uint32_t S = (CPU.op >> 26) & 0x1;
-        uint32_t imm10 = (CPU.op >> 16) & 0x3FF;
-        uint32_t J1 = (CPU.op >> 13) & 0x1;
-        uint32_t J2 = (CPU.op >> 11) & 0x1;
-        uint32_t imm11 = CPU.op & 0x7FF;
+        value = value > max ? max : min;
+        cpu->psr.value |= 1u << 27; // Q
+    }
+    cpu->REG.r[cpu->dec->rd] = (uint32_t)value;
+    return 0;
+}
 
-        // Изчисляване на I1 и I2
-        uint32_t I1 = ~(J1 ^ S);
-        uint32_t I2 = ~(J2 ^ S);
+// USAT Rd, #sat, Rn{, shift}: насищане до d->imm бита без знак
+static int execute_32_usat(CortexM4 *cpu)
+{
+    FUNC_VM();
+    int64_t value = t32_sat_operand(cpu);
+    int64_t max = ((int64_t)1 << cpu->dec->imm) - 1;
+    if (value > max || value < 0)
+    {
+        value = value > max ? max : 0;
+        cpu->psr.value |= 1u << 27; // Q
+    }
+    cpu->REG.r[cpu->dec->rd] = (uint32_t)value;
+    return 0;
+}
 
-        // Формиране на 25-битов офсет
-        uint32_t offset = (S << 24) | (I1 << 23) | (I2 << 22) | (imm10 << 12) | (imm11 << 1);
+// Обработка на данни с непосредствена стойност [11110 i 1 op Rn | 0 imm3 Rd imm8]
+static int decode_dp_plain(uint32_t op, M4_DECODED *d)
+{
+    uint32_t imm12 = ((op >> 15) & 0x800) | ((op >> 4) & 0x700) | (op & 0xFF);
+    uint32_t lsb = ((op >> 10) & 0x1C) | ((op >> 6) & 0x3); // imm3:imm2
+    uint32_t field = op & 0x1F;                              // msb, width-1 или sat_imm
+    d->rn = (op >> 16) & 0xF;
+    d->rd = (op >> 8) & 0xF;
+    d->rm = lsb; // Без Rm: младшият бит на полето или изместването
+    uint32_t opc = (op >> 20) & 0x1F;
+    // ADDW/SUBW SP, SP, #imm12 (рамки на стека) е единственото позволено Rd = SP
+    if (d->rd == 15 || (d->rd == 13 && !(d->rn == 13 && (opc == 0x00 || opc == 0x0A))))
+        return -1;
 
-        // Sign-extension до 32 бита
-        int32_t signed_offset;
-        if (S)
-            signed_offset = (int32_t)(offset | 0xFE000000); // Запълваме с 1 за отрицателни
-        else
-            signed_offset = (int32_t)(offset & 0x01FFFFFF); // Запълваме с 0 за положителни
-
-        CPU.REG.LR = CPU.REG.PC + 4;
-        uint32_t new_pc = CPU.REG.PC + signed_offset + 4; // някак си е правилно +4 ????
-
-        DEBUG_M4("[BL] Current PC: 0x%08X, Offset: 0x%08X (%d)\n", CPU.REG.PC, signed_offset, signed_offset);
-        if (new_pc & 0x1) {
-            DEBUG_M4("[ERROR] Unaligned target address for BL: 0x%08X at PC: 0x%08X\n", new_pc, CPU.REG.PC);
-            res = -1;
-        } else if (new_pc < ROM_BASE || new_pc >= ROM_BASE + CPU.ROM_SIZE) {
-            DEBUG_M4("[ERROR] Out-of-bounds PC after BL: 0x%08X at PC: 0x%08X\n", new_pc, CPU.REG.PC);
-            res = -1;
+    switch (opc)
+    {
+    case 0x00: // ADDW Rd, Rn, #imm12 / ADR Rd, <label>
+        d->imm = imm12;
+        d->handler = execute_32_addw;
+        return 0;
+    case 0x0A: // SUBW Rd, Rn, #imm12 / ADR Rd, <label> назад
+        d->imm = -imm12;
+        d->handler = execute_32_addw;
+        return 0;
+    case 0x04: // MOVW Rd, #imm16
+        d->imm = ((op >> 4) & 0xF000) | imm12;
+        d->handler = execute_32_movw;
+        return 0;
+    case 0x0C: // MOVT Rd, #imm16
+        d->imm = ((op >> 4) & 0xF000) | imm12;
+        d->handler = execute_32_movt;
+        return 0;
+    case 0x12: // SSAT Rd, #sat, Rn, ASR #n
+        if (!lsb)
+            return m4_decode_dsp(op, d); // SSAT16
+        /* fall through */
+    case 0x10: // SSAT Rd, #sat, Rn{, LSL #n}
+        d->imm = field + 1;
+        d->handler = execute_32_ssat;
+        return 0;
+    case 0x1A: // USAT Rd, #sat, Rn, ASR #n
+        if (!lsb)
+            return m4_decode_dsp(op, d); // USAT16
+        /* fall through */
+    case 0x18: // USAT Rd, #sat, Rn{, LSL #n}
+        d->imm = field;
+        d->handler = execute_32_usat;
+        return 0;
+    case 0x14: // SBFX Rd, Rn, #lsb, #width
+    case 0x1C: // UBFX Rd, Rn, #lsb, #width
+        if (lsb + field + 1 > 32)
+            return -1;
+        if (op & (1u << 23))
+        {
+            d->imm = field == 31 ? 0xFFFFFFFF : (2u << field) - 1;
+            d->handler = execute_32_ubfx;
         }
         else
         {
-            CPU.REG.PC = new_pc;
-            DEBUG_M4("[BL] New PC: 0x%08X\n", CPU.REG.PC);
+            d->imm = field + 1;
+            d->handler = execute_32_sbfx;
         }
-        break;
+        return 0;
+    case 0x16: // BFI Rd, Rn, #lsb, #width / BFC Rd, #lsb, #width
+        if (field < lsb)
+            return -1;
+        d->imm = ((2u << field) - 1) & ~((1u << lsb) - 1);
+        d->handler = execute_32_bfi;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+// ПРЕХОДИ И УПРАВЛЕНИЕ ///////////////
+
+// B.W <label>
+static int execute_32_b(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.PC += 4 + cpu->dec->imm;
+    return 0;
+}
+
+// B<c>.W <label>
+static int execute_32_b_cond(CortexM4 *cpu)
+{
+    FUNC_VM();
+    if (!m4_check_condition(cpu, cpu->dec->cond))
+    {
+        cpu->REG.PC += 4;
+        return 0;
     }
+    cpu->REG.PC += 4 + cpu->dec->imm;
+    return 0;
+}
+
+// BL <label>
+static int execute_32_bl(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.LR = (cpu->REG.PC + 4) | 0x1; // Следващият адрес с Thumb бит
+    cpu->REG.PC += 4 + cpu->dec->imm;
+    M4_HOOK_CALL(cpu, cpu->REG.PC, cpu->REG.LR);
+    return 0;
+}
+
+// NOP.W, YIELD.W, SEV.W, DBG, DSB, DMB, ISB: паметта е последователна
+static int execute_32_nop(CortexM4 *cpu)
+{
+    FUNC_VM();
+    (void)cpu;
+    return 0;
+}
+
+// CLREX
+static int execute_32_clrex(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->excl = 0;
+    return 0;
+}
+
+// Отместване на B.W и BL: S:I1:I2:imm10:imm11:0, I1 = NOT(J1 XOR S)
+static uint32_t t32_branch_offset(uint32_t op)
+{
+    uint32_t s = (op >> 26) & 0x1;
+    uint32_t i1 = ~((op >> 13) ^ s) & 0x1;
+    uint32_t i2 = ~((op >> 11) ^ s) & 0x1;
+    uint32_t imm = (s << 24) | (i1 << 23) | (i2 << 22) | (((op >> 16) & 0x3FF) << 12) | ((op & 0x7FF) << 1);
+    return (uint32_t)((int32_t)(imm << 7) >> 7);
+}
+
+// B<c>.W [11110 S cond imm6 | 10 J1 0 J2 imm11]
+static int decode_b_cond(uint32_t op, M4_DECODED *d)
+{
+    uint32_t imm = (((op >> 26) & 0x1) << 20) | (((op >> 11) & 0x1) << 19) | (((op >> 13) & 0x1) << 18) |
+                   (((op >> 16) & 0x3F) << 12) | ((op & 0x7FF) << 1);
+    d->cond = (op >> 22) & 0xF;
+    if (d->cond >= 0xE)
+        return -1;
+    d->imm = (uint32_t)((int32_t)(imm << 11) >> 11);
+    d->flags = M4_DEC_BRANCH;
+    d->handler = execute_32_b_cond;
+    return 0;
+}
+
+// B.W [11110 S imm10 | 10 J1 1 J2 imm11]
+static int decode_b(uint32_t op, M4_DECODED *d)
+{
+    d->imm = t32_branch_offset(op);
+    d->flags = M4_DEC_BRANCH;
+    d->handler = execute_32_b;
+    return 0;
+}
+
+// BL [11110 S imm10 | 11 J1 1 J2 imm11]
+static int decode_bl(uint32_t op, M4_DECODED *d)
+{
+    d->imm = t32_branch_offset(op);
+    d->flags = M4_DEC_BRANCH;
+    d->handler = execute_32_bl;
+    return 0;
+}
+
+// MRS, MSR (M4-SYSTEM.c)
+static int decode_system(uint32_t op, M4_DECODED *d)
+{
+#if USE_SYSTEM
+    d->flags = M4_DEC_BRANCH; // m4_execute_system сам управлява PC, MSR сменя маските
+    if (!(op & (1u << 21)))
+        d->flags |= M4_DEC_SETS_FLAGS; // MSR може да запише APSR
+    d->handler = m4_execute_system;
+    return 0;
+#else
+    (void)op;
+    (void)d;
+    return -1;
+#endif
+}
+
+// NOP.W, YIELD.W, WFE.W, WFI.W, SEV.W, DBG [11110011 10101111 | 10 0 0 0 000 hint]
+static int decode_hint(uint32_t op, M4_DECODED *d)
+{
+    d->imm = op & 0xFF;
+    if (d->imm == 0x2 || d->imm == 0x3)
+    { // WFE, WFI
+        d->flags = M4_DEC_BRANCH;
+        d->handler = m4_execute_wfi;
+    }
+    else
+    {
+        d->handler = execute_32_nop;
+    }
+    return 0;
+}
+
+// CLREX, DSB, DMB, ISB [11110011 10111111 | 10 0 0 1111 op option]
+static int decode_barrier(uint32_t op, M4_DECODED *d)
+{
+    switch ((op >> 4) & 0xF)
+    {
+    case 0x2: // CLREX
+        d->handler = execute_32_clrex;
+        return 0;
+    case 0x4: // DSB
+    case 0x5: // DMB
+    case 0x6: // ISB
+        d->handler = execute_32_nop;
+        return 0;
     default:
-        DEBUG_M4("[ERROR] Unsupported instruction: 0x%08X at PC: 0x%08X\n", CPU.op, CPU.REG.PC);
-        res = -1;
+        return -1;
+    }
+}
+
+// ЗАРЕЖДАНЕ И ЗАПИС //////////////////
+/*
+    LDR{B,H,SB,SH}, STR{B,H} [1111100 S A size L Rn | Rt ...]. Видът (kind)
+    е S:size:L, формата на адреса е от hw1[7] и битове 11:6 на hw2:
+
+        imm     [Rn, #imm12] / [Rn, #-imm8] / LDRT, STRT  d->imm със знак
+        reg     [Rn, Rm, LSL #imm2]                        d->imm = imm2
+        pre     [Rn, #±imm8]!                              d->imm със знак
+        post    [Rn], #±imm8                               d->imm със знак
+        lit     [PC, #±imm12] (само зареждане)             d->imm със знак
+*/
+
+enum
+{
+    T32_STRB = 0x0,
+    T32_LDRB = 0x1,
+    T32_STRH = 0x2,
+    T32_LDRH = 0x3,
+    T32_STR = 0x4,
+    T32_LDR = 0x5,
+    T32_LDRSB = 0x9,
+    T32_LDRSH = 0xB
+};
+
+enum
+{
+    T32_IMM,
+    T32_REG,
+    T32_PRE,
+    T32_POST,
+    T32_LIT,
+    T32_FORMS
+};
+
+// Пренос между Rt (d->rd) и address; при wb Rn става base. Rt се записва
+// след Rn, така че LDR PC, [SP], #4 (POP.W {PC}) се връща с новия SP.
+static inline int t32_ldst(CortexM4 *cpu, uint32_t kind, uint32_t address, int wb, uint32_t base)
+{
+    const M4_DECODED *d = cpu->dec;
+    uint32_t value = 0;
+    int res = 0;
+    switch (kind)
+    {
+    case T32_STRB:
+        res = WRITE_MEM_8(cpu, address, cpu->REG.r[d->rd] & 0xFF);
+        break;
+    case T32_STRH:
+        res = WRITE_MEM_16(cpu, address, cpu->REG.r[d->rd] & 0xFFFF);
+        break;
+    case T32_STR:
+        res = WRITE_MEM_32(cpu, address, cpu->REG.r[d->rd]);
         break;
+    case T32_LDRB:
+        value = READ_MEM_8(cpu, address, &res);
+        break;
+    case T32_LDRH:
+        value = READ_MEM_16(cpu, address, &res);
+        break;
+    case T32_LDR:
+        value = READ_MEM_32(cpu, address, &res);
+        break;
+    case T32_LDRSB:
+        value = (uint32_t)(int32_t)(int8_t)READ_MEM_8(cpu, address, &res);
+        break;
+    default: // T32_LDRSH
+        value = (uint32_t)(int32_t)(int16_t)READ_MEM_16(cpu, address, &res);
+        break;
+    }
+    if (res)
+        return res;
+    if (wb)
+        cpu->REG.r[d->rn] = base;
+    if (kind & 0x1)
+    {
+        if (d->rd == 15)
+            return t32_load_pc(cpu, value);
+        cpu->REG.r[d->rd] = value;
+    }
+    return 0;
+}
+
+#define T32_LDST(name, kind)                                                              \
+    static int execute_32_##name##_imm(CortexM4 *cpu)                                     \
+    {                                                                                     \
+        FUNC_VM();                                                                        \
+        return t32_ldst(cpu, kind, cpu->REG.r[cpu->dec->rn] + cpu->dec->imm, 0, 0);       \
+    }                                                                                     \
+    static int execute_32_##name##_reg(CortexM4 *cpu)                                     \
+    {                                                                                     \
+        FUNC_VM();                                                                        \
+        const M4_DECODED *d = cpu->dec;                                                   \
+        return t32_ldst(cpu, kind, cpu->REG.r[d->rn] + (cpu->REG.r[d->rm] << d->imm), 0, 0); \
+    }                                                                                     \
+    static int execute_32_##name##_pre(CortexM4 *cpu)                                     \
+    {                                                                                     \
+        FUNC_VM();                                                                        \
+        uint32_t address = cpu->REG.r[cpu->dec->rn] + cpu->dec->imm;                      \
+        return t32_ldst(cpu, kind, address, 1, address);                                  \
+    }                                                                                     \
+    static int execute_32_##name##_post(CortexM4 *cpu)                                    \
+    {                                                                                     \
+        FUNC_VM();                                                                        \
+        uint32_t address = cpu->REG.r[cpu->dec->rn];                                      \
+        return t32_ldst(cpu, kind, address, 1, address + cpu->dec->imm);                  \
+    }                                                                                     \
+    static int execute_32_##name##_lit(CortexM4 *cpu)                                     \
+    {                                                                                     \
+        FUNC_VM();                                                                        \
+        return t32_ldst(cpu, kind, ((cpu->REG.PC + 4) & ~0x3) + cpu->dec->imm, 0, 0);     \
+    }
+
+T32_LDST(strb, T32_STRB)
+T32_LDST(strh, T32_STRH)
+T32_LDST(str, T32_STR)
+T32_LDST(ldrb, T32_LDRB)
+T32_LDST(ldrh, T32_LDRH)
+T32_LDST(ldr, T32_LDR)
+T32_LDST(ldrsb, T32_LDRSB)
+T32_LDST(ldrsh, T32_LDRSH)
+
+#define T32_LDST_ROW(name)                                                          \
+    {                                                                               \
+        execute_32_##name##_imm, execute_32_##name##_reg, execute_32_##name##_pre, \
+            execute_32_##name##_post, execute_32_##name##_lit                       \
+    }
+
+// По вида S:size:L и формата на адреса
+static const M4_HANDLER t32_ldst_table[16][T32_FORMS] = {
+    [T32_STRB] = T32_LDST_ROW(strb),
+    [T32_LDRB] = T32_LDST_ROW(ldrb),
+    [T32_STRH] = T32_LDST_ROW(strh),
+    [T32_LDRH] = T32_LDST_ROW(ldrh),
+    [T32_STR] = T32_LDST_ROW(str),
+    [T32_LDR] = T32_LDST_ROW(ldr),
+    [T32_LDRSB] = T32_LDST_ROW(ldrsb),
+    [T32_LDRSH] = T32_LDST_ROW(ldrsh),
+};
+
+// LDR/STR{B,H,SB,SH}.W, PLD, PLI [1111100 S A size L Rn | Rt ...]
+static int decode_ldst(uint32_t op, M4_DECODED *d)
+{
+    uint32_t kind = ((op >> 21) & 0x8) | ((op >> 20) & 0x7);
+    uint32_t form;
+    d->rn = (op >> 16) & 0xF;
+    d->rd = (op >> 12) & 0xF; // Rt
+    d->rm = op & 0xF;
+
+    if (d->rn == 15)
+    { // [PC, #±imm12]
+        d->imm = (op & (1u << 23)) ? (op & 0xFFF) : -(op & 0xFFF);
+        form = T32_LIT;
+    }
+    else if (op & (1u << 23))
+    { // [Rn, #imm12]
+        d->imm = op & 0xFFF;
+        form = T32_IMM;
+    }
+    else if (op & 0x800)
+    { // [Rn, #±imm8], P U W = битове 10:8
+        d->imm = (op & 0x200) ? (op & 0xFF) : -(op & 0xFF);
+        if (!(op & 0x100))
+            form = T32_IMM; // P = 1, W = 0 (вкл. LDRT, STRT)
+        else
+            form = (op & 0x400) ? T32_PRE : T32_POST;
+        if (!(op & 0x500))
+            return -1; // P = 0, W = 0
+    }
+    else if (!(op & 0xFC0))
+    { // [Rn, Rm, LSL #imm2]
+        d->imm = (op >> 4) & 0x3;
+        form = T32_REG;
+    }
+    else
+    {
+        return -1;
+    }
+
+    d->handler = t32_ldst_table[kind][form];
+    if (!d->handler || (form == T32_LIT && !(kind & 0x1)))
+        return -1; // size = 11, S без L, запис спрямо PC
+
+    if (d->rd == 15 && (kind & 0x1))
+    {
+        if (kind != T32_LDR)
+            d->handler = execute_32_nop; // PLD, PLI: подсказки за кеша
+        else
+            d->flags = M4_DEC_BRANCH; // LDR PC, POP.W {PC}
+    }
+    return 0;
+}
+
+// LDM{IA,DB}.W Rn{!}, {<reg list>} / POP.W: d->imm е списъкът
+static int execute_32_ldm(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t list = d->imm;
+    uint32_t n = __builtin_popcount(list);
+    uint32_t base = cpu->REG.r[d->rn];
+    uint32_t address = (cpu->op & T32_P) ? base - 4 * n : base; // DB: под Rn
+    uint32_t words[16];
+    if (m4_mem_read_words(cpu, address, words, n))
+    {
+        DEBUG_M4("[ERROR] Memory read failed at 0x%08X\n", address);
+        return -1;
+    }
+    if (cpu->op & T32_W)
+        cpu->REG.r[d->rn] = (cpu->op & T32_P) ? address : base + 4 * n; // Rn в списъка печели
+
+    n = 0;
+    for (int i = 0; i < 15; i++)
+    {
+        if (list & (1u << i))
+            cpu->REG.r[i] = words[n++];
+    }
+    if (list & 0x8000)
+        return t32_load_pc(cpu, words[n]);
+    return 0;
+}
+
+// STM{IA,DB}.W Rn{!}, {<reg list>} / PUSH.W
+static int execute_32_stm(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t list = d->imm;
+    uint32_t base = cpu->REG.r[d->rn];
+    uint32_t words[16];
+    uint32_t n = 0;
+    for (int i = 0; i < 15; i++)
+    {
+        if (list & (1u << i))
+            words[n++] = cpu->REG.r[i];
+    }
+    uint32_t address = (cpu->op & T32_P) ? base - 4 * n : base;
+    if (m4_mem_write_words(cpu, address, words, n))
+    {
+        DEBUG_M4("[ERROR] Memory write failed at 0x%08X\n", address);
+        return -1;
+    }
+    if (cpu->op & T32_W)
+        cpu->REG.r[d->rn] = (cpu->op & T32_P) ? address : base + 4 * n;
+    return 0;
+}
+
+// LDM, STM [1110100 op 0 W L Rn | P M 0 reg list], op: 01 IA, 10 DB
+static int decode_ldm(uint32_t op, M4_DECODED *d)
+{
+    uint32_t mode = (op >> 23) & 0x3;
+    d->rn = (op >> 16) & 0xF;
+    d->imm = op & 0xFFFF;
+    if (mode == 0 || mode == 3 || d->rn == 15 || (d->imm & 0x2000) || __builtin_popcount(d->imm) < 2)
+        return -1;
+    if (op & T32_S)
+    { // L
+        if ((d->imm & 0xC000) == 0xC000)
+            return -1; // PC и LR заедно
+        if (d->imm & 0x8000)
+            d->flags = M4_DEC_BRANCH;
+        d->handler = execute_32_ldm;
+    }
+    else
+    {
+        if (d->imm & 0x8000)
+            return -1;
+        d->handler = execute_32_stm;
+    }
+    return 0;
+}
+
+// LDRD Rt, Rt2, [Rn, #±imm8*4]{!} / [Rn], #±imm8*4 / [PC, #±imm8*4]
+static int execute_32_ldrd(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t base = d->rn == 15 ? (cpu->REG.PC + 4) & ~0x3 : cpu->REG.r[d->rn];
+    uint32_t offset = base + d->imm;
+    uint32_t words[2];
+    if (m4_mem_read_words(cpu, (cpu->op & T32_P) ? offset : base, words, 2))
+        return -1;
+    if (cpu->op & T32_W)
+        cpu->REG.r[d->rn] = offset;
+    cpu->REG.r[d->rd] = words[0];
+    cpu->REG.r[d->rm] = words[1];
+    return 0;
+}
+
+// STRD Rt, Rt2, [Rn, #±imm8*4]{!} / [Rn], #±imm8*4
+static int execute_32_strd(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t base = cpu->REG.r[d->rn];
+    uint32_t offset = base + d->imm;
+    uint32_t words[2] = {cpu->REG.r[d->rd], cpu->REG.r[d->rm]};
+    if (m4_mem_write_words(cpu, (cpu->op & T32_P) ? offset : base, words, 2))
+        return -1;
+    if (cpu->op & T32_W)
+        cpu->REG.r[d->rn] = offset;
+    return 0;
+}
+
+// LDRD, STRD [1110100 P U 1 W L Rn | Rt Rt2 imm8]
+static int decode_ldrd(uint32_t op, M4_DECODED *d)
+{
+    d->rn = (op >> 16) & 0xF;
+    d->rd = (op >> 12) & 0xF; // Rt
+    d->rm = (op >> 8) & 0xF;  // Rt2
+    d->imm = (op & (1u << 23)) ? (op & 0xFF) << 2 : -((op & 0xFF) << 2);
+    if (d->rd == 15 || d->rm == 15)
+        return -1;
+    if (op & T32_S)
+    {
+        if (d->rd == d->rm || (d->rn == 15 && (op & T32_W)))
+            return -1;
+        d->handler = execute_32_ldrd;
+    }
+    else
+    {
+        if (d->rn == 15)
+            return -1;
+        d->handler = execute_32_strd;
+    }
+    return 0;
+}
+
+// Изключителен достъп: локалният монитор (cpu->excl) се отваря от LDREX
+// и се затваря от STREX, CLREX и връщане от изключение. Адресът не се
+// следи - друг изключителен достъп между тях е рядкост в едноядрен код.
+
+// LDREX{B,H} Rt, [Rn{, #imm8*4}]: d->cond е размерът в байтове
+static int execute_32_ldrex(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t address = cpu->REG.r[d->rn] + d->imm;
+    uint32_t value;
+    int res;
+    if (d->cond == 1)
+        value = READ_MEM_8(cpu, address, &res);
+    else if (d->cond == 2)
+        value = READ_MEM_16(cpu, address, &res);
+    else
+        value = READ_MEM_32(cpu, address, &res);
+    if (res)
+        return res;
+    cpu->REG.r[d->rd] = value;
+    cpu->excl = 1;
+    return 0;
+}
+
+// STREX{B,H} Rd, Rt, [Rn{, #imm8*4}]: Rd = 0 при запис, 1 без запис
+static int execute_32_strex(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t address = cpu->REG.r[d->rn] + d->imm;
+    uint32_t value = cpu->REG.r[d->rm];
+    int res = 0;
+    if (cpu->excl)
+    {
+        if (d->cond == 1)
+            res = WRITE_MEM_8(cpu, address, value & 0xFF);
+        else if (d->cond == 2)
+            res = WRITE_MEM_16(cpu, address, value & 0xFFFF);
+        else
+            res = WRITE_MEM_32(cpu, address, value);
+        if (res)
+            return res;
+    }
+    cpu->REG.r[d->rd] = !cpu->excl;
+    cpu->excl = 0;
+    return 0;
+}
+
+// LDREX, STREX [1110100 0 0 1 0 L Rn | Rt Rd imm8]
+// LDREXB/H, STREXB/H [1110100 0 1 1 0 L Rn | Rt 1111 010 H Rd]
+static int decode_ex(uint32_t op, M4_DECODED *d)
+{
+    uint32_t rt = (op >> 12) & 0xF;
+    d->rn = (op >> 16) & 0xF;
+    if (op & (1u << 23))
+    {
+        d->cond = (op & 0x10) ? 2 : 1;
+        d->rd = op & 0xF;
+    }
+    else
+    {
+        d->cond = 4;
+        d->rd = (op >> 8) & 0xF;
+        d->imm = (op & 0xFF) << 2;
+    }
+    if (d->rn == 15 || rt >= 13)
+        return -1;
+    if (op & T32_S)
+    { // LDREX: Rt е в d->rd
+        d->rd = rt;
+        d->handler = execute_32_ldrex;
+        return 0;
+    }
+    if (d->rd >= 13 || d->rd == rt || d->rd == d->rn)
+        return -1;
+    d->rm = rt;
+    d->handler = execute_32_strex;
+    return 0;
+}
+
+// TBB [Rn, Rm] / TBH [Rn, Rm, LSL #1]: преход напред с 2 * елемента от таблицата
+static int execute_32_tbb(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t base = d->rn == 15 ? cpu->REG.PC + 4 : cpu->REG.r[d->rn];
+    uint32_t index = cpu->REG.r[d->rm];
+    uint32_t halfwords;
+    int res;
+    if (cpu->op & 0x10)
+        halfwords = READ_MEM_16(cpu, base + 2 * index, &res);
+    else
+        halfwords = READ_MEM_8(cpu, base + index, &res);
+    if (res)
+        return res;
+    cpu->REG.PC += 4 + 2 * halfwords;
+    return 0;
+}
+
+// TBB, TBH [11101000 1101 Rn | 1111 0000 000 H Rm]
+static int decode_tbb(uint32_t op, M4_DECODED *d)
+{
+    d->rn = (op >> 16) & 0xF;
+    d->rm = op & 0xF;
+    if (d->rm >= 13)
+        return -1;
+    d->flags = M4_DEC_BRANCH;
+    d->handler = execute_32_tbb;
+    return 0;
+}
+
+// ОБРАБОТКА НА ДАННИ С РЕГИСТРИ //////
+
+// LSL, LSR, ASR, ROR{S}.W Rd, Rn, Rm: d->imm е видът на изместването
+static inline int t32_shift_reg(CortexM4 *cpu, int s)
+{
+    const M4_DECODED *d = cpu->dec;
+    uint32_t carry;
+    uint32_t result = m4_shift_c(cpu, cpu->REG.r[d->rn], d->imm, cpu->REG.r[d->rm] & 0xFF, &carry);
+    cpu->REG.r[d->rd] = m4_alu_logic(cpu, result, carry, s);
+    return 0;
+}
+
+static int execute_32_shift(CortexM4 *cpu)
+{
+    FUNC_VM();
+    return t32_shift_reg(cpu, 0);
+}
+
+static int execute_32_shift_s(CortexM4 *cpu)
+{
+    FUNC_VM();
+    return t32_shift_reg(cpu, 1);
+}
+
+// Разширенията завъртат Rm с d->imm (0, 8, 16, 24) и добавят Rn, ако не е PC
+static inline uint32_t t32_extend_source(CortexM4 *cpu)
+{
+    uint32_t value = cpu->REG.r[cpu->dec->rm];
+    uint32_t rot = cpu->dec->imm;
+    return rot ? (value >> rot) | (value << (32 - rot)) : value;
+}
+
+static inline uint32_t t32_extend_base(CortexM4 *cpu)
+{
+    return cpu->dec->rn == 15 ? 0 : cpu->REG.r[cpu->dec->rn];
+}
+
+// SXTH.W, SXTAH
+static int execute_32_sxth(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = t32_extend_base(cpu) + (uint32_t)(int32_t)(int16_t)t32_extend_source(cpu);
+    return 0;
+}
+
+// UXTH.W, UXTAH
+static int execute_32_uxth(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = t32_extend_base(cpu) + (t32_extend_source(cpu) & 0xFFFF);
+    return 0;
+}
+
+// SXTB.W, SXTAB
+static int execute_32_sxtb(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = t32_extend_base(cpu) + (uint32_t)(int32_t)(int8_t)t32_extend_source(cpu);
+    return 0;
+}
+
+// UXTB.W, UXTAB
+static int execute_32_uxtb(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = t32_extend_base(cpu) + (t32_extend_source(cpu) & 0xFF);
+    return 0;
+}
+
+// REV.W Rd, Rm
+static int execute_32_rev(CortexM4 *cpu)
+{
+    FUNC_VM();
+    cpu->REG.r[cpu->dec->rd] = __builtin_bswap32(cpu->REG.r[cpu->dec->rm]);
+    return 0;
+}
+
+// REV16.W Rd, Rm
+static int execute_32_rev16(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t value = cpu->REG.r[cpu->dec->rm];
+    cpu->REG.r[cpu->dec->rd] = ((value >> 8) & 0x00FF00FF) | ((value << 8) & 0xFF00FF00);
+    return 0;
+}
+
+// REVSH.W Rd, Rm
+static int execute_32_revsh(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t value = cpu->REG.r[cpu->dec->rm];
+    cpu->REG.r[cpu->dec->rd] = (uint32_t)(int32_t)(int16_t)(((value >> 8) & 0xFF) | (value << 8));
+    return 0;
+}
+
+// RBIT Rd, Rm
+static int execute_32_rbit(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t value = cpu->REG.r[cpu->dec->rm];
+    value = ((value >> 1) & 0x55555555) | ((value & 0x55555555) << 1);
+    value = ((value >> 2) & 0x33333333) | ((value & 0x33333333) << 2);
+    value = ((value >> 4) & 0x0F0F0F0F) | ((value & 0x0F0F0F0F) << 4);
+    cpu->REG.r[cpu->dec->rd] = __builtin_bswap32(value);
+    return 0;
+}
+
+// CLZ Rd, Rm
+static int execute_32_clz(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t value = cpu->REG.r[cpu->dec->rm];
+    cpu->REG.r[cpu->dec->rd] = value ? __builtin_clz(value) : 32;
+    return 0;
+}
+
+// Разширения по битове 6:4 на hw1 (U и B); XTAB16 е в M4-DSP.c
+static const M4_HANDLER t32_extend[8] = {
+    [0x0] = execute_32_sxth,
+    [0x1] = execute_32_uxth,
+    [0x4] = execute_32_sxtb,
+    [0x5] = execute_32_uxtb,
+};
+
+// Разни по битове 5:4 на hw1 и на hw2; QADD, QSUB, SEL са в M4-DSP.c
+static const M4_HANDLER t32_misc[4][4] = {
+    [0x1] = {execute_32_rev, execute_32_rev16, execute_32_rbit, execute_32_revsh},
+    [0x3] = {execute_32_clz},
+};
+
+// [11111010 op1 Rn | 1111 Rd op2 Rm]
+static int decode_dp_regs(uint32_t op, M4_DECODED *d)
+{
+    uint32_t op1 = (op >> 20) & 0xF;
+    uint32_t op2 = (op >> 4) & 0xF;
+    d->rn = (op >> 16) & 0xF;
+    d->rd = (op >> 8) & 0xF;
+    d->rm = op & 0xF;
+    if (d->rd >= 13 || d->rm >= 13)
+        return -1;
+
+    if (op2 == 0 && op1 < 0x8)
+    { // LSL, LSR, ASR, ROR{S}.W Rd, Rn, Rm
+        if (d->rn >= 13)
+            return -1;
+        d->imm = op1 >> 1;
+        d->handler = (op & T32_S) ? execute_32_shift_s : execute_32_shift;
+        if (op & T32_S)
+            d->flags = M4_DEC_SETS_FLAGS;
+    }
+    else if ((op2 & 0x8) && op1 < 0x8)
+    { // {S,U}XTA{B,H} Rd, Rn, Rm{, ROR #} и {S,U}XT{B,H}.W (Rn = PC)
+        d->imm = (op2 & 0x3) << 3;
+        d->handler = t32_extend[op1];
+        if (!d->handler)
+            return m4_decode_dsp(op, d);
+    }
+    else if ((op1 & 0xC) == 0x8 && (op2 & 0xC) == 0x8)
+    { // REV, REV16, RBIT, REVSH, CLZ
+        d->handler = t32_misc[op1 & 0x3][op2 & 0x3];
+        if (!d->handler)
+            return m4_decode_dsp(op, d);
+    }
+    else if (op1 & 0x8)
+    {
+        return m4_decode_dsp(op, d); // Паралелно събиране и изваждане
+    }
+    else
+    {
+        return -1;
     }
+    return 0;
+}
+
+// MUL Rd, Rn, Rm
+static int execute_32_mul(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    cpu->REG.r[d->rd] = cpu->REG.r[d->rn] * cpu->REG.r[d->rm];
+    return 0;
+}
+
+// MLA Rd, Rn, Rm, Ra: d->imm е Ra
+static int execute_32_mla(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    cpu->REG.r[d->rd] = cpu->REG.r[d->imm] + cpu->REG.r[d->rn] * cpu->REG.r[d->rm];
+    return 0;
+}
+
+// MLS Rd, Rn, Rm, Ra
+static int execute_32_mls(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    cpu->REG.r[d->rd] = cpu->REG.r[d->imm] - cpu->REG.r[d->rn] * cpu->REG.r[d->rm];
+    return 0;
+}
 
-    if (res == 0)
+// SMULL RdLo, RdHi, Rn, Rm: d->rd е RdLo, d->imm е RdHi
+static int execute_32_smull(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    int64_t result = (int64_t)(int32_t)cpu->REG.r[d->rn] * (int32_t)cpu->REG.r[d->rm];
+    cpu->REG.r[d->rd] = (uint32_t)result;
+    cpu->REG.r[d->imm] = (uint32_t)((uint64_t)result >> 32);
+    return 0;
+}
+
+// UMULL RdLo, RdHi, Rn, Rm
+static int execute_32_umull(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint64_t result = (uint64_t)cpu->REG.r[d->rn] * cpu->REG.r[d->rm];
+    cpu->REG.r[d->rd] = (uint32_t)result;
+    cpu->REG.r[d->imm] = (uint32_t)(result >> 32);
+    return 0;
+}
+
+// SMLAL RdLo, RdHi, Rn, Rm
+static int execute_32_smlal(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint64_t acc = ((uint64_t)cpu->REG.r[d->imm] << 32) | cpu->REG.r[d->rd];
+    acc += (uint64_t)((int64_t)(int32_t)cpu->REG.r[d->rn] * (int32_t)cpu->REG.r[d->rm]);
+    cpu->REG.r[d->rd] = (uint32_t)acc;
+    cpu->REG.r[d->imm] = (uint32_t)(acc >> 32);
+    return 0;
+}
+
+// UMLAL RdLo, RdHi, Rn, Rm
+static int execute_32_umlal(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint64_t acc = ((uint64_t)cpu->REG.r[d->imm] << 32) | cpu->REG.r[d->rd];
+    acc += (uint64_t)cpu->REG.r[d->rn] * cpu->REG.r[d->rm];
+    cpu->REG.r[d->rd] = (uint32_t)acc;
+    cpu->REG.r[d->imm] = (uint32_t)(acc >> 32);
+    return 0;
+}
+
+// SDIV Rd, Rn, Rm: деление на 0 дава 0 (CCR.DIV_0_TRP = 0)
+static int execute_32_sdiv(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    int32_t n = (int32_t)cpu->REG.r[d->rn];
+    int32_t m = (int32_t)cpu->REG.r[d->rm];
+    if (!m)
+        cpu->REG.r[d->rd] = 0;
+    else if (n == INT32_MIN && m == -1)
+        cpu->REG.r[d->rd] = (uint32_t)INT32_MIN; // Препълване: резултатът е 0x80000000
+    else
+        cpu->REG.r[d->rd] = (uint32_t)(n / m);
+    return 0;
+}
+
+// UDIV Rd, Rn, Rm
+static int execute_32_udiv(CortexM4 *cpu)
+{
+    FUNC_VM();
+    const M4_DECODED *d = cpu->dec;
+    uint32_t m = cpu->REG.r[d->rm];
+    cpu->REG.r[d->rd] = m ? cpu->REG.r[d->rn] / m : 0;
+    return 0;
+}
+
+// MUL, MLA, MLS [111110110 op1 Rn | Ra Rd op2 Rm]; останалите са DSP
+static int decode_mul(uint32_t op, M4_DECODED *d)
+{
+    uint32_t ra = (op >> 12) & 0xF;
+    d->rn = (op >> 16) & 0xF;
+    d->rd = (op >> 8) & 0xF;
+    d->rm = op & 0xF;
+    d->imm = ra;
+    if (op & 0x007000C0)
+        return m4_decode_dsp(op, d); // SMLA<x><y>, SMLAD, SMMUL, USAD8 ...
+    if (d->rd >= 13 || d->rn >= 13 || d->rm >= 13)
+        return -1;
+    switch ((op >> 4) & 0x3)
     {
-        PRINT_REG();
-        if (op != 0b11110) // Не увеличаваме PC за BL
-            CPU.REG.PC += 4;
+    case 0:
+        d->handler = ra == 15 ? execute_32_mul : execute_32_mla;
+        break;
+    case 1:
+        d->handler = execute_32_mls;
+        break;
+    default:
+        return -1;
+    }
+    if (ra == 13 || (ra == 15 && d->handler == execute_32_mls))
+        return -1;
+    return 0;
+}
+
+// Дълго умножение и деление по битове 6:4 на hw1 и 7:4 на hw2
+static const M4_HANDLER t32_mull[8][16] = {
+    [0x0] = {[0x0] = execute_32_smull},
+    [0x1] = {[0xF] = execute_32_sdiv},
+    [0x2] = {[0x0] = execute_32_umull},
+    [0x3] = {[0xF] = execute_32_udiv},
+    [0x4] = {[0x0] = execute_32_smlal},
+    [0x6] = {[0x0] = execute_32_umlal},
+};
+
+// [111110111 op1 Rn | RdLo RdHi op2 Rm] / [... Rn | 1111 Rd 1111 Rm]
+static int decode_mull(uint32_t op, M4_DECODED *d)
+{
+    uint32_t op1 = (op >> 20) & 0x7;
+    uint32_t op2 = (op >> 4) & 0xF;
+    d->rn = (op >> 16) & 0xF;
+    d->rm = op & 0xF;
+    d->handler = t32_mull[op1][op2];
+    if (!d->handler)
+        return m4_decode_dsp(op, d); // SMLAL<x><y>, SMLALD, SMLSLD, UMAAL
+    if (op2 == 0xF)
+    { // SDIV, UDIV
+        d->rd = (op >> 8) & 0xF;
+        if (d->rd >= 13 || ((op >> 12) & 0xF) != 0xF)
+            return -1;
     }
     else
     {
-        PRINT_REG();
+        d->rd = (op >> 12) & 0xF; // RdLo
+        d->imm = (op >> 8) & 0xF; // RdHi
+        if (d->rd >= 13 || d->imm >= 13 || d->rd == d->imm)
+            return -1;
     }
+    if (d->rn >= 13 || d->rm >= 13)
+        return -1;
+    return 0;
+}
+
+// DSP И FPU /////////////////////////
+
+// ARMv7E-M: SIMD, насищане, SMLA<x><y> ... (M4-DSP.c)
+int m4_decode_dsp(uint32_t op, M4_DECODED *d)
+{
+#if USE_DSP
+    (void)op;
+    d->flags = M4_DEC_BRANCH; // m4_execute_DSP сам управлява PC
+    d->handler = m4_execute_DSP;
+    return 0;
+#else
+    (void)op;
+    (void)d;
+    return -1;
+#endif
+}
+
+// Копроцесор: FPv4-SP (M4-FPU.c)
+static int decode_cp(uint32_t op, M4_DECODED *d)
+{
+#if USE_FPU
+    d->flags = M4_DEC_BRANCH; // m4_execute_FPU сам управлява PC
+    if (op == 0xEEF1FA10)
+        d->flags |= M4_DEC_SETS_FLAGS; // VMRS APSR_nzcv, FPSCR
+    d->handler = m4_execute_FPU;
+    return 0;
+#else
+    (void)op;
+    (void)d;
+    return -1;
+#endif
+}
 
-    RETURN_ERROR(res);
-}
\ No newline at end of file
+// ТАБЛИЦА НА ДЕКОДИРАНЕ //////////////
+
+typedef int (*T32_DECODE)(uint32_t op, M4_DECODED *d);
+
+typedef struct
+{
+    uint32_t mask;
+    uint32_t value;
+    T32_DECODE decode;
+} T32_PATTERN;
+
+// ARMv7-M ARM, A5.3: първото съвпадение печели
+static const T32_PATTERN t32_patterns[] = {
+    {0xFFF0FFE0, 0xE8D0F000, decode_tbb},      // TBB, TBH
+    {0xFFE00000, 0xE8400000, decode_ex},       // LDREX, STREX
+    {0xFFE00FE0, 0xE8C00F40, decode_ex},       // LDREXB, LDREXH, STREXB, STREXH
+    {0xFF400000, 0xE9400000, decode_ldrd},     // LDRD, STRD (P = 1)
+    {0xFF600000, 0xE8600000, decode_ldrd},     // LDRD, STRD (P = 0, W = 1)
+    {0xFE400000, 0xE8000000, decode_ldm},      // LDM, STM, PUSH.W, POP.W
+    {0xFE000000, 0xEA000000, decode_dp_reg},   // Обработка на данни с изместен регистър
+    {0xEC000000, 0xEC000000, decode_cp},       // Копроцесор (FPU)
+    {0xFA008000, 0xF0000000, decode_dp_imm},   // Обработка на данни с модифицирана константа
+    {0xFA008000, 0xF2000000, decode_dp_plain}, // ADDW, SUBW, MOVW, MOVT, SSAT, USAT, битови полета
+    {0xFFF0D000, 0xF3808000, decode_system},   // MSR
+    {0xFFFFD000, 0xF3EF8000, decode_system},   // MRS
+    {0xFFFFD700, 0xF3AF8000, decode_hint},     // NOP, YIELD, WFE, WFI, SEV
+    {0xFFFFD000, 0xF3BF8000, decode_barrier},  // CLREX, DSB, DMB, ISB
+    {0xF800D000, 0xF0008000, decode_b_cond},   // B<c>.W
+    {0xF800D000, 0xF0009000, decode_b},        // B.W
+    {0xF800D000, 0xF000D000, decode_bl},       // BL
+    {0xFE000000, 0xF8000000, decode_ldst},     // LDR, STR{B,H,SB,SH}, PLD, PLI
+    {0xFF00F000, 0xFA00F000, decode_dp_regs},  // Изместване с регистър, разширения, REV, CLZ
+    {0xFF800000, 0xFB000000, decode_mul},      // MUL, MLA, MLS
+    {0xFF800000, 0xFB800000, decode_mull},     // SMULL, UMULL, SMLAL, UMLAL, SDIV, UDIV
+};
+
+#define T32_PATTERNS (sizeof(t32_patterns) / sizeof(t32_patterns[0]))
+#define T32_KEY(op) (((op) >> 20) & 0x1FF) // Битове 12:4 на hw1 (15:13 са 111)
+#define T32_BUCKET 8                        // Най-много шаблони с един ключ
+
+// Номерата (+1, 0 = край) на шаблоните, които могат да съвпаднат с ключа
+static uint8_t t32_index[512][T32_BUCKET];
+
+// Генерира t32_index от t32_patterns преди main, така че декодирането от
+// няколко нишки (M4-BATCH.c) чете готова таблица
+__attribute__((constructor)) static void t32_index_build(void)
+{
+    for (uint32_t key = 0; key < 512; key++)
+    {
+        uint32_t hw1 = 0xE0000000 | (key << 20);
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < T32_PATTERNS; i++)
+        {
+            const T32_PATTERN *p = &t32_patterns[i];
+            if ((hw1 ^ p->value) & p->mask & 0xFFF00000)
+                continue;
+            if (n == T32_BUCKET)
+            {
+                PRINTF("[ERROR] t32_index_build: T32_BUCKET too small for key 0x%03X\n", key);
+                break;
+            }
+            t32_index[key][n++] = (uint8_t)(i + 1);
+        }
+    }
+}
+
+// DECODE 32 bytes  ///////////////////
+
+int m4_decode_32(uint32_t op, M4_DECODED *d)
+{
+    FUNC_VM();
+    memset(d, 0, sizeof(*d));
+    d->op = op;
+    d->size = 4;
+
+    const uint8_t *bucket = t32_index[T32_KEY(op)];
+    for (uint32_t i = 0; i < T32_BUCKET && bucket[i]; i++)
+    {
+        const T32_PATTERN *p = &t32_patterns[bucket[i] - 1];
+        if ((op & p->mask) == p->value)
+            return p->decode(op, d);
+    }
+    return -1;
+}
+
+// EXECUTE 32 bytes  //////////////////
+
+int m4_dispatch_32(CortexM4 *cpu, const M4_DECODED *d)
+{
+    FUNC_VM();
+    cpu->dec = d;
+    int res = d->handler(cpu);
+
+    if (!res && !(d->flags & M4_DEC_BRANCH)) // Преходите сами задават PC
+        cpu->REG.PC += 4;
+
+    RETURN_ERROR(res); // OK = 0 / ERROR = -1
+}
+
+int m4_execute_32(CortexM4 *cpu)
+{
+    FUNC_VM();
+    M4_DECODED d;
+
+    if (m4_decode_32(cpu->op, &d))
+    {
+        DEBUG_M4("[ERROR] Unsupported instruction: 0x%08X at PC: 0x%08X\n", cpu->op, cpu->REG.PC);
+        RETURN_ERROR(-1);
+    }
+    return m4_dispatch_32(cpu, &d);
+}
@@ -0,0 +1,256 @@
+#include "M4.h"
+#include "common.h"
+
+#if USE_BATCH
+
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+    Пакетно изпълнение на много инстанции на един и същ фърмуер.
+
+    ROM и кешът с декодираните инструкции се създават веднъж и се споделят
+    само за четене. Всяка нишка има собствено ядро и RAM, които се
+    нулират между задачите, така че паметта расте с броя нишки, а не с броя
+    инстанции.
+
+    Задачите се разпределят по равно между нишките. Нишка, която свърши
+    своите, краде половината от оставащите задачи на друга нишка.
+*/
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    uint32_t next; // Следваща задача на собственика (отпред)
+    uint32_t end;  // Край на диапазона (крадците вземат отзад)
+} M4_BATCH_QUEUE;
+
+typedef struct
+{
+    const M4_BATCH *batch;
+    M4_BATCH_JOB *jobs;
+    M4_DECODED *icache; // Споделен, запълнен предварително
+    M4_BATCH_QUEUE *queue;
+    int threads;
+} M4_BATCH_POOL;
+
+typedef struct
+{
+    M4_BATCH_POOL *pool;
+    int id;
+} M4_BATCH_WORKER;
+
+// Взима следващата задача от собствената опашка или краде от друга нишка
+static int batch_take(M4_BATCH_POOL *pool, int id, uint32_t *job)
+{
+    M4_BATCH_QUEUE *q = &pool->queue[id];
+    pthread_mutex_lock(&q->lock);
+    if (q->next < q->end)
+    {
+        *job = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    for (int i = 1; i < pool->threads; i++)
+    {
+        M4_BATCH_QUEUE *victim = &pool->queue[(id + i) % pool->threads];
+        pthread_mutex_lock(&victim->lock);
+        uint32_t left = victim->end - victim->next;
+        if (left == 0)
+        {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        uint32_t steal = (left + 1) / 2;
+        victim->end -= steal;
+        uint32_t first = victim->end;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&q->lock);
+        q->next = first + 1;
+        q->end = first + steal;
+        pthread_mutex_unlock(&q->lock);
+        *job = first;
+        return 1;
+    }
+    return 0;
+}
+
+// Изпълнява една инстанция върху вече подготвено ядро
+static void batch_job(CortexM4 *cpu, const M4_BATCH *batch, M4_BATCH_JOB *job)
+{
+    m4_reset_core(cpu); // Вкл. NVIC и системните регистри от предишната задача
+#if USE_CYCLES
+    cpu->cycles = 0;
+    cpu->cyccnt_base = 0;
+#endif
+#if USE_EVENTS
+    // Събитията са с абсолютен такт - тези на предишната задача са невалидни
+    m4_events_reset(cpu);
+    cpu->sleep_cycles = 0;
+    cpu->poll_elided = 0;
+    cpu->poll_volatile = 0;
+#endif
+
+    memset(cpu->RAM, 0, cpu->RAM_SIZE);
+    if (batch->ram_init)
+        memcpy(cpu->RAM, batch->ram_init, batch->ram_init_size);
+    if (job->input)
+        memcpy(cpu->RAM + (job->input_addr - RAM_BASE), job->input, job->input_size);
+
+    memcpy(cpu->REG.r, job->args, sizeof(job->args));
+    cpu->REG.SP = batch->initial_sp;
+    cpu->REG.PC = batch->entry_pc;
+
+    // SVC няма обработчик в пакетен режим и се пропуска
+    uint64_t steps = 0;
+    M4_STOP stop;
+    do
+    {
+        steps += m4_run(cpu, batch->max_steps - steps, &stop);
+    } while (stop == M4_STOP_SVC);
+
+    switch (stop)
+    {
+    case M4_STOP_BKPT:
+        job->exit_code = cpu->stop_code;
+        break;
+    case M4_STOP_BUDGET:
+        job->exit_code = M4_BATCH_TIMEOUT;
+        break;
+    case M4_STOP_WFI:
+        job->exit_code = M4_BATCH_SLEEP;
+        break;
+    default:
+        job->exit_code = M4_BATCH_FAULT;
+        break;
+    }
+
+#if USE_CYCLES
+    job->cycles = cpu->cycles;
+#else
+    job->cycles = steps;
+#endif
+    job->regs = cpu->REG;
+    job->psr = m4_read_psr(cpu);
+}
+
+static void *batch_worker(void *arg)
+{
+    M4_BATCH_WORKER *w = (M4_BATCH_WORKER *)arg;
+    M4_BATCH_POOL *pool = w->pool;
+    const M4_BATCH *batch = pool->batch;
+
+    CortexM4 *cpu = m4_create();
+    uint8_t *ram = (uint8_t *)malloc(batch->ram_size);
+    if (!cpu || !ram)
+    {
+        PRINTF("[ERROR] m4_batch_run: Out of memory\n");
+        m4_destroy(cpu);
+        free(ram);
+        return (void *)(intptr_t)-1;
+    }
+    cpu->ROM = (uint8_t *)batch->rom; // Само за четене: в ROM не се пише
+    cpu->ROM_SIZE = batch->rom_size;
+    cpu->RAM = ram;
+    cpu->RAM_SIZE = batch->ram_size;
+    m4_icache_share(cpu, pool->icache);
+
+    int res = m4_mem_init(cpu);
+    uint32_t job;
+    while (!res && batch_take(pool, w->id, &job))
+        batch_job(cpu, batch, &pool->jobs[job]);
+
+    m4_destroy(cpu);
+    free(ram);
+    return (void *)(intptr_t)res;
+}
+
+// Изпълнява count инстанции паралелно. Резултатите се записват в jobs.
+int m4_batch_run(const M4_BATCH *batch, M4_BATCH_JOB *jobs, uint32_t count)
+{
+    if (!batch || !batch->rom || !batch->rom_size || !batch->ram_size || batch->ram_init_size > batch->ram_size)
+    {
+        PRINTF("[ERROR] m4_batch_run: Invalid Parameter\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (jobs[i].input && (jobs[i].input_addr - RAM_BASE > batch->ram_size ||
+                              jobs[i].input_size > batch->ram_size - (jobs[i].input_addr - RAM_BASE)))
+        {
+            PRINTF("[ERROR] m4_batch_run: Input %u does not fit in RAM\n", i);
+            return -1;
+        }
+    }
+
+    int threads = batch->threads;
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    if ((uint32_t)threads > count)
+        threads = count ? count : 1;
+
+    // Декодиране на ROM веднъж за всички инстанции
+    CortexM4 *owner = m4_create();
+    if (!owner)
+        return -1;
+    owner->ROM = (uint8_t *)batch->rom;
+    owner->ROM_SIZE = batch->rom_size;
+    if (m4_icache_prefill(owner))
+    {
+        m4_destroy(owner);
+        return -1;
+    }
+
+    M4_BATCH_POOL pool = {batch, jobs, owner->icache, NULL, threads};
+    pool.queue = (M4_BATCH_QUEUE *)calloc(threads, sizeof(M4_BATCH_QUEUE));
+    pthread_t *tid = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    M4_BATCH_WORKER *workers = (M4_BATCH_WORKER *)calloc(threads, sizeof(M4_BATCH_WORKER));
+    int res = (pool.queue && tid && workers) ? 0 : -1;
+
+    int started = 0;
+    if (res)
+        PRINTF("[ERROR] m4_batch_run: Out of memory\n");
+    else
+    {
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_mutex_init(&pool.queue[i].lock, NULL);
+            pool.queue[i].next = (uint64_t)count * i / threads;
+            pool.queue[i].end = (uint64_t)count * (i + 1) / threads;
+        }
+    }
+    for (int i = 0; !res && i < threads; i++)
+    {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if (pthread_create(&tid[i], NULL, batch_worker, &workers[i]))
+        {
+            PRINTF("[ERROR] m4_batch_run: Cannot start thread %d\n", i);
+            res = -1;
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+    {
+        void *ret;
+        pthread_join(tid[i], &ret);
+        if (ret)
+            res = -1;
+    }
+    for (int i = 0; pool.queue && tid && workers && i < threads; i++)
+        pthread_mutex_destroy(&pool.queue[i].lock);
+
+    free(workers);
+    free(tid);
+    free(pool.queue);
+    m4_destroy(owner);
+    return res;
+}
+
+#endif // USE_BATCH
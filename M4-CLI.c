@@ -0,0 +1,200 @@
+#include "M4.h"
+#include "common.h"
+
+#if USE_BATCH && defined(M4_BATCH_MAIN)
+
+#include <unistd.h>
+
+/*
+    m4batch: пакетно изпълнение на един ROM образ в много инстанции.
+
+        m4batch [-n брой] [-j нишки] [-r RAM KB] [-m max инструкции]
+                [-i входове.txt] [-e PC] [-s SP] rom.bin
+
+    Всеки непразен ред на -i е една инстанция: до 4 числа за R0–R3.
+    Без -i се пускат -n инстанции с R0 = номер на инстанцията.
+    PC и SP по подразбиране се четат от векторната таблица в началото на ROM.
+    Фърмуерът завършва с BKPT #код; кодът е exit за инстанцията.
+
+    Компилира се с -DM4_BATCH_MAIN -pthread и USE_BATCH 1.
+*/
+
+static uint8_t *load_file(const char *name, uint32_t *size)
+{
+    FILE *f = fopen(name, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = (len > 0) ? (uint8_t *)malloc(len) : NULL;
+    if (data && fread(data, 1, len, f) != (size_t)len)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = (uint32_t)len;
+    return data;
+}
+
+// Чете входовете (R0–R3 на ред), връща броя инстанции
+static uint32_t load_inputs(const char *name, M4_BATCH_JOB **jobs)
+{
+    FILE *f = fopen(name, "r");
+    if (!f)
+        return 0;
+    uint32_t count = 0, cap = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        char *p = line;
+        uint32_t args[4] = {0};
+        int n = 0;
+        while (n < 4)
+        {
+            char *end;
+            args[n] = (uint32_t)strtoul(p, &end, 0);
+            if (end == p)
+                break;
+            p = end;
+            n++;
+        }
+        if (n == 0)
+            continue;
+        if (count == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            M4_BATCH_JOB *grown = (M4_BATCH_JOB *)realloc(*jobs, cap * sizeof(M4_BATCH_JOB));
+            if (!grown)
+                break;
+            *jobs = grown;
+        }
+        memset(&(*jobs)[count], 0, sizeof(M4_BATCH_JOB));
+        memcpy((*jobs)[count].args, args, sizeof(args));
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    M4_BATCH batch = {0};
+    batch.ram_size = 128 * 1024;
+    batch.max_steps = 100000000;
+    uint32_t count = 1;
+    const char *inputs = NULL;
+    int have_pc = 0, have_sp = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:j:r:m:i:e:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            batch.threads = atoi(optarg);
+            break;
+        case 'r':
+            batch.ram_size = (uint32_t)strtoul(optarg, NULL, 0) * 1024;
+            break;
+        case 'm':
+            batch.max_steps = strtoull(optarg, NULL, 0);
+            break;
+        case 'i':
+            inputs = optarg;
+            break;
+        case 'e':
+            batch.entry_pc = (uint32_t)strtoul(optarg, NULL, 0) & ~0x1;
+            have_pc = 1;
+            break;
+        case 's':
+            batch.initial_sp = (uint32_t)strtoul(optarg, NULL, 0);
+            have_sp = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n count] [-j threads] [-r ram_kb] [-m max_steps] [-i inputs] [-e pc] [-s sp] rom.bin\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "[ERROR] No ROM image\n");
+        return 2;
+    }
+
+    uint32_t rom_size;
+    uint8_t *rom = load_file(argv[optind], &rom_size);
+    if (!rom)
+    {
+        fprintf(stderr, "[ERROR] Cannot read ROM: %s\n", argv[optind]);
+        return 1;
+    }
+    batch.rom = rom;
+    batch.rom_size = rom_size;
+
+    // Векторна таблица: [0] = начален SP, [1] = Reset handler
+    if ((!have_pc || !have_sp) && rom_size >= 8)
+    {
+        uint32_t sp, pc;
+        memcpy(&sp, rom, 4);
+        memcpy(&pc, rom + 4, 4);
+        if (!have_sp)
+            batch.initial_sp = M4_LE32(sp);
+        if (!have_pc)
+            batch.entry_pc = M4_LE32(pc) & ~0x1;
+    }
+
+    M4_BATCH_JOB *jobs = NULL;
+    if (inputs)
+    {
+        count = load_inputs(inputs, &jobs);
+        if (!count)
+        {
+            fprintf(stderr, "[ERROR] No inputs in %s\n", inputs);
+            free(rom);
+            return 1;
+        }
+    }
+    else
+    {
+        jobs = (M4_BATCH_JOB *)calloc(count, sizeof(M4_BATCH_JOB));
+        for (uint32_t i = 0; jobs && i < count; i++)
+            jobs[i].args[0] = i;
+    }
+    if (!jobs)
+    {
+        fprintf(stderr, "[ERROR] Out of memory\n");
+        free(rom);
+        return 1;
+    }
+
+    int res = m4_batch_run(&batch, jobs, count);
+    if (res == 0)
+    {
+        printf("id\texit\tcycles");
+        for (int r = 0; r < 16; r++)
+            printf("\tR%d", r);
+        printf("\tPSR\n");
+        for (uint32_t i = 0; i < count; i++)
+        {
+            printf("%u\t%d\t%llu", i, jobs[i].exit_code, (unsigned long long)jobs[i].cycles);
+            for (int r = 0; r < 16; r++)
+                printf("\t0x%08X", jobs[i].regs.r[r]);
+            printf("\t0x%08X\n", jobs[i].psr);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "[ERROR] Batch run failed\n");
+    }
+
+    free(jobs);
+    free(rom);
+    return res ? 1 : 0;
+}
+
+#endif // USE_BATCH && M4_BATCH_MAIN
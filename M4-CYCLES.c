@@ -0,0 +1,290 @@
+#include "M4.h"
+#include "common.h"
+
+#if USE_CYCLES
+
+/*
+    Приблизителен модел на тактовете на Cortex-M4 (ARM DDI 0439, табл. 3-1).
+
+    Цената на всяка инструкция се изчислява веднъж при декодиране и се пази
+    в слота. При изпълнение се добавя само презареждането на конвейера
+    (M4_CYCLES_REFILL) за изпълнените преходи. Стойностите са горни граници
+    (деление 12, презареждане 3), защото моделът служи за оценка на най-лошия
+    случай. Не се моделират чакането на паметта, изключенията и
+    конвейеризирането на съседни LDR/STR.
+*/
+
+#define CYC_LIST 1  // + по един такт за всеки бит в list (регистров списък)
+#define CYC_COUNT 2 // + стойността на полето list (брой регистри във VLDM/VSTM)
+
+typedef struct
+{
+    uint32_t mask;
+    uint32_t value;
+    uint8_t cycles;
+    uint8_t kind; // 0, CYC_LIST или CYC_COUNT
+    uint32_t list;
+} M4_CYCLE_COST;
+
+// Thumb-16: първото съвпадение печели
+static const M4_CYCLE_COST cost_16[] = {
+    {0xFE00, 0xB400, 1, CYC_LIST, 0x1FF}, // PUSH {<reg list>, LR}
+    {0xFE00, 0xBC00, 1, CYC_LIST, 0x1FF}, // POP {<reg list>, PC}
+    {0xF000, 0xC000, 1, CYC_LIST, 0xFF},  // STMIA / LDMIA
+    {0xF800, 0x4800, 2, 0, 0},            // LDR Rd, [PC, #]
+    {0xF000, 0x5000, 2, 0, 0},            // LDR/STR Rd, [Rn, Rm]
+    {0xE000, 0x6000, 2, 0, 0},            // LDR/STR{B} Rd, [Rn, #]
+    {0xF000, 0x8000, 2, 0, 0},            // LDRH/STRH Rd, [Rn, #]
+    {0xF000, 0x9000, 2, 0, 0},            // LDR/STR Rd, [SP, #]
+    {0, 0, 1, 0, 0},                      // ALU, MUL, MOV, B, CBZ, BX, BL половини, разширения, REV, BKPT, SVC, подсказки
+};
+
+// Thumb-2, вкл. DSP (M4-DSP.c) и FPv4-SP (M4-FPU.c)
+static const M4_CYCLE_COST cost_32[] = {
+    {0xFFF0F0F0, 0xFB90F0F0, 12, 0, 0},           // SDIV: 2–12
+    {0xFFF0F0F0, 0xFBB0F0F0, 12, 0, 0},           // UDIV: 2–12
+    {0xFFF0F0F0, 0xFB00F000, 1, 0, 0},            // MUL
+    {0xFFF000E0, 0xFB000000, 2, 0, 0},            // MLA, MLS
+    {0xFF800000, 0xFB000000, 1, 0, 0},            // SMLA<x><y>, SMUAD, SMMUL ...
+    {0xFF800000, 0xFB800000, 1, 0, 0},            // SMULL, UMULL, SMLAL, UMLAL, UMAAL
+    {0xFFF0FFE0, 0xE8D0F000, 2, 0, 0},            // TBB, TBH
+    {0xFE400000, 0xE8400000, 3, 0, 0},            // LDRD, STRD, LDREX, STREX
+    {0xFE400000, 0xE8000000, 1, CYC_LIST, 0xFFFF}, // LDM, STM
+    {0xFE000000, 0xF8000000, 2, 0, 0},            // LDR/STR{B,H} и PLD
+    {0xFFB00F50, 0xEE800A00, 14, 0, 0},           // VDIV.F32
+    {0xFFBF0FD0, 0xEEB10AC0, 14, 0, 0},           // VSQRT.F32
+    {0xFFA00F10, 0xEE000A00, 3, 0, 0},            // VMLA, VMLS, VNMLA, VNMLS
+    {0xFFB00F10, 0xEEA00A00, 3, 0, 0},            // VFMA, VFMS
+    {0xFFB00F10, 0xEE900A00, 3, 0, 0},            // VFNMA, VFNMS
+    {0xFF200E00, 0xED000A00, 2, 0, 0},            // VLDR, VSTR
+    {0xFFE00E00, 0xEC400A00, 2, 0, 0},            // VMOV два регистъра
+    {0xFE000E00, 0xEC000A00, 1, CYC_COUNT, 0xFF}, // VLDM, VSTM, VPUSH, VPOP
+    {0, 0, 1, 0, 0},                              // Обработка на данни, BL, VADD, VMUL, VCMP, VMOV, VMRS
+};
+
+// Цена на декодирана инструкция без презареждане на конвейера
+uint8_t m4_cycles_cost(const M4_DECODED *d)
+{
+    const M4_CYCLE_COST *c = d->size == 4 ? cost_32 : cost_16;
+    while ((d->op & c->mask) != c->value)
+        c++;
+
+    uint32_t cycles = c->cycles;
+    if (c->kind == CYC_LIST)
+        cycles += __builtin_popcount(d->op & c->list);
+    else if (c->kind == CYC_COUNT)
+        cycles += d->op & c->list;
+    return cycles > 0xFF ? 0xFF : (uint8_t)cycles;
+}
+
+// Тактове на n слота, изпълнени наведнъж от pc нататък (JIT)
+void m4_cycles_block(CortexM4 *cpu, const M4_DECODED *d, uint32_t n, uint32_t pc)
+{
+    if (!n)
+        return;
+    for (; n > 1; n--)
+    {
+        cpu->cycles += d->cycles;
+        pc += d->size;
+        d += d->size >> 1;
+    }
+    m4_cycles_add(cpu, d, pc); // Последната може да е изпълнен преход
+}
+
+///////////////////////////////////////////////////////////
+
+/*
+    Тактове по функции. BL/BLX добавят кадър в сенчест стек, а BX, POP {PC}
+    и MOV PC, Rm, които се връщат на адреса от някой кадър, го премахват
+    заедно с всички над него (longjmp, изключения). Времето е включително -
+    с извиканите функции; при рекурсия се брои само най-външното извикване.
+*/
+
+#define M4_SHADOW_DEPTH 256
+
+typedef struct
+{
+    uint32_t func;
+    uint32_t ret; // Адрес на връщане без Thumb бит
+    uint64_t start;
+} M4_SHADOW_FRAME;
+
+struct M4_CYCLES_s
+{
+    M4_SHADOW_FRAME stack[M4_SHADOW_DEPTH];
+    uint32_t depth;
+    uint32_t lost; // Извиквания отвъд M4_SHADOW_DEPTH, които още не са се върнали
+    M4_FUNC_CYCLES *funcs; // Хеш таблица по адрес, празен запис: calls == 0
+    uint32_t *active;      // Брой кадри в стека за всеки запис (рекурсия)
+    uint32_t size;         // Степен на 2
+    uint32_t used;
+};
+
+static uint32_t func_hash(uint32_t addr, uint32_t size)
+{
+    return ((addr >> 1) * 2654435761u) & (size - 1);
+}
+
+static int func_grow(struct M4_CYCLES_s *p)
+{
+    uint32_t size = p->size ? p->size * 2 : 256;
+    M4_FUNC_CYCLES *funcs = (M4_FUNC_CYCLES *)calloc(size, sizeof(M4_FUNC_CYCLES));
+    uint32_t *active = (uint32_t *)calloc(size, sizeof(uint32_t));
+    if (!funcs || !active)
+    {
+        PRINTF("[ERROR] m4_cycles_profile: Out of memory\n");
+        free(funcs);
+        free(active);
+        return -1;
+    }
+    for (uint32_t i = 0; i < p->size; i++)
+    {
+        if (!p->funcs[i].calls)
+            continue;
+        uint32_t h = func_hash(p->funcs[i].addr, size);
+        while (funcs[h].calls)
+            h = (h + 1) & (size - 1);
+        funcs[h] = p->funcs[i];
+        active[h] = p->active[i];
+    }
+    free(p->funcs);
+    free(p->active);
+    p->funcs = funcs;
+    p->active = active;
+    p->size = size;
+    return 0;
+}
+
+// Запис за функцията addr; създава го при create. NULL при липса на памет.
+static uint32_t *func_find(struct M4_CYCLES_s *p, uint32_t addr, int create, M4_FUNC_CYCLES **f)
+{
+    if (create && (p->used + 1) * 4 > p->size * 3 && func_grow(p))
+        return NULL;
+    if (!p->size)
+        return NULL;
+    uint32_t h = func_hash(addr, p->size);
+    while (p->funcs[h].calls && p->funcs[h].addr != addr)
+        h = (h + 1) & (p->size - 1);
+    if (!p->funcs[h].calls)
+    {
+        if (!create)
+            return NULL;
+        p->funcs[h].addr = addr;
+        p->used++;
+    }
+    *f = &p->funcs[h];
+    return &p->active[h];
+}
+
+// Включва (enable != 0) или изключва и освобождава тактовете по функции
+int m4_cycles_profile(CortexM4 *cpu, int enable)
+{
+    if (cpu->prof)
+    {
+        free(cpu->prof->funcs);
+        free(cpu->prof->active);
+        free(cpu->prof);
+        cpu->prof = NULL;
+    }
+    if (!enable)
+        return 0;
+    cpu->prof = (struct M4_CYCLES_s *)calloc(1, sizeof(struct M4_CYCLES_s));
+    if (!cpu->prof)
+    {
+        PRINTF("[ERROR] m4_cycles_profile: Out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+void m4_cycles_call(CortexM4 *cpu, uint32_t target, uint32_t ret)
+{
+    struct M4_CYCLES_s *p = cpu->prof;
+    M4_FUNC_CYCLES *f;
+    uint32_t *active;
+    if (p->depth == M4_SHADOW_DEPTH || !(active = func_find(p, target & ~0x1, 1, &f)))
+    {
+        p->lost++;
+        return;
+    }
+    f->calls++;
+    (*active)++;
+    M4_SHADOW_FRAME *frame = &p->stack[p->depth++];
+    frame->func = target & ~0x1;
+    frame->ret = ret & ~0x1;
+    frame->start = cpu->cycles;
+}
+
+void m4_cycles_return(CortexM4 *cpu, uint32_t target)
+{
+    struct M4_CYCLES_s *p = cpu->prof;
+    target &= ~0x1;
+    if (p->lost)
+    {
+        p->lost--; // Връщане от извикване, което не се събра в стека
+        return;
+    }
+
+    uint32_t i = p->depth;
+    while (i && p->stack[i - 1].ret != target)
+        i--;
+    if (!i)
+        return; // Не е връщане от проследена функция
+
+    while (p->depth >= i)
+    {
+        M4_SHADOW_FRAME *frame = &p->stack[--p->depth];
+        M4_FUNC_CYCLES *f;
+        uint32_t *active = func_find(p, frame->func, 0, &f);
+        if (active && !--(*active))
+            f->cycles += cpu->cycles - frame->start;
+    }
+}
+
+// Премахва всички кадри, напр. след m4_restore. Събраните тактове остават.
+void m4_cycles_unwind(CortexM4 *cpu)
+{
+    struct M4_CYCLES_s *p = cpu->prof;
+    if (!p)
+        return;
+    memset(p->active, 0, p->size * sizeof(uint32_t));
+    p->depth = 0;
+    p->lost = 0;
+}
+
+static int func_compare(const void *a, const void *b)
+{
+    uint64_t x = ((const M4_FUNC_CYCLES *)a)->cycles;
+    uint64_t y = ((const M4_FUNC_CYCLES *)b)->cycles;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Копира до max функции в out, подредени по тактове (низходящо).
+// Връща общия брой функции. Функциите, които още не са се върнали, са с 0
+// тактове.
+uint32_t m4_cycles_report(CortexM4 *cpu, M4_FUNC_CYCLES *out, uint32_t max)
+{
+    struct M4_CYCLES_s *p = cpu->prof;
+    if (!p || !p->used)
+        return 0;
+    if (!out || !max)
+        return p->used;
+    M4_FUNC_CYCLES *all = (M4_FUNC_CYCLES *)malloc(p->used * sizeof(M4_FUNC_CYCLES));
+    if (!all)
+    {
+        PRINTF("[ERROR] m4_cycles_report: Out of memory\n");
+        return 0;
+    }
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < p->size; i++)
+    {
+        if (p->funcs[i].calls)
+            all[n++] = p->funcs[i];
+    }
+    qsort(all, n, sizeof(M4_FUNC_CYCLES), func_compare);
+    memcpy(out, all, (n < max ? n : max) * sizeof(M4_FUNC_CYCLES));
+    free(all);
+    return n;
+}
+
+#endif // USE_CYCLES
@@ -0,0 +1,444 @@
+#include "M4.h"
+#include "common.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define M4_ELF_MMAP 1
+#else
+#define M4_ELF_MMAP 0
+#endif
+
+/*
+    ELF32 (ARM, little-endian): зареждане на фърмуер и таблица на символите.
+
+    m4_image_open изобразява файла с mmap и подготвя образа веднъж: ROM сочи
+    директно във файла, ако сегментите за флаш паметта са на постоянно
+    отместване в него (обичайният случай), иначе се сглобява копие.
+    m4_image_load за всяко ядро само копира .data в RAM, нулира .bss и взима
+    SP и PC от векторната таблица.
+
+    От символите се използват само функциите (STT_FUNC), Thumb битът на
+    адресите им се изчиства.
+*/
+
+#define ELF_ET_EXEC 2
+#define ELF_EM_ARM 40
+#define ELF_PT_LOAD 1
+#define ELF_SHT_SYMTAB 2
+#define ELF_STT_FUNC 2
+
+// Сегмент, който се зарежда в RAM при всяко m4_image_load
+typedef struct
+{
+    uint32_t offset;
+    uint32_t addr;
+    uint32_t filesz;
+    uint32_t memsz;
+} M4_ELF_SEGMENT;
+
+struct M4_IMAGE_s
+{
+    const uint8_t *data; // Целият файл
+    uint32_t size;
+    int mapped;          // data е от mmap, иначе от malloc
+    uint8_t *rom;        // ROM от ROM_BASE: в data или в rom_copy
+    uint32_t rom_size;
+    uint8_t *rom_copy;
+    uint32_t entry;
+    M4_ELF_SEGMENT *ram; // Сегментите за RAM
+    uint32_t ram_count;
+    M4_SYMBOLS *syms;    // Създава се при първото m4_image_symbols
+};
+
+struct M4_SYMBOLS_s
+{
+    M4_SYMBOL *sym; // Подредени по адрес
+    uint32_t count;
+    char *names;
+};
+
+static uint32_t elf_16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t elf_32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Проверява заглавието; връща 0 за валиден ELF32 little-endian файл
+int m4_elf_check(const uint8_t *elf, uint32_t size)
+{
+    if (!elf || size < 52 || elf[0] != 0x7F || elf[1] != 'E' || elf[2] != 'L' || elf[3] != 'F')
+    {
+        PRINTF("[ERROR] ELF: Not an ELF file\n");
+        return -1;
+    }
+    if (elf[4] != 1 || elf[5] != 1)
+    {
+        PRINTF("[ERROR] ELF: Only 32-bit little-endian files are supported\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int symbol_compare(const void *a, const void *b)
+{
+    uint32_t x = ((const M4_SYMBOL *)a)->addr;
+    uint32_t y = ((const M4_SYMBOL *)b)->addr;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Чете функциите от .symtab. NULL при грешка или липса на символи.
+M4_SYMBOLS *m4_elf_symbols(const uint8_t *elf, uint32_t size)
+{
+    if (m4_elf_check(elf, size))
+        return NULL;
+
+    uint32_t shoff = elf_32(elf + 0x20);
+    uint32_t shentsize = elf_16(elf + 0x2E);
+    uint32_t shnum = elf_16(elf + 0x30);
+    if (shentsize < 40 || shoff > size || shnum > (size - shoff) / shentsize)
+    {
+        PRINTF("[ERROR] ELF: Invalid section table\n");
+        return NULL;
+    }
+
+    // Първата .symtab и свързаната с нея таблица с имена
+    const uint8_t *symtab = NULL, *strtab = NULL;
+    uint32_t sym_count = 0, str_size = 0;
+    for (uint32_t i = 0; i < shnum && !symtab; i++)
+    {
+        const uint8_t *sh = elf + shoff + i * shentsize;
+        if (elf_32(sh + 4) != ELF_SHT_SYMTAB)
+            continue;
+        uint32_t off = elf_32(sh + 16), len = elf_32(sh + 20), link = elf_32(sh + 24);
+        if (off > size || len > size - off || link >= shnum)
+            break;
+        const uint8_t *str = elf + shoff + link * shentsize;
+        uint32_t str_off = elf_32(str + 16);
+        str_size = elf_32(str + 20);
+        if (str_off > size || str_size > size - str_off)
+            break;
+        symtab = elf + off;
+        sym_count = len / 16;
+        strtab = elf + str_off;
+    }
+    if (!symtab)
+    {
+        PRINTF("[ERROR] ELF: No symbol table\n");
+        return NULL;
+    }
+
+    M4_SYMBOLS *syms = (M4_SYMBOLS *)calloc(1, sizeof(M4_SYMBOLS));
+    if (!syms || !(syms->sym = (M4_SYMBOL *)malloc((sym_count ? sym_count : 1) * sizeof(M4_SYMBOL))) ||
+        !(syms->names = (char *)malloc(str_size + 1)))
+    {
+        PRINTF("[ERROR] ELF: Out of memory\n");
+        m4_symbols_free(syms);
+        return NULL;
+    }
+    memcpy(syms->names, strtab, str_size);
+    syms->names[str_size] = 0; // Защита при неприключен последен низ
+
+    for (uint32_t i = 0; i < sym_count; i++)
+    {
+        const uint8_t *s = symtab + i * 16;
+        uint32_t name = elf_32(s);
+        if ((s[12] & 0xF) != ELF_STT_FUNC || elf_16(s + 14) == 0 || name >= str_size)
+            continue;
+        M4_SYMBOL *sym = &syms->sym[syms->count++];
+        sym->addr = elf_32(s + 4) & ~0x1;
+        sym->size = elf_32(s + 8);
+        sym->name = syms->names + name;
+    }
+    qsort(syms->sym, syms->count, sizeof(M4_SYMBOL), symbol_compare);
+    return syms;
+}
+
+// Функцията, която съдържа addr (или последната преди него, ако размерът е
+// 0). NULL, ако няма такава.
+const M4_SYMBOL *m4_symbol_find(const M4_SYMBOLS *syms, uint32_t addr)
+{
+    if (!syms || !syms->count || addr < syms->sym[0].addr)
+        return NULL;
+    uint32_t lo = 0, hi = syms->count; // sym[lo].addr <= addr < sym[hi].addr
+    while (hi - lo > 1)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (syms->sym[mid].addr <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const M4_SYMBOL *sym = &syms->sym[lo];
+    if (sym->size && addr - sym->addr >= sym->size)
+        return NULL;
+    return sym;
+}
+
+// Име за отчетите: символът или адресът в шестнадесетичен вид
+const char *m4_symbol_name(const M4_SYMBOLS *syms, uint32_t addr, char *buf, uint32_t size)
+{
+    const M4_SYMBOL *sym = m4_symbol_find(syms, addr);
+    if (sym)
+        return sym->name;
+    snprintf(buf, size, "0x%08X", addr);
+    return buf;
+}
+
+void m4_symbols_free(M4_SYMBOLS *syms)
+{
+    if (!syms)
+        return;
+    free(syms->sym);
+    free(syms->names);
+    free(syms);
+}
+
+///////////////////////////////////////////////////////////
+
+// Адресът е в ROM областта (под RAM_BASE)
+static int elf_in_rom(uint32_t addr, uint32_t size)
+{
+    return addr - ROM_BASE < RAM_BASE - ROM_BASE && size <= RAM_BASE - addr;
+}
+
+// Подготвя ROM и списъка сегменти за RAM от програмните заглавия
+static int image_segments(M4_IMAGE *img)
+{
+    const uint8_t *elf = img->data;
+    uint32_t phoff = elf_32(elf + 0x1C);
+    uint32_t phentsize = elf_16(elf + 0x2A);
+    uint32_t phnum = elf_16(elf + 0x2C);
+    if (phentsize < 32 || phoff > img->size || phnum > (img->size - phoff) / phentsize)
+    {
+        PRINTF("[ERROR] ELF: Invalid program header table\n");
+        return -1;
+    }
+    img->ram = (M4_ELF_SEGMENT *)calloc(phnum ? phnum : 1, sizeof(M4_ELF_SEGMENT));
+    if (!img->ram)
+    {
+        PRINTF("[ERROR] ELF: Out of memory\n");
+        return -1;
+    }
+
+    // ROM: файловото съдържание на всички сегменти, чийто адрес за зареждане
+    // (p_paddr) е във флаш паметта, вкл. началните стойности на .data
+    int direct = 1;
+    int64_t delta = -1;
+    for (uint32_t i = 0; i < phnum; i++)
+    {
+        const uint8_t *ph = elf + phoff + i * phentsize;
+        if (elf_32(ph) != ELF_PT_LOAD)
+            continue;
+        uint32_t offset = elf_32(ph + 4), vaddr = elf_32(ph + 8), paddr = elf_32(ph + 12);
+        uint32_t filesz = elf_32(ph + 16), memsz = elf_32(ph + 20);
+        if (offset > img->size || filesz > img->size - offset || filesz > memsz)
+        {
+            PRINTF("[ERROR] ELF: Segment %u is outside the file\n", i);
+            return -1;
+        }
+
+        if (filesz && elf_in_rom(paddr, filesz))
+        {
+            uint32_t end = paddr - ROM_BASE + filesz;
+            if (end > img->rom_size)
+                img->rom_size = end;
+            int64_t d = (int64_t)offset - (paddr - ROM_BASE);
+            if (d < 0 || (delta >= 0 && d != delta))
+                direct = 0;
+            delta = d;
+        }
+        if (!elf_in_rom(vaddr, memsz))
+        {
+            // Сегмент в RAM; границите се проверяват при зареждане
+            M4_ELF_SEGMENT *seg = &img->ram[img->ram_count++];
+            seg->offset = offset;
+            seg->addr = vaddr;
+            seg->filesz = filesz;
+            seg->memsz = memsz;
+        }
+    }
+    if (!img->rom_size)
+    {
+        PRINTF("[ERROR] ELF: No segments in ROM\n");
+        return -1;
+    }
+
+    if (direct && (uint64_t)delta + img->rom_size <= img->size)
+    {
+        img->rom = (uint8_t *)img->data + delta; // Само за четене: в ROM не се пише
+        return 0;
+    }
+
+    // Сегментите не са подредени във файла както в паметта: копие
+    img->rom_copy = (uint8_t *)malloc(img->rom_size);
+    if (!img->rom_copy)
+    {
+        PRINTF("[ERROR] ELF: Out of memory\n");
+        return -1;
+    }
+    memset(img->rom_copy, 0xFF, img->rom_size); // Изтрита флаш памет
+    for (uint32_t i = 0; i < phnum; i++)
+    {
+        const uint8_t *ph = elf + phoff + i * phentsize;
+        uint32_t paddr = elf_32(ph + 12), filesz = elf_32(ph + 16);
+        if (elf_32(ph) == ELF_PT_LOAD && filesz && elf_in_rom(paddr, filesz))
+            memcpy(img->rom_copy + (paddr - ROM_BASE), elf + elf_32(ph + 4), filesz);
+    }
+    img->rom = img->rom_copy;
+    return 0;
+}
+
+// Отваря ELF файл за зареждане в едно или много ядра
+M4_IMAGE *m4_image_open(const char *path)
+{
+    M4_IMAGE *img = (M4_IMAGE *)calloc(1, sizeof(M4_IMAGE));
+    if (!img)
+    {
+        PRINTF("[ERROR] m4_image_open: Out of memory\n");
+        return NULL;
+    }
+
+#if M4_ELF_MMAP
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= 0xFFFFFFFF)
+    {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            img->data = (const uint8_t *)p;
+            img->size = (uint32_t)st.st_size;
+            img->mapped = 1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#else
+    FILE *f = fopen(path, "rb");
+    if (f)
+    {
+        fseek(f, 0, SEEK_END);
+        long len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        uint8_t *data = (len > 0) ? (uint8_t *)malloc(len) : NULL;
+        if (data && fread(data, 1, len, f) == (size_t)len)
+        {
+            img->data = data;
+            img->size = (uint32_t)len;
+        }
+        else
+            free(data);
+        fclose(f);
+    }
+#endif
+    if (!img->data)
+    {
+        PRINTF("[ERROR] m4_image_open: Cannot read %s\n", path);
+        free(img);
+        return NULL;
+    }
+
+    if (m4_elf_check(img->data, img->size))
+    {
+        m4_image_close(img);
+        return NULL;
+    }
+    if (elf_16(img->data + 0x10) != ELF_ET_EXEC || elf_16(img->data + 0x12) != ELF_EM_ARM)
+    {
+        PRINTF("[ERROR] m4_image_open: %s is not an ARM executable\n", path);
+        m4_image_close(img);
+        return NULL;
+    }
+    img->entry = elf_32(img->data + 0x18) & ~0x1;
+    if (image_segments(img))
+    {
+        m4_image_close(img);
+        return NULL;
+    }
+    return img;
+}
+
+// Зарежда образа в ядрото: ROM сочи образа (споделен, само за четене), RAM
+// (cpu->RAM, зададен от извикващия) получава .data и нулирана .bss.
+// Регистрите се нулират, SP и PC се взимат от векторната таблица.
+// След това, както при m4_create, се извикват m4_mem_init и m4_icache_init.
+int m4_image_load(CortexM4 *cpu, const M4_IMAGE *img)
+{
+    for (uint32_t i = 0; i < img->ram_count; i++)
+    {
+        const M4_ELF_SEGMENT *seg = &img->ram[i];
+        uint32_t offset = seg->addr - RAM_BASE;
+        if (offset > cpu->RAM_SIZE || seg->memsz > cpu->RAM_SIZE - offset || (seg->memsz && !cpu->RAM))
+        {
+            PRINTF("[ERROR] m4_image_load: Segment 0x%08X-0x%08X is outside RAM\n", seg->addr, seg->addr + seg->memsz);
+            RETURN_ERROR(-1);
+        }
+    }
+
+    cpu->ROM = img->rom;
+    cpu->ROM_SIZE = img->rom_size;
+    for (uint32_t i = 0; i < img->ram_count; i++)
+    {
+        const M4_ELF_SEGMENT *seg = &img->ram[i];
+        uint8_t *dst = cpu->RAM + (seg->addr - RAM_BASE);
+        memcpy(dst, img->data + seg->offset, seg->filesz);
+        memset(dst + seg->filesz, 0, seg->memsz - seg->filesz); // .bss
+    }
+
+    m4_reset_core(cpu);
+#if USE_EVENTS
+    m4_systick_reset(cpu); // Събитията на периферията остават
+#endif
+    if (img->rom_size >= 8)
+    {
+        // Векторна таблица: [0] = начален SP, [1] = Reset handler
+        cpu->REG.SP = elf_32(img->rom);
+        cpu->REG.PC = elf_32(img->rom + 4) & ~0x1;
+    }
+    else
+    {
+        cpu->REG.PC = img->entry;
+    }
+
+    RETURN_ERROR(0);
+}
+
+// Символите на образа; създават се при първото извикване
+const M4_SYMBOLS *m4_image_symbols(M4_IMAGE *img)
+{
+    if (!img->syms)
+        img->syms = m4_elf_symbols(img->data, img->size);
+    return img->syms;
+}
+
+// ROM на образа, напр. за M4_BATCH.rom
+const uint8_t *m4_image_rom(const M4_IMAGE *img, uint32_t *size)
+{
+    *size = img->rom_size;
+    return img->rom;
+}
+
+void m4_image_close(M4_IMAGE *img)
+{
+    if (!img)
+        return;
+#if M4_ELF_MMAP
+    if (img->mapped)
+        munmap((void *)img->data, img->size);
+    else
+        free((void *)img->data);
+#else
+    free((void *)img->data);
+#endif
+    free(img->rom_copy);
+    free(img->ram);
+    m4_symbols_free(img->syms);
+    free(img);
+}
@@ -0,0 +1,330 @@
+#include "M4.h"
+#include "common.h"
+
+#if USE_EVENTS
+
+/*
+    Планировчик на събития и SysTick.
+
+    Периферията не се проверява след всяка инструкция. Вместо това тя
+    планира събитие за абсолютен такт (cpu->cycles), в който състоянието й
+    ще се промени - изтичане на таймер, край на предаване по UART и т.н.
+    Събитията са подредени по такт, а циклите на изпълнение сравняват
+    cpu->cycles само с event_next (тактът на първото събитие) и извикват
+    m4_events_run, когато той бъде достигнат.
+
+    Събитието се определя от двойката (fn, ctx): повторно планиране на
+    същата двойка го премества, вместо да добавя второ.
+*/
+
+#define SYST_CSR 0x0
+#define SYST_RVR 0x4
+#define SYST_CVR 0x8
+#define SYST_CALIB 0xC
+
+#define SYST_CSR_WRITABLE (M4_SYST_ENABLE | M4_SYST_TICKINT)
+#define EVENT_NEVER UINT64_MAX
+
+static void events_changed(CortexM4 *cpu)
+{
+    cpu->event_next = cpu->event_count ? cpu->events[0].when : EVENT_NEVER;
+}
+
+static int event_find(const CortexM4 *cpu, M4_EVENT_FN fn, void *ctx)
+{
+    for (uint32_t i = 0; i < cpu->event_count; i++)
+    {
+        if (cpu->events[i].fn == fn && cpu->events[i].ctx == ctx)
+            return (int)i;
+    }
+    return -1;
+}
+
+static void event_remove(CortexM4 *cpu, uint32_t i)
+{
+    cpu->event_count--;
+    memmove(&cpu->events[i], &cpu->events[i + 1], (cpu->event_count - i) * sizeof(M4_EVENT));
+}
+
+// Планира fn(cpu, ctx) за такт when. Такт, който вече е минал, се изпълнява
+// преди следващата инструкция.
+int m4_event_schedule(CortexM4 *cpu, uint64_t when, M4_EVENT_FN fn, void *ctx)
+{
+    if (!fn)
+    {
+        PRINTF("[ERROR] m4_event_schedule: Invalid Parameter\n");
+        return -1;
+    }
+    int old = event_find(cpu, fn, ctx);
+    if (old >= 0)
+        event_remove(cpu, (uint32_t)old);
+    else if (cpu->event_count >= M4_MAX_EVENTS)
+    {
+        PRINTF("[ERROR] m4_event_schedule: Too many events\n");
+        return -1;
+    }
+
+    // Събития с еднакъв такт се изпълняват в реда на планиране
+    uint32_t i = cpu->event_count;
+    while (i && cpu->events[i - 1].when > when)
+    {
+        cpu->events[i] = cpu->events[i - 1];
+        i--;
+    }
+    cpu->events[i].when = when;
+    cpu->events[i].fn = fn;
+    cpu->events[i].ctx = ctx;
+    cpu->event_count++;
+    events_changed(cpu);
+    return 0;
+}
+
+// Премахва планираното събитие (fn, ctx). Връща -1, ако няма такова.
+int m4_event_cancel(CortexM4 *cpu, M4_EVENT_FN fn, void *ctx)
+{
+    int i = event_find(cpu, fn, ctx);
+    if (i < 0)
+        return -1;
+    event_remove(cpu, (uint32_t)i);
+    events_changed(cpu);
+    return 0;
+}
+
+// Изпълнява всички събития до текущия такт. Събитие може да планира друго
+// (или себе си) - ако и то е настъпило, се изпълнява в същото извикване.
+void m4_events_run(CortexM4 *cpu)
+{
+    while (cpu->event_count && cpu->events[0].when <= cpu->cycles)
+    {
+        M4_EVENT e = cpu->events[0];
+        event_remove(cpu, 0);
+        events_changed(cpu);
+        e.fn(cpu, e.ctx);
+    }
+    events_changed(cpu);
+}
+
+// WFI/WFE: прескача тактовете до следващото събитие, вместо да ги
+// изпълнява, докато някое от тях не постави прекъсване в очакване. След
+// M4_SLEEP_EVENTS събития без прекъсване ядрото се събужда само -
+// WFI може да завърши и без причина, а иначе самопланиращо се събитие
+// (SysTick без TICKINT) би зациклило тук.
+void m4_events_sleep(CortexM4 *cpu)
+{
+    for (int n = 0; n < M4_SLEEP_EVENTS && cpu->event_count; n++)
+    {
+        if (cpu->cycles < cpu->event_next)
+        {
+            cpu->sleep_cycles += cpu->event_next - cpu->cycles;
+            cpu->cycles = cpu->event_next;
+        }
+        m4_events_run(cpu);
+#if USE_NVIC
+        if (cpu->nvic.pending)
+            break;
+#else
+        break; // Без NVIC събуждането е след всяко събитие
+#endif
+    }
+}
+
+// Блокът от len инструкции от адрес pc е цикъл на изчакване: завършва с
+// условен преход към началото си, не пише в паметта и всяка итерация
+// изчислява едно и също от едни и същи прочетени стойности - регистър или
+// флаг, който се чете, преди да е записан в итерацията, не се променя в нея.
+int m4_poll_block(const M4_DECODED *d, uint32_t len, uint32_t pc)
+{
+    uint32_t start = pc;
+    uint32_t inputs = 0;
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < len; i++, d++, pc += 2)
+    {
+        uint32_t reads;
+        uint32_t writes;
+        if (d->size != 2)
+            return 0;
+        int kind = m4_poll_16(d, &reads, &writes);
+        if (kind < 0 || (kind == 1) != (i == len - 1))
+            return 0;
+        if (kind == 1 && pc + 4 + d->imm != start)
+            return 0;
+        inputs |= reads & ~written;
+        written |= writes;
+    }
+    return !(inputs & written);
+}
+
+// Итерацията на цикъла на изчакване (iteration такта, len инструкции) не
+// го е напуснала. Без промяна в паметта следващите итерации ще направят
+// същото, а паметта се променя само от събитие - прескачат се всички
+// итерации до него.
+void m4_events_poll(CortexM4 *cpu, uint64_t iteration, uint32_t len)
+{
+    if (cpu->poll_volatile || !iteration || cpu->event_next == EVENT_NEVER || cpu->cycles >= cpu->event_next)
+        return; // Без събития цикълът е безкраен и се изпълнява до лимита
+#if USE_NVIC
+    if (cpu->nvic.next)
+        return;
+#endif
+    uint64_t n = (cpu->event_next - cpu->cycles + iteration - 1) / iteration;
+    cpu->cycles += n * iteration;
+    cpu->poll_elided += n * len;
+}
+
+// Премахва всички събития и нулира SysTick
+void m4_events_reset(CortexM4 *cpu)
+{
+    cpu->event_count = 0;
+    events_changed(cpu);
+    m4_systick_reset(cpu);
+}
+
+///////////////////////////////////////////////////////////
+
+/*
+    SysTick (ARMv7-M ARM, B3.3): 24-битов брояч надолу с тактовата честота
+    на ядрото. Броячът не се намалява на всеки такт - пази се тактът, в
+    който той достига 0, и стойността се изчислява при четене. Там е
+    планирано събитие, което вдига COUNTFLAG, поставя SysTick в очакване
+    (TICKINT) и планира следващото достигане на 0 след RVR + 1 такта.
+*/
+
+static void systick_event(CortexM4 *cpu, void *ctx);
+
+// Стартира броенето от стойност value (0: презарежда се на следващия такт)
+static void systick_start(CortexM4 *cpu, uint32_t value)
+{
+    M4_SYSTICK *st = &cpu->systick;
+    st->value = value;
+    if (value)
+        st->zero = cpu->cycles + value;
+    else if (st->RVR)
+        st->zero = cpu->cycles + 1 + st->RVR;
+    else
+        st->zero = EVENT_NEVER; // RVR = 0: броячът остава на 0
+
+    if (st->zero != EVENT_NEVER)
+        m4_event_schedule(cpu, st->zero, systick_event, NULL);
+    else
+        m4_event_cancel(cpu, systick_event, NULL);
+}
+
+static void systick_event(CortexM4 *cpu, void *ctx)
+{
+    (void)ctx;
+    M4_SYSTICK *st = &cpu->systick;
+    st->CSR |= M4_SYST_COUNTFLAG;
+#if USE_NVIC
+    if (st->CSR & M4_SYST_TICKINT)
+        m4_exception_pend(cpu, M4_EXC_SYSTICK);
+#endif
+    if (!st->RVR)
+    {
+        st->value = 0;
+        st->zero = EVENT_NEVER;
+        return;
+    }
+    // Пропуснатите периоди (събитието е закъсняло) само поддържат COUNTFLAG
+    uint64_t period = (uint64_t)st->RVR + 1;
+    st->zero += period * ((cpu->cycles - st->zero) / period + 1);
+    m4_event_schedule(cpu, st->zero, systick_event, NULL);
+}
+
+// Спира и нулира SysTick; останалите събития не се променят
+void m4_systick_reset(CortexM4 *cpu)
+{
+    m4_event_cancel(cpu, systick_event, NULL);
+    memset(&cpu->systick, 0, sizeof(cpu->systick));
+    cpu->systick.zero = EVENT_NEVER;
+}
+
+// Текуща стойност на брояча (SYST_CVR)
+static uint32_t systick_current(const CortexM4 *cpu)
+{
+    const M4_SYSTICK *st = &cpu->systick;
+    if (!(st->CSR & M4_SYST_ENABLE) || st->zero == EVENT_NEVER)
+        return st->value;
+    // В такта на достигане на 0 събитието вече е преместило zero с период
+    // напред: броячът е 0, а не RVR + 1
+    uint64_t left = st->zero - cpu->cycles;
+    if (left == (uint64_t)st->RVR + 1)
+        return 0;
+    return (uint32_t)left & 0xFFFFFF;
+}
+
+uint32_t m4_systick_read(CortexM4 *cpu, uint32_t address, uint32_t size, int *result)
+{
+    M4_SYSTICK *st = &cpu->systick;
+    uint32_t offset = address - M4_SYST_BASE;
+    *result = 0;
+    if (size != 4 || (offset & 0x3))
+        return 0;
+    if (cpu->cycles >= cpu->event_next)
+        m4_events_run(cpu);
+
+    switch (offset)
+    {
+    case SYST_CSR:
+    {
+        uint32_t value = st->CSR | M4_SYST_CLKSOURCE;
+        st->CSR &= ~M4_SYST_COUNTFLAG; // Четенето нулира COUNTFLAG
+        return value;
+    }
+    case SYST_RVR:
+        return st->RVR;
+    case SYST_CVR:
+        cpu->poll_volatile = 1; // Променя се на всеки такт
+        return systick_current(cpu);
+    default:
+        return 1u << 31; // SYST_CALIB: NOREF, само тактът на ядрото
+    }
+}
+
+int m4_systick_write(CortexM4 *cpu, uint32_t address, uint32_t data, uint32_t size)
+{
+    M4_SYSTICK *st = &cpu->systick;
+    uint32_t offset = address - M4_SYST_BASE;
+    if (size != 4 || (offset & 0x3))
+        return 0;
+    if (cpu->cycles >= cpu->event_next)
+        m4_events_run(cpu);
+
+    switch (offset)
+    {
+    case SYST_CSR:
+    {
+        uint32_t enable = data & M4_SYST_ENABLE;
+        uint32_t value = systick_current(cpu);
+        st->CSR = (st->CSR & ~SYST_CSR_WRITABLE) | (data & SYST_CSR_WRITABLE);
+        if (enable && st->zero == EVENT_NEVER)
+            systick_start(cpu, value);
+        else if (!enable && st->zero != EVENT_NEVER)
+        {
+            st->value = value; // Броячът спира на текущата стойност
+            st->zero = EVENT_NEVER;
+            m4_event_cancel(cpu, systick_event, NULL);
+        }
+        break;
+    }
+    case SYST_RVR:
+        // Новата стойност се взима при следващото презареждане; ако броячът
+        // е стоял на 0 (RVR = 0), то е на следващия такт
+        st->RVR = data & 0xFFFFFF;
+        if ((st->CSR & M4_SYST_ENABLE) && st->zero == EVENT_NEVER)
+            systick_start(cpu, 0);
+        break;
+    case SYST_CVR:
+        // Всеки запис нулира брояча и COUNTFLAG
+        st->CSR &= ~M4_SYST_COUNTFLAG;
+        if (st->CSR & M4_SYST_ENABLE)
+            systick_start(cpu, 0);
+        else
+            st->value = 0;
+        break;
+    default:
+        break; // SYST_CALIB е само за четене
+    }
+    return 0;
+}
+
+#endif // USE_EVENTS
@@ -0,0 +1,740 @@
+// ARMv7-M / Cortex M4F / JIT за x86-64 на горещи основни блокове
+
+#include "M4.h"
+#include "common.h"
+
+#if USE_JIT
+
+#if !defined(__x86_64__)
+#error "USE_JIT requires an x86-64 host"
+#endif
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+/*
+    Компилира се най-дългият префикс на блока, съставен от инструкции само
+    с регистри (групи 0, 1, 2 без шифт по регистър, ADD/SUB спрямо SP/PC),
+    плюс завършващ B / B{<cond>}. Всичко останало (памет, BX/BLX, POP,
+    32-битови инструкции) остава за интерпретатора.
+
+    Регистри на хоста по време на блока:
+        rdi         -> CortexM4 (cpu)
+        rsi         -> флагове N, Z, C, V (по един байт)
+        r8d..r15d   -> R0..R7
+        eax, ecx    -> временни
+    Функцията връща броя изпълнени инструкции и записва PC.
+*/
+
+#define JIT_CODE_SIZE (1024 * 1024)
+#define JIT_THRESHOLD 16        // Изпълнения на блок преди компилиране
+#define JIT_FAILED ((void *)1) // Блокът не може да се компилира
+
+#define HOST_EAX 0
+#define HOST_ECX 1
+#define HOST_GUEST(r) (8 + (r)) // R0..R7 -> r8d..r15d
+
+// Отмествания на флаговете в масива, подаден в rsi
+#define FLAG_N 0
+#define FLAG_Z 1
+#define FLAG_C 2
+#define FLAG_V 3
+
+// Кодове за условие на x86 (Jcc / SETcc)
+#define CC_O 0x0
+#define CC_NO 0x1
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define CC_S 0x8
+#define CC_NS 0x9
+#define CC_L 0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G 0xF
+
+// Състояние на флаговете на хоста спрямо NZCV
+#define HOST_FLAGS_NONE 0 // EFLAGS не отговарят на NZCV
+#define HOST_FLAGS_SUB 1  // След SUB/CMP: CF = !C
+#define HOST_FLAGS_ADD 2  // След ADD: CF = C
+
+typedef uint32_t (*M4_JIT_FN)(CortexM4 *cpu, uint8_t *flags);
+
+typedef struct
+{
+    void *code;
+    uint32_t hits;
+#if USE_EVENTS
+    uint32_t cycles; // Горна граница на тактовете на блока
+#endif
+} M4_JIT_ENTRY;
+
+typedef struct M4_JIT_s
+{
+    int mode;
+    uint8_t *buf;
+    uint32_t used;
+    M4_JIT_ENTRY *entry; // Един запис на всяко полуслово от ROM
+    uint32_t mismatches;
+} M4_JIT;
+
+typedef struct
+{
+    uint8_t *p;
+    uint8_t *end;
+    uint32_t written; // Маска на променените R0..R7
+    int host_flags;
+} EMITTER;
+
+// Условие на ARM (EQ..LE) -> Jcc при CF = !C
+static const uint8_t arm_to_x86_cc[14] = {
+    CC_E, CC_NE, CC_AE, CC_B, CC_S, CC_NS, CC_O, CC_NO, CC_A, CC_BE, CC_GE, CC_L, CC_G, CC_LE};
+
+#define REG_OFFSET(r) ((int32_t)(offsetof(CortexM4, REG) + (r) * sizeof(uint32_t)))
+
+// EMIT ///////////////////////////////
+
+static void emit8(EMITTER *e, uint8_t b)
+{
+    if (e->p < e->end)
+        *e->p = b;
+    e->p++;
+}
+
+static void emit32(EMITTER *e, uint32_t v)
+{
+    emit8(e, v);
+    emit8(e, v >> 8);
+    emit8(e, v >> 16);
+    emit8(e, v >> 24);
+}
+
+static void emit_rex(EMITTER *e, int reg, int rm)
+{
+    if (reg >= 8 || rm >= 8)
+        emit8(e, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// <op> rm, reg (32 бита, регистър-регистър)
+static void emit_rr(EMITTER *e, uint8_t op, int reg, int rm)
+{
+    emit_rex(e, reg, rm);
+    emit8(e, op);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// <op> reg, [rdi + disp32] / [rdi + disp32], reg
+static void emit_rdi(EMITTER *e, uint8_t op, int reg, int32_t disp)
+{
+    emit_rex(e, reg, 0);
+    emit8(e, op);
+    emit8(e, 0x80 | ((reg & 7) << 3) | 7);
+    emit32(e, disp);
+}
+
+static void emit_mov_imm(EMITTER *e, int reg, uint32_t imm)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0xB8 + (reg & 7));
+    emit32(e, imm);
+}
+
+// Група 81 /ext: add 0, or 1, and 4, sub 5, xor 6, cmp 7
+static void emit_alu_imm(EMITTER *e, int ext, int reg, uint32_t imm)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0x81);
+    emit8(e, 0xC0 | (ext << 3) | (reg & 7));
+    emit32(e, imm);
+}
+
+// Група C1 /ext ib: shl 4, shr 5, sar 7
+static void emit_shift_imm(EMITTER *e, int ext, int reg, uint8_t imm)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0xC1);
+    emit8(e, 0xC0 | (ext << 3) | (reg & 7));
+    emit8(e, imm);
+}
+
+// Група F7 /ext: not 2, neg 3
+static void emit_unary(EMITTER *e, int ext, int reg)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0xF7);
+    emit8(e, 0xC0 | (ext << 3) | (reg & 7));
+}
+
+static void emit_imul(EMITTER *e, int dst, int src)
+{
+    emit_rex(e, dst, src);
+    emit8(e, 0x0F);
+    emit8(e, 0xAF);
+    emit8(e, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// setcc byte [rsi + flag]
+static void emit_setcc(EMITTER *e, uint8_t cc, int flag)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x90 | cc);
+    emit8(e, 0x46);
+    emit8(e, flag);
+}
+
+// mov byte [rsi + flag], imm8
+static void emit_set_flag(EMITTER *e, int flag, uint8_t value)
+{
+    emit8(e, 0xC6);
+    emit8(e, 0x46);
+    emit8(e, flag);
+    emit8(e, value);
+}
+
+// movzx reg, byte [rsi + flag]
+static void emit_load_flag(EMITTER *e, int reg, int flag)
+{
+    emit_rex(e, reg, 0);
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit8(e, 0x46 | ((reg & 7) << 3));
+    emit8(e, flag);
+}
+
+// Четене на регистър на госта в регистър на хоста
+static void emit_read(EMITTER *e, int host, int guest)
+{
+    if (guest < 8)
+        emit_rr(e, 0x89, HOST_GUEST(guest), host); // mov host, rN
+    else
+        emit_rdi(e, 0x8B, host, REG_OFFSET(guest)); // mov host, [rdi + r]
+}
+
+// Като emit_read, но PC е константата адрес + 4 (ADD/MOV Rd, PC)
+static void emit_read_hi(EMITTER *e, int host, int guest, uint32_t pc)
+{
+    if (guest == 15)
+        emit_mov_imm(e, host, pc + 4);
+    else
+        emit_read(e, host, guest);
+}
+
+// Запис от регистър на хоста в регистър на госта
+static void emit_write(EMITTER *e, int guest, int host)
+{
+    if (guest < 8)
+    {
+        emit_rr(e, 0x89, host, HOST_GUEST(guest));
+        e->written |= 1u << guest;
+    }
+    else
+    {
+        emit_rdi(e, 0x89, host, REG_OFFSET(guest));
+    }
+}
+
+// Флагове след SUB/CMP (C = няма заем)
+static void emit_flags_sub(EMITTER *e)
+{
+    emit_setcc(e, CC_S, FLAG_N);
+    emit_setcc(e, CC_E, FLAG_Z);
+    emit_setcc(e, CC_AE, FLAG_C);
+    emit_setcc(e, CC_O, FLAG_V);
+    e->host_flags = HOST_FLAGS_SUB;
+}
+
+// Флагове след ADD
+static void emit_flags_add(EMITTER *e)
+{
+    emit_setcc(e, CC_S, FLAG_N);
+    emit_setcc(e, CC_E, FLAG_Z);
+    emit_setcc(e, CC_B, FLAG_C);
+    emit_setcc(e, CC_O, FLAG_V);
+    e->host_flags = HOST_FLAGS_ADD;
+}
+
+static void emit_prologue(EMITTER *e)
+{
+    for (int r = 12; r <= 15; r++) // push r12..r15 (callee-saved)
+    {
+        emit8(e, 0x41);
+        emit8(e, 0x50 + (r & 7));
+    }
+    for (int g = 0; g < 8; g++)
+        emit_rdi(e, 0x8B, HOST_GUEST(g), REG_OFFSET(g));
+}
+
+static void emit_epilogue(EMITTER *e, uint32_t pc, uint32_t count)
+{
+    emit8(e, 0xC7); // mov dword [rdi + PC], imm32
+    emit8(e, 0x87);
+    emit32(e, REG_OFFSET(15));
+    emit32(e, pc);
+    for (int g = 0; g < 8; g++)
+        if (e->written & (1u << g))
+            emit_rdi(e, 0x89, HOST_GUEST(g), REG_OFFSET(g));
+    for (int r = 15; r >= 12; r--)
+    {
+        emit8(e, 0x41);
+        emit8(e, 0x58 + (r & 7));
+    }
+    emit_mov_imm(e, HOST_EAX, count);
+    emit8(e, 0xC3); // ret
+}
+
+// Възстановява EFLAGS от байтовете NZCV (CF = !C)
+static void emit_restore_host_flags(EMITTER *e)
+{
+    emit_load_flag(e, HOST_EAX, FLAG_N);
+    emit_shift_imm(e, 4, HOST_EAX, 7); // SF
+    emit_load_flag(e, HOST_ECX, FLAG_Z);
+    emit_shift_imm(e, 4, HOST_ECX, 6); // ZF
+    emit_rr(e, 0x09, HOST_ECX, HOST_EAX);
+    emit_load_flag(e, HOST_ECX, FLAG_C);
+    emit_alu_imm(e, 6, HOST_ECX, 1); // CF = !C
+    emit_rr(e, 0x09, HOST_ECX, HOST_EAX);
+    emit_load_flag(e, HOST_ECX, FLAG_V);
+    emit_shift_imm(e, 4, HOST_ECX, 11); // OF
+    emit_rr(e, 0x09, HOST_ECX, HOST_EAX);
+    emit8(e, 0x50); // push rax
+    emit8(e, 0x9D); // popfq
+    e->host_flags = HOST_FLAGS_SUB;
+}
+
+// COMPILE ////////////////////////////
+
+// Компилира една инструкция. Връща 1 при успех, 0 ако не се поддържа.
+static int compile_16(EMITTER *e, uint32_t op, uint32_t pc)
+{
+    switch (op >> 13)
+    {
+    case 0: // LSLS/LSRS/ASRS imm, ADDS/SUBS reg/imm3
+    {
+        int rd = op & 0x7, rn = (op >> 3) & 0x7;
+        if (op >> 11 == 3)
+        {
+            emit_read(e, HOST_EAX, rn);
+            if (op & 0x400)
+                emit_alu_imm(e, (op & 0x200) ? 5 : 0, HOST_EAX, (op >> 6) & 0x7);
+            else
+                emit_rr(e, (op & 0x200) ? 0x29 : 0x01, HOST_GUEST((op >> 6) & 0x7), HOST_EAX);
+            emit_write(e, rd, HOST_EAX);
+            if (op & 0x200)
+                emit_flags_sub(e);
+            else
+                emit_flags_add(e);
+            return 1;
+        }
+        static const int ext[3] = {4, 5, 7};
+        uint8_t imm5 = (op >> 6) & 0x1F;
+        if (!imm5 && (op >> 11))
+            return 0; // LSR #32, ASR #32
+        emit_read(e, HOST_EAX, rn);
+        if (imm5)
+        {
+            emit_shift_imm(e, ext[(op >> 11) & 0x3], HOST_EAX, imm5);
+            emit_setcc(e, CC_B, FLAG_C); // Последният изнесен бит
+        }
+        else
+        {
+            emit_rr(e, 0x85, HOST_EAX, HOST_EAX); // MOVS: C остава
+        }
+        emit_setcc(e, CC_S, FLAG_N);
+        emit_setcc(e, CC_E, FLAG_Z);
+        emit_write(e, rd, HOST_EAX);
+        e->host_flags = HOST_FLAGS_NONE;
+        return 1;
+    }
+    case 1: // MOV/CMP/ADD/SUB imm8
+    {
+        int rd = (op >> 8) & 0x7;
+        uint32_t imm8 = op & 0xFF;
+        switch ((op >> 11) & 0x3)
+        {
+        case 0: // MOV: Z = (imm8 == 0), N = 0
+            emit_mov_imm(e, HOST_GUEST(rd), imm8);
+            e->written |= 1u << rd;
+            emit_set_flag(e, FLAG_Z, imm8 == 0);
+            emit_set_flag(e, FLAG_N, 0);
+            e->host_flags = HOST_FLAGS_NONE;
+            return 1;
+        case 1: // CMP
+            emit_alu_imm(e, 7, HOST_GUEST(rd), imm8);
+            emit_flags_sub(e);
+            return 1;
+        case 2: // ADD
+            emit_alu_imm(e, 0, HOST_GUEST(rd), imm8);
+            e->written |= 1u << rd;
+            emit_flags_add(e);
+            return 1;
+        default: // SUB
+            emit_alu_imm(e, 5, HOST_GUEST(rd), imm8);
+            e->written |= 1u << rd;
+            emit_flags_sub(e);
+            return 1;
+        }
+    }
+    case 2:
+    {
+        if ((op >> 10) == 0x10) // ANDS..MVNS, TST, CMP, CMN
+        {
+            int rd = op & 0x7, rm = (op >> 3) & 0x7;
+            int hd = HOST_GUEST(rd), hm = HOST_GUEST(rm);
+            switch ((op >> 6) & 0xF)
+            {
+            case 0x0: // AND
+                emit_rr(e, 0x21, hm, hd);
+                break;
+            case 0x1: // EOR
+                emit_rr(e, 0x31, hm, hd);
+                break;
+            case 0x5: // ADC: CF = C, adc Rd, Rm
+                emit_load_flag(e, HOST_EAX, FLAG_C);
+                emit_alu_imm(e, 0, HOST_EAX, 0xFFFFFFFF);
+                emit_rr(e, 0x11, hm, hd);
+                e->written |= 1u << rd;
+                emit_flags_add(e);
+                return 1;
+            case 0x6: // SBC: CF = !C, sbb Rd, Rm
+                emit_load_flag(e, HOST_EAX, FLAG_C);
+                emit_alu_imm(e, 5, HOST_EAX, 1);
+                emit_rr(e, 0x19, hm, hd);
+                e->written |= 1u << rd;
+                emit_flags_sub(e);
+                return 1;
+            case 0x8: // TST
+                emit_rr(e, 0x85, hm, hd);
+                emit_setcc(e, CC_S, FLAG_N);
+                emit_setcc(e, CC_E, FLAG_Z);
+                e->host_flags = HOST_FLAGS_NONE;
+                return 1;
+            case 0x9: // NEG
+                emit_rr(e, 0x89, hm, HOST_EAX);
+                emit_unary(e, 3, HOST_EAX);
+                emit_rr(e, 0x89, HOST_EAX, hd);
+                e->written |= 1u << rd;
+                emit_flags_sub(e);
+                return 1;
+            case 0xA: // CMP
+                emit_rr(e, 0x39, hm, hd);
+                emit_flags_sub(e);
+                return 1;
+            case 0xB: // CMN
+                emit_rr(e, 0x89, hd, HOST_EAX);
+                emit_rr(e, 0x01, hm, HOST_EAX);
+                emit_flags_add(e);
+                return 1;
+            case 0xC: // ORR
+                emit_rr(e, 0x09, hm, hd);
+                break;
+            case 0xD: // MUL: флаговете на imul не са N и Z
+                emit_imul(e, hd, hm);
+                emit_rr(e, 0x85, hd, hd);
+                break;
+            case 0xE: // BIC
+                emit_rr(e, 0x89, hm, HOST_EAX);
+                emit_unary(e, 2, HOST_EAX);
+                emit_rr(e, 0x21, HOST_EAX, hd);
+                break;
+            case 0xF: // MVN: not не променя флаговете
+                emit_rr(e, 0x89, hm, HOST_EAX);
+                emit_unary(e, 2, HOST_EAX);
+                emit_rr(e, 0x89, HOST_EAX, hd);
+                emit_rr(e, 0x85, hd, hd);
+                break;
+            default: // Шифт по регистър
+                return 0;
+            }
+            emit_setcc(e, CC_S, FLAG_N); // Логическите: N, Z
+            emit_setcc(e, CC_E, FLAG_Z);
+            e->written |= 1u << rd;
+            e->host_flags = HOST_FLAGS_NONE;
+            return 1;
+        }
+        if ((op >> 8) >= 0x44 && (op >> 8) <= 0x46) // ADD/CMP/MOV с високи регистри
+        {
+            int rd = (op & 0x7) | (((op >> 7) & 0x1) << 3);
+            int rm = (op >> 3) & 0xF;
+            if (rd == 15 || (rm == 15 && ((op >> 8) & 0x3) == 1))
+                return 0; // Преход (интерпретатор) или CMP с PC (непредсказуема)
+            switch ((op >> 8) & 0x3)
+            {
+            case 0: // ADD
+                emit_read_hi(e, HOST_EAX, rm, pc);
+                emit_read(e, HOST_ECX, rd);
+                emit_rr(e, 0x01, HOST_ECX, HOST_EAX);
+                emit_write(e, rd, HOST_EAX);
+                break;
+            case 1: // CMP
+                emit_read(e, HOST_EAX, rd);
+                emit_read(e, HOST_ECX, rm);
+                emit_rr(e, 0x39, HOST_ECX, HOST_EAX);
+                emit_flags_sub(e);
+                return 1;
+            default: // MOV
+                emit_read_hi(e, HOST_EAX, rm, pc);
+                emit_write(e, rd, HOST_EAX);
+                break;
+            }
+            e->host_flags = HOST_FLAGS_NONE;
+            return 1;
+        }
+        return 0;
+    }
+    case 5:
+    {
+        uint32_t op8 = (op >> 8) & 0xFF;
+        int rd = (op >> 8) & 0x7;
+        if ((op8 & 0xF8) == 0xA0) // ADD Rd, PC, #OFF
+        {
+            emit_mov_imm(e, HOST_GUEST(rd), ((pc + 4) & ~0x3) + ((op & 0xFF) << 2)); // Align(PC + 4, 4)
+            e->written |= 1u << rd;
+            return 1;
+        }
+        if ((op8 & 0xF8) == 0xA8) // ADD Rd, SP, #OFF
+        {
+            emit_read(e, HOST_EAX, 13);
+            emit_alu_imm(e, 0, HOST_EAX, (op & 0xFF) << 2);
+            emit_write(e, rd, HOST_EAX);
+            e->host_flags = HOST_FLAGS_NONE;
+            return 1;
+        }
+        if (op8 == 0xB0) // ADD / SUB SP, SP, #OFF (бит 7)
+        {
+            emit_read(e, HOST_EAX, 13);
+            emit_alu_imm(e, (op & 0x80) ? 5 : 0, HOST_EAX, (op & 0x7F) << 2);
+            emit_write(e, 13, HOST_EAX);
+            e->host_flags = HOST_FLAGS_NONE;
+            return 1;
+        }
+        return 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+// Завършващ преход: B <Target Addr> или B{<cond>} <Target Addr>
+static int compile_branch(EMITTER *e, uint32_t op, uint32_t pc, uint32_t count)
+{
+    if ((op & 0xF800) == 0xE000) // B
+    {
+        int32_t offset = ((int32_t)(op & 0x7FF) << 21) >> 20;
+        emit_epilogue(e, (pc + 4 + offset) & ~0x1, count);
+        return 1;
+    }
+    if ((op & 0xF000) == 0xD000 && ((op >> 8) & 0xF) < 0xE) // B{<cond>}
+    {
+        uint32_t cond = (op >> 8) & 0xF;
+        uint32_t target = (pc + 4 + ((int32_t)(int8_t)(op & 0xFF) << 1)) & ~0x1;
+
+        // C след ADD е с обратен смисъл на CF -> възстановяваме EFLAGS
+        int uses_c = cond == 0x2 || cond == 0x3 || cond == 0x8 || cond == 0x9;
+        if (e->host_flags == HOST_FLAGS_NONE || (e->host_flags == HOST_FLAGS_ADD && uses_c))
+            emit_restore_host_flags(e);
+
+        emit8(e, 0x0F); // jcc rel32 -> taken
+        emit8(e, 0x80 | arm_to_x86_cc[cond]);
+        uint8_t *fixup = e->p;
+        emit32(e, 0);
+        emit_epilogue(e, pc + 2, count); // Не е изпълнено
+        if (e->p <= e->end)
+        {
+            int32_t rel = (int32_t)(e->p - (fixup + 4));
+            fixup[0] = rel;
+            fixup[1] = rel >> 8;
+            fixup[2] = rel >> 16;
+            fixup[3] = rel >> 24;
+        }
+        emit_epilogue(e, target, count); // Изпълнено
+        return 1;
+    }
+    return 0;
+}
+
+static void *m4_jit_compile(CortexM4 *cpu, const M4_DECODED *d, uint32_t pc)
+{
+    M4_JIT *j = cpu->jit;
+    EMITTER e = {j->buf + j->used, j->buf + JIT_CODE_SIZE, 0, HOST_FLAGS_NONE};
+    uint8_t *start = e.p;
+    uint32_t count = 0;
+    int closed = 0;
+
+    emit_prologue(&e);
+    for (uint32_t n = d->block_len; n; n--, d += d->size >> 1)
+    {
+        if (d->size != 2)
+            break;
+        if (d->flags & M4_DEC_BRANCH)
+        {
+            closed = compile_branch(&e, d->op, pc, count + 1);
+            if (closed)
+                count++;
+            break;
+        }
+        if (!compile_16(&e, d->op, pc))
+            break;
+        count++;
+        pc += 2;
+    }
+
+    if (count == 0)
+        return JIT_FAILED;
+    if (!closed)
+        emit_epilogue(&e, pc, count);
+    if (e.p > e.end)
+    {
+        DEBUG_M4("[JIT] Code buffer full\n");
+        return JIT_FAILED;
+    }
+
+    j->used += e.p - start;
+    DEBUG_M4("[JIT] Compiled %u instructions, %u bytes\n", count, (uint32_t)(e.p - start));
+    return start;
+}
+
+// RUN ////////////////////////////////
+
+static uint32_t jit_call(CortexM4 *cpu, void *code)
+{
+    M4_FLAGS_SYNC(cpu);
+    uint8_t flags[4] = {cpu->psr.apsr.N, cpu->psr.apsr.Z, cpu->psr.apsr.C, cpu->psr.apsr.V};
+    uint32_t n = ((M4_JIT_FN)code)(cpu, flags);
+    cpu->psr.apsr.N = flags[FLAG_N];
+    cpu->psr.apsr.Z = flags[FLAG_Z];
+    cpu->psr.apsr.C = flags[FLAG_C];
+    cpu->psr.apsr.V = flags[FLAG_V];
+    return n;
+}
+
+// Изпълнява блока с компилиран код. Връща 0, ако блокът трябва да се
+// изпълни от интерпретатора.
+int m4_jit_run(CortexM4 *cpu, const M4_DECODED *d, uint32_t *executed)
+{
+    M4_JIT *j = cpu->jit;
+    M4_JIT_ENTRY *entry = &j->entry[d - cpu->icache];
+
+#if USE_TRACE
+    if (cpu->trace)
+        return 0; // Следата се записва от интерпретатора
+#endif
+#if USE_PROFILE
+    if (cpu->profile)
+        return 0; // Профилът брои всяка инструкция
+#endif
+
+    if (!entry->code)
+    {
+        if (++entry->hits < JIT_THRESHOLD)
+            return 0;
+        entry->code = m4_jit_compile(cpu, d, cpu->REG.PC);
+#if USE_EVENTS
+        const M4_DECODED *s = d;
+        for (uint32_t n = d->block_len; n; n--, s += s->size >> 1)
+            entry->cycles += s->cycles;
+        entry->cycles += M4_CYCLES_REFILL;
+#endif
+    }
+    if (entry->code == JIT_FAILED)
+        return 0;
+#if USE_EVENTS
+    // Събитие в блока или цикъл на изчакване: интерпретаторът спира на
+    // границата на събитието и прескача итерациите (m4_run)
+    if ((d->flags & M4_DEC_POLL) || cpu->cycles + entry->cycles >= cpu->event_next)
+        return 0;
+#endif
+
+    if (j->mode != M4_JIT_VERIFY)
+    {
+#if USE_CYCLES
+        uint32_t pc = cpu->REG.PC;
+        *executed = jit_call(cpu, entry->code);
+        m4_cycles_block(cpu, d, *executed, pc);
+#else
+        *executed = jit_call(cpu, entry->code);
+#endif
+        return 1;
+    }
+
+    // Диференциална проверка: същите инструкции през интерпретатора
+    M4_FLAGS_SYNC(cpu);
+    M4 regs = cpu->REG;
+    PSR psr = cpu->psr;
+    uint32_t n = jit_call(cpu, entry->code);
+    M4 jit_regs = cpu->REG;
+    PSR jit_psr = cpu->psr;
+
+    cpu->REG = regs;
+    cpu->psr = psr;
+    *executed = 0;
+    if (m4_execute_slots(cpu, d, n, executed))
+        return 1;
+    M4_FLAGS_SYNC(cpu);
+
+    if (memcmp(&jit_regs, &cpu->REG, sizeof(M4)) || jit_psr.value != cpu->psr.value)
+    {
+        PRINTF("[ERROR] JIT mismatch in block at 0x%08X, JIT disabled for it\n", regs.PC);
+        for (int i = 0; i < 16; i++)
+            if (jit_regs.r[i] != cpu->REG.r[i])
+                PRINTF("\tR%d: JIT 0x%08X, interpreter 0x%08X\n", i, jit_regs.r[i], cpu->REG.r[i]);
+        if (jit_psr.value != cpu->psr.value)
+            PRINTF("\tPSR: JIT 0x%08X, interpreter 0x%08X\n", jit_psr.value, cpu->psr.value);
+        entry->code = JIT_FAILED;
+        j->mismatches++;
+    }
+    return 1;
+}
+
+///////////////////////////////////////
+
+int m4_jit_init(CortexM4 *cpu, int mode)
+{
+    m4_jit_free(cpu);
+    if (!cpu->icache)
+    {
+        PRINTF("[ERROR] m4_jit_init: Instruction cache not initialized\n");
+        return -1;
+    }
+
+    M4_JIT *j = (M4_JIT *)calloc(1, sizeof(M4_JIT));
+    if (!j)
+        return -1;
+    j->mode = mode;
+    j->entry = (M4_JIT_ENTRY *)calloc(cpu->ROM_SIZE / 2, sizeof(M4_JIT_ENTRY));
+    j->buf = (uint8_t *)mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!j->entry || j->buf == MAP_FAILED)
+    {
+        PRINTF("[ERROR] m4_jit_init: Out of memory\n");
+        if (j->buf != MAP_FAILED)
+            munmap(j->buf, JIT_CODE_SIZE);
+        free(j->entry);
+        free(j);
+        return -1;
+    }
+    cpu->jit = j;
+    return 0;
+}
+
+void m4_jit_invalidate(CortexM4 *cpu)
+{
+    if (!cpu->jit)
+        return;
+    memset(cpu->jit->entry, 0, (cpu->ROM_SIZE / 2) * sizeof(M4_JIT_ENTRY));
+    cpu->jit->used = 0;
+}
+
+void m4_jit_free(CortexM4 *cpu)
+{
+    M4_JIT *j = cpu->jit;
+    if (!j)
+        return;
+    munmap(j->buf, JIT_CODE_SIZE);
+    free(j->entry);
+    free(j);
+    cpu->jit = NULL;
+}
+
+#endif // USE_JIT
@@ -0,0 +1,523 @@
+#include "M4.h"
+#include "common.h"
+
+#if USE_NVIC
+
+/*
+    NVIC и изключения (ARMv7-M ARM, B1.5).
+
+    Всяка промяна на чакащите, разрешените или активните изключения и на
+    маските (PRIMASK, FAULTMASK, BASEPRI) извиква m4_nvic_update, която
+    избира чакащото изключение с най-висок приоритет и го записва в
+    nvic.next, ако то може да прекъсне текущото изпълнение. Циклите на
+    изпълнение проверяват само nvic.next, без да обхождат ISPR.
+
+    Влизане: рамка от 8 думи (R0–R3, R12, LR, адрес на връщане, xPSR) в
+    текущия стек, подравнен на 8 байта (CCR.STKALIGN), LR = EXC_RETURN.
+    Векторът се избира след записа на рамката, така че изключение с
+    по-висок приоритет, появило се междувременно, се обслужва първо със
+    същата рамка (late-arrival). При връщане чакащо изключение, което може
+    да прекъсне контекста, към който се връщаме, започва веднага без
+    четене и нов запис на рамката (tail-chaining).
+
+    FPU контекстът не се записва в рамката; грешките при изпълнение спират
+    m4_run (M4_STOP_FAULT), вместо да влизат в HardFault.
+*/
+
+#define NVIC_PRIO_MASK ((0xFF << (8 - M4_NVIC_PRIO_BITS)) & 0xFF)
+#define NVIC_SYS_WRITABLE 0xD870 // SHPR: изключения 4–6, 11, 12, 14, 15
+
+// Приоритет на изключение exc (по-малкото е по-важно)
+static int exc_priority(const CortexM4 *cpu, uint32_t exc)
+{
+    if (exc >= M4_EXC_IRQ0)
+        return cpu->nvic.IPR[exc - M4_EXC_IRQ0];
+    if (exc == M4_EXC_NMI)
+        return -2;
+    if (exc == M4_EXC_HARDFAULT)
+        return -1;
+    return cpu->nvic.SHPR[exc - 4];
+}
+
+// Групов приоритет: само той решава дали едно изключение прекъсва друго
+static int exc_group(const CortexM4 *cpu, int prio)
+{
+    if (prio < 0)
+        return prio;
+    return prio & (0x1FE << cpu->nvic.PRIGROUP) & 0xFF;
+}
+
+static void exc_set_active(CortexM4 *cpu, uint32_t exc, int active)
+{
+    uint32_t *word = exc >= M4_EXC_IRQ0 ? &cpu->nvic.IABR[(exc - M4_EXC_IRQ0) >> 5] : &cpu->nvic.sys_active;
+    uint32_t bit = 1u << (exc >= M4_EXC_IRQ0 ? (exc - M4_EXC_IRQ0) & 31 : exc);
+    if (active)
+        *word |= bit;
+    else
+        *word &= ~bit;
+}
+
+static void exc_set_pending(CortexM4 *cpu, uint32_t exc, int pending)
+{
+    uint32_t *word = exc >= M4_EXC_IRQ0 ? &cpu->nvic.ISPR[(exc - M4_EXC_IRQ0) >> 5] : &cpu->nvic.sys_pending;
+    uint32_t bit = 1u << (exc >= M4_EXC_IRQ0 ? (exc - M4_EXC_IRQ0) & 31 : exc);
+    if (pending)
+        *word |= bit;
+    else
+        *word &= ~bit;
+}
+
+// Брой активни изключения (за ICSR.RETTOBASE)
+static uint32_t exc_active_count(const CortexM4 *cpu)
+{
+    uint32_t n = __builtin_popcount(cpu->nvic.sys_active);
+    for (int w = 0; w < 8; w++)
+        n += __builtin_popcount(cpu->nvic.IABR[w]);
+    return n;
+}
+
+void m4_nvic_reset(CortexM4 *cpu)
+{
+    memset(&cpu->nvic, 0, sizeof(cpu->nvic));
+    cpu->nvic.exec_prio = 256;
+}
+
+// Преизчислява приоритета на изпълнение и nvic.next. Извиква се при всяка
+// промяна на състоянието, не на всяка инструкция.
+void m4_nvic_update(CortexM4 *cpu)
+{
+    NVIC *n = &cpu->nvic;
+
+    int exec = 256; // Thread режим без маски
+    for (uint32_t bits = n->sys_active; bits; bits &= bits - 1)
+    {
+        int p = exc_group(cpu, exc_priority(cpu, __builtin_ctz(bits)));
+        if (p < exec)
+            exec = p;
+    }
+    for (int w = 0; w < 8; w++)
+    {
+        for (uint32_t bits = n->IABR[w]; bits; bits &= bits - 1)
+        {
+            int p = exc_group(cpu, n->IPR[w * 32 + __builtin_ctz(bits)]);
+            if (p < exec)
+                exec = p;
+        }
+    }
+    if (cpu->BASEPRI && exc_group(cpu, cpu->BASEPRI) < exec)
+        exec = exc_group(cpu, cpu->BASEPRI);
+    if ((cpu->PRIMASK & 0x1) && exec > 0)
+        exec = 0;
+    if ((cpu->FAULTMASK & 0x1) && exec > -1)
+        exec = -1;
+    n->exec_prio = exec;
+
+    // Най-нисък приоритет, при равенство - най-малък номер
+    uint32_t best = 0;
+    int best_prio = 256;
+    for (uint32_t bits = n->sys_pending; bits; bits &= bits - 1)
+    {
+        uint32_t exc = __builtin_ctz(bits);
+        int p = exc_priority(cpu, exc);
+        if (p < best_prio)
+        {
+            best = exc;
+            best_prio = p;
+        }
+    }
+    for (int w = 0; w < 8; w++)
+    {
+        for (uint32_t bits = n->ISPR[w] & n->ISER[w]; bits; bits &= bits - 1)
+        {
+            uint32_t irq = w * 32 + __builtin_ctz(bits);
+            if (n->IPR[irq] < best_prio)
+            {
+                best = M4_EXC_IRQ0 + irq;
+                best_prio = n->IPR[irq];
+            }
+        }
+    }
+    n->pending = best;
+    n->next = (best && exc_group(cpu, best_prio) < exec) ? best : 0;
+}
+
+// Задава (pending != 0) или изчиства чакането на прекъсване irq (0–239).
+// За модели на периферия.
+int m4_nvic_irq(CortexM4 *cpu, uint32_t irq, int pending)
+{
+    if (irq >= M4_NVIC_IRQS)
+    {
+        PRINTF("[ERROR] m4_nvic_irq: Invalid IRQ %u\n", irq);
+        return -1;
+    }
+    exc_set_pending(cpu, M4_EXC_IRQ0 + irq, pending);
+    m4_nvic_update(cpu);
+    return 0;
+}
+
+void m4_exception_pend(CortexM4 *cpu, uint32_t exc)
+{
+    exc_set_pending(cpu, exc, 1);
+    m4_nvic_update(cpu);
+}
+
+// Синхронно изключение (SVC): трябва да прекъсне веднага, иначе ескалира до
+// HardFault. Ако и HardFault не може - lockup, връща -1.
+int m4_exception_sync(CortexM4 *cpu, uint32_t exc)
+{
+    if (exc_group(cpu, exc_priority(cpu, exc)) >= cpu->nvic.exec_prio)
+    {
+        if (cpu->nvic.exec_prio <= -1)
+        {
+            DEBUG_M4("[ERROR] Lockup: exception %u in HardFault/NMI at PC: 0x%08X\n", exc, cpu->REG.PC);
+            return -1;
+        }
+        exc = M4_EXC_HARDFAULT;
+    }
+    m4_exception_pend(cpu, exc);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////
+
+// xPSR с IT битовете от cpu->ITSTATE
+static uint32_t exc_xpsr(CortexM4 *cpu)
+{
+    uint32_t psr = m4_read_psr(cpu) & ~0x0600FC00;
+    psr |= (uint32_t)(cpu->ITSTATE & 0x3) << 25;
+    psr |= (uint32_t)(cpu->ITSTATE >> 2) << 10;
+    return psr;
+}
+
+// Активира exc: Handler режим с MSP, PC от векторната таблица
+static int exc_activate(CortexM4 *cpu, uint32_t exc, uint32_t ret)
+{
+    int res;
+    uint32_t vector = READ_MEM_32(cpu, cpu->nvic.VTOR + 4 * exc, &res);
+    if (res)
+    {
+        DEBUG_M4("[ERROR] Cannot read vector %u at 0x%08X\n", exc, cpu->nvic.VTOR + 4 * exc);
+        return -1;
+    }
+    exc_set_pending(cpu, exc, 0);
+    exc_set_active(cpu, exc, 1);
+    m4_sp_select(cpu, 0);
+    cpu->CONTROL &= ~M4_CONTROL_SPSEL;
+    cpu->psr.ExceptionNumber = exc;
+    cpu->psr.epsr.T = vector & 0x1;
+    cpu->ITSTATE = 0;
+    cpu->bl_upper_pending = 0;
+    cpu->REG.PC = vector & ~0x1;
+    M4_HOOK_CALL(cpu, cpu->REG.PC, ret);
+    m4_nvic_update(cpu);
+    return 0;
+}
+
+// Влиза в nvic.next: записва рамката и зарежда вектора
+int m4_exception_take(CortexM4 *cpu)
+{
+    uint32_t exc = cpu->nvic.next;
+    uint32_t sp = cpu->REG.SP;
+    uint32_t frame[8] = {
+        cpu->REG.R[0], cpu->REG.R[1], cpu->REG.R[2], cpu->REG.R[3],
+        cpu->REG.R[12], cpu->REG.LR, cpu->REG.PC, exc_xpsr(cpu)};
+    if (sp & 0x4)
+        frame[7] |= 1u << 9; // Стекът е подравнен с 4 байта
+    sp = (sp - sizeof(frame)) & ~0x7;
+    if (m4_mem_write_words(cpu, sp, frame, 8))
+    {
+        DEBUG_M4("[ERROR] Exception %u: stacking failed at SP: 0x%08X\n", exc, sp);
+        return -1;
+    }
+    cpu->REG.SP = sp;
+    if (cpu->psr.ExceptionNumber)
+        cpu->REG.LR = M4_EXC_RETURN_HANDLER;
+    else
+        cpu->REG.LR = cpu->sp_psp ? M4_EXC_RETURN_PSP : M4_EXC_RETURN_MSP;
+#if USE_CYCLES
+    cpu->cycles += M4_CYCLES_EXC_ENTRY;
+#endif
+
+    // Late-arrival: векторът е на най-приоритетното чакащо в този момент
+    m4_nvic_update(cpu);
+    if (cpu->nvic.next)
+        exc = cpu->nvic.next;
+    return exc_activate(cpu, exc, frame[6]);
+}
+
+// Връщане от изключение: BX или POP {PC} с EXC_RETURN в Handler режим
+int m4_exception_return(CortexM4 *cpu, uint32_t exc_return)
+{
+    uint32_t exc = cpu->psr.ExceptionNumber;
+    if (exc_return != M4_EXC_RETURN_HANDLER && exc_return != M4_EXC_RETURN_MSP && exc_return != M4_EXC_RETURN_PSP)
+    {
+        DEBUG_M4("[ERROR] Invalid EXC_RETURN: 0x%08X at PC: 0x%08X\n", exc_return, cpu->REG.PC);
+        return -1;
+    }
+    exc_set_active(cpu, exc, 0);
+    if (exc != M4_EXC_NMI)
+        cpu->FAULTMASK = 0;
+    m4_nvic_update(cpu);
+
+    // Tail-chaining: рамката остава, LR е същият EXC_RETURN
+    if (cpu->nvic.next)
+    {
+        int res;
+        uint32_t frame_sp = exc_return == M4_EXC_RETURN_PSP ? cpu->SP_alt : cpu->REG.SP;
+        uint32_t ret = READ_MEM_32(cpu, frame_sp + 24, &res);
+        if (res)
+            return -1;
+#if USE_CYCLES
+        cpu->cycles += M4_CYCLES_TAILCHAIN;
+#endif
+        M4_HOOK_RETURN(cpu, ret);
+        cpu->REG.LR = exc_return;
+        return exc_activate(cpu, cpu->nvic.next, ret);
+    }
+
+    m4_sp_select(cpu, exc_return == M4_EXC_RETURN_PSP);
+    if (exc_return == M4_EXC_RETURN_PSP)
+        cpu->CONTROL |= M4_CONTROL_SPSEL;
+    uint32_t frame[8];
+    if (m4_mem_read_words(cpu, cpu->REG.SP, frame, 8))
+    {
+        DEBUG_M4("[ERROR] Exception return: unstacking failed at SP: 0x%08X\n", cpu->REG.SP);
+        return -1;
+    }
+    for (int i = 0; i < 4; i++)
+        cpu->REG.R[i] = frame[i];
+    cpu->REG.R[12] = frame[4];
+    cpu->REG.LR = frame[5];
+    cpu->REG.PC = frame[6] & ~0x1;
+    cpu->REG.SP += sizeof(frame) + ((frame[7] >> 9) & 0x1) * 4;
+    cpu->excl = 0; // Връщането от изключение затваря локалния монитор
+
+    cpu->lazy.mask = 0; // Флаговете идват от рамката
+    cpu->psr.value = frame[7] & ~(0x0600FC00 | (1u << 9));
+    cpu->ITSTATE = (uint8_t)(((frame[7] >> 25) & 0x3) | (((frame[7] >> 10) & 0x3F) << 2));
+    if (cpu->ITSTATE)
+        m4_it_refresh(cpu); // Прекъснат IT блок
+    if (exc_return != M4_EXC_RETURN_HANDLER)
+        cpu->psr.ExceptionNumber = 0;
+#if USE_CYCLES
+    cpu->cycles += M4_CYCLES_EXC_RETURN;
+#endif
+    M4_HOOK_RETURN(cpu, cpu->REG.PC);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////
+
+/*
+    Регистри в System Control Space (0xE000E000). Непознатите адреси се
+    четат като 0 и записите в тях се игнорират. NVIC и SHPR могат да се
+    достъпват и по байтове, останалите регистри - само по думи.
+*/
+
+#define SCS_ICTR 0x004
+#define SCS_ISER 0x100
+#define SCS_ICER 0x180
+#define SCS_ISPR 0x200
+#define SCS_ICPR 0x280
+#define SCS_IABR 0x300
+#define SCS_IPR 0x400
+#define SCS_CPUID 0xD00
+#define SCS_ICSR 0xD04
+#define SCS_VTOR 0xD08
+#define SCS_AIRCR 0xD0C
+#define SCS_CCR 0xD14
+#define SCS_SHPR 0xD18
+#define SCS_SHCSR 0xD24
+#define SCS_STIR 0xF00
+
+#define ICSR_NMIPENDSET (1u << 31)
+#define ICSR_PENDSVSET (1u << 28)
+#define ICSR_PENDSVCLR (1u << 27)
+#define ICSR_PENDSTSET (1u << 26)
+#define ICSR_PENDSTCLR (1u << 25)
+#define ICSR_ISRPENDING (1u << 22)
+#define ICSR_RETTOBASE (1u << 11)
+
+static uint32_t scs_icsr(CortexM4 *cpu)
+{
+    NVIC *n = &cpu->nvic;
+    uint32_t value = cpu->psr.ExceptionNumber | ((uint32_t)n->pending << 12);
+    if (exc_active_count(cpu) <= 1)
+        value |= ICSR_RETTOBASE;
+    for (int w = 0; w < 8; w++)
+    {
+        if (n->ISPR[w])
+            value |= ICSR_ISRPENDING;
+    }
+    if (n->sys_pending & (1u << M4_EXC_NMI))
+        value |= ICSR_NMIPENDSET;
+    if (n->sys_pending & (1u << M4_EXC_PENDSV))
+        value |= ICSR_PENDSVSET;
+    if (n->sys_pending & (1u << M4_EXC_SYSTICK))
+        value |= ICSR_PENDSTSET;
+    return value;
+}
+
+static uint32_t scs_shcsr(CortexM4 *cpu)
+{
+    NVIC *n = &cpu->nvic;
+    uint32_t value = n->SHCSR;
+    static const uint8_t active[][2] = {{M4_EXC_MEMMANAGE, 0}, {M4_EXC_BUSFAULT, 1}, {M4_EXC_USAGEFAULT, 3}, {M4_EXC_SVCALL, 7}, {M4_EXC_DEBUGMON, 8}, {M4_EXC_PENDSV, 10}, {M4_EXC_SYSTICK, 11}};
+    for (uint32_t i = 0; i < sizeof(active) / sizeof(active[0]); i++)
+    {
+        if (n->sys_active & (1u << active[i][0]))
+            value |= 1u << active[i][1];
+    }
+    if (n->sys_pending & (1u << M4_EXC_SVCALL))
+        value |= 1u << 15;
+    return value;
+}
+
+// Байт от IPR или SHPR; NULL, ако адресът не е в тях
+static uint8_t *scs_prio_byte(CortexM4 *cpu, uint32_t offset, uint8_t *mask)
+{
+    *mask = NVIC_PRIO_MASK;
+    if (offset - SCS_IPR < M4_NVIC_IRQS)
+        return &cpu->nvic.IPR[offset - SCS_IPR];
+    if (offset - SCS_SHPR < sizeof(cpu->nvic.SHPR))
+    {
+        if (!(NVIC_SYS_WRITABLE & (1u << (offset - SCS_SHPR + 4))))
+            *mask = 0;
+        return &cpu->nvic.SHPR[offset - SCS_SHPR];
+    }
+    return NULL;
+}
+
+uint32_t m4_scs_read(CortexM4 *cpu, uint32_t address, uint32_t size, int *result)
+{
+    NVIC *n = &cpu->nvic;
+    uint32_t offset = address - M4_SCS_BASE;
+    uint8_t mask;
+    *result = 0;
+
+    if (scs_prio_byte(cpu, offset, &mask))
+    {
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < size; i++)
+        {
+            uint8_t *p = scs_prio_byte(cpu, offset + i, &mask);
+            value |= (uint32_t)(p ? *p : 0) << (8 * i);
+        }
+        return value;
+    }
+    if (size != 4 || (offset & 0x3))
+        return 0;
+
+    uint32_t w = (offset >> 2) & 0x1F;
+    switch (offset & ~0x7F)
+    {
+    case SCS_ISER:
+    case SCS_ICER:
+        return w < 8 ? n->ISER[w] : 0;
+    case SCS_ISPR:
+    case SCS_ICPR:
+        return w < 8 ? n->ISPR[w] : 0;
+    case SCS_IABR:
+        return w < 8 ? n->IABR[w] : 0;
+    default:
+        break;
+    }
+    switch (offset)
+    {
+    case SCS_ICTR:
+        return M4_NVIC_IRQS / 32 - 1;
+    case SCS_CPUID:
+        return 0x410FC241; // Cortex-M4 r0p1
+    case SCS_ICSR:
+        return scs_icsr(cpu);
+    case SCS_VTOR:
+        return n->VTOR;
+    case SCS_AIRCR:
+        return 0xFA050000 | ((uint32_t)n->PRIGROUP << 8);
+    case SCS_CCR:
+        return 1u << 9; // STKALIGN
+    case SCS_SHCSR:
+        return scs_shcsr(cpu);
+    default:
+        return 0;
+    }
+}
+
+int m4_scs_write(CortexM4 *cpu, uint32_t address, uint32_t data, uint32_t size)
+{
+    NVIC *n = &cpu->nvic;
+    uint32_t offset = address - M4_SCS_BASE;
+    uint8_t mask;
+
+    if (scs_prio_byte(cpu, offset, &mask))
+    {
+        for (uint32_t i = 0; i < size; i++)
+        {
+            uint8_t *p = scs_prio_byte(cpu, offset + i, &mask);
+            if (p)
+                *p = (uint8_t)(data >> (8 * i)) & mask;
+        }
+        m4_nvic_update(cpu);
+        return 0;
+    }
+    if (size != 4 || (offset & 0x3))
+        return 0;
+
+    uint32_t w = (offset >> 2) & 0x1F;
+    if (offset >= SCS_ISER && offset < SCS_IABR && w < 8)
+    {
+        switch (offset & ~0x7F)
+        {
+        case SCS_ISER:
+            n->ISER[w] |= data;
+            break;
+        case SCS_ICER:
+            n->ISER[w] &= ~data;
+            break;
+        case SCS_ISPR:
+            n->ISPR[w] |= data;
+            break;
+        default: // ICPR
+            n->ISPR[w] &= ~data;
+            break;
+        }
+        m4_nvic_update(cpu);
+        return 0;
+    }
+
+    switch (offset)
+    {
+    case SCS_ICSR:
+        if (data & ICSR_NMIPENDSET)
+            exc_set_pending(cpu, M4_EXC_NMI, 1);
+        if (data & ICSR_PENDSVSET)
+            exc_set_pending(cpu, M4_EXC_PENDSV, 1);
+        else if (data & ICSR_PENDSVCLR)
+            exc_set_pending(cpu, M4_EXC_PENDSV, 0);
+        if (data & ICSR_PENDSTSET)
+            exc_set_pending(cpu, M4_EXC_SYSTICK, 1);
+        else if (data & ICSR_PENDSTCLR)
+            exc_set_pending(cpu, M4_EXC_SYSTICK, 0);
+        break;
+    case SCS_VTOR:
+        n->VTOR = data & 0xFFFFFF80;
+        break;
+    case SCS_AIRCR:
+        if ((data >> 16) == 0x05FA)
+            n->PRIGROUP = (data >> 8) & 0x7; // SYSRESETREQ се игнорира
+        break;
+    case SCS_SHCSR:
+        n->SHCSR = data & (0x7u << 16);
+        break;
+    case SCS_STIR:
+        if ((data & 0x1FF) < M4_NVIC_IRQS)
+            exc_set_pending(cpu, M4_EXC_IRQ0 + (data & 0x1FF), 1);
+        break;
+    default:
+        return 0;
+    }
+    m4_nvic_update(cpu);
+    return 0;
+}
+
+#endif // USE_NVIC
@@ -0,0 +1,387 @@
+#include "M4.h"
+#include "common.h"
+
+#if USE_PROFILE
+
+/*
+    Точен профил на изпълнението.
+
+    Брои всяка изпълнена инструкция по адрес и всеки изпълнен основен блок.
+    Стекът на извикванията се строи от BL/BLX и от връщанията към адреса от
+    BL (BX LR, POP {PC}, MOV PC, LR) като дърво на контекстите: всеки възел е
+    функция, извикана от конкретна верига функции, и брои собствените си
+    инструкции (и тактове при USE_CYCLES). От дървото се извеждат сгънати
+    стекове за flame graph и отчет по функции.
+
+    Докато профилът е включен, JIT не се използва.
+*/
+
+#define M4_PROFILE_DEPTH 256
+
+typedef struct
+{
+    uint32_t func;
+    uint32_t parent;
+    uint32_t child; // Първо дете (0 = няма, коренът не е дете на никого)
+    uint32_t next;  // Следващ брат
+    uint64_t calls;
+    uint64_t insns; // Собствени инструкции, без извиканите функции
+#if USE_CYCLES
+    uint64_t cycles;
+#endif
+} M4_PROFILE_NODE;
+
+typedef struct
+{
+    uint32_t node;
+    uint32_t ret; // Адрес на връщане без Thumb бит
+} M4_PROFILE_FRAME;
+
+struct M4_PROFILE_s
+{
+    uint64_t *pc;    // Изпълнения за всяко полуслово на ROM
+    uint64_t *block; // Изпълнения на блока, започващ от полусловото
+    uint32_t slots;
+    M4_PROFILE_NODE *node;
+    uint32_t nodes;
+    uint32_t cap;
+    uint32_t cur; // Текущ контекст
+    M4_PROFILE_FRAME stack[M4_PROFILE_DEPTH];
+    uint32_t depth;
+    uint32_t lost; // Извиквания отвъд M4_PROFILE_DEPTH, които още не са се върнали
+#if USE_CYCLES
+    uint64_t mark; // cpu->cycles при последната смяна на контекста
+#endif
+};
+
+// Тежест на възел в отчетите: тактове, ако се броят, иначе инструкции
+#if USE_CYCLES
+#define NODE_WEIGHT(n) ((n)->cycles)
+#define WEIGHT_NAME "cycles"
+#else
+#define NODE_WEIGHT(n) ((n)->insns)
+#define WEIGHT_NAME "instructions"
+#endif
+
+// Отчита тактовете до момента на текущия контекст
+static void profile_switch(CortexM4 *cpu, uint32_t node)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+#if USE_CYCLES
+    p->node[p->cur].cycles += cpu->cycles - p->mark;
+    p->mark = cpu->cycles;
+#endif
+    p->cur = node;
+}
+
+int m4_profile_start(CortexM4 *cpu)
+{
+    m4_profile_stop(cpu);
+    struct M4_PROFILE_s *p = (struct M4_PROFILE_s *)calloc(1, sizeof(struct M4_PROFILE_s));
+    if (p)
+    {
+        p->slots = cpu->ROM_SIZE / 2;
+        p->cap = 256;
+        p->pc = (uint64_t *)calloc(p->slots ? p->slots : 1, sizeof(uint64_t));
+        p->block = (uint64_t *)calloc(p->slots ? p->slots : 1, sizeof(uint64_t));
+        p->node = (M4_PROFILE_NODE *)calloc(p->cap, sizeof(M4_PROFILE_NODE));
+    }
+    if (!p || !p->pc || !p->block || !p->node)
+    {
+        PRINTF("[ERROR] m4_profile_start: Out of memory\n");
+        if (p)
+        {
+            free(p->pc);
+            free(p->block);
+            free(p->node);
+            free(p);
+        }
+        return -1;
+    }
+    p->nodes = 1; // Коренът: кодът, изпълняван при старта
+    p->node[0].func = cpu->REG.PC;
+#if USE_CYCLES
+    p->mark = cpu->cycles;
+#endif
+    cpu->profile = p;
+    return 0;
+}
+
+void m4_profile_stop(CortexM4 *cpu)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+    if (!p)
+        return;
+    free(p->pc);
+    free(p->block);
+    free(p->node);
+    free(p);
+    cpu->profile = NULL;
+}
+
+void m4_profile_step(CortexM4 *cpu)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+    uint32_t offset = cpu->REG.PC - ROM_BASE;
+    if (offset < 2 * p->slots)
+        p->pc[offset >> 1]++;
+    p->node[p->cur].insns++;
+}
+
+void m4_profile_block(CortexM4 *cpu, const M4_DECODED *d)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+    uint32_t slot = d - cpu->icache;
+    if (slot < p->slots)
+        p->block[slot]++;
+}
+
+void m4_profile_call(CortexM4 *cpu, uint32_t target, uint32_t ret)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+    target &= ~0x1;
+    if (p->depth == M4_PROFILE_DEPTH)
+    {
+        p->lost++;
+        return;
+    }
+
+    uint32_t child = p->node[p->cur].child;
+    while (child && p->node[child].func != target)
+        child = p->node[child].next;
+    if (!child)
+    {
+        if (p->nodes == p->cap)
+        {
+            M4_PROFILE_NODE *grown = (M4_PROFILE_NODE *)realloc(p->node, 2 * p->cap * sizeof(M4_PROFILE_NODE));
+            if (!grown)
+            {
+                PRINTF("[ERROR] m4_profile_call: Out of memory\n");
+                p->lost++;
+                return;
+            }
+            p->node = grown;
+            p->cap *= 2;
+        }
+        child = p->nodes++;
+        memset(&p->node[child], 0, sizeof(M4_PROFILE_NODE));
+        p->node[child].func = target;
+        p->node[child].parent = p->cur;
+        p->node[child].next = p->node[p->cur].child;
+        p->node[p->cur].child = child;
+    }
+
+    p->node[child].calls++;
+    p->stack[p->depth].node = p->cur;
+    p->stack[p->depth].ret = ret & ~0x1;
+    p->depth++;
+    profile_switch(cpu, child);
+}
+
+void m4_profile_return(CortexM4 *cpu, uint32_t target)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+    target &= ~0x1;
+    if (p->lost)
+    {
+        p->lost--; // Връщане от извикване, което не се събра в стека
+        return;
+    }
+
+    uint32_t i = p->depth;
+    while (i && p->stack[i - 1].ret != target)
+        i--;
+    if (!i)
+        return; // Не е връщане от проследена функция
+    p->depth = i - 1;
+    profile_switch(cpu, p->stack[i - 1].node);
+}
+
+// Връща се в корена, напр. след m4_restore. Събраните бройки остават.
+void m4_profile_unwind(CortexM4 *cpu)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+    if (!p)
+        return;
+    profile_switch(cpu, 0);
+    p->depth = 0;
+    p->lost = 0;
+#if USE_CYCLES
+    p->mark = cpu->cycles;
+#endif
+}
+
+// ИЗХОД ///////////////////////////////
+
+// Сгънати стекове (flamegraph.pl, speedscope): "корен;функция;... тежест"
+int m4_profile_folded(CortexM4 *cpu, const M4_SYMBOLS *syms, FILE *file)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+    if (!p || !file)
+    {
+        PRINTF("[ERROR] m4_profile_folded: Invalid Parameter\n");
+        return -1;
+    }
+    profile_switch(cpu, p->cur);
+
+    uint32_t path[M4_PROFILE_DEPTH + 1];
+    char buf[16];
+    for (uint32_t i = 0; i < p->nodes; i++)
+    {
+        if (!NODE_WEIGHT(&p->node[i]))
+            continue;
+        uint32_t n = 0;
+        for (uint32_t node = i; n <= M4_PROFILE_DEPTH; node = p->node[node].parent)
+        {
+            path[n++] = node;
+            if (!node)
+                break;
+        }
+        while (n--)
+            fprintf(file, "%s%c", m4_symbol_name(syms, p->node[path[n]].func, buf, sizeof(buf)), n ? ';' : ' ');
+        fprintf(file, "%llu\n", (unsigned long long)NODE_WEIGHT(&p->node[i]));
+    }
+    return ferror(file) ? -1 : 0;
+}
+
+typedef struct
+{
+    uint32_t addr;
+    uint64_t calls;
+    uint64_t self;
+    uint64_t incl;
+} M4_PROFILE_FUNC;
+
+typedef struct
+{
+    uint32_t slot;
+    uint64_t count;
+} M4_PROFILE_HOT;
+
+static int func_by_addr(const void *a, const void *b)
+{
+    uint32_t x = ((const M4_PROFILE_FUNC *)a)->addr, y = ((const M4_PROFILE_FUNC *)b)->addr;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static int func_by_self(const void *a, const void *b)
+{
+    uint64_t x = ((const M4_PROFILE_FUNC *)a)->self, y = ((const M4_PROFILE_FUNC *)b)->self;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int hot_by_count(const void *a, const void *b)
+{
+    uint64_t x = ((const M4_PROFILE_HOT *)a)->count, y = ((const M4_PROFILE_HOT *)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Функции по собствена тежест; включителната брои рекурсията веднъж
+static void report_functions(struct M4_PROFILE_s *p, const M4_SYMBOLS *syms, FILE *file, uint32_t top,
+                             M4_PROFILE_FUNC *funcs, uint64_t *total)
+{
+    // Тежест на поддърветата: децата са винаги след родителя
+    for (uint32_t i = 0; i < p->nodes; i++)
+        total[i] = NODE_WEIGHT(&p->node[i]);
+    for (uint32_t i = p->nodes - 1; i > 0; i--)
+        total[p->node[i].parent] += total[i];
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < p->nodes; i++)
+        funcs[i].addr = p->node[i].func;
+    qsort(funcs, p->nodes, sizeof(M4_PROFILE_FUNC), func_by_addr);
+    for (uint32_t i = 0; i < p->nodes; i++)
+    {
+        if (!count || funcs[count - 1].addr != funcs[i].addr)
+            funcs[count++].addr = funcs[i].addr;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        funcs[i].calls = funcs[i].self = funcs[i].incl = 0;
+
+    for (uint32_t i = 0; i < p->nodes; i++)
+    {
+        M4_PROFILE_FUNC key = {p->node[i].func, 0, 0, 0};
+        M4_PROFILE_FUNC *f = (M4_PROFILE_FUNC *)bsearch(&key, funcs, count, sizeof(M4_PROFILE_FUNC), func_by_addr);
+        f->calls += p->node[i].calls;
+        f->self += NODE_WEIGHT(&p->node[i]);
+        uint32_t up = i;
+        while (up && p->node[up = p->node[up].parent].func != f->addr)
+            ;
+        if (!i || p->node[up].func != f->addr) // Няма същата функция по-нагоре
+            f->incl += total[i];
+    }
+    qsort(funcs, count, sizeof(M4_PROFILE_FUNC), func_by_self);
+
+    double all = total[0] ? (double)total[0] : 1.0;
+    char buf[16];
+    fprintf(file, "Functions (%s, %llu total):\n", WEIGHT_NAME, (unsigned long long)total[0]);
+    fprintf(file, "%14s %7s %14s %7s %10s  %s\n", "self", "self%", "incl", "incl%", "calls", "function");
+    for (uint32_t i = 0; i < count && i < top; i++)
+    {
+        fprintf(file, "%14llu %6.2f%% %14llu %6.2f%% %10llu  %s\n", (unsigned long long)funcs[i].self,
+                100.0 * funcs[i].self / all, (unsigned long long)funcs[i].incl, 100.0 * funcs[i].incl / all,
+                (unsigned long long)funcs[i].calls, m4_symbol_name(syms, funcs[i].addr, buf, sizeof(buf)));
+    }
+}
+
+// Най-честите адреси (counts = p->pc) или блокове (counts = p->block)
+static void report_hot(struct M4_PROFILE_s *p, const M4_SYMBOLS *syms, FILE *file, uint32_t top,
+                       const uint64_t *counts, const char *title, M4_PROFILE_HOT *hot)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < p->slots; i++)
+    {
+        if (counts[i])
+        {
+            hot[n].slot = i;
+            hot[n++].count = counts[i];
+        }
+    }
+    qsort(hot, n, sizeof(M4_PROFILE_HOT), hot_by_count);
+
+    char buf[16];
+    fprintf(file, "\n%s:\n%14s  %-10s  %s\n", title, "count", "address", "function");
+    for (uint32_t i = 0; i < n && i < top; i++)
+    {
+        uint32_t addr = ROM_BASE + 2 * hot[i].slot;
+        const M4_SYMBOL *sym = m4_symbol_find(syms, addr);
+        fprintf(file, "%14llu  0x%08X  ", (unsigned long long)hot[i].count, addr);
+        if (sym)
+            fprintf(file, "%s+0x%X\n", sym->name, addr - sym->addr);
+        else
+            fprintf(file, "%s\n", m4_symbol_name(syms, addr, buf, sizeof(buf)));
+    }
+}
+
+// Текстов отчет: до top функции, адреси и блокове. syms може да е NULL.
+int m4_profile_report(CortexM4 *cpu, const M4_SYMBOLS *syms, FILE *file, uint32_t top)
+{
+    struct M4_PROFILE_s *p = cpu->profile;
+    if (!p || !file)
+    {
+        PRINTF("[ERROR] m4_profile_report: Invalid Parameter\n");
+        return -1;
+    }
+    profile_switch(cpu, p->cur);
+
+    M4_PROFILE_FUNC *funcs = (M4_PROFILE_FUNC *)malloc(p->nodes * sizeof(M4_PROFILE_FUNC));
+    uint64_t *total = (uint64_t *)malloc(p->nodes * sizeof(uint64_t));
+    M4_PROFILE_HOT *hot = (M4_PROFILE_HOT *)malloc((p->slots ? p->slots : 1) * sizeof(M4_PROFILE_HOT));
+    int res = (funcs && total && hot) ? 0 : -1;
+    if (res)
+        PRINTF("[ERROR] m4_profile_report: Out of memory\n");
+    else
+    {
+        report_functions(p, syms, file, top, funcs, total);
+        report_hot(p, syms, file, top, p->pc, "Hot instructions", hot);
+        report_hot(p, syms, file, top, p->block, "Hot blocks", hot);
+        if (ferror(file))
+            res = -1;
+    }
+    free(funcs);
+    free(total);
+    free(hot);
+    return res;
+}
+
+#endif // USE_PROFILE
@@ -1,213 +1,108 @@
 #include "M4.h"
 #include "common.h"
 
-// Помощна функция за изчисляване на Overflow (V) за ADD и CMN
-static int compute_overflow_add(int32_t s_op1, int32_t s_op2, int32_t s_result)
-{
-    return ((s_op1 > 0 && s_op2 > 0 && s_result < 0) || (s_op1 < 0 && s_op2 < 0 && s_result > 0)) ? 1 : 0;
-}
+/*
+    NZCV се пазят като една дума: m4_flags_materialize изчислява четирите
+    бита на местата им в PSR (31:28) и ги записва с една маскирана операция.
+    C и V на събирането и изваждането идват от флаговете на хоста чрез
+    __builtin_*_overflow (на x86-64: add/sub + setc/seto).
+*/
 
-// Функция за ADD и ADC
-static void update_flags_add_adc(uint32_t op1, uint32_t op2, uint32_t result, int operation_type, int update_flags)
-{
-    if (update_flags & UPDATE_C)
-    {
-        CPU.psr.apsr.C = ((uint64_t)op1 + op2 + (operation_type == OP_ADC ? CPU.psr.apsr.C : 0) > 0xFFFFFFFF) ? 1 : 0;
-    }
-    if (update_flags & UPDATE_V)
-    {
-        int32_t s_op1 = (int32_t)op1, s_op2 = (int32_t)op2, s_result = (int32_t)result;
-        CPU.psr.apsr.V = compute_overflow_add(s_op1, s_op2, s_result);
-    }
-}
+#define PSR_N 0x80000000u
+#define PSR_Z 0x40000000u
+#define PSR_C 0x20000000u
+#define PSR_V 0x10000000u
 
-// Функция за SUB, SBC и CMP
-static void update_flags_sub_sbc_cmp(uint32_t op1, uint32_t op2, uint32_t result, int operation_type, int update_flags)
-{
-    if (update_flags & UPDATE_C)
-    {
-        CPU.psr.apsr.C = (op1 >= op2 + (operation_type == OP_SBC ? 1 - CPU.psr.apsr.C : 0)) ? 1 : 0;
-    }
-    if (update_flags & UPDATE_V)
-    {
-        int32_t s_op1 = (int32_t)op1, s_op2 = (int32_t)op2, s_result = (int32_t)result;
-        CPU.psr.apsr.V = ((s_op1 > 0 && s_op2 < 0 && s_result < 0) || (s_op1 < 0 && s_op2 > 0 && s_result > 0)) ? 1 : 0;
-    }
-}
+// Битовете в PSR по маска UPDATE_N/Z/C/V
+static const uint32_t psr_nzcv_bits[16] = {
+    0x00000000, 0x80000000, 0x40000000, 0xC0000000, 0x20000000, 0xA0000000, 0x60000000, 0xE0000000,
+    0x10000000, 0x90000000, 0x50000000, 0xD0000000, 0x30000000, 0xB0000000, 0x70000000, 0xF0000000,
+};
 
-// Функция за RSB
-static void update_flags_rsb(uint32_t op1, uint32_t op2, uint32_t result, int update_flags)
-{
-    if (update_flags & UPDATE_C)
-    {
-        CPU.psr.apsr.C = (op2 >= op1) ? 1 : 0;
-    }
-    if (update_flags & UPDATE_V)
-    {
-        int32_t s_op1 = (int32_t)op1, s_op2 = (int32_t)op2, s_result = (int32_t)result;
-        CPU.psr.apsr.V = ((s_op2 > 0 && s_op1 < 0 && s_result < 0) || (s_op2 < 0 && s_op1 > 0 && s_result > 0)) ? 1 : 0;
-    }
-}
+// Условие (EQ..AL) -> бит за всяка от 16-те стойности на NZCV (PSR >> 28)
+const uint16_t m4_cond_table[16] = {
+    0xF0F0, 0x0F0F, 0xCCCC, 0x3333, 0xFF00, 0x00FF, 0xAAAA, 0x5555,
+    0x0C0C, 0xF3F3, 0xAA55, 0x55AA, 0x0A05, 0xF5FA, 0xFFFF, 0x0000,
+};
 
-// Функция за CMN
-static void update_flags_cmn(uint32_t op1, uint32_t op2, uint32_t result, int update_flags)
+// C и V на op1 + op2 + carry (ADD, ADC, CMN). Двете събирания не могат да
+// препълнят едновременно без знак, а със знак второто отменя първото.
+static inline uint32_t flags_add(uint32_t op1, uint32_t op2, uint32_t carry)
 {
-    if (update_flags & UPDATE_C)
-    {
-        CPU.psr.apsr.C = ((uint64_t)op1 + op2 > 0xFFFFFFFF) ? 1 : 0;
-    }
-    if (update_flags & UPDATE_V)
-    {
-        int32_t s_op1 = (int32_t)op1, s_op2 = (int32_t)op2, s_result = (int32_t)result;
-        CPU.psr.apsr.V = compute_overflow_add(s_op1, s_op2, s_result);
-    }
+    uint32_t u;
+    int32_t s;
+    uint32_t c = __builtin_add_overflow(op1, op2, &u);
+    c |= __builtin_add_overflow(u, carry, &u);
+    uint32_t v = __builtin_add_overflow((int32_t)op1, (int32_t)op2, &s);
+    v ^= __builtin_add_overflow(s, (int32_t)carry, &s);
+    return (c ? PSR_C : 0) | (v ? PSR_V : 0);
 }
 
-// Функция за LSL
-static void update_flags_lsl(uint32_t op1, int shift_amount, int update_flags)
+// C (няма заем) и V на op1 - op2 - borrow (SUB, SBC, RSB, CMP)
+static inline uint32_t flags_sub(uint32_t op1, uint32_t op2, uint32_t borrow)
 {
-    if (update_flags & UPDATE_C)
-    {
-        if (shift_amount < 0 || shift_amount > 32)
-        {
-            DEBUG_M4("[ERROR] Invalid shift_amount %d in LSL\n", shift_amount);
-            CPU.psr.apsr.C = 0;
-            return;
-        }
-        if (shift_amount > 0)
-        {
-            CPU.psr.apsr.C = (op1 >> (32 - shift_amount)) & 1;
-        }
-        else
-        {
-            CPU.psr.apsr.C = 0; // Няма шифт, C остава непроменен
-        }
-    }
+    uint32_t u;
+    int32_t s;
+    uint32_t b = __builtin_sub_overflow(op1, op2, &u);
+    b |= __builtin_sub_overflow(u, borrow, &u);
+    uint32_t v = __builtin_sub_overflow((int32_t)op1, (int32_t)op2, &s);
+    v ^= __builtin_sub_overflow(s, (int32_t)borrow, &s);
+    return (b ? 0 : PSR_C) | (v ? PSR_V : 0);
 }
 
-// Функция за LSR, ASR и ROR
-static void update_flags_lsr_asr_ror(uint32_t op1, int shift_amount, int update_flags)
+// Записва в PSR отложените флагове от mask (NZCV)
+void m4_flags_materialize(CortexM4 *cpu, int mask)
 {
-    if (update_flags & UPDATE_C)
-    {
-        if (shift_amount < 0 || shift_amount > 32)
-        {
-            DEBUG_M4("[ERROR] Invalid shift_amount %d in LSR/ASR/ROR\n", shift_amount);
-            CPU.psr.apsr.C = 0;
-            return;
-        }
-        if (shift_amount > 0)
-        {
-            CPU.psr.apsr.C = (op1 >> (shift_amount - 1)) & 1;
-        }
-        else
-        {
-            CPU.psr.apsr.C = 0; // Няма шифт, C остава непроменен
-        }
-    }
-}
+    M4_LAZY *lazy = &cpu->lazy;
+    mask &= lazy->mask;
+    int done = mask;
 
-// Функция за TST и TEQ
-static void update_flags_tst_teq(int update_flags)
-{
-    // C и V не се променят
-    (void)update_flags; // Избягва предупреждение за неизползван параметър
-}
-
-#if USE_DSP
-// Функция за Q флага при SSAT и USAT
-static void update_flags_q_ssat_usat(uint32_t result, uint32_t op1, int update_flags)
-{
-    if (update_flags & UPDATE_Q)
-    {
-        CPU.psr.apsr.Q = (result != op1) ? 1 : CPU.psr.apsr.Q;
-    }
-}
+    // N и Z от резултата
+    uint32_t nzcv = (lazy->result & PSR_N) | (lazy->result ? 0 : PSR_Z);
 
-// Функция за GE флага при SADD16 и UADD16
-static void update_flags_ge_sadd16_uadd16(uint32_t result, uint32_t op1, uint32_t op2, int operation_type, int update_flags)
-{
-    if (update_flags & UPDATE_GE)
+    // C и V според операцията
+    if (mask & (UPDATE_C | UPDATE_V))
     {
-        int16_t op1_high = (op1 >> 16) & 0xFFFF, op1_low = op1 & 0xFFFF;
-        int16_t op2_high = (op2 >> 16) & 0xFFFF, op2_low = op2 & 0xFFFF;
-        int16_t res_high = (result >> 16) & 0xFFFF, res_low = result & 0xFFFF;
-        CPU.psr.apsr.GE = 0;
-        if (operation_type == OP_SADD16)
-        {
-            CPU.psr.apsr.GE |= (res_high >= 0) ? (1 << 3) : 0;
-            CPU.psr.apsr.GE |= (res_low >= 0) ? (1 << 2) : 0;
-        }
-        else
-        {
-            CPU.psr.apsr.GE |= (res_high >= op1_high + op2_high) ? (1 << 3) : 0;
-            CPU.psr.apsr.GE |= (res_low >= op1_low + op2_low) ? (1 << 2) : 0;
-        }
-    }
-}
-#endif
-
-// Основна функция за актуализация на APSR
-void m4_update_apsr(uint32_t result, uint32_t op1, uint32_t op2, int operation_type, int shift_amount, int update_flags)
-{
-    FUNC_VM();
-    // Актуализация на N (Negative)
-    if (update_flags & UPDATE_N)
-    {
-        CPU.psr.apsr.N = (result >> 31) & 1;
-    }
-
-    // Актуализация на Z (Zero)
-    if (update_flags & UPDATE_Z)
-    {
-        CPU.psr.apsr.Z = (result == 0) ? 1 : 0;
-    }
-
-    // Актуализация на всички флагове (C, V, Q, GE)
-    if (update_flags & (UPDATE_C | UPDATE_V | UPDATE_Q | UPDATE_GE))
-    {
-        switch (operation_type)
+        uint32_t op1 = lazy->op1;
+        uint32_t op2 = lazy->op2;
+        switch (lazy->type)
         {
         case OP_ADD:
+        case OP_CMN:
+            nzcv |= flags_add(op1, op2, 0);
+            break;
         case OP_ADC:
-            update_flags_add_adc(op1, op2, result, operation_type, update_flags);
+            nzcv |= flags_add(op1, op2, lazy->carry);
             break;
         case OP_SUB:
-        case OP_SBC:
         case OP_CMP:
-            update_flags_sub_sbc_cmp(op1, op2, result, operation_type, update_flags);
+            nzcv |= flags_sub(op1, op2, 0);
             break;
-        case OP_RSB:
-            update_flags_rsb(op1, op2, result, update_flags);
-            break;
-        case OP_CMN:
-            update_flags_cmn(op1, op2, result, update_flags);
-            break;
-        case OP_LSL:
-            update_flags_lsl(op1, shift_amount, update_flags);
+        case OP_SBC:
+            nzcv |= flags_sub(op1, op2, 1 - lazy->carry);
             break;
-        case OP_LSR:
-        case OP_ASR:
-        case OP_ROR:
-            update_flags_lsr_asr_ror(op1, shift_amount, update_flags);
+        case OP_RSB:
+            nzcv |= flags_sub(op2, op1, 0);
             break;
         case OP_TST:
         case OP_TEQ:
-            update_flags_tst_teq(update_flags);
-            break;
-#if USE_DSP
-        case OP_SSAT:
-        case OP_USAT:
-            update_flags_q_ssat_usat(result, op1, update_flags);
-            break;
-        case OP_SADD16:
-        case OP_UADD16:
-            update_flags_ge_sadd16_uadd16(result, op1, op2, operation_type, update_flags);
+            mask &= ~(UPDATE_C | UPDATE_V); // C и V не се променят
             break;
-#endif
         default:
-            DEBUG_M4("[WARNING] Unsupported operation_type %d in m4_update_apsr\n", operation_type);
+            DEBUG_M4("[WARNING] Unsupported operation_type %d in m4_flags_materialize\n", lazy->type);
+            mask &= ~(UPDATE_C | UPDATE_V);
             break;
         }
     }
+
+    uint32_t bits = psr_nzcv_bits[mask & UPDATE_NZCV];
+    cpu->psr.value = (cpu->psr.value & ~bits) | (nzcv & bits);
+    lazy->mask &= ~done;
+}
+
+// Четене на целия PSR (MRS, входа в изключение и т.н.)
+uint32_t m4_read_psr(CortexM4 *cpu)
+{
+    M4_FLAGS_SYNC(cpu);
+    return cpu->psr.value;
 }
@@ -0,0 +1,234 @@
+#include "M4.h"
+#include "common.h"
+
+/*
+    Снимка и възстановяване на състоянието на ядрото и RAM.
+
+    При m4_snapshot RAM се копира изцяло, а записът в RAM страниците се
+    изключва от таблицата на страниците. Първият запис във всяка страница
+    минава през бавния път, който я отбелязва като записана и я включва
+    обратно. m4_restore към същата снимка копира само записаните страници.
+*/
+
+struct M4_SNAPSHOT_s
+{
+    M4 REG;
+#if USE_FPU
+    FPU fpu;
+#endif
+    PSR psr;
+    M4_LAZY lazy;
+#if USE_NVIC
+    NVIC nvic;
+#endif
+#if USE_SYSTEM
+    uint32_t CONTROL;
+    uint32_t PRIMASK;
+    uint32_t FAULTMASK;
+    uint32_t BASEPRI;
+    uint32_t SP_alt;
+    uint8_t sp_psp;
+#endif
+    uint8_t ITSTATE;
+    uint8_t it_exec;
+    uint8_t excl;
+    uint32_t bl_upper_offset;
+    int bl_upper_pending;
+    uint8_t stop;
+    uint8_t stop_code;
+#if USE_CYCLES
+    uint64_t cycles;
+    uint32_t cyccnt_base;
+#endif
+#if USE_EVENTS
+    M4_EVENT events[M4_MAX_EVENTS];
+    uint32_t event_count;
+    M4_SYSTICK systick;
+#endif
+    uint8_t *ram;
+    uint32_t ram_size;
+};
+
+#define M4_RAM_PAGES(size) (((size) + M4_PAGE_SIZE - 1) >> M4_PAGE_BITS)
+
+// Отбелязва записаните страници и им връща директния запис
+void m4_mem_dirty(CortexM4 *cpu, uint32_t offset, uint32_t size)
+{
+    uint32_t last = (offset + size - 1) >> M4_PAGE_BITS;
+    for (uint32_t page = offset >> M4_PAGE_BITS; page <= last; page++)
+    {
+        cpu->dirty[page >> 5] |= 1u << (page & 31);
+        uint32_t start = page << M4_PAGE_BITS;
+        if (cpu->RAM_SIZE - start >= M4_PAGE_SIZE && m4_mem_host(cpu->mem.read, RAM_BASE + start, 1))
+            m4_mem_set_page(cpu->mem.write, RAM_BASE + start, cpu->RAM + start);
+    }
+}
+
+// Изключва директния запис за RAM страница, за да се хване следващият запис
+static void snap_protect(CortexM4 *cpu, uint32_t page)
+{
+    m4_mem_set_page(cpu->mem.write, RAM_BASE + (page << M4_PAGE_BITS), NULL);
+}
+
+// Започва следене на записите спрямо snap
+static int snap_track(CortexM4 *cpu, const M4_SNAPSHOT *snap)
+{
+    uint32_t pages = M4_RAM_PAGES(cpu->RAM_SIZE);
+    free(cpu->dirty); // RAM_SIZE може да се е променил
+    cpu->dirty = (uint32_t *)calloc((pages + 31) / 32, sizeof(uint32_t));
+    if (!cpu->dirty)
+    {
+        PRINTF("[ERROR] m4_snapshot: Out of memory\n");
+        return -1;
+    }
+    for (uint32_t page = 0; page < pages; page++)
+        snap_protect(cpu, page);
+    cpu->snap_base = snap;
+    return 0;
+}
+
+M4_SNAPSHOT *m4_snapshot(CortexM4 *cpu)
+{
+    M4_SNAPSHOT *snap = (M4_SNAPSHOT *)calloc(1, sizeof(M4_SNAPSHOT));
+    if (!snap || !(snap->ram = (uint8_t *)malloc(cpu->RAM_SIZE ? cpu->RAM_SIZE : 1)))
+    {
+        PRINTF("[ERROR] m4_snapshot: Out of memory\n");
+        free(snap);
+        return NULL;
+    }
+
+    snap->REG = cpu->REG;
+#if USE_FPU
+    snap->fpu = cpu->fpu;
+#endif
+    snap->psr = cpu->psr;
+    snap->lazy = cpu->lazy;
+#if USE_NVIC
+    snap->nvic = cpu->nvic;
+#endif
+#if USE_SYSTEM
+    snap->CONTROL = cpu->CONTROL;
+    snap->PRIMASK = cpu->PRIMASK;
+    snap->FAULTMASK = cpu->FAULTMASK;
+    snap->BASEPRI = cpu->BASEPRI;
+    snap->SP_alt = cpu->SP_alt;
+    snap->sp_psp = cpu->sp_psp;
+#endif
+    snap->ITSTATE = cpu->ITSTATE;
+    snap->it_exec = cpu->it_exec;
+    snap->excl = cpu->excl;
+    snap->bl_upper_offset = cpu->bl_upper_offset;
+    snap->bl_upper_pending = cpu->bl_upper_pending;
+    snap->stop = cpu->stop;
+    snap->stop_code = cpu->stop_code;
+#if USE_CYCLES
+    snap->cycles = cpu->cycles;
+    snap->cyccnt_base = cpu->cyccnt_base;
+#endif
+#if USE_EVENTS
+    memcpy(snap->events, cpu->events, sizeof(snap->events));
+    snap->event_count = cpu->event_count;
+    snap->systick = cpu->systick;
+#endif
+    snap->ram_size = cpu->RAM_SIZE;
+    memcpy(snap->ram, cpu->RAM, cpu->RAM_SIZE);
+
+    if (snap_track(cpu, snap))
+    {
+        m4_snapshot_free(cpu, snap);
+        return NULL;
+    }
+    return snap;
+}
+
+int m4_restore(CortexM4 *cpu, const M4_SNAPSHOT *snap)
+{
+    if (!snap || snap->ram_size != cpu->RAM_SIZE)
+    {
+        PRINTF("[ERROR] m4_restore: Snapshot does not match RAM size\n");
+        RETURN_ERROR(-1);
+    }
+
+    cpu->REG = snap->REG;
+#if USE_FPU
+    cpu->fpu = snap->fpu;
+#endif
+    cpu->psr = snap->psr;
+    cpu->lazy = snap->lazy;
+#if USE_NVIC
+    cpu->nvic = snap->nvic;
+#endif
+#if USE_SYSTEM
+    cpu->CONTROL = snap->CONTROL;
+    cpu->PRIMASK = snap->PRIMASK;
+    cpu->FAULTMASK = snap->FAULTMASK;
+    cpu->BASEPRI = snap->BASEPRI;
+    cpu->SP_alt = snap->SP_alt;
+    cpu->sp_psp = snap->sp_psp;
+#endif
+    cpu->ITSTATE = snap->ITSTATE;
+    cpu->it_exec = snap->it_exec;
+    cpu->excl = snap->excl;
+    cpu->bl_upper_offset = snap->bl_upper_offset;
+    cpu->bl_upper_pending = snap->bl_upper_pending;
+    cpu->stop = snap->stop;
+    cpu->stop_code = snap->stop_code;
+#if USE_CYCLES
+    cpu->cycles = snap->cycles;
+    cpu->cyccnt_base = snap->cyccnt_base;
+    m4_cycles_unwind(cpu); // Кадрите са от изоставеното изпълнение
+#endif
+#if USE_EVENTS
+    memcpy(cpu->events, snap->events, sizeof(cpu->events));
+    cpu->event_count = snap->event_count;
+    cpu->event_next = cpu->event_count ? cpu->events[0].when : UINT64_MAX;
+    cpu->systick = snap->systick;
+#endif
+#if USE_PROFILE
+    m4_profile_unwind(cpu);
+#endif
+    cpu->error = 0;
+
+    if (cpu->snap_base != snap)
+    {
+        // Друга снимка: пълно копие и следене спрямо нея
+        memcpy(cpu->RAM, snap->ram, cpu->RAM_SIZE);
+        if (snap_track(cpu, snap))
+            RETURN_ERROR(-1);
+        RETURN_ERROR(0);
+    }
+
+    // Само записаните страници
+    uint32_t words = (M4_RAM_PAGES(cpu->RAM_SIZE) + 31) / 32;
+    for (uint32_t w = 0; w < words; w++)
+    {
+        while (cpu->dirty[w])
+        {
+            uint32_t page = w * 32 + __builtin_ctz(cpu->dirty[w]);
+            uint32_t start = page << M4_PAGE_BITS;
+            uint32_t size = cpu->RAM_SIZE - start < M4_PAGE_SIZE ? cpu->RAM_SIZE - start : M4_PAGE_SIZE;
+            memcpy(cpu->RAM + start, snap->ram + start, size);
+            snap_protect(cpu, page);
+            cpu->dirty[w] &= cpu->dirty[w] - 1;
+        }
+    }
+    RETURN_ERROR(0);
+}
+
+void m4_snapshot_free(CortexM4 *cpu, M4_SNAPSHOT *snap)
+{
+    if (!snap)
+        return;
+    if (cpu && cpu->snap_base == snap)
+    {
+        // Без снимка записите не се следят: директен запис навсякъде
+        for (uint32_t start = 0; cpu->RAM_SIZE - start >= M4_PAGE_SIZE; start += M4_PAGE_SIZE)
+        {
+            if (m4_mem_host(cpu->mem.read, RAM_BASE + start, 1))
+                m4_mem_set_page(cpu->mem.write, RAM_BASE + start, cpu->RAM + start);
+        }
+        cpu->snap_base = NULL;
+    }
+    free(snap->ram);
+    free(snap);
+}
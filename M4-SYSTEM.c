@@ -0,0 +1,184 @@
+#include "M4.h"
+#include "common.h"
+
+#if USE_SYSTEM
+
+/*
+    Специални регистри: MRS, MSR (Thumb-2) и CPS (Thumb-16).
+
+    REG.SP е активният стеков указател, а другият (MSP или PSP) е в SP_alt.
+    Промените на маските преизчисляват чакащото прекъсване (USE_NVIC).
+*/
+
+#define SYSM_MSP 8
+#define SYSM_PSP 9
+#define SYSM_PRIMASK 16
+#define SYSM_BASEPRI 17
+#define SYSM_BASEPRI_MAX 18
+#define SYSM_FAULTMASK 19
+#define SYSM_CONTROL 20
+
+#if USE_NVIC
+#define SYSTEM_HANDLER_MODE(c) ((c)->psr.ExceptionNumber != 0)
+#define SYSTEM_BASEPRI_MASK ((0xFF << (8 - M4_NVIC_PRIO_BITS)) & 0xFF)
+#else
+#define SYSTEM_HANDLER_MODE(c) 0
+#define SYSTEM_BASEPRI_MASK 0xFF
+#endif
+
+static int system_privileged(const CortexM4 *cpu)
+{
+    return SYSTEM_HANDLER_MODE(cpu) || !(cpu->CONTROL & M4_CONTROL_NPRIV);
+}
+
+static void system_masks_changed(CortexM4 *cpu)
+{
+#if USE_NVIC
+    m4_nvic_update(cpu);
+#else
+    (void)cpu;
+#endif
+}
+
+static uint32_t system_read(CortexM4 *cpu, uint32_t sysm)
+{
+    if (sysm < 8)
+    {
+        // APSR, IAPSR, EAPSR, XPSR, IPSR, EPSR, IEPSR; EPSR се чете като 0
+        uint32_t psr = m4_read_psr(cpu);
+        uint32_t value = 0;
+        if (sysm & 0x1)
+            value |= psr & 0x1FF;
+        if (!(sysm & 0x4))
+            value |= psr & 0xF80F0000;
+        return value;
+    }
+    switch (sysm)
+    {
+    case SYSM_MSP:
+        return cpu->sp_psp ? cpu->SP_alt : cpu->REG.SP;
+    case SYSM_PSP:
+        return cpu->sp_psp ? cpu->REG.SP : cpu->SP_alt;
+    case SYSM_PRIMASK:
+        return cpu->PRIMASK & 0x1;
+    case SYSM_BASEPRI:
+    case SYSM_BASEPRI_MAX:
+        return cpu->BASEPRI;
+    case SYSM_FAULTMASK:
+        return cpu->FAULTMASK & 0x1;
+    case SYSM_CONTROL:
+        return cpu->CONTROL;
+    default:
+        return 0;
+    }
+}
+
+static void system_write(CortexM4 *cpu, uint32_t sysm, uint32_t mask, uint32_t value)
+{
+    if (sysm < 4)
+    {
+        // APSR_nzcvq (mask<1>); GE (mask<0>) е в M4-DSP.c
+        if (mask & 0x2)
+        {
+            M4_FLAGS_SYNC(cpu);
+            cpu->psr.value = (cpu->psr.value & ~0xF8000000) | (value & 0xF8000000);
+        }
+        return;
+    }
+    if (!system_privileged(cpu))
+        return; // Непривилегирован код: записът се игнорира
+
+    switch (sysm)
+    {
+    case SYSM_MSP:
+        if (cpu->sp_psp)
+            cpu->SP_alt = value & ~0x3;
+        else
+            cpu->REG.SP = value & ~0x3;
+        break;
+    case SYSM_PSP:
+        if (cpu->sp_psp)
+            cpu->REG.SP = value & ~0x3;
+        else
+            cpu->SP_alt = value & ~0x3;
+        break;
+    case SYSM_PRIMASK:
+        cpu->PRIMASK = value & 0x1;
+        break;
+    case SYSM_BASEPRI:
+        cpu->BASEPRI = value & SYSTEM_BASEPRI_MASK;
+        break;
+    case SYSM_BASEPRI_MAX:
+        value &= SYSTEM_BASEPRI_MASK;
+        if (value && (value < cpu->BASEPRI || !cpu->BASEPRI))
+            cpu->BASEPRI = value;
+        break;
+    case SYSM_FAULTMASK:
+#if USE_NVIC
+        if (cpu->nvic.exec_prio <= -1)
+            break; // Не се задава в NMI и HardFault
+#endif
+        cpu->FAULTMASK = value & 0x1;
+        break;
+    case SYSM_CONTROL:
+        if (SYSTEM_HANDLER_MODE(cpu))
+            value &= ~M4_CONTROL_SPSEL; // Handler режим винаги е с MSP
+        cpu->CONTROL = value & (M4_CONTROL_NPRIV | M4_CONTROL_SPSEL);
+        m4_sp_select(cpu, cpu->CONTROL & M4_CONTROL_SPSEL);
+        break;
+    default:
+        break;
+    }
+    system_masks_changed(cpu);
+}
+
+// MRS Rd, <spec_reg> [11110 0 1111 1 0 1111 | 10 0 0 Rd SYSm]
+// MSR <spec_reg>, Rn [11110 0 1110 0 0 Rn | 10 0 0 mask 00 SYSm]
+int m4_execute_system(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t op = cpu->op;
+    uint32_t sysm = op & 0xFF;
+    if ((op & 0xFFFFF000) == 0xF3EF8000)
+    {
+        uint32_t rd = (op >> 8) & 0xF;
+        if (rd >= 13)
+            return -1;
+        cpu->REG.r[rd] = system_read(cpu, sysm);
+    }
+    else
+    {
+        uint32_t rn = (op >> 16) & 0xF;
+        if (rn >= 13)
+            return -1;
+        system_write(cpu, sysm, (op >> 10) & 0x3, cpu->REG.r[rn]);
+    }
+    cpu->REG.PC += 4;
+    return 0;
+}
+
+// CPSIE/CPSID [1011 0110 011 im 0 0 I F]
+int m4_execute_cps(CortexM4 *cpu)
+{
+    FUNC_VM();
+    uint32_t disable = (cpu->op >> 4) & 0x1;
+    if (system_privileged(cpu))
+    {
+        if (cpu->op & 0x2)
+            cpu->PRIMASK = disable;
+        if (cpu->op & 0x1)
+        {
+#if USE_NVIC
+            if (!disable || cpu->nvic.exec_prio > -1)
+                cpu->FAULTMASK = disable;
+#else
+            cpu->FAULTMASK = disable;
+#endif
+        }
+        system_masks_changed(cpu);
+    }
+    cpu->REG.PC += 2; // Завършва блока, за да се види новата маска веднага
+    return 0;
+}
+
+#endif // USE_SYSTEM
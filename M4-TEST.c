@@ -0,0 +1,608 @@
+#include "M4.h"
+#include "common.h"
+
+#if defined(M4_TEST_MAIN)
+
+#include <time.h>
+#include <unistd.h>
+
+/*
+    m4test: проверки на ядрото върху готови фрагменти Thumb код.
+
+        m4test [-b]
+
+    Всеки фрагмент се изпълнява поотделно с m4_execute, m4_execute_block,
+    m4_run и при USE_JIT - с m4_run и JIT в режимите ON и VERIFY, всеки
+    път в ново ядро. Крайните регистри и PSR трябва да са
+    еднакви във всички режими и да съвпадат с очакваните стойности. Те са
+    изведени от ARMv7-M ARM, а не от ядрото. С -b се измерва и скоростта.
+
+    Фрагментите са асемблирани предварително; в коментара до всяка
+    полудума са адресът и инструкцията. Таблицата на флаговете се
+    превръща във фрагменти от една инструкция и BKPT.
+
+    Компилира се с -DM4_TEST_MAIN. Изходът е 0, ако всички проверки минат.
+*/
+
+#define TEST_ROM_SIZE 0x1000
+#define TEST_RAM_SIZE 0x10000
+#define TEST_SP (RAM_BASE + TEST_RAM_SIZE)
+#define TEST_NZCV (1u << 16) // В check: проверяват се и NZCV
+#define TEST_STEPS 100000    // Граница за фрагмент, който не стига до BKPT
+#define TEST_CORES 256       // Ядра при измерването с много инстанции
+#define TEST_SLICE 1000      // Инструкции на ядро, преди да дойде ред на следващото
+
+// Начини на изпълнение, които трябва да дадат едно и също състояние
+enum
+{
+    TEST_STEP,  // m4_execute
+    TEST_BLOCK, // m4_execute_block
+    TEST_RUN,   // m4_run
+#if USE_JIT
+    TEST_JIT,        // m4_run с M4_JIT_ON
+    TEST_JIT_VERIFY, // m4_run с M4_JIT_VERIFY
+#endif
+    TEST_MODES
+};
+
+static const char *const test_mode_name[TEST_MODES] = {
+    "m4_execute",
+    "m4_execute_block",
+    "m4_run",
+#if USE_JIT
+    "JIT",
+    "JIT verify",
+#endif
+};
+
+typedef struct
+{
+    const char *name;
+    const uint16_t *code;
+    uint32_t size;     // Байтове
+    uint32_t start;    // Начален PC
+    uint32_t in[8];    // R0–R7 в началото
+    uint32_t in_nzcv;  // NZCV в началото (битове 3:0)
+    uint32_t check;    // Проверяваните R0–R15 и TEST_NZCV
+    uint32_t out[16];  // Очаквани регистри
+    uint32_t out_nzcv; // Очаквани NZCV
+} M4_TEST;
+
+// Една инструкция с R0 = a, R1 = b, последвана от BKPT
+typedef struct
+{
+    const char *name;
+    uint16_t insn[2]; // Втората полудума само при Thumb-2
+    uint32_t a, b;
+    uint32_t in_nzcv;
+    int rd;          // Регистър с резултата, -1 при CMP и CMN
+    uint32_t result;
+    uint32_t nzcv;
+} M4_FLAGS;
+
+// ФРАГМЕНТИ //////////////////////////
+
+// Цикъл от 40 итерации: ALU, ADD Rd, PC / SP, ADD и SUB SP, MOV и ADD с PC.
+// Блокът на цикъла е достатъчно горещ, за да се компилира от JIT.
+static const uint16_t test_alu[] = {
+    0x2728,          // 00: movs r7, #40
+    0x2000,          // 02: movs r0, #0
+    0x2103,          // 04: movs r1, #3
+    0x2600,          // 06: movs r6, #0
+    0x1840,          // 08: adds r0, r0, r1
+    0x0082,          // 0A: lsls r2, r0, #2
+    0x404A,          // 0C: eors r2, r1
+    0xAB02,          // 0E: add r3, sp, #8
+    0xA403,          // 10: adr r4, #12
+    0xB082,          // 12: sub sp, #8
+    0xB001,          // 14: add sp, #4
+    0x467D,          // 16: mov r5, pc
+    0x447E,          // 18: add r6, pc
+    0x3F01,          // 1A: subs r7, #1
+    0xD1F4,          // 1C: bne 0x8
+    0xBE00,          // 1E: bkpt #0
+    0x0000, 0x0000,  // 20: .word 0x00000000
+};
+
+// CBZ, CBNZ, BL, PUSH, POP {PC}, разширения, REV и ADD PC, Rm
+static const uint16_t test_branch[] = {
+    0x2000,          // 00: movs r0, #0
+    0x2105,          // 02: movs r1, #5
+    0xB100,          // 04: cbz r0, 0x8
+    0x2109,          // 06: movs r1, #9
+    0xB900,          // 08: cbnz r0, 0xc
+    0x3101,          // 0A: adds r1, #1
+    0xF000, 0xF801,  // 0C: bl 0x12
+    0xE003,          // 10: b 0x1a
+    0xB510,          // 12: push {r4, lr}
+    0x2407,          // 14: movs r4, #7
+    0x1900,          // 16: adds r0, r0, r4
+    0xBD10,          // 18: pop {r4, pc}
+    0x4B05,          // 1A: ldr r3, [pc, #20]
+    0xB21A,          // 1C: sxth r2, r3
+    0xB2DC,          // 1E: uxtb r4, r3
+    0xBA1D,          // 20: rev r5, r3
+    0xBADE,          // 22: revsh r6, r3
+    0x2702,          // 24: movs r7, #2
+    0x44BF,          // 26: add pc, r7
+    0x20EE,          // 28: movs r0, #238
+    0x2777,          // 2A: movs r7, #119
+    0xBE00,          // 2C: bkpt #0
+    0x0000,          // 2E: подравняване
+    0xF2F3, 0x8081,  // 30: .word 0x8081F2F3
+};
+
+// IT блокове, в които CMP, CMN и SUBS.W променят условието
+static const uint16_t test_it[] = {
+    0x2005,          // 00: movs r0, #5
+    0x4680,          // 02: mov r8, r0
+    0x2100,          // 04: movs r1, #0
+    0x2200,          // 06: movs r2, #0
+    0x2300,          // 08: movs r3, #0
+    0x2400,          // 0A: movs r4, #0
+    0x2805,          // 0C: cmp r0, #5
+    0xBF0C,          // 0E: ite eq
+    0x2101,          // 10: moveq r1, #1
+    0x2102,          // 12: movne r1, #2
+    0xBF04,          // 14: itt eq
+    0x4590,          // 16: cmpeq r8, r2
+    0x2207,          // 18: moveq r2, #7
+    0x2805,          // 1A: cmp r0, #5
+    0xBF04,          // 1C: itt eq
+    0xF1B0, 0x0305,  // 1E: subseq.w r3, r0, #5
+    0x2303,          // 22: moveq r3, #3
+    0x2805,          // 24: cmp r0, #5
+    0xBF04,          // 26: itt eq
+    0x42C0,          // 28: cmneq r0, r0
+    0x2404,          // 2A: moveq r4, #4
+    0xBE00,          // 2C: bkpt #0
+};
+
+// Thumb-2: ADDW и SUBW SP, MOVW и MOVT, модифицирана константа, MUL, UDIV
+static const uint16_t test_t2[] = {
+    0x466F,          // 00: mov r7, sp
+    0xF2AD, 0x1D23,  // 02: subw sp, sp, #0x123
+    0x466E,          // 06: mov r6, sp
+    0xF20D, 0x1D23,  // 08: addw sp, sp, #0x123
+    0xF245, 0x6078,  // 0C: movw r0, #0x5678
+    0xF2C1, 0x2034,  // 10: movt r0, #0x1234
+    0xF500, 0x7180,  // 14: add.w r1, r0, #0x100
+    0xF400, 0x427F,  // 18: and r2, r0, #0xFF00
+    0x2307,          // 1C: movs r3, #7
+    0xFB03, 0xF303,  // 1E: mul r3, r3, r3
+    0xFBB0, 0xF4F3,  // 22: udiv r4, r0, r3
+    0xFA03, 0xF503,  // 26: lsl.w r5, r3, r3
+    0xFA90, 0xF590,  // 2A: rev16.w r5, r0
+    0xBE00,          // 2E: bkpt #0
+};
+
+// Bit-band: запис и четене през псевдонима на бит 3 от байт 0x20000010, после
+// байтът и полудумата през обикновения адрес
+static const uint16_t test_bitband[] = {
+    0x4806,          // 00: ldr r0, [pc, #24]
+    0x2101,          // 02: movs r1, #1
+    0x6001,          // 04: str r1, [r0]
+    0x6141,          // 06: str r1, [r0, #20]
+    0x6802,          // 08: ldr r2, [r0]
+    0x6843,          // 0A: ldr r3, [r0, #4]
+    0x4C04,          // 0C: ldr r4, [pc, #16]
+    0x7824,          // 0E: ldrb r4, [r4]
+    0x2100,          // 10: movs r1, #0
+    0x6001,          // 12: str r1, [r0]
+    0x4D02,          // 14: ldr r5, [pc, #8]
+    0x882D,          // 16: ldrh r5, [r5]
+    0xBE00,          // 18: bkpt #0
+    0x0000,          // 1A: подравняване
+    0x020C, 0x2200,  // 1C: .word 0x2200020C
+    0x0010, 0x2000,  // 20: .word 0x20000010
+};
+
+// За скоростта: R7 пъти вдигане и сваляне на бит през псевдонима (от 0x0)
+// и същото с LDRB/ORRS/BICS/STRB върху байта (от 0xA)
+static const uint16_t test_bitband_loop[] = {
+    0x6001,          // 00: str r1, [r0]
+    0x6002,          // 02: str r2, [r0]
+    0x3F01,          // 04: subs r7, #1
+    0xD1FB,          // 06: bne 0x0
+    0xBE00,          // 08: bkpt #0
+    0x781C,          // 0A: ldrb r4, [r3]
+    0x432C,          // 0C: orrs r4, r5
+    0x701C,          // 0E: strb r4, [r3]
+    0x781C,          // 10: ldrb r4, [r3]
+    0x43AC,          // 12: bics r4, r5
+    0x701C,          // 14: strb r4, [r3]
+    0x3F01,          // 16: subs r7, #1
+    0xD1F7,          // 18: bne 0xa
+    0xBE00,          // 1A: bkpt #0
+};
+
+// За скоростта: R7 итерации с флагове от почти всяка инструкция
+static const uint16_t test_flags_loop[] = {
+    0x1840,          // 00: adds r0, r0, r1
+    0x415A,          // 02: adcs r2, r3
+    0x418C,          // 04: sbcs r4, r1
+    0x42D0,          // 06: cmn r0, r2
+    0x0045,          // 08: lsls r5, r0, #1
+    0x0856,          // 0A: lsrs r6, r2, #1
+    0x3F01,          // 0C: subs r7, #1
+    0xD1F7,          // 0E: bne 0x0
+    0xBE00,          // 10: bkpt #0
+};
+
+#define TEST_CODE(c) (c), sizeof(c)
+
+static const M4_TEST tests[] = {
+    {
+        .name = "alu",
+        TEST_CODE(test_alu),
+        .check = 0xE0FF | TEST_NZCV,
+        .out = {120, 3, 483, TEST_SP - 148, 0x20, 0x1A, 40 * 0x1C, 0, [13] = TEST_SP - 160, 0, 0x1E},
+        .out_nzcv = 0x6, // Z, C от последното SUBS
+    },
+    {
+        .name = "branch",
+        TEST_CODE(test_branch),
+        .check = 0xE0FF | TEST_NZCV,
+        .out = {7, 6, 0xFFFFF2F3, 0x8081F2F3, 0xF3, 0xF3F28180, 0xFFFFF3F2, 2, [13] = TEST_SP, 0x11, 0x2C},
+        .out_nzcv = 0,
+    },
+    {
+        .name = "it",
+        TEST_CODE(test_it),
+        .check = 0x811F | TEST_NZCV,
+        .out = {5, 1, 0, 3, 0, [8] = 5, [15] = 0x2C},
+        .out_nzcv = 0, // CMN 5 + 5
+    },
+    {
+        .name = "thumb2",
+        TEST_CODE(test_t2),
+        .check = 0xA0FF | TEST_NZCV,
+        .out = {0x12345678, 0x12345778, 0x5600, 49, 0x12345678 / 49, 0x34127856, TEST_SP - 0x123, TEST_SP, [13] = TEST_SP, [15] = 0x2E},
+        .out_nzcv = 0,
+    },
+    {
+        .name = "bitband",
+        TEST_CODE(test_bitband),
+        .check = 0x803F,
+        .out = {0x2200020C, 0, 1, 0, 0x08, 0x0100, [15] = 0x18},
+    },
+};
+
+#define TEST_COUNT (sizeof(tests) / sizeof(tests[0]))
+
+// Флагове по ARMv7-M ARM, AddWithCarry и Shift_C. Пренос, препълване, нула и
+// знак поотделно, включително входният C при ADCS и SBCS.
+static const M4_FLAGS test_flags[] = {
+    {"ADDS 0x7FFFFFFF + 1", {0x1842}, 0x7FFFFFFF, 1, 0x0, 2, 0x80000000, 0x9},
+    {"ADDS 0xFFFFFFFF + 1", {0x1842}, 0xFFFFFFFF, 1, 0x0, 2, 0, 0x6},
+    {"ADDS 0x80000000 + 0x80000000", {0x1842}, 0x80000000, 0x80000000, 0x0, 2, 0, 0x7},
+    {"ADDS 1 + 2", {0x1842}, 1, 2, 0xF, 2, 3, 0x0},
+    {"SUBS 0 - 1", {0x1A42}, 0, 1, 0x0, 2, 0xFFFFFFFF, 0x8},
+    {"SUBS 5 - 5", {0x1A42}, 5, 5, 0x0, 2, 0, 0x6},
+    {"SUBS 0x80000000 - 1", {0x1A42}, 0x80000000, 1, 0x0, 2, 0x7FFFFFFF, 0x3},
+    {"SUBS 0x7FFFFFFF - 0xFFFFFFFF", {0x1A42}, 0x7FFFFFFF, 0xFFFFFFFF, 0x0, 2, 0x80000000, 0x9},
+    {"ADCS 0xFFFFFFFF + 0 + C", {0x4148}, 0xFFFFFFFF, 0, 0x2, 0, 0, 0x6},
+    {"ADCS 0x7FFFFFFF + 0 + C", {0x4148}, 0x7FFFFFFF, 0, 0x2, 0, 0x80000000, 0x9},
+    {"ADCS 1 + 1", {0x4148}, 1, 1, 0x0, 0, 2, 0x0},
+    {"SBCS 5 - 5 - !C", {0x4188}, 5, 5, 0x0, 0, 0xFFFFFFFF, 0x8},
+    {"SBCS 5 - 5", {0x4188}, 5, 5, 0x2, 0, 0, 0x6},
+    {"SBCS 0x80000000 - 0 - !C", {0x4188}, 0x80000000, 0, 0x0, 0, 0x7FFFFFFF, 0x3},
+    {"CMP 3, 5", {0x4288}, 3, 5, 0x0, -1, 0, 0x8},
+    {"CMP 5, 3", {0x4288}, 5, 3, 0x0, -1, 0, 0x2},
+    {"CMN 0xFFFFFFFF, 1", {0x42C8}, 0xFFFFFFFF, 1, 0x0, -1, 0, 0x6},
+    {"CMN 0x7FFFFFFF, 0x7FFFFFFF", {0x42C8}, 0x7FFFFFFF, 0x7FFFFFFF, 0x0, -1, 0, 0x9},
+    {"LSLS 0x80000001, #1", {0x0042}, 0x80000001, 0, 0x0, 2, 2, 0x2},
+    {"LSRS 1, #1", {0x0842}, 1, 0, 0x0, 2, 0, 0x6},
+    {"ADDS.W 0xFFFFFFFF + 1", {0xEB10, 0x0201}, 0xFFFFFFFF, 1, 0x0, 2, 0, 0x6},
+    {"ADDS.W 0x7FFFFFFF + 1", {0xEB10, 0x0201}, 0x7FFFFFFF, 1, 0x0, 2, 0x80000000, 0x9},
+    {"SBCS.W 5 - 5 - !C", {0xEB70, 0x0201}, 5, 5, 0x0, 2, 0xFFFFFFFF, 0x8},
+    {"SBCS.W 0x80000000 - 0 - !C", {0xEB70, 0x0201}, 0x80000000, 0, 0x0, 2, 0x7FFFFFFF, 0x3},
+    {"MOVS #0", {0x2200}, 0, 0, 0xB, 2, 0, 0x7}, // C и V се запазват
+};
+
+#define TEST_FLAGS_COUNT (sizeof(test_flags) / sizeof(test_flags[0]))
+
+// ЯДРО ///////////////////////////////
+
+static void test_free(CortexM4 *cpu)
+{
+    if (!cpu)
+        return;
+    uint8_t *rom = cpu->ROM;
+    uint8_t *ram = cpu->RAM;
+    m4_destroy(cpu);
+    free(rom);
+    free(ram);
+}
+
+// Ново ядро с кода в началото на ROM и SP в края на RAM
+static CortexM4 *test_core(const uint16_t *code, uint32_t size, int mode)
+{
+    CortexM4 *cpu = m4_create();
+    if (!cpu)
+        return NULL;
+    cpu->ROM = (uint8_t *)calloc(1, TEST_ROM_SIZE);
+    cpu->RAM = (uint8_t *)calloc(1, TEST_RAM_SIZE);
+    cpu->ROM_SIZE = TEST_ROM_SIZE;
+    cpu->RAM_SIZE = TEST_RAM_SIZE;
+    if (!cpu->ROM || !cpu->RAM || size > TEST_ROM_SIZE || m4_mem_init(cpu) || m4_icache_init(cpu))
+    {
+        test_free(cpu);
+        return NULL;
+    }
+    memcpy(cpu->ROM, code, size);
+    cpu->REG.SP = TEST_SP;
+#if USE_JIT
+    if (mode >= TEST_JIT && m4_jit_init(cpu, mode == TEST_JIT ? M4_JIT_ON : M4_JIT_VERIFY))
+    {
+        test_free(cpu);
+        return NULL;
+    }
+#else
+    (void)mode;
+#endif
+    return cpu;
+}
+
+// Изпълнява до BKPT или до max инструкции. Връща 0 при спиране на BKPT.
+static int test_exec(CortexM4 *cpu, int mode, uint64_t max, uint64_t *count)
+{
+    uint64_t n = 0;
+    M4_STOP stop;
+    switch (mode)
+    {
+    case TEST_STEP:
+        while (!cpu->stop && n < max)
+        {
+            if (m4_execute(cpu))
+                return -1;
+            n++;
+        }
+        break;
+    case TEST_BLOCK:
+        while (!cpu->stop && n < max)
+        {
+            uint32_t executed;
+            if (m4_execute_block(cpu, &executed))
+                return -1;
+            n += executed;
+        }
+        break;
+    default:
+        n = m4_run(cpu, max, &stop);
+        break;
+    }
+    if (count)
+        *count = n;
+    return cpu->stop == M4_STOP_BKPT ? 0 : -1;
+}
+
+// Пуска фрагмента във всички режими. Връща 0, ако всичко съвпада.
+static int test_case(const M4_TEST *t)
+{
+    M4 regs[TEST_MODES];
+    uint32_t psr[TEST_MODES];
+    int fail = 0;
+
+    for (int mode = 0; mode < TEST_MODES; mode++)
+    {
+        CortexM4 *cpu = test_core(t->code, t->size, mode);
+        if (!cpu)
+        {
+            printf("[FAIL] %s: cannot create core\n", t->name);
+            return 1;
+        }
+        memcpy(cpu->REG.r, t->in, sizeof(t->in));
+        cpu->REG.PC = t->start;
+        cpu->psr.value |= t->in_nzcv << 28;
+        if (test_exec(cpu, mode, TEST_STEPS, NULL))
+        {
+            printf("[FAIL] %s: %s stopped at 0x%08X without BKPT\n", t->name, test_mode_name[mode], cpu->REG.PC);
+            fail = 1;
+        }
+        regs[mode] = cpu->REG;
+        psr[mode] = m4_read_psr(cpu);
+        test_free(cpu);
+    }
+
+    // Стъпковото изпълнение спрямо очакваното, останалите - спрямо него
+    for (int i = 0; i < 16; i++)
+    {
+        if (((t->check >> i) & 0x1) && regs[TEST_STEP].r[i] != t->out[i])
+        {
+            printf("[FAIL] %s: R%d 0x%08X, expected 0x%08X\n", t->name, i, regs[TEST_STEP].r[i], t->out[i]);
+            fail = 1;
+        }
+    }
+    if ((t->check & TEST_NZCV) && (psr[TEST_STEP] >> 28) != t->out_nzcv)
+    {
+        printf("[FAIL] %s: NZCV 0x%X, expected 0x%X\n", t->name, psr[TEST_STEP] >> 28, t->out_nzcv);
+        fail = 1;
+    }
+    for (int mode = TEST_STEP + 1; mode < TEST_MODES; mode++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            if (regs[mode].r[i] != regs[TEST_STEP].r[i])
+            {
+                printf("[FAIL] %s: R%d 0x%08X in %s, 0x%08X in %s\n", t->name, i, regs[mode].r[i], test_mode_name[mode],
+                       regs[TEST_STEP].r[i], test_mode_name[TEST_STEP]);
+                fail = 1;
+            }
+        }
+        if (psr[mode] != psr[TEST_STEP])
+        {
+            printf("[FAIL] %s: PSR 0x%08X in %s, 0x%08X in %s\n", t->name, psr[mode], test_mode_name[mode], psr[TEST_STEP],
+                   test_mode_name[TEST_STEP]);
+            fail = 1;
+        }
+    }
+    return fail;
+}
+
+// Ред от таблицата на флаговете като фрагмент. Връща 0, ако всичко съвпада.
+static int test_flags_case(const M4_FLAGS *f)
+{
+    uint16_t code[3] = {f->insn[0], f->insn[1]};
+    uint32_t n = (f->insn[0] >> 11) >= 0x1D ? 2 : 1; // 0b11101, 0b11110, 0b11111: Thumb-2
+    code[n] = 0xBE00;
+
+    M4_TEST t = {
+        .name = f->name,
+        .code = code,
+        .size = (n + 1) * sizeof(uint16_t),
+        .in = {f->a, f->b},
+        .in_nzcv = f->in_nzcv,
+        .check = 0x8003 | TEST_NZCV,
+        .out = {f->a, f->b, [15] = n * 2},
+        .out_nzcv = f->nzcv,
+    };
+    if (f->rd >= 0)
+    {
+        t.check |= 1u << f->rd;
+        t.out[f->rd] = f->result;
+    }
+    return test_case(&t);
+}
+
+// СКОРОСТ ////////////////////////////
+
+static double test_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Секунди за фрагмента от start с R0–R7 = in; в count - изпълнените инструкции
+static double test_time(const uint16_t *code, uint32_t size, uint32_t start, const uint32_t *in, int mode, uint64_t *count)
+{
+    CortexM4 *cpu = test_core(code, size, mode);
+    if (!cpu)
+        return 0;
+    memcpy(cpu->REG.r, in, 8 * sizeof(uint32_t));
+    cpu->REG.PC = start;
+    double t0 = test_now();
+    int res = test_exec(cpu, mode, UINT64_MAX, count);
+    double t1 = test_now();
+    test_free(cpu);
+    return res ? 0 : t1 - t0;
+}
+
+// Милиони инструкции в секунда
+static double test_mips(const uint16_t *code, uint32_t size, uint32_t start, const uint32_t *in, int mode)
+{
+    uint64_t count = 0;
+    double t = test_time(code, size, start, in, mode, &count);
+    return t > 0 ? count / t / 1e6 : 0;
+}
+
+// Милиони инструкции в секунда за TEST_CORES ядра с един и същи фрагмент,
+// редувани през TEST_SLICE инструкции, както в пакетен режим
+static double test_mips_cores(const uint16_t *code, uint32_t size, uint32_t start, const uint32_t *in, int mode)
+{
+    static CortexM4 *cpu[TEST_CORES];
+    uint32_t cores = 0;
+    while (cores < TEST_CORES && (cpu[cores] = test_core(code, size, mode)))
+    {
+        memcpy(cpu[cores]->REG.r, in, 8 * sizeof(uint32_t));
+        cpu[cores]->REG.PC = start;
+        cores++;
+    }
+
+    uint64_t total = 0;
+    int res = cores == TEST_CORES ? 0 : -1;
+    double t0 = test_now();
+    for (int running = !res; running;)
+    {
+        running = 0;
+        for (uint32_t i = 0; i < cores; i++)
+        {
+            // m4_run отбелязва изчерпания отрязък с M4_STOP_BUDGET
+            if (cpu[i]->stop != M4_STOP_NONE && cpu[i]->stop != M4_STOP_BUDGET)
+                continue;
+            uint64_t count = 0;
+            test_exec(cpu[i], mode, TEST_SLICE, &count);
+            total += count;
+            running |= cpu[i]->stop == M4_STOP_NONE || cpu[i]->stop == M4_STOP_BUDGET;
+        }
+    }
+    double t1 = test_now();
+
+    for (uint32_t i = 0; i < cores; i++)
+    {
+        if (cpu[i]->stop != M4_STOP_BKPT)
+            res = -1;
+        test_free(cpu[i]);
+    }
+    return res ? 0 : total / (t1 - t0) / 1e6;
+}
+
+static void test_bench(void)
+{
+    // Цикълът на "alu" без началните MOVS: R7 итерации по 11 инструкции
+    const uint32_t in[8] = {0, 3, 0, 0, 0, 0, 0, 1u << 20};
+    printf("\nMIPS, alu loop:\n");
+    for (int mode = 0; mode < TEST_MODES; mode++)
+        printf("  %-18s %8.1f\n", test_mode_name[mode], test_mips(TEST_CODE(test_alu), 0x8, in, mode));
+
+    // Същата работа, разделена между TEST_CORES ядра: разликата спрямо горното е
+    // цената на честата смяна на ядрото, включително промахите в кеша на хоста
+    const uint32_t many[8] = {0, 3, 0, 0, 0, 0, 0, (1u << 20) / TEST_CORES};
+    printf("\nMIPS, alu loop on %u cores, %u instructions per slice:\n", TEST_CORES, TEST_SLICE);
+    for (int mode = 0; mode < TEST_MODES; mode++)
+        printf("  %-18s %8.1f\n", test_mode_name[mode], test_mips_cores(TEST_CODE(test_alu), 0x8, many, mode));
+
+    const uint32_t fl[8] = {0, 0x9E3779B9, 0, 0x7FFFFFFF, 0, 0, 0, 1u << 20};
+    printf("\nMIPS, flags loop:\n");
+    for (int mode = 0; mode < TEST_MODES; mode++)
+        printf("  %-18s %8.1f\n", test_mode_name[mode], test_mips(TEST_CODE(test_flags_loop), 0x0, fl, mode));
+
+    // Две превключвания на итерация: през псевдонима и с четене-промяна-запис
+    const uint32_t bb[8] = {0x2200020C, 1, 0, 0x20000010, 0, 0x08, 0, 1u << 20};
+    printf("\nMillion bit toggles/s, bit-band alias / LDRB-ORRS-BICS-STRB:\n");
+    for (int mode = 0; mode < TEST_MODES; mode++)
+    {
+        double alias = test_time(TEST_CODE(test_bitband_loop), 0x0, bb, mode, NULL);
+        double rmw = test_time(TEST_CODE(test_bitband_loop), 0xA, bb, mode, NULL);
+        printf("  %-18s %8.1f %8.1f\n", test_mode_name[mode], alias > 0 ? 2.0 * bb[7] / alias / 1e6 : 0,
+               rmw > 0 ? 2.0 * bb[7] / rmw / 1e6 : 0);
+    }
+}
+
+///////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+    int bench = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b")) != -1)
+    {
+        if (opt != 'b')
+        {
+            fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+            return 2;
+        }
+        bench = 1;
+    }
+
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < TEST_COUNT; i++)
+    {
+        int fail = test_case(&tests[i]);
+        printf("[%s] %s\n", fail ? "FAIL" : " OK ", tests[i].name);
+        failed += fail;
+    }
+    int fail = 0;
+    for (uint32_t i = 0; i < TEST_FLAGS_COUNT; i++)
+        fail |= test_flags_case(&test_flags[i]);
+    printf("[%s] flags (%u cases)\n", fail ? "FAIL" : " OK ", (uint32_t)TEST_FLAGS_COUNT);
+    failed += fail;
+    printf("%u of %u tests passed\n", (uint32_t)TEST_COUNT + 1 - failed, (uint32_t)TEST_COUNT + 1);
+
+    if (bench)
+        test_bench();
+    return failed ? 1 : 0;
+}
+
+#endif // M4_TEST_MAIN
@@ -0,0 +1,163 @@
+#include "M4.h"
+#include "common.h"
+
+#if USE_TRACE
+
+/*
+    Следа на изпълнението: пръстенов буфер от двоични записи за всяко ядро.
+
+    Всеки запис е PC, опкод, маска на променените регистри и новите им
+    стойности (виж M4_TRACE_* в M4.h). Записите не се разделят при края на
+    буфера - остатъкът се маркира с M4_TRACE_PAD и записът започва от
+    началото, като най-старите записи се презаписват. m4_trace_dump записва
+    буфера във файл, който се чете с m4trace (M4-TRACEDUMP.c).
+
+    Докато следата е включена, JIT не се използва, за да се вижда всяка
+    инструкция.
+*/
+
+struct M4_TRACE_s
+{
+    M4 before; // Регистрите преди текущата инструкция
+    uint32_t psr;
+    uint32_t *buf;
+    uint32_t size; // В думи
+    uint32_t head; // Следващ запис
+    uint32_t tail; // Най-старият запис
+    uint32_t records;
+    uint32_t overwritten;
+};
+
+static uint32_t trace_len(const uint32_t *rec)
+{
+    return 3 + __builtin_popcount(rec[2]);
+}
+
+// Премахва най-стария запис
+static void trace_drop(struct M4_TRACE_s *t)
+{
+    t->tail += trace_len(t->buf + t->tail);
+    if (t->tail >= t->size || t->buf[t->tail] == M4_TRACE_PAD)
+        t->tail = 0;
+    t->records--;
+    if (t->overwritten != 0xFFFFFFFF)
+        t->overwritten++;
+}
+
+static void trace_write(struct M4_TRACE_s *t, const uint32_t *rec, uint32_t len)
+{
+    if (t->head + len > t->size)
+    {
+        // Остатъкът до края не стига: записите в него се губят
+        while (t->records && t->tail >= t->head)
+            trace_drop(t);
+        if (t->head < t->size)
+            t->buf[t->head] = M4_TRACE_PAD;
+        t->head = 0;
+    }
+    while (t->records && t->tail >= t->head && t->tail < t->head + len)
+        trace_drop(t);
+    if (!t->records)
+        t->tail = t->head;
+    memcpy(t->buf + t->head, rec, len * sizeof(uint32_t));
+    t->head += len;
+    t->records++;
+}
+
+// Включва следата с буфер от words думи (най-малко 64)
+int m4_trace_start(CortexM4 *cpu, uint32_t words)
+{
+    m4_trace_stop(cpu);
+    if (words < 64)
+        words = 64;
+    struct M4_TRACE_s *t = (struct M4_TRACE_s *)calloc(1, sizeof(struct M4_TRACE_s));
+    if (!t || !(t->buf = (uint32_t *)malloc(words * sizeof(uint32_t))))
+    {
+        PRINTF("[ERROR] m4_trace_start: Out of memory\n");
+        free(t);
+        return -1;
+    }
+    t->size = words;
+    cpu->trace = t;
+    return 0;
+}
+
+void m4_trace_stop(CortexM4 *cpu)
+{
+    if (!cpu->trace)
+        return;
+    free(cpu->trace->buf);
+    free(cpu->trace);
+    cpu->trace = NULL;
+}
+
+void m4_trace_pre(CortexM4 *cpu)
+{
+    cpu->trace->before = cpu->REG;
+    cpu->trace->psr = m4_read_psr(cpu);
+}
+
+// Записва инструкцията op, изпълнена след m4_trace_pre
+void m4_trace_post(CortexM4 *cpu, uint32_t op)
+{
+    struct M4_TRACE_s *t = cpu->trace;
+    uint32_t rec[3 + 16];
+    uint32_t len = 3;
+    uint32_t mask = 0;
+
+    for (int i = 0; i < 15; i++) // PC се вижда от следващия запис
+    {
+        if (cpu->REG.r[i] != t->before.r[i])
+        {
+            mask |= 1u << i;
+            rec[len++] = cpu->REG.r[i];
+        }
+    }
+    uint32_t psr = m4_read_psr(cpu);
+    if (psr != t->psr)
+    {
+        mask |= M4_TRACE_PSR;
+        rec[len++] = psr;
+    }
+    rec[0] = t->before.PC;
+    rec[1] = op;
+    rec[2] = mask;
+    trace_write(t, rec, len);
+}
+
+// Записва следата от най-стария към най-новия запис. Формат: M4_TRACE_HEADER
+// и записите, всички думи little-endian.
+int m4_trace_dump(CortexM4 *cpu, FILE *file)
+{
+    struct M4_TRACE_s *t = cpu->trace;
+    if (!t || !file)
+    {
+        PRINTF("[ERROR] m4_trace_dump: Invalid Parameter\n");
+        return -1;
+    }
+
+    uint32_t header[4] = {M4_TRACE_MAGIC, M4_TRACE_VERSION, t->records, t->overwritten};
+    for (int i = 0; i < 4; i++)
+        header[i] = M4_LE32(header[i]);
+    int res = fwrite(header, sizeof(header), 1, file) == 1 ? 0 : -1;
+
+    uint32_t pos = t->tail;
+    for (uint32_t n = 0; !res && n < t->records; n++)
+    {
+        if (pos >= t->size || t->buf[pos] == M4_TRACE_PAD)
+            pos = 0;
+        uint32_t len = trace_len(t->buf + pos);
+        for (uint32_t i = 0; !res && i < len; i++)
+        {
+            uint32_t word = M4_LE32(t->buf[pos + i]);
+            if (fwrite(&word, sizeof(word), 1, file) != 1)
+                res = -1;
+        }
+        pos += len;
+    }
+    if (res)
+        PRINTF("[ERROR] m4_trace_dump: Write failed\n");
+    return res;
+}
+
+#endif // USE_TRACE
@@ -0,0 +1,136 @@
+#include "M4.h"
+#include "common.h"
+
+#if defined(M4_TRACE_MAIN)
+
+/*
+    m4trace: текстов изглед на следа, записана с m4_trace_dump.
+
+        m4trace [-n брой] [-e фърмуер.elf] trace.bin
+
+    Всеки ред е една изпълнена инструкция: PC, опкод и регистрите, които
+    тя е променила. С -n се показват само последните записи, с -e пред
+    всеки ред се показва функцията и отместването в нея.
+
+    Компилира се с -DM4_TRACE_MAIN заедно с M4-ELF.c, не изисква USE_TRACE.
+*/
+
+static int read_word(FILE *f, uint32_t *word)
+{
+    if (fread(word, sizeof(*word), 1, f) != 1)
+        return -1;
+    *word = M4_LE32(*word);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t last = 0;
+    const char *elf = NULL;
+    int arg = 1;
+    while (arg + 1 < argc && argv[arg][0] == '-')
+    {
+        if (!strcmp(argv[arg], "-n"))
+            last = (uint32_t)strtoul(argv[arg + 1], NULL, 0);
+        else if (!strcmp(argv[arg], "-e"))
+            elf = argv[arg + 1];
+        else
+            break;
+        arg += 2;
+    }
+    if (arg >= argc)
+    {
+        fprintf(stderr, "usage: %s [-n last] [-e firmware.elf] trace.bin\n", argv[0]);
+        return 2;
+    }
+
+    M4_IMAGE *img = NULL;
+    const M4_SYMBOLS *syms = NULL;
+    if (elf && (!(img = m4_image_open(elf)) || !(syms = m4_image_symbols(img))))
+    {
+        fprintf(stderr, "[ERROR] Cannot read symbols: %s\n", elf);
+        m4_image_close(img);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[arg], "rb");
+    if (!f)
+    {
+        fprintf(stderr, "[ERROR] Cannot read trace: %s\n", argv[arg]);
+        m4_image_close(img);
+        return 1;
+    }
+
+    uint32_t header[4];
+    for (int i = 0; i < 4; i++)
+    {
+        if (read_word(f, &header[i]))
+            header[0] = 0;
+    }
+    if (header[0] != M4_TRACE_MAGIC || header[1] != M4_TRACE_VERSION)
+    {
+        fprintf(stderr, "[ERROR] Not a trace file (version %u expected)\n", M4_TRACE_VERSION);
+        fclose(f);
+        m4_image_close(img);
+        return 1;
+    }
+    uint32_t records = header[2];
+    if (header[3])
+        printf("# %u older records were overwritten\n", header[3]);
+
+    uint32_t skip = (last && last < records) ? records - last : 0;
+    int res = 0;
+    for (uint32_t n = 0; n < records; n++)
+    {
+        uint32_t pc, op, mask, value;
+        if (read_word(f, &pc) || read_word(f, &op) || read_word(f, &mask))
+        {
+            res = 1;
+            break;
+        }
+        if (n >= skip)
+        {
+            const M4_SYMBOL *sym = syms ? m4_symbol_find(syms, pc) : NULL;
+            if (sym)
+                printf("%s+0x%X  ", sym->name, pc - sym->addr);
+            else if (syms)
+                printf("?  ");
+            if (op > 0xFFFF)
+                printf("%08X  %08X", pc, op);
+            else
+                printf("%08X  %04X    ", pc, op);
+        }
+        for (int i = 0; i < 17; i++)
+        {
+            if (!(mask & (1u << i)))
+                continue;
+            if (read_word(f, &value))
+            {
+                res = 1;
+                break;
+            }
+            if (n < skip)
+                continue;
+            if (i == 16)
+                printf("  PSR=%08X", value);
+            else if (i == 13)
+                printf("  SP=%08X", value);
+            else if (i == 14)
+                printf("  LR=%08X", value);
+            else
+                printf("  R%d=%08X", i, value);
+        }
+        if (n >= skip)
+            printf("\n");
+        if (res)
+            break;
+    }
+    if (res)
+        fprintf(stderr, "[ERROR] Trace is truncated\n");
+
+    fclose(f);
+    m4_image_close(img);
+    return res;
+}
+
+#endif // M4_TRACE_MAIN
@@ -1,194 +1,432 @@
 #include "M4.h"
 #include "common.h"
 
-CortexM4 CPU;
+// Ново ядро с нулирано състояние. ROM/RAM се задават от извикващия,
+// след което се извикват m4_mem_init и m4_icache_init.
+CortexM4 *m4_create(void)
+{
+    // Подравнено на линия на кеша, за да са REG и psr в две цели линии
+    CortexM4 *cpu = (CortexM4 *)aligned_alloc(M4_CACHE_LINE, sizeof(CortexM4));
+    if (!cpu)
+    {
+        PRINTF("[ERROR] m4_create: Out of memory\n");
+        return NULL;
+    }
+    memset(cpu, 0, sizeof(CortexM4));
+    m4_reset_core(cpu);
+#if USE_EVENTS
+    m4_events_reset(cpu);
+#endif
+    return cpu;
+}
+
+// Нулира архитектурното състояние на ядрото: регистри, флагове, IT блок,
+// монитора на LDREX, системните регистри и NVIC. Паметта, кешовете,
+// тактовете и събитията не се променят.
+void m4_reset_core(CortexM4 *cpu)
+{
+    memset(&cpu->REG, 0, sizeof(cpu->REG));
+    memset(&cpu->lazy, 0, sizeof(cpu->lazy));
+    cpu->psr.value = 0;
+    cpu->psr.epsr.T = 1; // Cortex-M изпълнява само Thumb
+    cpu->ITSTATE = 0;
+    cpu->it_exec = 0;
+    cpu->excl = 0;
+    cpu->bl_upper_pending = 0;
+    cpu->error = 0;
+    cpu->stop = M4_STOP_NONE;
+    cpu->stop_code = 0;
+#if USE_SYSTEM
+    cpu->CONTROL = 0;
+    cpu->PRIMASK = 0;
+    cpu->FAULTMASK = 0;
+    cpu->BASEPRI = 0;
+    cpu->SP_alt = 0;
+    cpu->sp_psp = 0;
+#endif
+#if USE_NVIC
+    m4_nvic_reset(cpu);
+#endif
+}
+
+// Освобождава ядрото и кешовете му (ROM и RAM са на извикващия)
+void m4_destroy(CortexM4 *cpu)
+{
+    if (!cpu)
+        return;
+#if USE_JIT
+    m4_jit_free(cpu);
+#endif
+#if USE_CYCLES
+    m4_cycles_profile(cpu, 0);
+#endif
+#if USE_TRACE
+    m4_trace_stop(cpu);
+#endif
+#if USE_PROFILE
+    m4_profile_stop(cpu);
+#endif
+    m4_icache_free(cpu);
+    m4_mem_free(cpu);
+    free(cpu->dirty);
+    free(cpu);
+}
 
 ///////////////////////////////////////////////////////////
 
-uint32_t READ_MEM_32(uint32_t address, int *result)
+// Адресът е в някой от двата bit-band псевдонима
+static inline int m4_bitband(uint32_t address)
+{
+    return address - M4_BITBAND_SRAM < M4_BITBAND_SIZE || address - M4_BITBAND_PERIPH < M4_BITBAND_SIZE;
+}
+
+// Байтът, в който е битът на адрес от псевдонима
+static inline uint32_t m4_bitband_byte(uint32_t address)
+{
+    return (address & 0xF0000000) | ((address & (M4_BITBAND_SIZE - 1)) >> 5);
+}
+
+// Бавен път при четене: страницата не е изобразена (непълна последна
+// страница на ROM/RAM, m4_mem_init не е извикан), bit-band или MMIO
+uint32_t m4_mem_read_slow(CortexM4 *cpu, uint32_t address, uint32_t size, int *result)
 {
     if (!result)
     {
-        PRINTF("[ERROR] READ_MEM_32: Invalid Parameter\n");
+        PRINTF("[ERROR] READ_MEM_%u: Invalid Parameter\n", size * 8);
         exit(0);
     }
     *result = 0;
-    uint32_t offset;
-    if (address >= ROM_BASE && address < ROM_BASE + CPU.ROM_SIZE)
+    const uint8_t *mem = NULL;
+    uint32_t offset = 0;
+    uint32_t limit = 0;
+    if (address - ROM_BASE < cpu->ROM_SIZE)
     {
         // Четене от ROM
+        mem = cpu->ROM;
         offset = address - ROM_BASE;
-        if (offset + 3 < CPU.ROM_SIZE)
-        {
-            return ((uint32_t)CPU.ROM[offset] |
-                    ((uint32_t)CPU.ROM[offset + 1] << 8) |
-                    ((uint32_t)CPU.ROM[offset + 2] << 16) |
-                    ((uint32_t)CPU.ROM[offset + 3] << 24));
-        }
+        limit = cpu->ROM_SIZE;
     }
-    else if (address >= RAM_BASE && address < RAM_BASE + CPU.RAM_SIZE)
+    else if (address - RAM_BASE < cpu->RAM_SIZE)
     {
         // Четене от RAM
+        mem = cpu->RAM;
         offset = address - RAM_BASE;
-        if (offset + 3 < CPU.RAM_SIZE)
+        limit = cpu->RAM_SIZE;
+    }
+    else if (m4_bitband(address))
+    {
+        // Битът от байта в SRAM/периферията, през бързия път, ако е изобразен
+        uint8_t byte = READ_MEM_8(cpu, m4_bitband_byte(address), result);
+        return *result ? 0 : (byte >> ((address >> 2) & 0x7)) & 0x1;
+    }
+    else
+    {
+        const M4_REGION *region = m4_region_find(cpu, address);
+        if (region && size <= region->size - (address - region->base))
         {
-            return ((uint32_t)CPU.RAM[offset] |
-                    ((uint32_t)CPU.RAM[offset + 1] << 8) |
-                    ((uint32_t)CPU.RAM[offset + 2] << 16) |
-                    ((uint32_t)CPU.RAM[offset + 3] << 24));
+            if (region->type == M4_REGION_MMIO)
+                return region->read ? region->read(cpu, region->ctx, address - region->base, size, result) : 0;
+            mem = region->host;
+            offset = address - region->base;
+            limit = region->size;
         }
     }
+    if (mem && size <= limit - offset)
+    {
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < size; i++)
+            value |= (uint32_t)mem[offset + i] << (8 * i); // Little-endian
+        return value;
+    }
+#if USE_CYCLES
+    if (size == 4)
+    {
+        // DWT винаги брои, TRCENA и CYCCNTENA са включени
+        if (address == M4_DWT_CYCCNT)
+        {
+#if USE_EVENTS
+            cpu->poll_volatile = 1;
+#endif
+            return m4_dwt_cyccnt(cpu);
+        }
+        if (address == M4_DWT_CTRL)
+            return 0x1;
+        if (address == M4_DEMCR)
+            return 1u << 24;
+    }
+#endif
+#if USE_EVENTS
+    if (address - M4_SYST_BASE < M4_SYST_SIZE)
+        return m4_systick_read(cpu, address, size, result);
+#endif
+#if USE_NVIC
+    if (address - M4_SCS_BASE < M4_SCS_SIZE)
+        return m4_scs_read(cpu, address, size, result);
+#endif
     // Невалиден адрес
-    PRINTF("[ERROR] READ_MEM_32: Invalid Address: 0x%08X\n", address);
+    PRINTF("[ERROR] READ_MEM_%u: Invalid Address: 0x%08X\n", size * 8, address);
     *result = -1;
     return 0; // Връща 0 при невалиден достъп
 }
 
-uint16_t READ_MEM_16(uint32_t address, int *result)
+uint32_t READ_THUMB_32(CortexM4 *cpu, uint32_t address, int *result)
 {
     if (!result)
     {
-        PRINTF("[ERROR] READ_MEM: Invalid Parameter\n");
+        PRINTF("[ERROR] READ_MEM_32: Invalid Parameter\n");
         exit(0);
     }
-    *result = 0;
-    uint32_t offset;
-    if (address >= ROM_BASE && address < ROM_BASE + CPU.ROM_SIZE)
+    // Първото полуслово е старшата част на инструкцията. Четенето минава
+    // през картата на паметта, така че код може да се изпълнява и от RAM.
+    uint32_t high = READ_MEM_16(cpu, address, result);
+    if (*result)
+        return 0;
+    uint32_t low = READ_MEM_16(cpu, address + 2, result);
+    if (*result)
+        return 0;
+    return (high << 16) | low;
+}
+
+///////////////////////////////////////////////////////////
+
+// Бавен път при запис
+int m4_mem_write_slow(CortexM4 *cpu, uint32_t address, uint32_t data, uint32_t size)
+{
+    // Проверка дали адресът е в обхвата на RAM
+    uint32_t offset = address - RAM_BASE;
+    if (offset < cpu->RAM_SIZE && size <= cpu->RAM_SIZE - offset)
     {
-        // Четене от ROM
-        offset = address - ROM_BASE;
-        if (offset + 1 < CPU.ROM_SIZE)
+        if (cpu->dirty)
+            m4_mem_dirty(cpu, offset, size);
+        for (uint32_t i = 0; i < size; i++)
+            cpu->RAM[offset + i] = (uint8_t)(data >> (8 * i));
+        return 0; // Успешен запис
+    }
+    if (m4_bitband(address))
+    {
+        // Четене-промяна-запис на един байт; записва се бит 0 на data
+        int res;
+        uint32_t target = m4_bitband_byte(address);
+        uint32_t bit = (address >> 2) & 0x7;
+        uint8_t byte = READ_MEM_8(cpu, target, &res);
+        if (res)
+            return -1;
+        return WRITE_MEM_8(cpu, target, (uint8_t)((byte & ~(1u << bit)) | ((data & 0x1) << bit)));
+    }
+    const M4_REGION *region = m4_region_find(cpu, address);
+    if (region && size <= region->size - (address - region->base))
+    {
+        offset = address - region->base;
+        if (region->type == M4_REGION_MMIO)
+            return region->write ? region->write(cpu, region->ctx, offset, data, size) : 0;
+        if (region->type == M4_REGION_RAM)
         {
-            return ((uint16_t)CPU.ROM[offset] | ((uint16_t)CPU.ROM[offset + 1] << 8));
+            for (uint32_t i = 0; i < size; i++)
+                region->host[offset + i] = (uint8_t)(data >> (8 * i));
         }
+        return 0; // M4_REGION_ROM: записът се игнорира
     }
-    else if (address >= RAM_BASE && address < RAM_BASE + CPU.RAM_SIZE)
+#if USE_CYCLES
+    if (size == 4 && address == M4_DWT_CYCCNT)
     {
-        // Четене от RAM
-        offset = address - RAM_BASE;
-        if (offset + 1 < CPU.RAM_SIZE)
+        cpu->cyccnt_base = (uint32_t)cpu->cycles - data;
+        return 0;
+    }
+    if (size == 4 && (address == M4_DWT_CTRL || address == M4_DEMCR))
+        return 0; // Включване на брояча: винаги е включен
+#endif
+#if USE_EVENTS
+    if (address - M4_SYST_BASE < M4_SYST_SIZE)
+        return m4_systick_write(cpu, address, data, size);
+#endif
+#if USE_NVIC
+    if (address - M4_SCS_BASE < M4_SCS_SIZE)
+        return m4_scs_write(cpu, address, data, size);
+#endif
+    PRINTF("[ERROR] WRITE_MEM_%u: Invalid Address: 0x%08X, Data: 0x%08X\n", size * 8, address, data);
+    return -1; // Невалиден адрес или недостатъчно място
+}
+
+///////////////////////////////////////////////////////////
+
+// Четене на count последователни думи (LDM, POP). Ако целият диапазон е в
+// една страница, проверката се прави веднъж.
+int m4_mem_read_words(CortexM4 *cpu, uint32_t address, uint32_t *words, uint32_t count)
+{
+    uint8_t *p = m4_mem_host(cpu->mem.read, address, 4 * count);
+    if (p)
+    {
+        for (uint32_t i = 0; i < count; i++)
         {
-            return ((uint16_t)CPU.RAM[offset] | ((uint16_t)CPU.RAM[offset + 1] << 8));
+            memcpy(&words[i], p + 4 * i, 4);
+            words[i] = M4_LE32(words[i]);
         }
+        return 0;
     }
-    // Невалиден адрес или размер
-    PRINTF("[ERROR] READ_MEM_16: Invalid Address: 0x%08X\n", address);
-    *result = -1; // Връща -1 при невалиден достъп
-    return 0;     // без значение
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int res;
+        words[i] = READ_MEM_32(cpu, address + 4 * i, &res);
+        if (res)
+            return res;
+    }
+    return 0;
 }
 
-uint8_t READ_MEM_8(uint32_t address, int *result)
+// Запис на count последователни думи (STM, PUSH)
+int m4_mem_write_words(CortexM4 *cpu, uint32_t address, const uint32_t *words, uint32_t count)
 {
-    if (!result)
+    uint8_t *p = m4_mem_host(cpu->mem.write, address, 4 * count);
+    if (p)
     {
-        PRINTF("[ERROR] READ_MEM: Invalid Parameter\n");
-        exit(0);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t value = M4_LE32(words[i]);
+            memcpy(p + 4 * i, &value, 4);
+        }
+        return 0;
     }
-    *result = 0;
-    uint32_t offset;
-    if (address >= ROM_BASE && address < ROM_BASE + CPU.ROM_SIZE)
+    for (uint32_t i = 0; i < count; i++)
     {
-        // Четене от ROM
-        offset = address - ROM_BASE;
-        if (offset < CPU.ROM_SIZE)
-            return CPU.ROM[offset];
+        if (WRITE_MEM_32(cpu, address + 4 * i, words[i]))
+            return -1;
     }
-    else if (address >= RAM_BASE && address < RAM_BASE + CPU.RAM_SIZE)
+    return 0;
+}
+
+// Задава страницата в хоста за адрес page в table (NULL = бавен път)
+int m4_mem_set_page(uint8_t ***table, uint32_t page, uint8_t *host)
+{
+    uint32_t l1 = page >> (M4_PAGE_BITS + M4_L2_BITS);
+    if (!table[l1])
     {
-        // Четене от RAM
-        offset = address - RAM_BASE;
-        if (offset < CPU.RAM_SIZE)
-            return CPU.RAM[offset];
+        if (!host)
+            return 0;
+        table[l1] = (uint8_t **)calloc(M4_L2_SIZE, sizeof(uint8_t *));
+        if (!table[l1])
+        {
+            PRINTF("[ERROR] m4_mem_map: Out of memory\n");
+            return -1;
+        }
     }
-    // Невалиден адрес или размер
-    PRINTF("[ERROR] READ_MEM_8: Invalid Address: 0x%08X\n", address);
-    *result = -1; // Връща -1 при невалиден достъп
-    return 0;     // без значение
+    table[l1][(page >> M4_PAGE_BITS) & (M4_L2_SIZE - 1)] = host;
+    return 0;
 }
 
-uint32_t READ_THUMB_32(uint32_t address, int *result){
-    if (!result)
+// Изобразява size байта от host на адрес address. Изобразяват се само цели
+// страници; остатъкът минава през бавния път.
+int m4_mem_map(CortexM4 *cpu, uint32_t address, uint8_t *host, uint32_t size, int writable)
+{
+    if (address & M4_PAGE_MASK)
     {
-        PRINTF("[ERROR] READ_MEM_32: Invalid Parameter\n");
-        exit(0);
+        PRINTF("[ERROR] m4_mem_map: Unaligned address 0x%08X\n", address);
+        return -1;
     }
-    *result = 0;
-    uint32_t offset;
-    if (address >= ROM_BASE && address < ROM_BASE + CPU.ROM_SIZE)
+    for (uint32_t off = 0; size - off >= M4_PAGE_SIZE; off += M4_PAGE_SIZE)
     {
-        // Четене от ROM
-        offset = address - ROM_BASE;
-        if (offset + 3 < CPU.ROM_SIZE)
-        {
-            return CPU.ROM[offset+2] | (CPU.ROM[offset+3] << 8) | (CPU.ROM[offset+0] << 16) | (CPU.ROM[offset+1] << 24);
-        }
+        if (m4_mem_set_page(cpu->mem.read, address + off, host + off))
+            return -1;
+        if (writable && m4_mem_set_page(cpu->mem.write, address + off, host + off))
+            return -1;
     }
+    return 0;
 }
 
-///////////////////////////////////////////////////////////
+// Изобразява целите страници на RAM или ROM регион
+static int m4_region_map(CortexM4 *cpu, const M4_REGION *region)
+{
+    if (region->type == M4_REGION_MMIO)
+        return 0;
+    uint32_t skip = (0u - region->base) & M4_PAGE_MASK; // До първата цяла страница
+    if (skip >= region->size)
+        return 0;
+    return m4_mem_map(cpu, region->base + skip, region->host + skip, region->size - skip, region->type == M4_REGION_RAM);
+}
 
-int WRITE_MEM_32(uint32_t address, uint32_t data)
+// Добавя регион към картата на паметта. cpu->ROM и cpu->RAM имат
+// предимство пред регион на същия адрес. Записите в RAM регионите не се
+// следят от m4_snapshot.
+int m4_region_add(CortexM4 *cpu, const M4_REGION *region)
 {
-    // Проверка дали адресът е в обхвата на RAM
-    if (address >= RAM_BASE && address < RAM_BASE + CPU.RAM_SIZE)
+    if (!region || !region->size || region->size - 1 > 0xFFFFFFFF - region->base || region->type > M4_REGION_MMIO || (region->type != M4_REGION_MMIO && !region->host))
     {
-        uint32_t offset = address - RAM_BASE;
-        // Проверка дали има достатъчно място за 4 байта
-        if (offset + 3 < CPU.RAM_SIZE)
-        {
-            CPU.RAM[offset] = (uint8_t)(data & 0xFF);
-            CPU.RAM[offset + 1] = (uint8_t)((data >> 8) & 0xFF);
-            CPU.RAM[offset + 2] = (uint8_t)((data >> 16) & 0xFF);
-            CPU.RAM[offset + 3] = (uint8_t)((data >> 24) & 0xFF);
-            return 0; // Успешен запис
-        }
+        PRINTF("[ERROR] m4_region_add: Invalid Parameter\n");
+        return -1;
     }
-    PRINTF("[ERROR] WRITE_MEM_32: Invalid Address: 0x%08X, Data: 0x%08X\n", address, data);
-    return -1; // Невалиден адрес или недостатъчно място
+    if (cpu->region_count == M4_MAX_REGIONS)
+    {
+        PRINTF("[ERROR] m4_region_add: Too many regions\n");
+        return -1;
+    }
+
+    uint32_t i = 0;
+    while (i < cpu->region_count && cpu->regions[i].base < region->base)
+        i++;
+    if ((i > 0 && region->base - cpu->regions[i - 1].base < cpu->regions[i - 1].size) || (i < cpu->region_count && cpu->regions[i].base - region->base < region->size))
+    {
+        PRINTF("[ERROR] m4_region_add: Region 0x%08X overlaps another region\n", region->base);
+        return -1;
+    }
+    memmove(&cpu->regions[i + 1], &cpu->regions[i], (cpu->region_count - i) * sizeof(M4_REGION));
+    cpu->regions[i] = *region;
+    cpu->region_count++;
+    return m4_region_map(cpu, region);
 }
 
-int WRITE_MEM_16(uint32_t address, uint16_t data)
+// Регионът, който съдържа address, или NULL (двоично търсене)
+const M4_REGION *m4_region_find(const CortexM4 *cpu, uint32_t address)
 {
-    // Проверка дали адресът е в обхвата на RAM
-    if (address >= RAM_BASE && address < RAM_BASE + CPU.RAM_SIZE)
+    uint32_t lo = 0, hi = cpu->region_count;
+    while (lo < hi)
     {
-        uint32_t offset = address - RAM_BASE;
-        // Проверка дали има достатъчно място за 4 байта
-        if (offset + 1 < CPU.RAM_SIZE)
-        {
-            CPU.RAM[offset] = (uint8_t)(data & 0xFF);
-            CPU.RAM[offset + 1] = (uint8_t)(data >> 8);
-            return 0; // Успешен запис
-        }
+        uint32_t mid = (lo + hi) / 2;
+        if (cpu->regions[mid].base <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    PRINTF("[ERROR] WRITE_MEM_16: Invalid Address: 0x%08X, Data: 0x%08X\n", address, data);
-    return -1; // Невалиден адрес или недостатъчно място
+    if (lo == 0)
+        return NULL;
+    const M4_REGION *region = &cpu->regions[lo - 1];
+    return address - region->base < region->size ? region : NULL;
 }
 
-int WRITE_MEM_8(uint32_t address, uint8_t data)
+// Изгражда таблицата на страниците за регионите, ROM (само четене) и RAM.
+// Трябва да се извика след като cpu->ROM и cpu->RAM са заредени.
+int m4_mem_init(CortexM4 *cpu)
 {
-    // Проверка дали адресът е в обхвата на RAM
-    if (address >= RAM_BASE && address < RAM_BASE + CPU.RAM_SIZE)
+    m4_mem_free(cpu);
+    cpu->snap_base = NULL; // Записите вече не се следят
+    for (uint32_t i = 0; i < cpu->region_count; i++)
     {
-        uint32_t offset = address - RAM_BASE;
-        // Проверка дали има достатъчно място за 4 байта
-        if (offset < CPU.RAM_SIZE)
-        {
-            CPU.RAM[offset] = data;
-            return 0; // Успешен запис
-        }
+        if (m4_region_map(cpu, &cpu->regions[i]))
+            return -1;
     }
-    PRINTF("[ERROR] WRITE_MEM_8: Invalid Address: 0x%08X, Data: 0x%08X\n", address, data);
-    return -1; // Невалиден адрес или недостатъчно място
+    if (cpu->ROM && m4_mem_map(cpu, ROM_BASE, cpu->ROM, cpu->ROM_SIZE, 0))
+        return -1;
+    if (cpu->RAM && m4_mem_map(cpu, RAM_BASE, cpu->RAM, cpu->RAM_SIZE, 1))
+        return -1;
+    return 0;
+}
+
+void m4_mem_free(CortexM4 *cpu)
+{
+    for (uint32_t i = 0; i < M4_L1_SIZE; i++)
+    {
+        free(cpu->mem.read[i]);
+        free(cpu->mem.write[i]);
+    }
+    memset(&cpu->mem, 0, sizeof(cpu->mem));
 }
 
 ///////////////////////////////////////////////////////////
 
-void PRINT_REG(void)
+void PRINT_REG(CortexM4 *cpu)
 {
     printf("=== CPU Registers ===\n");
     for (int i = 0; i < 16; i++)
     {
+        char buf[8];
         const char *reg_name;
         switch (i)
         {
@@ -203,67 +441,434 @@ void PRINT_REG(void)
             break;
         default:
         {
-            static char buf[8];
             snprintf(buf, sizeof(buf), "R%02d", i);
             reg_name = buf;
             break;
         }
         }
-        printf("%s = 0x%08X\n", reg_name, CPU.REG.r[i]);
+        printf("%s = 0x%08X\n", reg_name, cpu->REG.r[i]);
     }
     printf("===================\n");
 }
 
 ///////////////////////////////////////////////////////////
 
-int m4_execute(void)
+// Извличане и декодиране на инструкция от адрес pc
+static int m4_fetch_decode(CortexM4 *cpu, uint32_t pc, M4_DECODED *d)
 {
-    FUNC_VM();
+    int res;
+    uint32_t op = READ_MEM_16(cpu, pc, &res);
+    if (res) // Проверка за граници, има съобщение за грешка
+    {
+        return -1;
+    }
+
+    if ((op & 0xF800) >= 0xE800)
+    {
+        // Thumb-2 изисква само подравняване на полуслово
+        op = READ_THUMB_32(cpu, pc, &res);
+        if (res) // Проверка за граници, има съобщение за грешка
+        {
+            return -1;
+        }
+
+        if (m4_decode_32(op, d))
+        {
+            DEBUG_M4("[ERROR] Unknown Instruction: 0x%08X, PC: 0x%08X\n", op, pc);
+            return -1;
+        }
+#if USE_CYCLES
+        d->cycles = m4_cycles_cost(d);
+#endif
+        return 0;
+    }
 
-    if (CPU.REG.PC & 0x1)
+    if (m4_decode_16(op, d))
+    {
+        DEBUG_M4("[ERROR] Unknown Instruction: 0x%04X, PC: 0x%08X\n", op, pc);
+        return -1;
+    }
+#if USE_CYCLES
+    d->cycles = m4_cycles_cost(d);
+#endif
+    return 0;
+}
+
+///////////////////////////////////////////////////////////
+
+// Кеш на декодираните инструкции: един слот на всяко полуслово от ROM
+int m4_icache_init(CortexM4 *cpu)
+{
+    m4_icache_free(cpu);
+    if (!cpu->ROM || cpu->ROM_SIZE == 0)
+    {
+        PRINTF("[ERROR] m4_icache_init: ROM not loaded\n");
+        return -1;
+    }
+    cpu->icache = (M4_DECODED *)calloc(cpu->ROM_SIZE / 2, sizeof(M4_DECODED));
+    if (!cpu->icache)
+    {
+        PRINTF("[ERROR] m4_icache_init: Out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Трябва да се извика след всяко презареждане на ROM
+void m4_icache_invalidate(CortexM4 *cpu)
+{
+    if (cpu->icache_shared)
+    {
+        PRINTF("[ERROR] m4_icache_invalidate: Shared cache is read-only\n");
+        return;
+    }
+    if (cpu->icache)
+        memset(cpu->icache, 0, (cpu->ROM_SIZE / 2) * sizeof(M4_DECODED));
+#if USE_JIT
+    m4_jit_invalidate(cpu);
+#endif
+}
+
+void m4_icache_free(CortexM4 *cpu)
+{
+    if (!cpu->icache_shared)
+        free(cpu->icache);
+    cpu->icache = NULL;
+    cpu->icache_shared = 0;
+}
+
+// Използва готов кеш на друго ядро със същото ROM. Кешът трябва да е запълнен
+// с m4_icache_prefill - споделеният кеш не се променя, пропуските се декодират
+// локално.
+void m4_icache_share(CortexM4 *cpu, M4_DECODED *icache)
+{
+    m4_icache_free(cpu);
+    cpu->icache = icache;
+    cpu->icache_shared = 1;
+}
+
+///////////////////////////////////////////////////////////
+
+int m4_execute(CortexM4 *cpu)
+{
+    FUNC_VM();
+#if USE_EVENTS
+    if (cpu->cycles >= cpu->event_next)
+        m4_events_run(cpu);
+#endif
+#if USE_NVIC
+    // Чакащо изключение се поема преди следващата инструкция
+    if (cpu->nvic.next && m4_exception_take(cpu))
     {
-        DEBUG_M4("[ERROR] Unaligned PC: 0x%08X\n", CPU.REG.PC);
         RETURN_ERROR(-1);
     }
+#endif
 
-    if (!CPU.psr.epsr.T)
+    if (cpu->REG.PC & 0x1)
     {
-        DEBUG_M4("[ERROR] Invalid Thumb state at PC: 0x%08X\n", CPU.REG.PC);
+        DEBUG_M4("[ERROR] Unaligned PC: 0x%08X\n", cpu->REG.PC);
         RETURN_ERROR(-1);
     }
 
-    int res;
-    CPU.op = READ_MEM_16(CPU.REG.PC, &res);
-    if (res) // Проверка за граници, има съобщение за грешка
+    if (!cpu->psr.epsr.T)
     {
+        DEBUG_M4("[ERROR] Invalid Thumb state at PC: 0x%08X\n", cpu->REG.PC);
         RETURN_ERROR(-1);
     }
 
-    if ((CPU.op & 0xF800) >= 0xE800)
+    M4_DECODED local;
+    const M4_DECODED *d;
+    uint32_t offset = cpu->REG.PC - ROM_BASE;
+    if (cpu->icache && offset < cpu->ROM_SIZE)
     {
-        if (CPU.REG.PC & 0x3)
+        M4_DECODED *slot = &cpu->icache[offset >> 1];
+        if (!slot->handler)
         {
-            DEBUG_M4("[ERROR] Unaligned PC for 32-bit instruction: 0x%08X\n", CPU.REG.PC);
-            RETURN_ERROR(-1);
+            if (cpu->icache_shared)
+                slot = &local;
+            if (m4_fetch_decode(cpu, cpu->REG.PC, slot))
+            {
+                RETURN_ERROR(-1);
+            }
         }
-        if (CPU.REG.PC + 3 >= CPU.ROM_SIZE + ROM_BASE)
+        d = slot;
+    }
+    else
+    {
+        // Извън ROM (или без кеш) се декодира всеки път
+        if (m4_fetch_decode(cpu, cpu->REG.PC, &local))
         {
-            DEBUG_M4("[ERROR] Invalid PC access: 0x%08X\n", CPU.REG.PC);
             RETURN_ERROR(-1);
         }
+        d = &local;
+    }
 
-        CPU.op = READ_THUMB_32(CPU.REG.PC, &res);
-        if (res) // Проверка за граници, има съобщение за грешка
+    cpu->op = d->op;
+    M4_PROFILE_STEP(cpu);
+    M4_TRACE_PRE(cpu);
+#if USE_CYCLES
+    uint32_t pc = cpu->REG.PC;
+#endif
+    int res;
+    if (cpu->ITSTATE)
+    {
+        res = m4_execute_it(cpu, d);
+    }
+    else if (d->size == 4)
+    {
+        res = m4_dispatch_32(cpu, d);
+    }
+    else
+    {
+        res = m4_dispatch_16(cpu, d);
+    }
+    if (!res)
+    {
+        M4_TRACE_POST(cpu, d->op);
+#if USE_CYCLES
+        m4_cycles_add(cpu, d, pc);
+#endif
+    }
+    return res;
+}
+
+///////////////////////////////////////////////////////////
+
+// Построява основен блок от slot нататък: поредица инструкции до първия преход
+static int m4_block_build(CortexM4 *cpu, M4_DECODED *slot, uint32_t pc)
+{
+    M4_DECODED *d = slot;
+#if USE_EVENTS
+    uint32_t start = pc;
+#endif
+    uint32_t end = ROM_BASE + cpu->ROM_SIZE;
+    int len = 0;
+
+    while (len < M4_BLOCK_MAX && pc < end)
+    {
+        if (!d->handler && m4_fetch_decode(cpu, pc, d))
+            break;
+        len++;
+        if (d->flags & M4_DEC_BRANCH)
+            break;
+        pc += d->size;
+        d += d->size >> 1;
+    }
+    slot->block_len = len;
+#if USE_EVENTS
+    if (len && m4_poll_block(slot, len, start))
+        slot->flags |= M4_DEC_POLL;
+#endif
+    return len ? 0 : -1;
+}
+
+// Изпълнява n последователни слота, започвайки от d
+int m4_execute_slots(CortexM4 *cpu, const M4_DECODED *d, uint32_t n, uint32_t *executed)
+{
+    for (; n; n--)
+    {
+        int res;
+#if USE_CYCLES
+        uint32_t pc = cpu->REG.PC;
+#endif
+        cpu->op = d->op;
+        cpu->dec = d;
+        M4_PROFILE_STEP(cpu);
+        M4_TRACE_PRE(cpu);
+        res = d->handler(cpu);
+        if (!res && !(d->flags & M4_DEC_BRANCH))
+            cpu->REG.PC += d->size;
+        if (res)
         {
-            RETURN_ERROR(-1);
+            RETURN_ERROR(res);
         }
+        M4_TRACE_POST(cpu, d->op);
+#if USE_CYCLES
+        m4_cycles_add(cpu, d, pc);
+#endif
+        (*executed)++;
+        d += d->size >> 1;
+    }
+    RETURN_ERROR(0);
+}
+
+// Изпълнява цял основен блок. Проверките за PC, T бит и граници се правят
+// веднъж за блока, след което слотовете се изпълняват последователно.
+int m4_execute_block(CortexM4 *cpu, uint32_t *executed)
+{
+    FUNC_VM();
+    *executed = 0;
 
-        return m4_execute_32();
+    uint32_t offset = cpu->REG.PC - ROM_BASE;
+#if USE_NVIC
+    if (cpu->nvic.next)
+    {
+        // Изключението се поема от m4_execute
+        *executed = 1;
+        return m4_execute(cpu);
     }
-    else
+#endif
+#if USE_EVENTS
+    if (cpu->cycles >= cpu->event_next)
+    {
+        // Събитията се изпълняват от m4_execute
+        *executed = 1;
+        return m4_execute(cpu);
+    }
+#endif
+    if (!cpu->icache || offset >= cpu->ROM_SIZE || (cpu->REG.PC & 0x1) || !cpu->psr.epsr.T || cpu->ITSTATE)
+    {
+        // Извън ROM, IT блок или невалидно състояние: стъпка по стъпка
+        *executed = 1;
+        return m4_execute(cpu);
+    }
+
+    M4_DECODED *d = &cpu->icache[offset >> 1];
+    if (!d->block_len && (cpu->icache_shared || m4_block_build(cpu, d, cpu->REG.PC)))
+    {
+        *executed = 1;
+        return m4_execute(cpu); // Съобщава точната грешка
+    }
+    M4_PROFILE_BLOCK(cpu, d);
+
+#if USE_JIT
+    if (cpu->jit && m4_jit_run(cpu, d, executed))
+    {
+        RETURN_ERROR(0);
+    }
+#endif
+
+    return m4_execute_slots(cpu, d, d->block_len, executed);
+}
+
+// Основен цикъл: изпълнява до max_instructions инструкции или до спиране.
+// Блоковете се изпълняват директно от кеша, без m4_execute_block и кодове
+// за грешка на всяка стъпка. Връща броя изпълнени инструкции.
+uint64_t m4_run(CortexM4 *cpu, uint64_t max_instructions, M4_STOP *stop_reason)
+{
+    uint64_t count = 0;
+    cpu->stop = M4_STOP_NONE;
+
+    while (!cpu->stop)
+    {
+        uint64_t left = max_instructions - count;
+        if (!left)
+        {
+            cpu->stop = M4_STOP_BUDGET;
+            break;
+        }
+#if USE_EVENTS
+        if (cpu->cycles >= cpu->event_next)
+            m4_events_run(cpu); // Може да постави прекъсване в очакване
+#endif
+#if USE_NVIC
+        if (cpu->nvic.next && m4_exception_take(cpu))
+        {
+            cpu->stop = M4_STOP_FAULT;
+            break;
+        }
+#endif
+
+        const M4_DECODED *d = NULL;
+        uint32_t offset = cpu->REG.PC - ROM_BASE;
+        if (cpu->icache && offset < cpu->ROM_SIZE && !(offset & 0x1) && cpu->psr.epsr.T && !cpu->ITSTATE)
+        {
+            M4_DECODED *slot = &cpu->icache[offset >> 1];
+            if (slot->block_len || (!cpu->icache_shared && !m4_block_build(cpu, slot, cpu->REG.PC)))
+                d = slot;
+        }
+        if (!d)
+        {
+            // Извън ROM, IT блок или невалидно състояние: стъпка по стъпка
+            if (m4_execute(cpu))
+            {
+                cpu->stop = M4_STOP_FAULT;
+                break;
+            }
+            count++;
+            continue;
+        }
+        M4_PROFILE_BLOCK(cpu, d);
+
+#if USE_JIT
+        uint32_t executed;
+        if (cpu->jit && d->block_len <= left && m4_jit_run(cpu, d, &executed))
+        {
+            count += executed;
+            continue;
+        }
+#endif
+
+        // BKPT, SVC и WFI завършват блока, затова cpu->stop не се проверява
+        // след всяка инструкция
+        uint32_t n = d->block_len < left ? d->block_len : (uint32_t)left;
+#if USE_EVENTS
+        const M4_DECODED *head = d;
+        uint32_t head_pc = cpu->REG.PC;
+        uint64_t head_cycles = cpu->cycles;
+        cpu->poll_volatile = 0;
+#endif
+        for (; n; n--)
+        {
+#if USE_NVIC
+            if (cpu->nvic.next)
+                break; // Прекъсване от запис в NVIC: поема се преди следващата
+#endif
+#if USE_EVENTS
+            if (cpu->cycles >= cpu->event_next)
+                break; // Събитията са между инструкциите, не в края на блока
+#endif
+#if USE_CYCLES
+            uint32_t pc = cpu->REG.PC;
+#endif
+            cpu->op = d->op;
+            cpu->dec = d;
+            M4_PROFILE_STEP(cpu);
+            M4_TRACE_PRE(cpu);
+            if (d->handler(cpu))
+            {
+                cpu->stop = M4_STOP_FAULT;
+                break;
+            }
+            if (!(d->flags & M4_DEC_BRANCH))
+                cpu->REG.PC += d->size;
+            M4_TRACE_POST(cpu, d->op);
+#if USE_CYCLES
+            m4_cycles_add(cpu, d, pc);
+#endif
+            count++;
+            d += d->size >> 1;
+        }
+#if USE_EVENTS
+        // Цикъл на изчакване, който се върна в началото си
+        if ((head->flags & M4_DEC_POLL) && cpu->REG.PC == head_pc && !cpu->stop)
+            m4_events_poll(cpu, cpu->cycles - head_cycles, head->block_len);
+#endif
+    }
+
+    if (stop_reason)
+        *stop_reason = (M4_STOP)cpu->stop;
+    return count;
+}
+
+///////////////////////////////////////////////////////////
+
+// Декодира цялото ROM и строи блоковете от всяко полуслово, за да може
+// кешът да се споделя между ядра (m4_icache_share). Данните в ROM просто
+// остават с празни слотове.
+int m4_icache_prefill(CortexM4 *cpu)
+{
+    if (!cpu->icache && m4_icache_init(cpu))
+        return -1;
+    for (uint32_t offset = 0; offset + 1 < cpu->ROM_SIZE; offset += 2)
     {
-        return m4_execute_16();
+        M4_DECODED *d = &cpu->icache[offset >> 1];
+        if (!d->handler && m4_fetch_decode(cpu, ROM_BASE + offset, d))
+            continue;
+        if (!d->block_len)
+            m4_block_build(cpu, d, ROM_BASE + offset);
     }
+    return 0;
 }
 
 ///////////////////////////////////////////////////////////
\ No newline at end of file
@@ -12,6 +12,12 @@
 #define USE_DSP 0
 #define USE_NVIC 0
 #define USE_SYSTEM 0
+#define USE_JIT 0
+#define USE_BATCH 0
+#define USE_CYCLES 0
+#define USE_TRACE 0
+#define USE_PROFILE 0
+#define USE_EVENTS 0
 
 typedef union M4_u
 {
@@ -35,18 +41,18 @@ typedef struct
 
 typedef struct
 {
-    uint32_t N : 1;
-    uint32_t Z : 1;
-    uint32_t C : 1;
-    uint32_t V : 1;
+    uint32_t reserved2 : 16;
 #if USE_DSP
-    uint32_t Q : 1;
-    uint32_t reserved1 : 7;
     uint32_t GE : 4;
+    uint32_t reserved1 : 7;
+    uint32_t Q : 1;
 #else
     uint32_t reserved1 : 12;
 #endif
-    uint32_t reserved2 : 16;
+    uint32_t V : 1;
+    uint32_t C : 1;
+    uint32_t Z : 1;
+    uint32_t N : 1;
 } APSR;
 
 #if USE_NVIC
@@ -59,11 +65,12 @@ typedef struct
 
 typedef struct
 {
+    uint32_t reserved1 : 10;
+    uint32_t ICI_IT_low : 6;
+    uint32_t reserved2 : 8;
     uint32_t T : 1;
     uint32_t ICI_IT_high : 2;
-    uint32_t reserved1 : 8;
-    uint32_t ICI_IT_low : 6;
-    uint32_t reserved2 : 10;
+    uint32_t reserved3 : 5;
 } EPSR;
 
 typedef union
@@ -103,50 +110,273 @@ typedef union
     };
 } PSR;
 
+// Отложени флагове: последната операция, която променя NZCV
+typedef struct
+{
+    uint32_t result;
+    uint32_t op1;
+    uint32_t op2;
+    uint8_t type;  // OP_TYPE
+    uint8_t mask;  // UPDATE_N/Z/C/V, които още не са записани в PSR
+    uint8_t carry; // Входящ C за ADC/SBC
+} M4_LAZY;
+
 #if USE_NVIC
+#if !USE_SYSTEM
+#error "USE_NVIC requires USE_SYSTEM (PRIMASK, BASEPRI, MSP/PSP)"
+#endif
+
+#define M4_NVIC_IRQS 240     // Външни прекъсвания: изключения 16–255
+#define M4_NVIC_PRIO_BITS 4  // Реализирани битове на приоритета (старшите)
+
+// Номера на системните изключения
+#define M4_EXC_NMI 2
+#define M4_EXC_HARDFAULT 3
+#define M4_EXC_MEMMANAGE 4
+#define M4_EXC_BUSFAULT 5
+#define M4_EXC_USAGEFAULT 6
+#define M4_EXC_SVCALL 11
+#define M4_EXC_DEBUGMON 12
+#define M4_EXC_PENDSV 14
+#define M4_EXC_SYSTICK 15
+#define M4_EXC_IRQ0 16
+
+// NVIC и състоянието на изключенията от SCB. ICER/ICPR са само изгледи за
+// запис върху ISER/ISPR и не се пазят отделно.
 typedef struct
 {
+    uint16_t next;     // pending, ако може да прекъсне изпълнението, иначе 0
+    uint16_t pending;  // Чакащото изключение с най-висок приоритет (VECTPENDING)
+    int16_t exec_prio; // Текущ приоритет на изпълнение (групов, -2..256)
+    uint8_t PRIGROUP;
+    uint8_t SHPR[12];     // Приоритети на изключения 4–15 (SHPR1–3)
+    uint32_t sys_pending; // Бит за всяко чакащо системно изключение (2–15)
+    uint32_t sys_active;  // Бит за всяко активно системно изключение
+    uint32_t SHCSR;       // Само битовете за разрешаване (16–18)
+    uint32_t VTOR;
     uint32_t ISER[8];
-    uint32_t ICER[8];
     uint32_t ISPR[8];
-    uint32_t ICPR[8];
     uint32_t IABR[8];
     uint8_t IPR[240];
 } NVIC;
 #endif
 
+typedef struct CortexM4_s CortexM4;
+
+// Причина за спиране на m4_run
+typedef enum
+{
+    M4_STOP_NONE,   // Работи
+    M4_STOP_BKPT,   // BKPT #imm; PC сочи BKPT
+    M4_STOP_FAULT,  // Грешка при изпълнение
+    M4_STOP_BUDGET, // Изчерпан лимит инструкции
+    M4_STOP_SVC,    // SVC #imm; PC е след SVC
+    M4_STOP_WFI     // WFI/WFE без планирани събития; PC е след инструкцията
+} M4_STOP;
+typedef struct M4_SNAPSHOT_s M4_SNAPSHOT;
+typedef int (*M4_HANDLER)(CortexM4 *cpu);
+
+#define M4_DEC_BRANCH 0x01     // Инструкцията сама задава PC и завършва блока
+#define M4_DEC_POLL 0x02       // Начало на блок - цикъл на изчакване (USE_EVENTS)
+#define M4_DEC_SETS_FLAGS 0x04 // Променя NZCV и в IT блок: CMP, CMN, TST, S, MSR, VMRS
+#define M4_BLOCK_MAX 64    // Максимален брой инструкции в основен блок
+
+typedef struct
+{
+    M4_HANDLER handler; // NULL = празен слот
+    uint32_t op;
+    uint32_t imm;
+    uint8_t size;
+    uint8_t rd;
+    uint8_t rn;
+    uint8_t rm;
+    uint8_t cond;
+    uint8_t flags;
+    uint8_t block_len; // Дължина на блока, започващ от този слот (0 = непостроен)
+#if USE_CYCLES
+    uint8_t cycles; // Тактове без презареждане на конвейера (m4_cycles_cost)
+#endif
+} M4_DECODED;
+
+#define M4_PAGE_BITS 12 // Страници от 4 KB
+#define M4_PAGE_SIZE (1u << M4_PAGE_BITS)
+#define M4_PAGE_MASK (M4_PAGE_SIZE - 1)
+#define M4_L2_BITS 10 // 1024 страници (4 MB) на запис от L1
+#define M4_L2_SIZE (1u << M4_L2_BITS)
+#define M4_L1_SIZE (1u << (32 - M4_PAGE_BITS - M4_L2_BITS))
+
+// Двустепенна таблица на страниците: адрес -> памет в хоста.
+// NULL (на кое да е ниво) означава бавен път - неизобразена страница или MMIO.
 typedef struct
 {
-    M4 REG;
-#if USE_FPU
-    FPU fpu;
+    uint8_t **read[M4_L1_SIZE];
+    uint8_t **write[M4_L1_SIZE];
+} M4_MEMORY;
+
+// Карта на паметта: освен cpu->ROM и cpu->RAM, до M4_MAX_REGIONS региона
+// (флаш псевдоними, SRAM2, CCM, периферия). Целите страници на RAM и ROM
+// регионите се изобразяват в таблицата на страниците, така че бавният път
+// (и търсенето в регионите) се минава само за MMIO и непълни страници.
+#define M4_MAX_REGIONS 16
+
+typedef enum
+{
+    M4_REGION_RAM,  // Четене и запис в host
+    M4_REGION_ROM,  // Четене от host, записите се игнорират
+    M4_REGION_MMIO, // Извикване на read/write; NULL = чете се 0, записите се игнорират
+} M4_REGION_TYPE;
+
+// offset е спрямо base. Грешка: *result = -1 / връща -1.
+// С USE_EVENTS цикъл, който само чете регистъра, може да бъде прескочен до
+// следващото събитие: read трябва да връща същото, докато събитие или
+// запис не промени състоянието, иначе задава cpu->poll_volatile = 1.
+typedef uint32_t (*M4_MMIO_READ)(CortexM4 *cpu, void *ctx, uint32_t offset, uint32_t size, int *result);
+typedef int (*M4_MMIO_WRITE)(CortexM4 *cpu, void *ctx, uint32_t offset, uint32_t data, uint32_t size);
+
+typedef struct
+{
+    uint32_t base;
+    uint32_t size;
+    uint8_t type; // M4_REGION_TYPE
+    uint8_t *host;
+    M4_MMIO_READ read;
+    M4_MMIO_WRITE write;
+    void *ctx;
+} M4_REGION;
+
+// Bit-band (ARM DDI 0403, B3.1.3): всяка дума от псевдонима е един бит от
+// първия 1 MB на SRAM (0x20000000) или на периферията (0x40000000)
+#define M4_BITBAND_SRAM 0x22000000
+#define M4_BITBAND_PERIPH 0x42000000
+#define M4_BITBAND_SIZE 0x02000000
+
+#if USE_EVENTS
+#if !USE_CYCLES
+#error "USE_EVENTS requires USE_CYCLES (events are scheduled in cycles)"
+#endif
+
+#define M4_MAX_EVENTS 16
+#define M4_SLEEP_EVENTS 256 // Най-много събития в едно заспиване (WFI/WFE)
+
+// Флаговете в маските на m4_poll_16 (след регистрите R0–R15)
+#define M4_POLL_NZ 0x30000
+#define M4_POLL_C 0x40000
+#define M4_POLL_NZCV 0xF0000
+
+// Събитие на периферия: извиква се, когато cpu->cycles достигне when
+typedef void (*M4_EVENT_FN)(CortexM4 *cpu, void *ctx);
+
+typedef struct
+{
+    uint64_t when;
+    M4_EVENT_FN fn;
+    void *ctx;
+} M4_EVENT;
+
+// SysTick: вместо стойността на брояча се пази тактът, в който той достига 0
+typedef struct
+{
+    uint32_t CSR;
+    uint32_t RVR;
+    uint32_t value; // SYST_CVR, докато броячът стои
+    uint64_t zero;  // Такт на следващото достигане на 0 или UINT64_MAX
+} M4_SYSTICK;
 #endif
+
+#define M4_CACHE_LINE 64
+
+/*
+    Пълното състояние на едно ядро. Всички функции получават контекста като
+    първи параметър, така че в един процес може да има много независими ядра.
+
+    Полетата са подредени по честота на достъп. Състоянието на всяка
+    инструкция е в първите две линии на кеша (регистрите - в първата) и е
+    на едни и същи отмествания при всички USE_*. Следват полетата, които
+    m4_run проверява на всеки блок, таблицата на страниците и разширенията,
+    а накрая - редко използваното (региони, снимки). Така
+    при много ядра, изпълнявани на смени в една нишка, всяко заема по две
+    горещи линии в L1.
+*/
+struct CortexM4_s
+{
+    // Линия 0: R0-R15
+    M4 REG;
+
+    // Линия 1: флагове, текуща инструкция, IT блок
     PSR psr;
+    M4_LAZY lazy;
+    uint32_t op;
+    uint32_t bl_upper_offset; // BL/BLX: горна половина на офсета
+    int error;
+    const M4_DECODED *dec;
+    M4_DECODED *icache;
+    int bl_upper_pending; // BL/BLX: чака се долна половина
+    uint8_t ITSTATE;
+    uint8_t it_exec;       // Бит за всяка оставаща инструкция от IT блока: 1 = изпълнява се
+    uint8_t excl;          // Локален монитор на LDREX/STREX: 1 = отворен
+    uint8_t stop;          // M4_STOP: задава се от BKPT, SVC, WFI
+    uint8_t stop_code;     // imm на инструкцията, спряла изпълнението
+    uint8_t icache_shared; // Кешът е чужд (m4_icache_share) и е само за четене
+
+    // Линия 2: проверява се на всеки блок (m4_run)
+    uint8_t *ROM;
+    uint8_t *RAM;
+    uint32_t ROM_SIZE;
+    uint32_t RAM_SIZE;
+#if USE_CYCLES
+    uint64_t cycles; // Изминали тактове от m4_create
+#endif
+#if USE_EVENTS
+    uint64_t event_next;   // when на първото събитие или UINT64_MAX
+    uint8_t poll_volatile; // Текущата итерация е прочела стойност, зависеща от времето
+#endif
+#if USE_JIT
+    struct M4_JIT_s *jit;
+#endif
 #if USE_NVIC
-    NVIC nvic;
+    NVIC nvic; // nvic.next е в началото
+#endif
+#if USE_TRACE
+    struct M4_TRACE_s *trace; // NULL = следата е изключена
+#endif
+#if USE_PROFILE
+    struct M4_PROFILE_s *profile; // NULL = профилът е изключен
+#endif
+
+    // Таблицата на страниците и разширенията
+    M4_MEMORY mem;
+#if USE_FPU
+    FPU fpu;
 #endif
 #if USE_SYSTEM
     uint32_t CONTROL;
     uint32_t PRIMASK;
     uint32_t FAULTMASK;
     uint32_t BASEPRI;
+    uint32_t SP_alt; // Неактивният от MSP и PSP; REG.SP е активният
+    uint8_t sp_psp;  // REG.SP е PSP
 #endif
-#if USE_NVIC
-    uint32_t *vector_table;
-    uint32_t vector_table_size;
+#if USE_CYCLES
+    uint32_t cyccnt_base;     // DWT_CYCCNT = cycles - cyccnt_base (32 бита)
+    struct M4_CYCLES_s *prof; // Тактове по функции (m4_cycles_profile)
 #endif
-    uint8_t ITSTATE;
-    uint32_t op;
-    int error;
+#if USE_EVENTS
+    uint32_t event_count;
+    uint64_t sleep_cycles; // Тактове, прескочени в WFI/WFE
+    uint64_t poll_elided;  // Инструкции, прескочени в цикли на изчакване
+    M4_EVENT events[M4_MAX_EVENTS]; // Подредени по when
+    M4_SYSTICK systick;
+#endif
+
+    // Рядко използвани
+    M4_REGION regions[M4_MAX_REGIONS]; // Подредени по base, без застъпване
+    uint32_t region_count;
+    uint32_t *dirty;              // Бит за всяка RAM страница, записана след snap_base
+    const M4_SNAPSHOT *snap_base; // Снимката, спрямо която се следят записите
 #if 1
     FILE *file;
 #endif
-    uint8_t *ROM;
-    uint32_t ROM_SIZE;
-    uint8_t *RAM;
-    uint32_t RAM_SIZE;
-} CortexM4;
-extern CortexM4 CPU;
+} __attribute__((aligned(M4_CACHE_LINE)));
 
 #define UPDATE_N 0x1
 #define UPDATE_Z 0x2
@@ -154,6 +384,7 @@ extern CortexM4 CPU;
 #define UPDATE_V 0x8
 #define UPDATE_Q 0x10
 #define UPDATE_GE 0x20
+#define UPDATE_NZCV (UPDATE_N | UPDATE_Z | UPDATE_C | UPDATE_V)
 
 typedef enum
 {
@@ -186,22 +417,595 @@ typedef enum
     OP_UADD16
 } OP_TYPE;
 
-#define RETURN_ERROR(E) return ((CPU.error = E))
+// Очаква контекста в локална променлива cpu
+#define RETURN_ERROR(E) return ((cpu->error = E))
+
+CortexM4 *m4_create(void);
+void m4_destroy(CortexM4 *cpu);
+void m4_reset_core(CortexM4 *cpu);
 
-void PRINT_REG(void);
+void PRINT_REG(CortexM4 *cpu);
 
-uint32_t READ_THUMB_32(uint32_t address, int *result);
-uint32_t READ_MEM_32(uint32_t address, int *result);
-uint16_t READ_MEM_16(uint32_t address, int *result);
-uint8_t READ_MEM_8(uint32_t address, int *result);
+uint32_t READ_THUMB_32(CortexM4 *cpu, uint32_t address, int *result);
 
-int WRITE_MEM_32(uint32_t address, uint32_t data);
-int WRITE_MEM_16(uint32_t address, uint16_t data);
-int WRITE_MEM_8(uint32_t address, uint8_t data);
+int m4_mem_init(CortexM4 *cpu);
+int m4_mem_map(CortexM4 *cpu, uint32_t address, uint8_t *host, uint32_t size, int writable);
+void m4_mem_free(CortexM4 *cpu);
+int m4_region_add(CortexM4 *cpu, const M4_REGION *region);
+const M4_REGION *m4_region_find(const CortexM4 *cpu, uint32_t address);
+uint32_t m4_mem_read_slow(CortexM4 *cpu, uint32_t address, uint32_t size, int *result);
+int m4_mem_write_slow(CortexM4 *cpu, uint32_t address, uint32_t data, uint32_t size);
+int m4_mem_read_words(CortexM4 *cpu, uint32_t address, uint32_t *words, uint32_t count);
+int m4_mem_write_words(CortexM4 *cpu, uint32_t address, const uint32_t *words, uint32_t count);
+int m4_mem_set_page(uint8_t ***table, uint32_t page, uint8_t *host);
+void m4_mem_dirty(CortexM4 *cpu, uint32_t offset, uint32_t size);
 
-void m4_update_apsr(uint32_t result, uint32_t op1, uint32_t op2, int operation_type, int shift_amount, int update_flags);
-int m4_execute_16(void);
-int m4_execute_32(void);
-int m4_execute(void);
+M4_SNAPSHOT *m4_snapshot(CortexM4 *cpu);
+int m4_restore(CortexM4 *cpu, const M4_SNAPSHOT *snap);
+void m4_snapshot_free(CortexM4 *cpu, M4_SNAPSHOT *snap);
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define M4_LE16(x) __builtin_bswap16(x)
+#define M4_LE32(x) __builtin_bswap32(x)
+#else
+#define M4_LE16(x) (x)
+#define M4_LE32(x) (x)
+#endif
+
+// Указател в хоста към size байта от address, ако са в една директно
+// изобразена страница, иначе NULL
+static inline uint8_t *m4_mem_host(uint8_t ***table, uint32_t address, uint32_t size)
+{
+    uint8_t **l2 = table[address >> (M4_PAGE_BITS + M4_L2_BITS)];
+    if (!l2 || (address & M4_PAGE_MASK) > M4_PAGE_SIZE - size)
+        return NULL;
+    uint8_t *page = l2[(address >> M4_PAGE_BITS) & (M4_L2_SIZE - 1)];
+    return page ? page + (address & M4_PAGE_MASK) : NULL;
+}
+
+static inline uint32_t READ_MEM_32(CortexM4 *cpu, uint32_t address, int *result)
+{
+    uint8_t *p = m4_mem_host(cpu->mem.read, address, 4);
+    if (p)
+    {
+        uint32_t value;
+        memcpy(&value, p, 4); // Едно (неподравнено) четене в хоста
+        *result = 0;
+        return M4_LE32(value);
+    }
+    return m4_mem_read_slow(cpu, address, 4, result);
+}
+
+static inline uint16_t READ_MEM_16(CortexM4 *cpu, uint32_t address, int *result)
+{
+    uint8_t *p = m4_mem_host(cpu->mem.read, address, 2);
+    if (p)
+    {
+        uint16_t value;
+        memcpy(&value, p, 2);
+        *result = 0;
+        return M4_LE16(value);
+    }
+    return (uint16_t)m4_mem_read_slow(cpu, address, 2, result);
+}
+
+static inline uint8_t READ_MEM_8(CortexM4 *cpu, uint32_t address, int *result)
+{
+    uint8_t *p = m4_mem_host(cpu->mem.read, address, 1);
+    if (p)
+    {
+        *result = 0;
+        return *p;
+    }
+    return (uint8_t)m4_mem_read_slow(cpu, address, 1, result);
+}
+
+static inline int WRITE_MEM_32(CortexM4 *cpu, uint32_t address, uint32_t data)
+{
+    uint8_t *p = m4_mem_host(cpu->mem.write, address, 4);
+    if (p)
+    {
+        data = M4_LE32(data);
+        memcpy(p, &data, 4);
+        return 0;
+    }
+    return m4_mem_write_slow(cpu, address, data, 4);
+}
+
+static inline int WRITE_MEM_16(CortexM4 *cpu, uint32_t address, uint16_t data)
+{
+    uint8_t *p = m4_mem_host(cpu->mem.write, address, 2);
+    if (p)
+    {
+        data = M4_LE16(data);
+        memcpy(p, &data, 2);
+        return 0;
+    }
+    return m4_mem_write_slow(cpu, address, data, 2);
+}
+
+static inline int WRITE_MEM_8(CortexM4 *cpu, uint32_t address, uint8_t data)
+{
+    uint8_t *p = m4_mem_host(cpu->mem.write, address, 1);
+    if (p)
+    {
+        *p = data;
+        return 0;
+    }
+    return m4_mem_write_slow(cpu, address, data, 1);
+}
+
+void m4_flags_materialize(CortexM4 *cpu, int mask);
+uint32_t m4_read_psr(CortexM4 *cpu);
+
+// Условие (EQ..AL, 0xF: никога) -> маска по NZCV (PSR битове 31:28)
+extern const uint16_t m4_cond_table[16];
+
+// Записва NZCV в PSR преди всяко четене на флаговете
+#define M4_FLAGS_SYNC(c)                               \
+    do                                                 \
+    {                                                  \
+        if ((c)->lazy.mask)                            \
+            m4_flags_materialize((c), (c)->lazy.mask); \
+    } while (0)
+
+// Отлага изчисляването на флаговете до момента, в който са нужни
+static inline void m4_flags_lazy(CortexM4 *cpu, uint32_t result, uint32_t op1, uint32_t op2, int operation_type, int mask)
+{
+    if (cpu->lazy.mask & ~mask) // Флагове от предишната операция, които тази не покрива
+        m4_flags_materialize(cpu, cpu->lazy.mask & ~mask);
+    cpu->lazy.result = result;
+    cpu->lazy.op1 = op1;
+    cpu->lazy.op2 = op2;
+    cpu->lazy.type = operation_type;
+    cpu->lazy.mask = mask;
+}
+
+// ALU ЯДРА ///////////////////////////
+/*
+    Общи за 16- и 32-битовите инструкции. s (задаване на флаговете) е
+    константа във всеки обработчик, затова вариантите ADDS и ADD (в IT блок
+    или ADD.W) се компилират поотделно, без проверка при изпълнение.
+*/
+
+#define M4_SHIFT_LSL 0
+#define M4_SHIFT_LSR 1
+#define M4_SHIFT_ASR 2
+#define M4_SHIFT_ROR 3
+#define M4_SHIFT_RRX 4
+#define M4_C_KEEP 2 // Изместването не променя C
+
+// Shift_C с изместване n от 0 до 255. *carry е изнесеният бит или M4_C_KEEP.
+static inline uint32_t m4_shift_c(CortexM4 *cpu, uint32_t value, uint32_t type, uint32_t n, uint32_t *carry)
+{
+    if (!n && type != M4_SHIFT_RRX)
+    {
+        *carry = M4_C_KEEP;
+        return value;
+    }
+    switch (type)
+    {
+    case M4_SHIFT_LSL:
+        if (n >= 32)
+        {
+            *carry = n == 32 ? value & 0x1 : 0;
+            return 0;
+        }
+        *carry = (value >> (32 - n)) & 0x1;
+        return value << n;
+    case M4_SHIFT_LSR:
+        if (n >= 32)
+        {
+            *carry = n == 32 ? value >> 31 : 0;
+            return 0;
+        }
+        *carry = (value >> (n - 1)) & 0x1;
+        return value >> n;
+    case M4_SHIFT_ASR:
+        if (n >= 32)
+        {
+            *carry = value >> 31;
+            return (uint32_t)((int32_t)value >> 31);
+        }
+        *carry = (value >> (n - 1)) & 0x1;
+        return (uint32_t)((int32_t)value >> n);
+    case M4_SHIFT_ROR:
+        n &= 0x1F;
+        if (n)
+            value = (value >> n) | (value << (32 - n));
+        *carry = value >> 31;
+        return value;
+    default: // RRX
+        M4_FLAGS_SYNC(cpu);
+        *carry = value & 0x1;
+        return (value >> 1) | ((uint32_t)cpu->psr.apsr.C << 31);
+    }
+}
+
+// AND, ORR, MOV, MUL ...: N, Z от резултата, C от изместването
+static inline uint32_t m4_alu_logic(CortexM4 *cpu, uint32_t result, uint32_t carry, int s)
+{
+    if (s)
+    {
+        m4_flags_lazy(cpu, result, 0, 0, OP_AND, UPDATE_N | UPDATE_Z);
+        if (carry != M4_C_KEEP)
+            cpu->psr.apsr.C = carry;
+    }
+    return result;
+}
+
+// ADD, CMN
+static inline uint32_t m4_alu_add(CortexM4 *cpu, uint32_t a, uint32_t b, int s)
+{
+    uint32_t result = a + b;
+    if (s)
+        m4_flags_lazy(cpu, result, a, b, OP_ADD, UPDATE_NZCV);
+    return result;
+}
+
+// SUB, CMP
+static inline uint32_t m4_alu_sub(CortexM4 *cpu, uint32_t a, uint32_t b, int s)
+{
+    uint32_t result = a - b;
+    if (s)
+        m4_flags_lazy(cpu, result, a, b, OP_SUB, UPDATE_NZCV);
+    return result;
+}
+
+// RSB, NEG: b - a
+static inline uint32_t m4_alu_rsb(CortexM4 *cpu, uint32_t a, uint32_t b, int s)
+{
+    uint32_t result = b - a;
+    if (s)
+        m4_flags_lazy(cpu, result, a, b, OP_RSB, UPDATE_NZCV);
+    return result;
+}
+
+// ADC, SBC: входящият C се пази в cpu->lazy.carry
+static inline uint32_t m4_alu_adc(CortexM4 *cpu, uint32_t a, uint32_t b, int s)
+{
+    M4_FLAGS_SYNC(cpu);
+    uint32_t carry = cpu->psr.apsr.C;
+    uint32_t result = a + b + carry;
+    if (s)
+    {
+        m4_flags_lazy(cpu, result, a, b, OP_ADC, UPDATE_NZCV);
+        cpu->lazy.carry = carry;
+    }
+    return result;
+}
+
+static inline uint32_t m4_alu_sbc(CortexM4 *cpu, uint32_t a, uint32_t b, int s)
+{
+    M4_FLAGS_SYNC(cpu);
+    uint32_t carry = cpu->psr.apsr.C;
+    uint32_t result = a - b - (1 - carry);
+    if (s)
+    {
+        m4_flags_lazy(cpu, result, a, b, OP_SBC, UPDATE_NZCV);
+        cpu->lazy.carry = carry;
+    }
+    return result;
+}
+
+// Помощна функция за проверка на условията за B{<cond>}, B<c>.W и IT
+static inline int m4_check_condition(CortexM4 *cpu, uint32_t cond)
+{
+    // EQ/NE се решават директно от отложения резултат, без запис в PSR
+    if (cond <= 0x1 && (cpu->lazy.mask & UPDATE_Z))
+        return (cpu->lazy.result == 0) ^ cond;
+
+    M4_FLAGS_SYNC(cpu);
+    return (m4_cond_table[cond & 0xF] >> (cpu->psr.value >> 28)) & 0x1;
+}
+
+int m4_decode_16(uint16_t op, M4_DECODED *d);
+int m4_dispatch_16(CortexM4 *cpu, const M4_DECODED *d);
+int m4_execute_16(CortexM4 *cpu);
+int m4_execute_it(CortexM4 *cpu, const M4_DECODED *d);
+void m4_it_refresh(CortexM4 *cpu);
+int m4_execute_wfi(CortexM4 *cpu);
+int m4_decode_32(uint32_t op, M4_DECODED *d);
+int m4_decode_dsp(uint32_t op, M4_DECODED *d);
+int m4_dispatch_32(CortexM4 *cpu, const M4_DECODED *d);
+int m4_execute_32(CortexM4 *cpu);
+#if USE_DSP
+int m4_execute_DSP(CortexM4 *cpu);
+#endif
+#if USE_FPU
+int m4_execute_FPU(CortexM4 *cpu);
+#endif
+int m4_execute(CortexM4 *cpu);
+int m4_execute_slots(CortexM4 *cpu, const M4_DECODED *d, uint32_t n, uint32_t *executed);
+int m4_execute_block(CortexM4 *cpu, uint32_t *executed);
+uint64_t m4_run(CortexM4 *cpu, uint64_t max_instructions, M4_STOP *stop_reason);
+
+int m4_icache_init(CortexM4 *cpu);
+void m4_icache_invalidate(CortexM4 *cpu);
+void m4_icache_free(CortexM4 *cpu);
+int m4_icache_prefill(CortexM4 *cpu);
+void m4_icache_share(CortexM4 *cpu, M4_DECODED *icache);
+
+#if USE_JIT
+#define M4_JIT_ON 1     // Горещите блокове се компилират до x86-64
+#define M4_JIT_VERIFY 2 // + всяко изпълнение се сравнява с интерпретатора
+
+int m4_jit_init(CortexM4 *cpu, int mode);
+void m4_jit_invalidate(CortexM4 *cpu);
+void m4_jit_free(CortexM4 *cpu);
+int m4_jit_run(CortexM4 *cpu, const M4_DECODED *d, uint32_t *executed);
+#endif
+
+#if USE_CYCLES
+#define M4_CYCLES_REFILL 3 // Презареждане на конвейера след преход: 1–3, горна граница
+#define M4_CYCLES_EXC_ENTRY 12 // Влизане в изключение (запис на рамката и вектор)
+#define M4_CYCLES_EXC_RETURN 10 // Връщане от изключение
+#define M4_CYCLES_TAILCHAIN 6   // Преход от изключение към следващото без стека
+
+#define M4_DWT_CTRL 0xE0001000
+#define M4_DWT_CYCCNT 0xE0001004
+#define M4_DEMCR 0xE000EDFC
+
+// Тактове по функции: включително извиканите от тях
+typedef struct
+{
+    uint32_t addr;
+    uint32_t calls;
+    uint64_t cycles;
+} M4_FUNC_CYCLES;
+
+uint8_t m4_cycles_cost(const M4_DECODED *d);
+void m4_cycles_block(CortexM4 *cpu, const M4_DECODED *d, uint32_t n, uint32_t pc);
+int m4_cycles_profile(CortexM4 *cpu, int enable);
+uint32_t m4_cycles_report(CortexM4 *cpu, M4_FUNC_CYCLES *out, uint32_t max);
+void m4_cycles_call(CortexM4 *cpu, uint32_t target, uint32_t ret);
+void m4_cycles_return(CortexM4 *cpu, uint32_t target);
+void m4_cycles_unwind(CortexM4 *cpu);
+
+// Тактове на току-що изпълнената инструкция d от адрес pc
+static inline void m4_cycles_add(CortexM4 *cpu, const M4_DECODED *d, uint32_t pc)
+{
+    cpu->cycles += d->cycles;
+    // Изпълнен преход (BKPT оставя PC на място, без преход)
+    if ((d->flags & M4_DEC_BRANCH) && cpu->REG.PC != pc + d->size && cpu->stop != M4_STOP_BKPT)
+        cpu->cycles += M4_CYCLES_REFILL;
+}
+
+// DWT_CYCCNT: 32-битов брояч, който фърмуерът може да нулира
+static inline uint32_t m4_dwt_cyccnt(const CortexM4 *cpu)
+{
+    return (uint32_t)cpu->cycles - cpu->cyccnt_base;
+}
+
+#define M4_CYCLES_CALL(c, target, ret)            \
+    do                                            \
+    {                                             \
+        if ((c)->prof)                            \
+            m4_cycles_call((c), (target), (ret)); \
+    } while (0)
+#define M4_CYCLES_RETURN(c, target)          \
+    do                                       \
+    {                                        \
+        if ((c)->prof)                       \
+            m4_cycles_return((c), (target)); \
+    } while (0)
+#else
+#define M4_CYCLES_CALL(c, target, ret) ((void)0)
+#define M4_CYCLES_RETURN(c, target) ((void)0)
+#endif
+
+// Файл със следа (m4_trace_dump, чете се с m4trace): заглавие от 4 думи -
+// M4_TRACE_MAGIC, M4_TRACE_VERSION, брой записи, брой презаписани записи.
+// Всеки запис: PC, опкод, маска и по една дума за всеки бит на маската -
+// R0–R14 (битове 0–14), после PSR (M4_TRACE_PSR). Думите са little-endian.
+#define M4_TRACE_MAGIC 0x5254344D // "M4TR"
+#define M4_TRACE_VERSION 1
+#define M4_TRACE_PSR 0x10000
+#define M4_TRACE_PAD 0xFFFFFFFF // Край на записите преди началото на буфера (PC е четен)
+
+#if USE_TRACE
+int m4_trace_start(CortexM4 *cpu, uint32_t words);
+void m4_trace_stop(CortexM4 *cpu);
+int m4_trace_dump(CortexM4 *cpu, FILE *file);
+void m4_trace_pre(CortexM4 *cpu);
+void m4_trace_post(CortexM4 *cpu, uint32_t op);
+
+// Точки на следата в изпълнителите: без USE_TRACE не остава нищо
+#define M4_TRACE_PRE(c)        \
+    do                         \
+    {                          \
+        if ((c)->trace)        \
+            m4_trace_pre((c)); \
+    } while (0)
+#define M4_TRACE_POST(c, op)          \
+    do                                \
+    {                                 \
+        if ((c)->trace)               \
+            m4_trace_post((c), (op)); \
+    } while (0)
+#else
+#define M4_TRACE_PRE(c) ((void)0)
+#define M4_TRACE_POST(c, op) ((void)0)
+#endif
+
+// Функция от таблицата на символите на ELF файл
+typedef struct
+{
+    uint32_t addr; // Без Thumb бит
+    uint32_t size;
+    const char *name;
+} M4_SYMBOL;
+
+typedef struct M4_SYMBOLS_s M4_SYMBOLS;
+
+int m4_elf_check(const uint8_t *elf, uint32_t size);
+M4_SYMBOLS *m4_elf_symbols(const uint8_t *elf, uint32_t size);
+const M4_SYMBOL *m4_symbol_find(const M4_SYMBOLS *syms, uint32_t addr);
+const char *m4_symbol_name(const M4_SYMBOLS *syms, uint32_t addr, char *buf, uint32_t size);
+void m4_symbols_free(M4_SYMBOLS *syms);
+
+// Зареден в паметта ELF файл, споделян от много ядра
+typedef struct M4_IMAGE_s M4_IMAGE;
+
+M4_IMAGE *m4_image_open(const char *path);
+int m4_image_load(CortexM4 *cpu, const M4_IMAGE *img);
+const M4_SYMBOLS *m4_image_symbols(M4_IMAGE *img);
+const uint8_t *m4_image_rom(const M4_IMAGE *img, uint32_t *size);
+void m4_image_close(M4_IMAGE *img);
+
+#if USE_PROFILE
+int m4_profile_start(CortexM4 *cpu);
+void m4_profile_stop(CortexM4 *cpu);
+void m4_profile_step(CortexM4 *cpu);
+void m4_profile_block(CortexM4 *cpu, const M4_DECODED *d);
+void m4_profile_call(CortexM4 *cpu, uint32_t target, uint32_t ret);
+void m4_profile_return(CortexM4 *cpu, uint32_t target);
+void m4_profile_unwind(CortexM4 *cpu);
+int m4_profile_folded(CortexM4 *cpu, const M4_SYMBOLS *syms, FILE *file);
+int m4_profile_report(CortexM4 *cpu, const M4_SYMBOLS *syms, FILE *file, uint32_t top);
+
+#define M4_PROFILE_STEP(c)        \
+    do                            \
+    {                             \
+        if ((c)->profile)         \
+            m4_profile_step((c)); \
+    } while (0)
+#define M4_PROFILE_BLOCK(c, d)          \
+    do                                  \
+    {                                   \
+        if ((c)->profile)               \
+            m4_profile_block((c), (d)); \
+    } while (0)
+#define M4_PROFILE_CALL(c, target, ret)            \
+    do                                             \
+    {                                              \
+        if ((c)->profile)                          \
+            m4_profile_call((c), (target), (ret)); \
+    } while (0)
+#define M4_PROFILE_RETURN(c, target)          \
+    do                                        \
+    {                                         \
+        if ((c)->profile)                     \
+            m4_profile_return((c), (target)); \
+    } while (0)
+#else
+#define M4_PROFILE_STEP(c) ((void)0)
+#define M4_PROFILE_BLOCK(c, d) ((void)0)
+#define M4_PROFILE_CALL(c, target, ret) ((void)0)
+#define M4_PROFILE_RETURN(c, target) ((void)0)
+#endif
+
+// Извикване (BL, BLX) и възможно връщане (BX, POP {PC}, MOV PC) за
+// тактовете по функции и профила
+#define M4_HOOK_CALL(c, target, ret)           \
+    do                                         \
+    {                                          \
+        M4_CYCLES_CALL((c), (target), (ret));  \
+        M4_PROFILE_CALL((c), (target), (ret)); \
+    } while (0)
+#define M4_HOOK_RETURN(c, target)         \
+    do                                    \
+    {                                     \
+        M4_CYCLES_RETURN((c), (target));  \
+        M4_PROFILE_RETURN((c), (target)); \
+    } while (0)
+
+#if USE_SYSTEM
+#define M4_CONTROL_NPRIV 0x1
+#define M4_CONTROL_SPSEL 0x2
+
+// Превключва активния стеков указател (psp != 0: PSP, иначе MSP)
+static inline void m4_sp_select(CortexM4 *cpu, int psp)
+{
+    if (cpu->sp_psp == !!psp)
+        return;
+    uint32_t sp = cpu->REG.SP;
+    cpu->REG.SP = cpu->SP_alt;
+    cpu->SP_alt = sp;
+    cpu->sp_psp = !!psp;
+}
+
+int m4_execute_system(CortexM4 *cpu);
+int m4_execute_cps(CortexM4 *cpu);
+#endif
+
+#if USE_NVIC
+#define M4_SCS_BASE 0xE000E000 // System Control Space: NVIC, SCB
+#define M4_SCS_SIZE 0x1000
+
+#define M4_EXC_RETURN_HANDLER 0xFFFFFFF1 // Към Handler, MSP
+#define M4_EXC_RETURN_MSP 0xFFFFFFF9     // Към Thread, MSP
+#define M4_EXC_RETURN_PSP 0xFFFFFFFD     // Към Thread, PSP
+
+// Зареждането на такъв адрес в PC в Handler режим е връщане от изключение
+#define M4_IS_EXC_RETURN(c, target) ((target) >= 0xF0000000 && (c)->psr.ExceptionNumber)
+
+void m4_nvic_reset(CortexM4 *cpu);
+void m4_nvic_update(CortexM4 *cpu);
+int m4_nvic_irq(CortexM4 *cpu, uint32_t irq, int pending);
+void m4_exception_pend(CortexM4 *cpu, uint32_t exc);
+int m4_exception_sync(CortexM4 *cpu, uint32_t exc);
+int m4_exception_take(CortexM4 *cpu);
+int m4_exception_return(CortexM4 *cpu, uint32_t exc_return);
+uint32_t m4_scs_read(CortexM4 *cpu, uint32_t address, uint32_t size, int *result);
+int m4_scs_write(CortexM4 *cpu, uint32_t address, uint32_t data, uint32_t size);
+#endif
+
+#if USE_EVENTS
+#define M4_SYST_BASE 0xE000E010 // SysTick: CSR, RVR, CVR, CALIB
+#define M4_SYST_SIZE 0x10
+
+#define M4_SYST_ENABLE 0x1
+#define M4_SYST_TICKINT 0x2
+#define M4_SYST_CLKSOURCE 0x4
+#define M4_SYST_COUNTFLAG 0x10000
+
+int m4_event_schedule(CortexM4 *cpu, uint64_t when, M4_EVENT_FN fn, void *ctx);
+int m4_event_cancel(CortexM4 *cpu, M4_EVENT_FN fn, void *ctx);
+void m4_events_run(CortexM4 *cpu);
+void m4_events_reset(CortexM4 *cpu);
+void m4_events_sleep(CortexM4 *cpu);
+int m4_poll_16(const M4_DECODED *d, uint32_t *reads, uint32_t *writes);
+int m4_poll_block(const M4_DECODED *d, uint32_t len, uint32_t pc);
+void m4_events_poll(CortexM4 *cpu, uint64_t iteration, uint32_t len);
+void m4_systick_reset(CortexM4 *cpu);
+uint32_t m4_systick_read(CortexM4 *cpu, uint32_t address, uint32_t size, int *result);
+int m4_systick_write(CortexM4 *cpu, uint32_t address, uint32_t data, uint32_t size);
+#endif
+
+#if USE_BATCH
+// Една инстанция в пакетно изпълнение: входни данни и резултат
+typedef struct
+{
+    uint32_t args[4];      // R0–R3 при старт
+    const uint8_t *input;  // Копира се в RAM на input_addr (може NULL)
+    uint32_t input_size;
+    uint32_t input_addr;
+    int exit_code;         // imm8 на BKPT или M4_BATCH_FAULT / TIMEOUT / SLEEP
+    uint64_t cycles;       // Тактове (USE_CYCLES), иначе изпълнени инструкции
+    M4 regs;               // Крайни регистри
+    uint32_t psr;
+} M4_BATCH_JOB;
+
+#define M4_BATCH_FAULT -1   // Грешка при изпълнение
+#define M4_BATCH_TIMEOUT -2 // Достигнат max_steps без BKPT
+#define M4_BATCH_SLEEP -3   // WFI/WFE без източник на събития
+
+// Общи настройки: ROM и декодираните инструкции се споделят от всички инстанции
+typedef struct
+{
+    const uint8_t *rom;
+    uint32_t rom_size;
+    const uint8_t *ram_init; // Начално съдържание на RAM (може NULL)
+    uint32_t ram_init_size;
+    uint32_t ram_size;
+    uint32_t entry_pc;
+    uint32_t initial_sp;
+    uint64_t max_steps;
+    int threads;             // 0 = по една нишка на ядро
+} M4_BATCH;
+
+int m4_batch_run(const M4_BATCH *batch, M4_BATCH_JOB *jobs, uint32_t count);
+#endif
 
 #endif // _M4_H_
\ No newline at end of file